@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <event-parse.h>
+#include <kbuffer.h>
+
+#include "accessors.h"
+#include "batch.h"
+#include "fixture.h"
+#include "merge.h"
+#include "render.h"
+#include "util.h"
+
+/*
+ * Replays synthetic ring-buffer sub-buffers through the hot paths of the
+ * collector, each stage on 1..N threads with private data, and writes one
+ * line per stage and thread count to bench_output.txt:
+ *
+ *	stage=decode threads=2 records=... seconds=... records_per_s=... ns_per_record=... max_rss_kb=...
+ *
+ * records_per_s is the aggregate over all threads, ns_per_record the
+ * average cost of one record on one thread, and max_rss_kb the peak RSS
+ * of that run alone: each stage and thread count runs in a child of its
+ * own. tests/replay.c takes its budgets from them.
+ */
+
+#define BENCH_PAGE_SIZE		4096
+#define BENCH_STREAMS		4	/* merged per-CPU streams */
+#define BENCH_PAGES		512	/* per stream and thread */
+#define BENCH_REPS		8
+#define BENCH_EVENT_ID		1000
+#define BENCH_EVENT_SIZE	32	/* payload, a multiple of 4 */
+#define BENCH_DELTA_NS		100	/* between records of one stream */
+
+/* The format the synthetic records follow, as tracefs would show it */
+static const char bench_format[] =
+	"name: bench_event\n"
+	"ID: 1000\n"
+	"format:\n"
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+	"\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+	"\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+	"\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"\tfield:u64 value;\toffset:8;\tsize:8;\tsigned:0;\n"
+	"\tfield:int target;\toffset:16;\tsize:4;\tsigned:1;\n"
+	"\tfield:char comm[12];\toffset:20;\tsize:12;\tsigned:0;\n"
+	"\n"
+	"print fmt: \"comm=%s value=%llu target=%d\", REC->comm, REC->value, REC->target\n";
+
+struct worker {
+	int			id;
+	unsigned char		*mem;		/* BENCH_STREAMS * BENCH_PAGES pages */
+	struct bg_page		*pages;
+	int			nr_pages;
+	const void		**recs;		/* every record, for field access */
+	unsigned long long	nr_recs;
+	struct kbuffer		*kbuf;
+	struct bg_batch		batch;
+	struct tep_handle	*tep;
+	struct tep_format_field	*value_field;
+	struct bg_acc		value;
+	struct bg_acc		target;
+	int			null_fd;
+	struct bg_page_streams	streams;	/* the pages, for the merge */
+	int			first[BENCH_STREAMS];
+	int			count[BENCH_STREAMS];
+	int			next[BENCH_STREAMS];
+	uint64_t		sink;		/* keeps the loads alive */
+	unsigned long long	records;
+	uint64_t		ns;
+};
+
+static const struct bg_synth bench_synth = {
+	.page_size	= BENCH_PAGE_SIZE,
+	.event_size	= BENCH_EVENT_SIZE,
+	.id		= BENCH_EVENT_ID,
+	.delta_ns	= BENCH_DELTA_NS,
+	.comm		= "bench",
+};
+
+static int worker_init(struct worker *w)
+{
+	uint64_t value = 0, ts;
+	struct tep_event *event;
+	struct tep_format_field *field;
+	int s, i, per_page = bg_synth_per_page(&bench_synth);
+	unsigned long long r;
+	void *data;
+
+	w->nr_pages = BENCH_STREAMS * BENCH_PAGES;
+	w->mem = aligned_alloc(BENCH_PAGE_SIZE,
+			       (size_t)w->nr_pages * BENCH_PAGE_SIZE);
+	w->pages = calloc(w->nr_pages, sizeof(*w->pages));
+	w->kbuf = kbuffer_alloc(KBUFFER_LSIZE_SAME_AS_HOST,
+				KBUFFER_ENDIAN_SAME_AS_HOST);
+	w->tep = tep_alloc();
+	w->null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (!w->mem || !w->pages || !w->kbuf || !w->tep || w->null_fd < 0 ||
+	    bg_batch_init(&w->batch, 256) < 0)
+		return -1;
+
+	/* Stream s is pages s * BENCH_PAGES on; streams overlap in time */
+	for (i = 0; i < w->nr_pages; i++) {
+		s = i / BENCH_PAGES;
+		w->pages[i].data = w->mem + (size_t)i * BENCH_PAGE_SIZE;
+		w->pages[i].size = BENCH_PAGE_SIZE;
+		w->pages[i].cpu = s;
+		ts = 1000000 + (uint64_t)(i % BENCH_PAGES) * per_page *
+		     BENCH_DELTA_NS + s * (BENCH_DELTA_NS / BENCH_STREAMS);
+		bg_synth_page(&bench_synth, w->pages[i].data, ts, 1000 + s,
+			      &value);
+	}
+	for (s = 0; s < BENCH_STREAMS; s++) {
+		w->first[s] = s * BENCH_PAGES;
+		w->count[s] = BENCH_PAGES;
+	}
+	w->streams = (struct bg_page_streams){ w->pages, w->first, w->count,
+					       w->next };
+
+	w->recs = malloc((size_t)w->nr_pages * per_page * sizeof(*w->recs));
+	if (!w->recs)
+		return -1;
+	for (i = 0; i < w->nr_pages; i++) {
+		kbuffer_load_subbuffer(w->kbuf, w->pages[i].data);
+		for (data = kbuffer_read_event(w->kbuf, &r); data;
+		     data = kbuffer_next_event(w->kbuf, &r))
+			w->recs[w->nr_recs++] = data;
+	}
+
+	tep_set_long_size(w->tep, sizeof(long));
+	tep_set_page_size(w->tep, BENCH_PAGE_SIZE);
+	if (tep_parse_event(w->tep, bench_format, sizeof(bench_format) - 1,
+			    "bench"))
+		return -1;
+	event = tep_find_event(w->tep, BENCH_EVENT_ID);
+	if (!event)
+		return -1;
+
+	w->value_field = tep_find_field(event, "value");
+	field = tep_find_field(event, "target");
+	if (!w->value_field || !field)
+		return -1;
+	w->value = (struct bg_acc){ w->value_field->offset,
+				    w->value_field->size, BG_ACC_VALID };
+	w->target = (struct bg_acc){ field->offset, field->size,
+				     BG_ACC_VALID | BG_ACC_SIGNED };
+	return 0;
+}
+
+static void worker_free(struct worker *w)
+{
+	bg_batch_free(&w->batch);
+	if (w->kbuf)
+		kbuffer_free(w->kbuf);
+	if (w->tep)
+		tep_free(w->tep);
+	if (w->null_fd >= 0)
+		close(w->null_fd);
+	free(w->recs);
+	free(w->pages);
+	free(w->mem);
+}
+
+static unsigned long long run_decode(struct worker *w)
+{
+	unsigned long long n = 0;
+	int i;
+
+	for (i = 0; i < w->nr_pages; i++) {
+		kbuffer_load_subbuffer(w->kbuf, w->pages[i].data);
+		n += bg_batch_decode(&w->batch, w->kbuf, w->pages[i].cpu);
+		w->sink += w->batch.ts[w->batch.nr - 1];
+	}
+	return n;
+}
+
+static unsigned long long run_field(struct worker *w)
+{
+	unsigned long long i;
+
+	for (i = 0; i < w->nr_recs; i++)
+		w->sink += bg_acc_u64(&w->value, w->recs[i]) +
+			   bg_acc_s64(&w->target, w->recs[i]);
+	return w->nr_recs;
+}
+
+/* The same loads through tep, for comparison */
+static unsigned long long run_field_tep(struct worker *w)
+{
+	unsigned long long i, v;
+
+	for (i = 0; i < w->nr_recs; i++) {
+		tep_read_number_field(w->value_field, w->recs[i], &v);
+		w->sink += v;
+	}
+	return w->nr_recs;
+}
+
+static unsigned long long run_merge(struct worker *w)
+{
+	struct bg_merge_rec rec;
+	struct bg_merge *m;
+	unsigned long long n = 0;
+	int ret;
+
+	memset(w->next, 0, sizeof(w->next));
+	m = bg_merge_alloc(BENCH_STREAMS, BG_MERGE_WINDOW_NS,
+			   &bg_page_streams_ops, &w->streams);
+	if (!m)
+		return 0;
+	while ((ret = bg_merge_next(m, &rec)) >= 0) {
+		if (ret) {
+			w->sink += rec.ts;
+			n++;
+		}
+	}
+	bg_merge_free(m);
+	return n;
+}
+
+static unsigned long long run_render(struct worker *w)
+{
+	struct tep_record record = { 0 };
+	struct bg_render r;
+	unsigned long long i;
+	int page = 0, left = 0;
+
+	bg_render_init(&r, w->null_fd, NULL);
+	for (i = 0; i < w->nr_recs; i++) {
+		if (!left) {
+			kbuffer_load_subbuffer(w->kbuf, w->pages[page].data);
+			record.cpu = w->pages[page].cpu;
+			record.ts = kbuffer_subbuf_timestamp(w->kbuf,
+							     w->pages[page].data);
+			left = w->nr_recs / w->nr_pages;
+			page++;
+		}
+		record.data = (void *)w->recs[i];
+		record.size = BENCH_EVENT_SIZE;
+		left--;
+		if (bg_render_record(&r, w->tep, &record) < 0)
+			break;
+		record.ts += BENCH_DELTA_NS;
+	}
+	bg_render_destroy(&r);
+	return i;
+}
+
+struct stage {
+	const char		*name;
+	unsigned long long	(*run)(struct worker *w);
+};
+
+static const struct stage stages[] = {
+	{ "decode",	run_decode },
+	{ "field",	run_field },
+	{ "field_tep",	run_field_tep },
+	{ "merge",	run_merge },
+	{ "render",	run_render },
+};
+
+struct job {
+	const struct stage	*stage;
+	struct worker		*w;
+	pthread_barrier_t	*barrier;
+};
+
+static void *bench_thread(void *arg)
+{
+	struct job *job = arg;
+	struct worker *w = job->w;
+	uint64_t start;
+	int rep;
+
+	/* Warm the caches and the branch predictors once */
+	job->stage->run(w);
+	pthread_barrier_wait(job->barrier);
+
+	w->records = 0;
+	start = bg_now_ns();
+	for (rep = 0; rep < BENCH_REPS; rep++)
+		w->records += job->stage->run(w);
+	w->ns = bg_now_ns() - start;
+	return NULL;
+}
+
+struct result {
+	unsigned long long	records;
+	uint64_t		ns;		/* summed over the threads */
+	uint64_t		wall;		/* of the slowest thread */
+};
+
+static int run_stage(const struct stage *stage, struct worker *workers,
+		     int nr, struct result *res)
+{
+	pthread_barrier_t barrier;
+	struct job jobs[nr];
+	pthread_t threads[nr];
+	int i;
+
+	pthread_barrier_init(&barrier, NULL, nr);
+	for (i = 0; i < nr; i++) {
+		jobs[i] = (struct job){ stage, &workers[i], &barrier };
+		errno = pthread_create(&threads[i], NULL, bench_thread, &jobs[i]);
+		if (errno) {
+			bg_warn("cannot start thread: %s", strerror(errno));
+			exit(1);
+		}
+	}
+	*res = (struct result){ 0 };
+	for (i = 0; i < nr; i++) {
+		pthread_join(threads[i], NULL);
+		res->records += workers[i].records;
+		res->ns += workers[i].ns;
+		if (workers[i].ns > res->wall)
+			res->wall = workers[i].ns;
+	}
+	pthread_barrier_destroy(&barrier);
+	return res->records ? 0 : -1;
+}
+
+/*
+ * Child side of one run: set up only the @nr workers it uses, so its peak
+ * RSS is that of this stage and thread count alone, and hand the timings
+ * back through @fd.
+ */
+static int child_run(const struct stage *stage, int nr, int fd)
+{
+	struct worker workers[nr];
+	struct result res;
+	int i, ret = 1;
+
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < nr; i++) {
+		workers[i].id = i;
+		workers[i].null_fd = -1;
+		if (worker_init(&workers[i]) < 0) {
+			bg_warn("cannot set up synthetic pages");
+			goto out;
+		}
+	}
+	if (run_stage(stage, workers, nr, &res) < 0) {
+		bg_warn("stage %s produced no records", stage->name);
+		goto out;
+	}
+	if (write(fd, &res, sizeof(res)) == sizeof(res))
+		ret = 0;
+out:
+	while (i-- > 0)
+		worker_free(&workers[i]);
+	return ret;
+}
+
+static void print_result(FILE *out, const struct stage *stage, int nr,
+			 const struct result *res, long rss_kb)
+{
+	double secs = res->wall / (double)NSEC_PER_SEC;
+
+	fprintf(out, "stage=%s threads=%d records=%llu seconds=%.6f records_per_s=%.0f ns_per_record=%.2f max_rss_kb=%ld\n",
+		stage->name, nr, res->records, secs, res->records / secs,
+		(double)res->ns / res->records, rss_kb);
+}
+
+/* One stage at one thread count, in a process of its own */
+static int bench_stage(const struct stage *stage, int nr, FILE *out)
+{
+	struct result res;
+	struct rusage ru;
+	int fds[2], status;
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe(fds) < 0)
+		return -1;
+	fflush(NULL);
+	pid = fork();
+	if (!pid) {
+		close(fds[0]);
+		_exit(child_run(stage, nr, fds[1]));
+	}
+	close(fds[1]);
+	n = pid < 0 ? -1 : read(fds[0], &res, sizeof(res));
+	close(fds[0]);
+	if (pid < 0 || wait4(pid, &status, 0, &ru) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) || n != sizeof(res))
+		return -1;
+
+	print_result(out, stage, nr, &res, ru.ru_maxrss);
+	print_result(stdout, stage, nr, &res, ru.ru_maxrss);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bg-bench [options]\n"
+		"  -t threads   up to this many threads (default: online CPUs)\n"
+		"  -s stage     only this stage (decode, field, field_tep, merge, render)\n"
+		"  -o file      results (default bench_output.txt)\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = "bench_output.txt", *only = NULL;
+	long max = sysconf(_SC_NPROCESSORS_ONLN);
+	int c, nr, ret = 0;
+	size_t s;
+	FILE *out;
+
+	while ((c = getopt(argc, argv, "t:s:o:h")) != -1) {
+		switch (c) {
+		case 't':
+			max = atoi(optarg);
+			break;
+		case 's':
+			only = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage();
+			return c != 'h';
+		}
+	}
+	if (max < 1)
+		max = 1;
+
+	out = fopen(output, "w");
+	if (!out) {
+		bg_warn("cannot create %s: %s", output, strerror(errno));
+		return 1;
+	}
+
+	for (s = 0; s < ARRAY_SIZE(stages); s++) {
+		if (only && strcmp(only, stages[s].name))
+			continue;
+		/* 1, 2, 4, ... and max itself */
+		for (nr = 1; nr <= max; nr = nr < max && nr * 2 > max ? max : nr * 2) {
+			if (bench_stage(&stages[s], nr, out) < 0) {
+				bg_warn("stage %s failed on %d threads",
+					stages[s].name, nr);
+				ret = 1;
+			}
+			if (nr == max)
+				break;
+		}
+	}
+
+	fclose(out);
+	return ret;
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cmds.h"
+#include "util.h"
+
+static const struct bg_cmd cmds[] = {
+	{ "record",	cmd_record,	"drain per-CPU ring buffers" },
+	{ "hist",	cmd_hist,	"aggregate in the kernel with hist triggers" },
+	{ "report",	cmd_report,	"summarize a capture file" },
+	{ "flight",	cmd_flight,	"snapshot an always-on buffer on a trigger" },
+	{ "offcpu",	cmd_offcpu,	"off-CPU time and run queue latency, streamed" },
+	{ "stress",	cmd_stress,	"find the rate at which events are lost" },
+	{ "funcgraph",	cmd_funcgraph,	"per-function time from the function_graph tracer" },
+	{ "aggregate",	cmd_aggregate,	"merge the deltas many hosts export" },
+};
+
+static void usage(void)
+{
+	size_t i;
+
+	fprintf(stderr, "usage: bg-c-perf-tools <command> [options]\n\n");
+	for (i = 0; i < ARRAY_SIZE(cmds); i++)
+		fprintf(stderr, "  %-10s %s\n", cmds[i].name, cmds[i].summary);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+
+	if (argc < 2) {
+		usage();
+		return 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(cmds); i++) {
+		if (!strcmp(argv[1], cmds[i].name))
+			return cmds[i].fn(argc - 1, argv + 1);
+	}
+
+	bg_warn("unknown command '%s'", argv[1]);
+	usage();
+	return 1;
+}
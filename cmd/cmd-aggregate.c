@@ -0,0 +1,446 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "export.h"
+#include "loghist.h"
+#include "util.h"
+
+#define AGGREGATE_INTERVAL	10	/* seconds */
+#define MAX_CLIENTS		65536
+
+static volatile sig_atomic_t done;
+
+static void stop_handler(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bg-c-perf-tools aggregate -l addr [options]\n"
+		"  -l addr      listen on unix:/path or [host]:port\n"
+		"  -i seconds   print the fleet's deltas this often (default %d)\n"
+		"  -c           keep accumulating histograms across intervals\n"
+		"  -d seconds   stop after this long (default: until ^C)\n",
+		AGGREGATE_INTERVAL);
+}
+
+/* Fleet-wide metrics, matched across hosts by name */
+struct counter {
+	char			*name;
+	unsigned long long	interval;
+	unsigned long long	total;
+};
+
+struct hist {
+	char			*name;
+	uint64_t		div;
+	char			*unit;
+	struct bg_loghist	h;
+};
+
+struct client {
+	int			fd;
+	uint8_t			*buf;
+	size_t			len;
+	size_t			size;
+	uint8_t			*hello_frame;	/* the strings of hello */
+	struct bg_export_hello	hello;
+	bool			said_hello;
+	unsigned int		*counter_map;	/* sender index -> ours */
+	unsigned int		*hist_map;
+	uint64_t		*counters;	/* one delta, decoded */
+	struct bg_loghist	*hists;
+};
+
+struct fleet {
+	struct counter		*counters;
+	unsigned int		nr_counters;
+	struct hist		*hists;
+	unsigned int		nr_hists;
+	struct client		*clients;
+	int			nr_clients;
+	unsigned long long	deltas;
+	unsigned long long	bytes;
+	unsigned long long	bad;
+};
+
+static char *strdup_n(const struct bg_export_str *s)
+{
+	return strndup(s->s, s->len);
+}
+
+static bool str_is(const char *name, const struct bg_export_str *s)
+{
+	return strlen(name) == s->len && !memcmp(name, s->s, s->len);
+}
+
+static int find_counter(struct fleet *f, const struct bg_export_str *name)
+{
+	struct counter *c;
+	unsigned int i;
+
+	for (i = 0; i < f->nr_counters; i++)
+		if (str_is(f->counters[i].name, name))
+			return i;
+	c = realloc(f->counters, (f->nr_counters + 1) * sizeof(*c));
+	if (!c)
+		return -1;
+	f->counters = c;
+	c += f->nr_counters;
+	memset(c, 0, sizeof(*c));
+	c->name = strdup_n(name);
+	if (!c->name)
+		return -1;
+	return f->nr_counters++;
+}
+
+static int find_hist(struct fleet *f, const struct bg_export_str *name,
+		     uint64_t div, const struct bg_export_str *unit)
+{
+	struct hist *h;
+	unsigned int i;
+
+	for (i = 0; i < f->nr_hists; i++)
+		if (str_is(f->hists[i].name, name))
+			return i;
+	h = realloc(f->hists, (f->nr_hists + 1) * sizeof(*h));
+	if (!h)
+		return -1;
+	f->hists = h;
+	h += f->nr_hists;
+	memset(h, 0, sizeof(*h));
+	h->div = div;
+	h->name = strdup_n(name);
+	h->unit = strdup_n(unit);
+	if (!h->name || !h->unit) {
+		free(h->name);
+		free(h->unit);
+		return -1;
+	}
+	return f->nr_hists++;
+}
+
+static void client_reset(struct client *c)
+{
+	bg_export_hello_free(&c->hello);
+	free(c->hello_frame);
+	free(c->counter_map);
+	free(c->hist_map);
+	free(c->counters);
+	free(c->hists);
+	c->hello_frame = NULL;
+	c->counter_map = c->hist_map = NULL;
+	c->counters = NULL;
+	c->hists = NULL;
+	c->said_hello = false;
+}
+
+static int on_hello(struct fleet *f, struct client *c, const uint8_t *p,
+		    size_t len)
+{
+	struct bg_export_hello *h = &c->hello;
+	unsigned int i;
+	int idx;
+
+	client_reset(c);
+	c->hello_frame = malloc(len);
+	if (!c->hello_frame)
+		return -1;
+	memcpy(c->hello_frame, p, len);
+	if (bg_export_parse_hello(c->hello_frame, len, h) < 0)
+		return -1;
+
+	c->counter_map = calloc(h->nr_counters + 1, sizeof(*c->counter_map));
+	c->hist_map = calloc(h->nr_hists + 1, sizeof(*c->hist_map));
+	c->counters = calloc(h->nr_counters + 1, sizeof(*c->counters));
+	c->hists = calloc(h->nr_hists + 1, sizeof(*c->hists));
+	if (!c->counter_map || !c->hist_map || !c->counters || !c->hists)
+		return -1;
+	for (i = 0; i < h->nr_counters; i++) {
+		idx = find_counter(f, &h->counters[i]);
+		if (idx < 0)
+			return -1;
+		c->counter_map[i] = idx;
+	}
+	for (i = 0; i < h->nr_hists; i++) {
+		idx = find_hist(f, &h->hists[i], h->divs[i], &h->units[i]);
+		if (idx < 0)
+			return -1;
+		c->hist_map[i] = idx;
+	}
+	c->said_hello = true;
+	return 0;
+}
+
+static int on_delta(struct fleet *f, struct client *c, const uint8_t *p,
+		    size_t len)
+{
+	const struct bg_export_hello *h = &c->hello;
+	struct counter *fc;
+	uint64_t time;
+	unsigned int i;
+
+	if (!c->said_hello) {
+		errno = EPROTO;
+		return -1;
+	}
+	memset(c->counters, 0, h->nr_counters * sizeof(*c->counters));
+	memset(c->hists, 0, h->nr_hists * sizeof(*c->hists));
+	if (bg_export_parse_delta(p, len, h, &time, c->counters, c->hists) < 0)
+		return -1;
+
+	for (i = 0; i < h->nr_counters; i++) {
+		fc = &f->counters[c->counter_map[i]];
+		fc->interval += c->counters[i];
+		fc->total += c->counters[i];
+	}
+	for (i = 0; i < h->nr_hists; i++)
+		if (c->hists[i].total)
+			bg_loghist_merge(&f->hists[c->hist_map[i]].h,
+					 &c->hists[i]);
+	f->deltas++;
+	return 0;
+}
+
+/* Handle every complete frame in the buffer; -1 drops the client */
+static int on_data(struct fleet *f, struct client *c)
+{
+	size_t off = 0, len;
+	const uint8_t *p;
+	int ret = 0;
+
+	while (c->len - off >= 5) {
+		p = c->buf + off;
+		len = p[0] | p[1] << 8 | p[2] << 16 | (size_t)p[3] << 24;
+		if (len < 1 || len > BG_EXPORT_MAX_FRAME) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (c->len - off < 4 + len)
+			break;
+		if (p[4] == BG_EXPORT_HELLO)
+			ret = on_hello(f, c, p + 5, len - 1);
+		else if (p[4] == BG_EXPORT_DELTA)
+			ret = on_delta(f, c, p + 5, len - 1);
+		/* Unknown frame types are for newer aggregators */
+		if (ret < 0)
+			return -1;
+		off += 4 + len;
+	}
+	memmove(c->buf, c->buf + off, c->len - off);
+	c->len -= off;
+	return 0;
+}
+
+static int read_client(struct fleet *f, struct client *c)
+{
+	uint8_t *buf;
+	ssize_t n;
+
+	for (;;) {
+		if (c->size - c->len < 4096) {
+			if (c->size >= BG_EXPORT_MAX_FRAME + 4096) {
+				errno = EPROTO;
+				return -1;
+			}
+			buf = realloc(c->buf, c->size ? c->size * 2 : 16384);
+			if (!buf)
+				return -1;
+			c->buf = buf;
+			c->size = c->size ? c->size * 2 : 16384;
+		}
+		n = recv(c->fd, c->buf + c->len, c->size - c->len, 0);
+		if (n > 0) {
+			c->len += n;
+			f->bytes += n;
+			if (on_data(f, c) < 0)
+				return -1;
+			continue;
+		}
+		if (!n) {
+			errno = 0;
+			return -1;
+		}
+		if (errno == EINTR)
+			continue;
+		return errno == EAGAIN ? 0 : -1;
+	}
+}
+
+static void drop_client(struct fleet *f, int i)
+{
+	struct client *c = &f->clients[i];
+
+	close(c->fd);
+	client_reset(c);
+	free(c->buf);
+	f->clients[i] = f->clients[--f->nr_clients];
+}
+
+static void accept_clients(struct fleet *f, int listen_fd)
+{
+	struct client *c;
+	int fd;
+
+	while ((fd = accept4(listen_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (f->nr_clients == MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		c = realloc(f->clients, (f->nr_clients + 1) * sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		f->clients = c;
+		c += f->nr_clients++;
+		memset(c, 0, sizeof(*c));
+		c->fd = fd;
+	}
+}
+
+static void report(struct fleet *f, bool cumulative, double secs,
+		   double interval)
+{
+	struct counter *c;
+	unsigned int i;
+	int hosts = 0;
+
+	for (i = 0; i < (unsigned int)f->nr_clients; i++)
+		hosts += f->clients[i].said_hello;
+	printf("--- %.1f s: %d hosts, %llu deltas %llu bytes, %llu dropped connections\n",
+	       secs, hosts, f->deltas, f->bytes, f->bad);
+	for (i = 0; i < f->nr_counters; i++) {
+		c = &f->counters[i];
+		printf("%-32s %16llu %14.1f/s\n", c->name, c->total,
+		       interval > 0 ? c->interval / interval : 0);
+		c->interval = 0;
+	}
+	for (i = 0; i < f->nr_hists; i++) {
+		if (!f->hists[i].h.total)
+			continue;
+		bg_loghist_print(stdout, f->hists[i].name, &f->hists[i].h,
+				 f->hists[i].div, f->hists[i].unit);
+		if (!cumulative)
+			bg_loghist_reset(&f->hists[i].h);
+	}
+	fflush(stdout);
+}
+
+int cmd_aggregate(int argc, char **argv)
+{
+	struct sigaction sa = { .sa_handler = stop_handler };
+	struct fleet f = { 0 };
+	struct pollfd *pfds = NULL, *p;
+	const char *addr = NULL;
+	int interval = AGGREGATE_INTERVAL, duration = 0, c, i, n, fd;
+	bool cumulative = false;
+	uint64_t start, last, now, next;
+	unsigned int k;
+
+	while ((c = getopt(argc, argv, "+l:i:cd:h")) != -1) {
+		switch (c) {
+		case 'l':
+			addr = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'c':
+			cumulative = true;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		default:
+			usage();
+			return c != 'h';
+		}
+	}
+	if (!addr || interval <= 0) {
+		usage();
+		return 1;
+	}
+
+	fd = bg_export_listen(addr);
+	if (fd < 0) {
+		bg_warn("cannot listen on %s: %s", addr, strerror(errno));
+		return 1;
+	}
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	start = last = bg_now_ns();
+	while (!done) {
+		now = bg_now_ns();
+		if (duration && now - start >= duration * NSEC_PER_SEC)
+			break;
+		if (now - last >= interval * NSEC_PER_SEC) {
+			report(&f, cumulative, (now - start) / (double)NSEC_PER_SEC,
+			       (now - last) / (double)NSEC_PER_SEC);
+			last = now;
+		}
+		next = last + interval * NSEC_PER_SEC;
+
+		p = realloc(pfds, (f.nr_clients + 1) * sizeof(*pfds));
+		if (!p)
+			break;
+		pfds = p;
+		pfds[0] = (struct pollfd){ .fd = fd, .events = POLLIN };
+		for (i = 0; i < f.nr_clients; i++)
+			pfds[i + 1] = (struct pollfd){ .fd = f.clients[i].fd,
+						       .events = POLLIN };
+		n = poll(pfds, f.nr_clients + 1,
+			 next > now ? (next - now) / NSEC_PER_MSEC + 1 : 0);
+		if (n <= 0)
+			continue;
+
+		/* Backwards, so dropping a client leaves the rest in place */
+		for (i = f.nr_clients - 1; i >= 0; i--) {
+			if (!pfds[i + 1].revents)
+				continue;
+			if (read_client(&f, &f.clients[i]) < 0) {
+				if (errno == EPROTO)
+					f.bad++;
+				drop_client(&f, i);
+			}
+		}
+		if (pfds[0].revents)
+			accept_clients(&f, fd);
+	}
+
+	now = bg_now_ns();
+	report(&f, cumulative, (now - start) / (double)NSEC_PER_SEC,
+	       (now - last) / (double)NSEC_PER_SEC);
+
+	while (f.nr_clients)
+		drop_client(&f, f.nr_clients - 1);
+	close(fd);
+	if (!strncmp(addr, "unix:", 5))
+		unlink(addr + 5);
+	for (k = 0; k < f.nr_counters; k++)
+		free(f.counters[k].name);
+	for (k = 0; k < f.nr_hists; k++) {
+		free(f.hists[k].name);
+		free(f.hists[k].unit);
+	}
+	free(f.counters);
+	free(f.hists);
+	free(f.clients);
+	free(pfds);
+	return 0;
+}
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "cpu.h"
+#include "formats.h"
+#include "khist.h"
+#include "session.h"
+#include "snapshot.h"
+#include "util.h"
+
+#define MAX_EVENTS	64
+
+/* How often a kernel-side latency trigger is checked for having fired */
+#define LATENCY_POLL_MS	250
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bg-c-perf-tools flight [options]\n"
+		"  -e system[:event]  enable events (repeatable, default sched)\n"
+		"  -f filter          in-kernel filter for the preceding -e\n"
+		"  -b kb              per-CPU buffer size (default %d)\n"
+		"  -o prefix          snapshots go to prefix.NNN (default flight)\n"
+		"  -t file            snapshot whenever file is touched\n"
+		"  -l usecs           snapshot when a wakeup latency exceeds usecs\n"
+		"  -n count           exit after this many snapshots\n"
+		"  -N name            tracefs instance name\n"
+		"Snapshots are also taken on SIGUSR1.\n",
+		BG_MIN_BUFFER_KB * 4);
+}
+
+/* Watch @path, creating it first so there is something to watch */
+static int watch_file(const char *path)
+{
+	int fd, ifd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	close(fd);
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd < 0)
+		return -1;
+	if (inotify_add_watch(ifd, path, IN_ATTRIB | IN_CLOSE_WRITE) < 0) {
+		close(ifd);
+		return -1;
+	}
+	return ifd;
+}
+
+static void drain(int fd)
+{
+	char buf[4096];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+int cmd_flight(int argc, char **argv)
+{
+	char *events[MAX_EVENTS];
+	char *filters[MAX_EVENTS] = { NULL };
+	struct bg_formats *formats = NULL;
+	struct bg_session *session;
+	struct bg_khist *lat = NULL;
+	const char *name = NULL, *prefix = "flight", *touch = NULL;
+	const char *reason;
+	bool in_kernel;
+	struct signalfd_siginfo si;
+	struct pollfd pfd[2];
+	sigset_t mask, old;
+	cpu_set_t cpus;
+	size_t kb = BG_MIN_BUFFER_KB * 4;
+	unsigned long latency = 0;
+	int nr_events = 0, max_shots = 0, shots = 0, nr_pfd;
+	int c, i, sfd = -1, ifd = -1, ret = 1;
+	char *path, *filter;
+	long pages;
+
+	while ((c = getopt(argc, argv, "+e:f:b:o:t:l:n:N:h")) != -1) {
+		switch (c) {
+		case 'e':
+			if (nr_events == MAX_EVENTS) {
+				bg_warn("too many -e options");
+				return 1;
+			}
+			events[nr_events++] = optarg;
+			break;
+		case 'f':
+			if (!nr_events) {
+				bg_warn("-f filters the preceding -e");
+				return 1;
+			}
+			filters[nr_events - 1] = optarg;
+			break;
+		case 'b':
+			kb = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			prefix = optarg;
+			break;
+		case 't':
+			touch = optarg;
+			break;
+		case 'l':
+			latency = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			max_shots = atoi(optarg);
+			break;
+		case 'N':
+			name = optarg;
+			break;
+		default:
+			usage();
+			return c != 'h';
+		}
+	}
+
+	if (bg_online_cpus(&cpus) <= 0) {
+		bg_warn("cannot read online cpus: %s", strerror(errno));
+		return 1;
+	}
+	if (!nr_events)
+		events[nr_events++] = "sched";
+
+	session = bg_session_create(name);
+	if (!session) {
+		bg_warn("cannot create instance: %s", strerror(errno));
+		return 1;
+	}
+
+	formats = bg_formats_open(NULL);
+	if (!formats)
+		goto out;
+
+	for (i = 0; i < nr_events; i++) {
+		if (filters[i] &&
+		    bg_session_set_filter(session, formats, events[i],
+					  filters[i]) < 0) {
+			bg_warn("cannot filter '%s' with '%s'", events[i],
+				filters[i]);
+			goto out;
+		}
+		if (bg_session_enable(session, events[i], true) < 0) {
+			bg_warn("cannot enable event '%s'", events[i]);
+			goto out;
+		}
+	}
+
+	if (bg_session_set_buffer_kb(session, kb, -1) < 0 ||
+	    bg_snapshot_prepare(session->instance) < 0) {
+		bg_warn("cannot set up overwrite and snapshot buffers: %s",
+			strerror(errno));
+		goto out;
+	}
+
+	/* The kernel takes this snapshot itself, at the offending switch */
+	if (latency) {
+		lat = bg_khist_wakeup_latency(session->instance, formats);
+		if (!lat || asprintf(&filter, "delta > %lu", latency) < 0) {
+			bg_warn("cannot set up wakeup latency trigger");
+			goto out;
+		}
+		i = bg_khist_snapshot_if(lat, filter);
+		free(filter);
+		if (i < 0) {
+			bg_warn("cannot set up wakeup latency trigger");
+			goto out;
+		}
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, &old);
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd < 0) {
+		bg_warn("cannot wait for signals: %s", strerror(errno));
+		goto out_mask;
+	}
+	pfd[0].fd = sfd;
+	pfd[0].events = POLLIN;
+	nr_pfd = 1;
+
+	if (touch) {
+		ifd = watch_file(touch);
+		if (ifd < 0) {
+			bg_warn("cannot watch %s: %s", touch, strerror(errno));
+			goto out_mask;
+		}
+		pfd[1].fd = ifd;
+		pfd[1].events = POLLIN;
+		nr_pfd = 2;
+	}
+
+	/* Steady state: nothing is read, we only wait for a trigger */
+	while (!max_shots || shots < max_shots) {
+		reason = NULL;
+		in_kernel = false;
+		if (poll(pfd, nr_pfd, lat ? LATENCY_POLL_MS : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			if (read(sfd, &si, sizeof(si)) != sizeof(si))
+				continue;
+			if (si.ssi_signo != SIGUSR1)
+				break;
+			reason = "signal";
+		} else if (nr_pfd > 1 && pfd[1].revents & POLLIN) {
+			drain(ifd);
+			reason = touch;
+		} else if (lat && bg_khist_snapshot_fired(lat)) {
+			reason = "latency";
+			in_kernel = true;
+		}
+		if (!reason)
+			continue;
+
+		if (!in_kernel && bg_snapshot_take(session->instance) < 0) {
+			bg_warn("cannot take snapshot: %s", strerror(errno));
+			continue;
+		}
+
+		if (asprintf(&path, "%s.%03d", prefix, shots) < 0)
+			break;
+		pages = bg_snapshot_dump(session->instance, formats, &cpus, path);
+		if (pages < 0)
+			bg_warn("cannot write %s: %s", path, strerror(errno));
+		else
+			fprintf(stderr, "snapshot %s (%s): %ld sub-buffers\n",
+				path, reason, pages);
+		free(path);
+		shots++;
+
+		if (in_kernel && bg_khist_snapshot_rearm(lat) < 0) {
+			bg_warn("cannot re-arm latency trigger");
+			break;
+		}
+	}
+	ret = 0;
+
+ out_mask:
+	if (ifd >= 0)
+		close(ifd);
+	if (sfd >= 0)
+		close(sfd);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+ out:
+	bg_khist_destroy(lat);
+	bg_formats_close(formats);
+	bg_session_destroy(session);
+	return ret;
+}
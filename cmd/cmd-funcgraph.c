@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "accessors.h"
+#include "cpu.h"
+#include "fgraph.h"
+#include "formats.h"
+#include "ksyms.h"
+#include "merge.h"
+#include "reader.h"
+#include "session.h"
+#include "util.h"
+
+#define FUNCGRAPH_TOP		30
+#define MAX_FILTERS		64
+
+enum sort_key {
+	SORT_EXCL,
+	SORT_INCL,
+	SORT_CALLS,
+};
+
+static volatile sig_atomic_t done;
+static enum sort_key sort_by;
+
+static void stop_handler(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bg-c-perf-tools funcgraph [options]\n"
+		"  -f glob      trace only matching functions (repeatable)\n"
+		"  -M module    match the -f globs in this module only\n"
+		"  -g func      trace only calls made under func (repeatable)\n"
+		"  -D depth     max_graph_depth (default: unlimited)\n"
+		"  -s key       sort by self, total or calls (default self)\n"
+		"  -n count     functions to print (default %d)\n"
+		"  -i seconds   print and start over this often (default: once, at exit)\n"
+		"  -d seconds   stop after this long (default: until ^C)\n"
+		"  -C cpulist   CPUs to trace (default: all online)\n"
+		"  -t tasks     size of the in-call task table (default %d)\n"
+		"  -k file      kallsyms to resolve with (default %s)\n"
+		"  -m ms        reorder window of the merge (default %llu)\n"
+		"  -b kb        per-CPU buffer size\n"
+		"  -N name      tracefs instance name\n",
+		FUNCGRAPH_TOP, BG_FGRAPH_TASKS, BG_KALLSYMS,
+		BG_MERGE_WINDOW_NS / NSEC_PER_MSEC);
+}
+
+static uint64_t sort_value(const struct bg_fgraph_func *f)
+{
+	switch (sort_by) {
+	case SORT_INCL:
+		return f->incl;
+	case SORT_CALLS:
+		return f->calls;
+	default:
+		return f->excl;
+	}
+}
+
+static int cmp_func(const void *a, const void *b)
+{
+	uint64_t x = sort_value(*(const struct bg_fgraph_func **)a);
+	uint64_t y = sort_value(*(const struct bg_fgraph_func **)b);
+
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Names are only looked up for the functions printed */
+static void report(struct bg_fgraph *g, const struct bg_ksyms *ks,
+		   unsigned int top, double secs)
+{
+	struct bg_fgraph_func **sorted;
+	const struct bg_fgraph_func *f;
+	unsigned int i, n = 0;
+	const char *name;
+	uint64_t off;
+
+	printf("--- %.1f s: %llu entries %llu exits, %u functions, %llu unmatched %llu dropped\n",
+	       secs, g->entries, g->exits, g->nr_funcs, g->unmatched,
+	       g->dropped);
+
+	sorted = malloc((g->nr_funcs + 1) * sizeof(*sorted));
+	if (!sorted)
+		return;
+	for (i = 0; i <= g->func_mask; i++)
+		if (g->funcs[i].addr)
+			sorted[n++] = &g->funcs[i];
+	qsort(sorted, n, sizeof(*sorted), cmp_func);
+
+	printf("%12s %14s %14s %10s %10s  %s\n", "calls", "total(us)",
+	       "self(us)", "avg(us)", "max(us)", "function");
+	for (i = 0; i < n && i < top; i++) {
+		f = sorted[i];
+		printf("%12llu %14.3f %14.3f %10.3f %10.3f  ", f->calls,
+		       f->incl / (double)NSEC_PER_USEC,
+		       f->excl / (double)NSEC_PER_USEC,
+		       f->incl / (double)NSEC_PER_USEC / f->calls,
+		       f->max / (double)NSEC_PER_USEC);
+		name = ks ? bg_ksyms_lookup(ks, f->addr, &off) : NULL;
+		if (!name)
+			printf("0x%llx\n", (unsigned long long)f->addr);
+		else if (off)
+			printf("%s+0x%llx\n", name, (unsigned long long)off);
+		else
+			printf("%s\n", name);
+	}
+	free(sorted);
+	fflush(stdout);
+}
+
+static int set_filters(struct bg_session *session, char **filters, int nr,
+		       const char *module)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (tracefs_function_filter(session->instance, filters[i],
+					    module, TRACEFS_FL_CONTINUE |
+					    (i ? 0 : TRACEFS_FL_RESET)) < 0) {
+			bg_warn("no function matches '%s'", filters[i]);
+			return -1;
+		}
+	}
+	/* Commit the list */
+	return nr ? tracefs_function_filter(session->instance, NULL, NULL, 0) : 0;
+}
+
+static int set_graph_functions(struct bg_session *session, char **funcs, int nr)
+{
+	int i, ret;
+
+	for (i = 0; i < nr; i++) {
+		ret = i ? tracefs_instance_file_append(session->instance,
+						       "set_graph_function",
+						       funcs[i]) :
+			  tracefs_instance_file_write(session->instance,
+						      "set_graph_function",
+						      funcs[i]);
+		if (ret < 0) {
+			bg_warn("cannot graph '%s': %s", funcs[i],
+				strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * max_graph_depth lives at the top level only on kernels before function
+ * graph instances, and applies to every instance there: remember what to
+ * put back.
+ */
+static struct tracefs_instance *depth_instance(struct bg_session *session)
+{
+	if (tracefs_file_exists(session->instance, "max_graph_depth"))
+		return session->instance;
+	return NULL;
+}
+
+int cmd_funcgraph(int argc, char **argv)
+{
+	struct timespec idle = { .tv_nsec = NSEC_PER_MSEC };
+	struct sigaction sa = { .sa_handler = stop_handler };
+	struct tracefs_instance *depth_inst = NULL;
+	struct bg_readers *readers = NULL;
+	struct bg_formats *formats = NULL;
+	struct bg_merge *merge = NULL;
+	struct bg_fgraph *g = NULL;
+	struct bg_ksyms *ks = NULL;
+	struct bg_session *session;
+	struct bg_accessors acc;
+	struct bg_merge_rec rec;
+	char *filters[MAX_FILTERS], *graphs[MAX_FILTERS];
+	char *old_depth = NULL, buf[16];
+	const char *name = NULL, *module = NULL, *kallsyms = NULL;
+	unsigned long long window = BG_MERGE_WINDOW_NS, records = 0;
+	unsigned int tasks = 0, top = FUNCGRAPH_TOP;
+	int nr_filters = 0, nr_graphs = 0, depth = -1;
+	int interval = 0, duration = 0, c, ret = 1, n;
+	bool stopping = false, have_cpus = false;
+	uint64_t start, last, now;
+	unsigned short id;
+	size_t kb = 0;
+	cpu_set_t cpus;
+
+	while ((c = getopt(argc, argv, "+f:M:g:D:s:n:i:d:C:t:k:m:b:N:h")) != -1) {
+		switch (c) {
+		case 'f':
+		case 'g':
+			if ((c == 'f' ? nr_filters : nr_graphs) == MAX_FILTERS) {
+				bg_warn("too many -%c", c);
+				return 1;
+			}
+			if (c == 'f')
+				filters[nr_filters++] = optarg;
+			else
+				graphs[nr_graphs++] = optarg;
+			break;
+		case 'M':
+			module = optarg;
+			break;
+		case 'D':
+			depth = atoi(optarg);
+			break;
+		case 's':
+			if (!strcmp(optarg, "self")) {
+				sort_by = SORT_EXCL;
+			} else if (!strcmp(optarg, "total")) {
+				sort_by = SORT_INCL;
+			} else if (!strcmp(optarg, "calls")) {
+				sort_by = SORT_CALLS;
+			} else {
+				bg_warn("bad sort key '%s'", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			top = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'C':
+			if (bg_cpulist_parse(optarg, &cpus) <= 0) {
+				bg_warn("bad cpu list '%s'", optarg);
+				return 1;
+			}
+			have_cpus = true;
+			break;
+		case 't':
+			tasks = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			kallsyms = optarg;
+			break;
+		case 'm':
+			window = strtoull(optarg, NULL, 0) * NSEC_PER_MSEC;
+			break;
+		case 'b':
+			kb = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			name = optarg;
+			break;
+		default:
+			usage();
+			return c != 'h';
+		}
+	}
+
+	if (!have_cpus && bg_online_cpus(&cpus) <= 0) {
+		bg_warn("cannot read online cpus: %s", strerror(errno));
+		return 1;
+	}
+
+	/* Read once up front; nothing is resolved while tracing */
+	ks = bg_ksyms_load(kallsyms);
+	if (!ks)
+		bg_warn("cannot load %s: %s; printing addresses",
+			kallsyms ? kallsyms : BG_KALLSYMS, strerror(errno));
+
+	session = bg_session_create(name);
+	if (!session) {
+		bg_warn("cannot create instance: %s", strerror(errno));
+		bg_ksyms_free(ks);
+		return 1;
+	}
+
+	formats = bg_formats_open(NULL);
+	g = bg_fgraph_alloc(tasks);
+	if (!formats || !g)
+		goto out;
+	bg_accessors_init(&acc);
+	bg_accessors_load(&acc, formats);
+	if (acc.funcgraph_entry.id < 0 || acc.funcgraph_exit.id < 0) {
+		bg_warn("cannot load the funcgraph_entry and funcgraph_exit formats");
+		goto out;
+	}
+
+	if (set_filters(session, filters, nr_filters, module) < 0 ||
+	    set_graph_functions(session, graphs, nr_graphs) < 0)
+		goto out;
+	if (depth >= 0) {
+		depth_inst = depth_instance(session);
+		old_depth = tracefs_instance_file_read(depth_inst,
+						       "max_graph_depth", NULL);
+		snprintf(buf, sizeof(buf), "%d", depth);
+		if (tracefs_instance_file_write(depth_inst, "max_graph_depth",
+						buf) < 0) {
+			bg_warn("cannot set max_graph_depth: %s",
+				strerror(errno));
+			goto out;
+		}
+	}
+	if (kb && bg_session_set_buffer_kb(session, kb, -1) < 0) {
+		bg_warn("cannot size ring buffers: %s", strerror(errno));
+		goto out;
+	}
+
+	readers = bg_readers_alloc(session->instance, &cpus);
+	if (!readers)
+		goto out;
+	merge = bg_merge_alloc(readers->nr_readers, window,
+			       &bg_merge_reader_ops, readers);
+	if (!merge)
+		goto out;
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (bg_readers_start_ring(readers, BG_RING_PAGES) < 0) {
+		bg_warn("cannot start readers: %s", strerror(errno));
+		goto out;
+	}
+	if (tracefs_tracer_set(session->instance,
+			       TRACEFS_TRACER_FUNCTION_GRAPH) < 0) {
+		bg_warn("cannot set the function_graph tracer: %s",
+			strerror(errno));
+		bg_readers_stop(readers);
+		goto out;
+	}
+	tracefs_trace_on(session->instance);
+	start = last = bg_now_ns();
+
+	while ((n = bg_merge_next(merge, &rec)) >= 0) {
+		if (n) {
+			memcpy(&id, rec.data, sizeof(id));
+			if (bg_fgraph_record(g, &acc, id, rec.cpu, rec.data,
+					     rec.ts) < 0) {
+				bg_warn("out of memory");
+				done = 1;
+			}
+			if (++records % 4096)
+				continue;
+		}
+
+		now = bg_now_ns();
+		if (!stopping && (done || (duration &&
+		    now - start >= duration * NSEC_PER_SEC))) {
+			tracefs_trace_off(session->instance);
+			bg_readers_signal_stop(readers);
+			stopping = true;
+		}
+		if (interval && !stopping &&
+		    now - last >= interval * NSEC_PER_SEC) {
+			report(g, ks, top, (now - start) / (double)NSEC_PER_SEC);
+			bg_fgraph_reset(g);
+			last = now;
+		}
+		if (!n)
+			nanosleep(&idle, NULL);
+	}
+	bg_readers_stop(readers);
+	tracefs_tracer_clear(session->instance);
+
+	if (!interval || g->nr_funcs)
+		report(g, ks, top, (bg_now_ns() - start) / (double)NSEC_PER_SEC);
+	ret = 0;
+
+ out:
+	if (old_depth) {
+		tracefs_instance_file_write(depth_inst, "max_graph_depth",
+					    old_depth);
+		free(old_depth);
+	}
+	bg_merge_free(merge);
+	bg_readers_free(readers);
+	bg_fgraph_free(g);
+	bg_formats_close(formats);
+	bg_session_destroy(session);
+	bg_ksyms_free(ks);
+	return ret;
+}
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "formats.h"
+#include "khist.h"
+#include "session.h"
+#include "util.h"
+
+static volatile sig_atomic_t done;
+
+static void stop_handler(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bg-c-perf-tools hist [options]\n"
+		"  -w           per-pid wakeup latency in usecs (log2 buckets)\n"
+		"  -i           per-device I/O request sizes (log2 buckets)\n"
+		"  -H spec      system:event:key[.mod][,key...][:filter] (repeatable)\n"
+		"  -d seconds   aggregate for this long (default: until ^C)\n"
+		"  -N name      tracefs instance name\n"
+		"  -o file      write the tables here instead of stdout\n");
+}
+
+static void push(struct bg_khist **list, struct bg_khist *kh)
+{
+	kh->next = *list;
+	*list = kh;
+}
+
+int cmd_hist(int argc, char **argv)
+{
+	struct sigaction sa = { .sa_handler = stop_handler };
+	struct bg_khist *list = NULL, *kh, *next;
+	struct bg_formats *formats = NULL;
+	struct bg_session *session;
+	const char *name = NULL, *output = NULL;
+	char *specs[32];
+	bool wakeup = false, io = false;
+	int c, i, nr_specs = 0, duration = 0, ret = 1;
+	FILE *out = stdout;
+	uint64_t start;
+	char *table;
+
+	while ((c = getopt(argc, argv, "+wiH:d:N:o:h")) != -1) {
+		switch (c) {
+		case 'w':
+			wakeup = true;
+			break;
+		case 'i':
+			io = true;
+			break;
+		case 'H':
+			if (nr_specs == (int)ARRAY_SIZE(specs)) {
+				bg_warn("too many -H options");
+				return 1;
+			}
+			specs[nr_specs++] = optarg;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'N':
+			name = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage();
+			return c != 'h';
+		}
+	}
+
+	if (!wakeup && !io && !nr_specs) {
+		usage();
+		return 1;
+	}
+
+	session = bg_session_create(name);
+	if (!session) {
+		bg_warn("cannot create instance: %s", strerror(errno));
+		return 1;
+	}
+
+	formats = bg_formats_open(NULL);
+	if (!formats)
+		goto out;
+
+	if (wakeup) {
+		kh = bg_khist_wakeup_latency(NULL, formats);
+		if (!kh) {
+			bg_warn("cannot set up wakeup latency histogram");
+			goto out;
+		}
+		push(&list, kh);
+	}
+	if (io) {
+		kh = bg_khist_io_sizes(session->instance, formats);
+		if (!kh) {
+			bg_warn("cannot set up I/O size histogram");
+			goto out;
+		}
+		push(&list, kh);
+	}
+	for (i = 0; i < nr_specs; i++) {
+		kh = bg_khist_parse(session->instance, formats, specs[i]);
+		if (!kh) {
+			bg_warn("bad histogram '%s': %s", specs[i], strerror(errno));
+			goto out;
+		}
+		push(&list, kh);
+	}
+
+	/* The ring buffer is not needed at all */
+	bg_session_set_buffer_kb(session, 4, -1);
+
+	for (kh = list; kh; kh = kh->next) {
+		if (bg_khist_start(kh) < 0) {
+			bg_warn("cannot start histogram on %s:%s", kh->system,
+				kh->event);
+			goto out;
+		}
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	start = bg_now_ns();
+	while (!done) {
+		if (duration && bg_now_ns() - start >= duration * NSEC_PER_SEC)
+			break;
+		sleep(1);
+	}
+
+	if (output) {
+		out = fopen(output, "w");
+		if (!out) {
+			bg_warn("cannot create %s: %s", output, strerror(errno));
+			goto out;
+		}
+	}
+
+	for (kh = list; kh; kh = kh->next) {
+		table = bg_khist_read(kh);
+		fprintf(out, "# %s:%s\n%s\n", kh->system, kh->event,
+			table ? table : "(unreadable)\n");
+		free(table);
+	}
+	ret = 0;
+
+	if (out != stdout)
+		fclose(out);
+ out:
+	for (kh = list; kh; kh = next) {
+		next = kh->next;
+		bg_khist_destroy(kh);
+	}
+	bg_formats_close(formats);
+	bg_session_destroy(session);
+	return ret;
+}
@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "accessors.h"
+#include "agg.h"
+#include "cpu.h"
+#include "export.h"
+#include "formats.h"
+#include "merge.h"
+#include "reader.h"
+#include "schedlat.h"
+#include "session.h"
+#include "util.h"
+
+static volatile sig_atomic_t done;
+
+static void stop_handler(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bg-c-perf-tools offcpu [options]\n"
+		"  -i seconds   print and start over this often (default: once, at exit)\n"
+		"  -c           keep accumulating across -i intervals\n"
+		"  -d seconds   stop after this long (default: until ^C)\n"
+		"  -C cpulist   CPUs to trace (default: all online)\n"
+		"  -t tasks     size of the per-task table (default %d)\n"
+		"  -m ms        reorder window of the merge (default %llu)\n"
+		"  -b kb        per-CPU buffer size\n"
+		"  -N name      tracefs instance name\n"
+		"  -x addr      send deltas to an aggregator at unix:/path or host:port\n"
+		"  -X ms        ... this often (default %d)\n"
+		"  -H host      name to send them under (default: hostname)\n",
+		BG_SCHEDLAT_TASKS, BG_MERGE_WINDOW_NS / NSEC_PER_MSEC,
+		BG_EXPORT_INTERVAL_MS);
+}
+
+/* Names of the bg_schedlat_set_agg() counters and histograms */
+static const char * const export_counters[] = {
+	[BG_SCHEDLAT_SWITCHES]	= "offcpu.switches",
+	[BG_SCHEDLAT_WAKEUPS]	= "offcpu.wakeups",
+	[BG_SCHEDLAT_EXPIRED]	= "offcpu.expired",
+	[BG_SCHEDLAT_DROPPED]	= "offcpu.dropped",
+};
+
+static const struct bg_export_hist_def export_hists[] = {
+	[BG_SCHEDLAT_OFFCPU]	= { "offcpu.offcpu_time", NSEC_PER_USEC, "us" },
+	[BG_SCHEDLAT_RUNQ]	= { "offcpu.runq_latency", NSEC_PER_USEC, "us" },
+};
+
+
+static void report(struct bg_schedlat *s, double secs)
+{
+	printf("--- %.1f s: %llu switches %llu wakeups, %u tasks tracked %llu expired %llu dropped\n",
+	       secs, s->switches, s->wakeups, s->used, s->expired, s->dropped);
+	bg_loghist_print(stdout, "off-CPU time (usecs)", &s->offcpu,
+			 NSEC_PER_USEC, "us");
+	bg_loghist_print(stdout, "run queue latency (usecs)", &s->runq,
+			 NSEC_PER_USEC, "us");
+	fflush(stdout);
+}
+
+int cmd_offcpu(int argc, char **argv)
+{
+	struct timespec idle = { .tv_nsec = NSEC_PER_MSEC };
+	struct sigaction sa = { .sa_handler = stop_handler };
+	struct bg_readers *readers = NULL;
+	struct bg_formats *formats = NULL;
+	struct bg_merge *merge = NULL;
+	struct bg_schedlat *lat = NULL;
+	struct bg_export *export = NULL;
+	struct bg_agg *agg = NULL;
+	const char *export_addr = NULL, *host = NULL;
+	unsigned int export_ms = BG_EXPORT_INTERVAL_MS;
+	char hostname[256];
+	struct bg_session *session;
+	struct bg_accessors acc;
+	struct bg_merge_rec rec;
+	const char *name = NULL;
+	unsigned long long window = BG_MERGE_WINDOW_NS, records = 0;
+	unsigned int tasks = 0;
+	int interval = 0, duration = 0, c, ret = 1, n;
+	bool cumulative = false, stopping = false;
+	uint64_t start, last, now;
+	unsigned short id;
+	size_t kb = 0;
+	cpu_set_t cpus;
+	bool have_cpus = false;
+
+	while ((c = getopt(argc, argv, "+i:cd:C:t:m:b:N:x:X:H:h")) != -1) {
+		switch (c) {
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'c':
+			cumulative = true;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'C':
+			if (bg_cpulist_parse(optarg, &cpus) <= 0) {
+				bg_warn("bad cpu list '%s'", optarg);
+				return 1;
+			}
+			have_cpus = true;
+			break;
+		case 't':
+			tasks = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			window = strtoull(optarg, NULL, 0) * NSEC_PER_MSEC;
+			break;
+		case 'b':
+			kb = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			name = optarg;
+			break;
+		case 'x':
+			export_addr = optarg;
+			break;
+		case 'X':
+			export_ms = strtoul(optarg, NULL, 0);
+			if (!export_ms)
+				export_ms = BG_EXPORT_INTERVAL_MS;
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		default:
+			usage();
+			return c != 'h';
+		}
+	}
+
+	if (!have_cpus && bg_online_cpus(&cpus) <= 0) {
+		bg_warn("cannot read online cpus: %s", strerror(errno));
+		return 1;
+	}
+
+	if (export_addr) {
+		if (!host) {
+			if (gethostname(hostname, sizeof(hostname)) < 0)
+				snprintf(hostname, sizeof(hostname), "unknown");
+			hostname[sizeof(hostname) - 1] = '\0';
+			host = hostname;
+		}
+		export = bg_export_open(export_addr, host, export_counters,
+					BG_SCHEDLAT_NR_COUNTERS, export_hists,
+					ARRAY_SIZE(export_hists));
+		if (!export) {
+			bg_warn("cannot export to %s: %s", export_addr,
+				strerror(errno));
+			return 1;
+		}
+	}
+
+	session = bg_session_create(name);
+	if (!session) {
+		bg_warn("cannot create instance: %s", strerror(errno));
+		bg_export_close(export);
+		return 1;
+	}
+
+	formats = bg_formats_open(NULL);
+	lat = bg_schedlat_alloc(tasks);
+	if (!formats || !lat)
+		goto out;
+	if (export) {
+		/* Only the merge's consumer writes: one slot */
+		agg = bg_agg_alloc(1, BG_SCHEDLAT_NR_COUNTERS,
+				   BG_SCHEDLAT_NR_HISTS);
+		if (!agg)
+			goto out;
+		bg_schedlat_set_agg(lat, agg, 0);
+	}
+	bg_accessors_init(&acc);
+	bg_accessors_load(&acc, formats);
+	if (acc.sched_switch.id < 0 || acc.sched_wakeup.id < 0) {
+		bg_warn("cannot load the sched_switch and sched_wakeup formats");
+		goto out;
+	}
+
+	if (bg_session_enable(session, "sched:sched_switch", true) < 0 ||
+	    bg_session_enable(session, "sched:sched_wakeup", true) < 0) {
+		bg_warn("cannot enable sched events: %s", strerror(errno));
+		goto out;
+	}
+	if (kb && bg_session_set_buffer_kb(session, kb, -1) < 0) {
+		bg_warn("cannot size ring buffers: %s", strerror(errno));
+		goto out;
+	}
+
+	readers = bg_readers_alloc(session->instance, &cpus);
+	if (!readers)
+		goto out;
+	merge = bg_merge_alloc(readers->nr_readers, window,
+			       &bg_merge_reader_ops, readers);
+	if (!merge)
+		goto out;
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (bg_readers_start_ring(readers, BG_RING_PAGES) < 0) {
+		bg_warn("cannot start readers: %s", strerror(errno));
+		goto out;
+	}
+	/*
+	 * Connects and sends may block for a while: they happen on the fold
+	 * thread, never on this one, which has to keep the rings drained.
+	 */
+	if (agg && bg_agg_start(agg, export_ms, bg_export_fold, export) < 0) {
+		bg_warn("cannot start the export thread: %s", strerror(errno));
+		bg_readers_stop(readers);
+		goto out;
+	}
+	tracefs_trace_on(session->instance);
+	start = last = bg_now_ns();
+
+	/* Every record is looked at once and dropped; nothing is kept */
+	while ((n = bg_merge_next(merge, &rec)) >= 0) {
+		if (n) {
+			memcpy(&id, rec.data, sizeof(id));
+			bg_schedlat_record(lat, &acc, id, rec.data, rec.ts);
+			if (++records % 4096)
+				continue;
+		}
+
+		now = bg_now_ns();
+		if (!stopping && (done || (duration &&
+		    now - start >= duration * NSEC_PER_SEC))) {
+			tracefs_trace_off(session->instance);
+			bg_readers_signal_stop(readers);
+			stopping = true;
+		}
+		if (interval && !stopping &&
+		    now - last >= interval * NSEC_PER_SEC) {
+			report(lat, (now - start) / (double)NSEC_PER_SEC);
+			if (!cumulative)
+				bg_schedlat_reset(lat);
+			last = now;
+		}
+		if (!n)
+			nanosleep(&idle, NULL);
+	}
+	bg_readers_stop(readers);
+	/* A last fold ships whatever came in since the previous one */
+	if (agg)
+		bg_agg_stop(agg);
+
+	if (!interval || cumulative || lat->offcpu.total || lat->runq.total)
+		report(lat, (bg_now_ns() - start) / (double)NSEC_PER_SEC);
+	ret = 0;
+
+ out:
+	bg_merge_free(merge);
+	bg_readers_free(readers);
+	bg_schedlat_free(lat);
+	bg_agg_free(agg);
+	bg_formats_close(formats);
+	bg_session_destroy(session);
+	bg_export_close(export);
+	return ret;
+}
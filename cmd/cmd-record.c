@@ -0,0 +1,1129 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "batch.h"
+#include "capture.h"
+#include "config.h"
+#include "cpu.h"
+#include "export.h"
+#include "formats.h"
+#include "merge.h"
+#include "probes.h"
+#include "selfstats.h"
+#include "reader.h"
+#include "sample.h"
+#include "segments.h"
+#include "session.h"
+#include "util.h"
+
+#define MAX_EVENTS	64
+
+struct record_cpu {
+	int			fd;
+	unsigned long long	events;
+	unsigned long long	*id_counts;	/* -s: events per event id */
+	int			nr_ids;
+	struct bg_batch		batch;
+	struct bg_sampler	sampler;
+};
+
+static volatile sig_atomic_t done, reload;
+
+static void stop_handler(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static void reload_handler(int sig)
+{
+	(void)sig;
+	reload = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bg-c-perf-tools record [options]\n"
+		"  -e system[:event]  enable events (repeatable, default sched)\n"
+		"  -f filter          in-kernel filter for the preceding -e\n"
+		"  -p probe           add a probe, \"kprobe:name symbol [args]\" (see\n"
+		"                     src/probes.h for the other kinds; repeatable)\n"
+		"  -P file            add the probes of file, one per line\n"
+		"  -F file            events, filters, sampling and hist triggers from\n"
+		"                     file (see src/config.h), re-read on SIGHUP\n"
+		"  -L path            also take \"reload [file]\" on this Unix socket\n"
+		"  -o file            write an indexed capture file\n"
+		"  -S                 splice raw pages into -o.cpuN without decoding them\n"
+		"  -z codec[:level]   compress capture chunks (zstd, lz4)\n"
+		"  -u depth           write -o through io_uring, depth chunks in flight\n"
+		"                     (0: default %d)\n"
+		"  -Y mb              fdatasync -o after every mb of chunks\n"
+		"  -G seconds         cut -o into indexed files of this long each,\n"
+		"                     named output.NNNNNN\n"
+		"  -M mb              delete the oldest of them to stay under mb\n"
+		"  -W policy[:pct]    reader wakeup: adaptive (default), watermark or\n"
+		"                     busy; pct is the buffer_percent watermark (%d)\n"
+		"  -T file            append a line of collector stats every second\n"
+		"  -U path            serve the same lines on a Unix socket\n"
+		"  -C cpulist         CPUs to drain (default: all online)\n"
+		"  -I                 keep every collector thread off the isolated\n"
+		"                     (isolcpus=, nohz_full=) CPUs, draining them remotely\n"
+		"  -d seconds         stop after this long (default: until ^C)\n"
+		"  -N name            tracefs instance name (default: bg-c-perf-tools.<pid>)\n"
+		"  -b kb              per-CPU buffer size\n"
+		"  -r events/s        size buffers for this expected per-CPU rate\n"
+		"                     (default %d)\n"
+		"  -c ms              size each CPU's buffer from a calibration run\n"
+		"  -B ms              burst the buffers must absorb (default %d)\n"
+		"  -s                 summarize events by name (formats are loaded lazily)\n"
+		"  -k event=spec      sample system:event (or * for any) before decoding:\n"
+		"                     1/N keeps one in N, K/s at most K per second and CPU\n"
+		"                     (-o still gets every record)\n"
+		"  -m ms              merge CPUs into one time-ordered stream with this\n"
+		"                     reorder window (0: default %llu ms)\n",
+		BG_CAP_URING_DEPTH, BG_WAKE_PERCENT, BG_DEFAULT_RATE,
+		BG_DEFAULT_BURST_MS,
+		BG_MERGE_WINDOW_NS / NSEC_PER_MSEC);
+}
+
+static int count_id(struct record_cpu *rc, unsigned short id)
+{
+	unsigned long long *counts;
+	int nr;
+
+	if (unlikely(id >= rc->nr_ids)) {
+		nr = id < 1024 ? 1024 : id + 1;
+		counts = realloc(rc->id_counts, nr * sizeof(*counts));
+		if (!counts)
+			return -1;
+		memset(counts + rc->nr_ids, 0,
+		       (nr - rc->nr_ids) * sizeof(*counts));
+		rc->id_counts = counts;
+		rc->nr_ids = nr;
+	}
+	rc->id_counts[id]++;
+	return 0;
+}
+
+static const struct {
+	const char	*name;
+	enum bg_wakeup	wakeup;
+} wakeups[] = {
+	{ "adaptive",	BG_WAKE_ADAPTIVE },
+	{ "watermark",	BG_WAKE_WATERMARK },
+	{ "busy",	BG_WAKE_BUSY },
+};
+
+/* "policy[:percent]" */
+static int parse_wakeup(const char *arg, enum bg_wakeup *wakeup, int *percent)
+{
+	const char *sep = strchr(arg, ':');
+	size_t len = sep ? (size_t)(sep - arg) : strlen(arg);
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(wakeups); i++) {
+		if (strlen(wakeups[i].name) == len &&
+		    !strncmp(arg, wakeups[i].name, len))
+			break;
+	}
+	if (i == ARRAY_SIZE(wakeups))
+		return -1;
+	*wakeup = wakeups[i].wakeup;
+	if (sep)
+		*percent = atoi(sep + 1);
+	return *percent < 0 || *percent > 100 ? -1 : 0;
+}
+
+/* State shared by the consumer loops */
+struct record_run {
+	struct bg_readers	*readers;
+	struct record_cpu	*rcs;
+	struct bg_session	*session;
+	struct kbuffer		*kbuf;
+	struct bg_capture	*cap;
+	struct bg_segments	*segs;
+	struct bg_selfstats	*stats;
+	struct bg_config_state	*config;
+	const char		*config_path;
+	int			control_fd;
+	bool			splice;
+	bool			summarize;
+	bool			sampling;
+	bool			stopping;
+	bool			failed;
+	int			duration;
+	uint64_t		start;
+};
+
+/*
+ * Load @path and apply it to the running session. Readers and their
+ * buffers are left alone; only the event files, sampling rules and hist
+ * triggers that changed are touched. @msg gets a one-line result.
+ */
+static int reload_config(struct record_run *run, const char *path,
+			 char *msg, size_t len)
+{
+	struct bg_config_diff diff;
+	struct bg_config *c;
+	int i, line;
+
+	c = bg_config_load(path, &line);
+	if (!c) {
+		if (line)
+			snprintf(msg, len, "error %s:%d: bad directive", path,
+				 line);
+		else
+			snprintf(msg, len, "error %s: %s", path,
+				 strerror(errno));
+		return -1;
+	}
+	if (run->splice && c->nr_samples) {
+		bg_config_free(c);
+		snprintf(msg, len, "error sampling needs decoding, which -S skips");
+		return -1;
+	}
+	if (bg_config_apply(run->config, c, &diff) < 0) {
+		snprintf(msg, len, "error %s: %s", path, strerror(errno));
+		bg_config_free(c);
+		return -1;
+	}
+
+	/*
+	 * Formats are dumped when the capture is closed, so loading those of
+	 * newly enabled events now covers every record of them it will hold.
+	 */
+	if (run->cap)
+		bg_capture_add_formats(run->cap, run->config->formats,
+				       run->session->instance);
+	if (run->segs)
+		bg_segments_add_formats(run->segs);
+
+	run->sampling = !bg_sample_rules_empty(&run->config->rules);
+	for (i = 0; run->rcs && i < run->config->nr_samplers; i++)
+		run->rcs[i].batch.sampler = run->sampling ?
+					    &run->rcs[i].sampler : NULL;
+
+	snprintf(msg, len, "ok enabled=%d disabled=%d filtered=%d unchanged=%d skipped=%d hists_added=%d hists_removed=%d failed=%d",
+		 diff.enabled, diff.disabled, diff.filtered, diff.unchanged,
+		 diff.skipped, diff.hists_added, diff.hists_removed,
+		 diff.failed);
+	return diff.failed ? -1 : 0;
+}
+
+/* One request per connection: "reload [file]\n", answered with one line */
+static void serve_control(struct record_run *run, int fd)
+{
+	struct timeval tv = { .tv_usec = 100 * 1000 };
+	char req[4096], msg[512];
+	const char *path;
+	ssize_t n;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	n = read(fd, req, sizeof(req) - 1);
+	if (n <= 0)
+		return;
+	req[n] = '\0';
+	req[strcspn(req, "\r\n")] = '\0';
+
+	if (!strncmp(req, "reload", 6) && (!req[6] || req[6] == ' ')) {
+		path = req[6] ? req + 7 : run->config_path;
+		/* One byte kept back for the newline */
+		reload_config(run, path, msg, sizeof(msg) - 1);
+		fprintf(stderr, "reload %s: %s\n", path, msg);
+	} else {
+		snprintf(msg, sizeof(msg) - 1, "error unknown request");
+	}
+	strcat(msg, "\n");
+	bg_write_all(fd, msg, strlen(msg));
+}
+
+/* Between stretches of consuming is when a new config goes in */
+static void check_reload(struct record_run *run)
+{
+	char msg[512];
+	int fd;
+
+	if (!run->config)
+		return;
+	if (reload) {
+		reload = 0;
+		reload_config(run, run->config_path, msg, sizeof(msg));
+		fprintf(stderr, "reload %s: %s\n", run->config_path, msg);
+	}
+	while (run->control_fd >= 0 &&
+	       (fd = accept4(run->control_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		serve_control(run, fd);
+		close(fd);
+	}
+}
+
+static int write_page(struct record_run *run, struct bg_page *page)
+{
+	uint64_t t = bg_stage_clock(run->stats);
+	int ret;
+
+	if (run->segs)
+		ret = bg_segments_add_page(run->segs, page->cpu, page->data,
+					   page->size);
+	else if (run->cap)
+		ret = bg_capture_add_page(run->cap, page->cpu, page->data,
+					  page->size);
+	else
+		return 0;
+	if (ret < 0) {
+		bg_warn("cpu %d: write failed: %s", page->cpu, strerror(errno));
+		return -1;
+	}
+	bg_stage_add(run->stats, BG_STAGE_WRITE, 1, page->size, t);
+	return 0;
+}
+
+static int consume_page(struct record_run *run, struct record_cpu *rc,
+			struct bg_page *page)
+{
+	struct kbuffer *kbuf = run->kbuf;
+	unsigned long long ts, events = rc->events;
+	uint64_t t = bg_stage_clock(run->stats);
+	unsigned int i;
+	void *event;
+	int n;
+
+	if (kbuffer_load_subbuffer(kbuf, page->data) < 0)
+		return -1;
+
+	if (run->summarize || run->sampling) {
+		n = bg_batch_decode(&rc->batch, kbuf, page->cpu);
+		if (n < 0)
+			return -1;
+		rc->events += n;
+		for (i = 0; run->summarize && i < rc->batch.nr; i++) {
+			if (count_id(rc, rc->batch.id[i]) < 0)
+				return -1;
+		}
+	} else {
+		for (event = kbuffer_read_event(kbuf, &ts); event;
+		     event = kbuffer_next_event(kbuf, &ts))
+			rc->events++;
+	}
+	bg_stage_add(run->stats, BG_STAGE_DECODE, rc->events - events,
+		     page->size, t);
+
+	return write_page(run, page);
+}
+
+/* Turn tracing off and wake the readers once it is time to stop */
+static void check_stop(struct record_run *run)
+{
+	if (run->stopping)
+		return;
+	check_reload(run);
+	if (!done && !run->failed &&
+	    (!run->duration ||
+	     bg_now_ns() - run->start < run->duration * NSEC_PER_SEC))
+		return;
+
+	tracefs_trace_off(run->session->instance);
+	bg_readers_signal_stop(run->readers);
+	run->stopping = true;
+}
+
+/*
+ * The aggregation side of the pipeline, run on the main thread: drain
+ * every reader's ring, recycle the pages, and once it is time to stop
+ * keep draining until each reader has flushed its last page.
+ */
+static void consume(struct record_run *run)
+{
+	struct timespec idle = { .tv_nsec = NSEC_PER_MSEC };
+	struct bg_readers *readers = run->readers;
+	struct bg_reader *r;
+	struct bg_page *page;
+	int i, got, drained;
+
+	for (;;) {
+		got = drained = 0;
+		for (i = 0; i < readers->nr_readers; i++) {
+			r = &readers->readers[i];
+			while ((page = bg_reader_next_page(r))) {
+				if (run->failed)
+					bg_selfstats_drop(run->stats, 1);
+				else if (consume_page(run, &run->rcs[i], page) < 0)
+					run->failed = true;
+				bg_page_put(page);
+				got++;
+			}
+			if (run->stopping && bg_reader_drained(r))
+				drained++;
+		}
+
+		if (run->stopping && drained == readers->nr_readers)
+			break;
+
+		check_stop(run);
+		if (!got)
+			nanosleep(&idle, NULL);
+	}
+}
+
+static struct bg_page *merge_next_page(void *src, int stream)
+{
+	struct record_run *run = src;
+
+	return bg_reader_next_page(&run->readers->readers[stream]);
+}
+
+static bool merge_finished(void *src, int stream)
+{
+	struct record_run *run = src;
+
+	return bg_reader_drained(&run->readers->readers[stream]);
+}
+
+/* Pages are written out whole once the merge has gone through them */
+static void merge_put_page(void *src, struct bg_page *page)
+{
+	struct record_run *run = src;
+
+	if (run->failed)
+		bg_selfstats_drop(run->stats, 1);
+	else if (write_page(run, page) < 0)
+		run->failed = true;
+	bg_page_put(page);
+}
+
+static const struct bg_merge_ops merge_ops = {
+	.next_page	= merge_next_page,
+	.finished	= merge_finished,
+	.put_page	= merge_put_page,
+};
+
+/* Like consume(), but records come out in global timestamp order */
+static void consume_merged(struct record_run *run, unsigned long long window)
+{
+	struct timespec idle = { .tv_nsec = NSEC_PER_MSEC };
+	struct bg_merge_stats stats;
+	struct bg_merge_rec rec;
+	struct record_cpu *rc;
+	struct bg_merge *merge;
+	unsigned short id;
+	unsigned int n = 0, batch = 0;
+	uint64_t t;
+	int ret;
+
+	merge = bg_merge_alloc(run->readers->nr_readers, window, &merge_ops, run);
+	if (!merge) {
+		run->failed = true;
+		check_stop(run);
+		consume(run);
+		return;
+	}
+
+	/* Timed per stretch of records, not per record; includes writes */
+	t = bg_stage_clock(run->stats);
+	while ((ret = bg_merge_next(merge, &rec)) >= 0) {
+		if (ret) {
+			rc = &run->rcs[rec.stream];
+			memcpy(&id, rec.data, sizeof(id));
+			if (!run->sampling ||
+			    bg_sample_keep(&rc->sampler, id, rec.ts)) {
+				rc->events++;
+				if (run->summarize && count_id(rc, id) < 0)
+					run->failed = true;
+			}
+			batch++;
+			if (++n % 4096)
+				continue;
+		}
+		bg_stage_add(run->stats, BG_STAGE_MERGE, batch, 0, t);
+		batch = 0;
+		check_stop(run);
+		if (!ret)
+			nanosleep(&idle, NULL);
+		t = bg_stage_clock(run->stats);
+	}
+
+	bg_merge_get_stats(merge, &stats);
+	printf("merged:  %10llu records %llu late %llu delayed %llu window waits\n",
+	       stats.records, stats.late, stats.delayed, stats.window_waits);
+	bg_merge_free(merge);
+}
+
+struct record_opts {
+	const char	*name;
+	size_t		buffer_kb;
+	double		rate;
+	unsigned int	calibrate_ms;
+	unsigned int	burst_ms;
+};
+
+static int size_buffers(struct bg_session *session, cpu_set_t *cpus,
+			const struct record_opts *opts)
+{
+	struct bg_calibration *cal;
+	size_t kb;
+	int i, n, ret = 0;
+
+	if (opts->buffer_kb)
+		return bg_session_set_buffer_kb(session, opts->buffer_kb, -1);
+
+	if (!opts->calibrate_ms) {
+		kb = bg_buffer_kb_for_rate(opts->rate ? opts->rate :
+					   BG_DEFAULT_RATE,
+					   BG_DEFAULT_EVENT_BYTES, opts->burst_ms);
+		return bg_session_set_buffer_kb(session, kb, -1);
+	}
+
+	n = CPU_COUNT(cpus);
+	cal = calloc(n, sizeof(*cal));
+	if (!cal)
+		return -1;
+
+	if (bg_session_calibrate(session, cpus, opts->calibrate_ms, cal) < 0) {
+		free(cal);
+		return -1;
+	}
+
+	/* Every CPU gets a buffer sized for its own measured rate */
+	for (i = 0; i < n && !ret; i++) {
+		kb = bg_buffer_kb_for_rate(cal[i].rate, cal[i].event_bytes,
+					   opts->burst_ms);
+		printf("cpu %3d: %10.0f events/s %4u bytes/event -> %zu KB\n",
+		       cal[i].cpu, cal[i].rate, cal[i].event_bytes, kb);
+		ret = bg_session_set_buffer_kb(session, kb, cal[i].cpu);
+	}
+
+	free(cal);
+	return ret;
+}
+
+/*
+ * Only the ids that actually showed up get their formats parsed. Sampled
+ * ids also show what was suppressed and the factor scaling counts back up.
+ */
+static void print_summary(struct record_cpu *rcs, int nr_cpus)
+{
+	struct bg_formats *formats;
+	struct tep_event *event;
+	unsigned long long count, suppressed;
+	char scale[64] = "";
+	int id, i, max = 0;
+
+	formats = bg_formats_open(NULL);
+	if (!formats) {
+		bg_warn("cannot load event formats");
+		return;
+	}
+
+	/* Ids whose every record was suppressed are only in the samplers */
+	for (i = 0; i < nr_cpus; i++) {
+		if (rcs[i].nr_ids > max)
+			max = rcs[i].nr_ids;
+		if (rcs[i].sampler.nr > max)
+			max = rcs[i].sampler.nr;
+	}
+
+	for (id = 0; id < max; id++) {
+		count = suppressed = 0;
+		for (i = 0; i < nr_cpus; i++) {
+			if (id < rcs[i].nr_ids)
+				count += rcs[i].id_counts[id];
+			suppressed += bg_sample_suppressed(&rcs[i].sampler, id);
+		}
+		if (!count && !suppressed)
+			continue;
+		if (!count)
+			snprintf(scale, sizeof(scale), " (%llu suppressed)",
+				 suppressed);
+		else if (suppressed)
+			snprintf(scale, sizeof(scale), " (%llu suppressed, x%.2f)",
+				 suppressed, (double)(count + suppressed) / count);
+		else
+			scale[0] = '\0';
+		event = bg_formats_lookup(formats, id);
+		if (event)
+			printf("%12llu %s:%s%s\n", count, event->system,
+			       event->name, scale);
+		else
+			printf("%12llu <id %d>%s\n", count, id, scale);
+	}
+
+	bg_formats_close(formats);
+}
+
+int cmd_record(int argc, char **argv)
+{
+	char *events[MAX_EVENTS];
+	char *filters[MAX_EVENTS] = { NULL };
+	char *samples[MAX_EVENTS];
+	char *probe_lines[MAX_EVENTS], *probe_files[MAX_EVENTS];
+	struct bg_probes *probes = NULL;
+	struct bg_config_state config;
+	struct bg_config *cfg = NULL;
+	struct bg_config_diff diff;
+	struct bg_sample_rules rules = { 0 };
+	struct bg_formats *formats = NULL;
+	struct record_opts opts = { .burst_ms = BG_DEFAULT_BURST_MS };
+	struct record_cpu *rcs = NULL;
+	struct bg_session *session;
+	struct bg_readers *readers = NULL;
+	struct sigaction sa = { .sa_handler = stop_handler };
+	const char *output = NULL, *stats_file = NULL, *stats_sock = NULL;
+	const char *config_path = NULL, *control = NULL;
+	unsigned long long total = 0, suppressed = 0;
+	int nr_events = 0, nr_samples = 0, duration = 0;
+	int nr_probe_lines = 0, nr_probe_files = 0;
+	cpu_set_t cpus, isolated;
+	bool isolate = false, have_cpus = false, splice = false, summarize = false;
+	struct record_run run = { .control_fd = -1 };
+	unsigned long long window = 0;
+	enum bg_cap_codec codec = BG_CAP_CODEC_NONE;
+	enum bg_wakeup wakeup = BG_WAKE_ADAPTIVE;
+	int level = 0, percent = BG_WAKE_PERCENT, uring_depth = -1;
+	unsigned long long sync_mb = 0, max_mb = 0;
+	unsigned int segment_s = 0;
+	int *fds = NULL;
+	int c, i, err, line, ret = 1;
+	uint64_t start;
+	char *addr;
+
+	while ((c = getopt(argc, argv, "+e:f:p:P:F:L:o:C:Id:SN:b:r:c:B:sk:m:z:u:Y:G:M:W:T:U:h")) != -1) {
+		switch (c) {
+		case 'e':
+			if (nr_events == MAX_EVENTS) {
+				bg_warn("too many -e options");
+				return 1;
+			}
+			events[nr_events++] = optarg;
+			break;
+		case 'f':
+			if (!nr_events) {
+				bg_warn("-f filters the preceding -e");
+				return 1;
+			}
+			filters[nr_events - 1] = optarg;
+			break;
+		case 'p':
+			if (nr_probe_lines == MAX_EVENTS) {
+				bg_warn("too many -p options");
+				return 1;
+			}
+			probe_lines[nr_probe_lines++] = optarg;
+			break;
+		case 'P':
+			if (nr_probe_files == MAX_EVENTS) {
+				bg_warn("too many -P options");
+				return 1;
+			}
+			probe_files[nr_probe_files++] = optarg;
+			break;
+		case 'F':
+			config_path = optarg;
+			break;
+		case 'L':
+			control = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'C':
+			if (bg_cpulist_parse(optarg, &cpus) <= 0) {
+				bg_warn("bad cpu list '%s'", optarg);
+				return 1;
+			}
+			have_cpus = true;
+			break;
+		case 'I':
+			isolate = true;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'S':
+			splice = true;
+			break;
+		case 'N':
+			opts.name = optarg;
+			break;
+		case 'b':
+			opts.buffer_kb = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.rate = strtod(optarg, NULL);
+			break;
+		case 'c':
+			opts.calibrate_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			opts.burst_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			summarize = true;
+			break;
+		case 'k':
+			if (nr_samples == MAX_EVENTS) {
+				bg_warn("too many -k options");
+				return 1;
+			}
+			samples[nr_samples++] = optarg;
+			break;
+		case 'm':
+			window = strtoull(optarg, NULL, 0) * NSEC_PER_MSEC;
+			if (!window)
+				window = BG_MERGE_WINDOW_NS;
+			break;
+		case 'W':
+			if (parse_wakeup(optarg, &wakeup, &percent) < 0) {
+				bg_warn("bad wakeup policy '%s'", optarg);
+				return 1;
+			}
+			break;
+		case 'u':
+			uring_depth = atoi(optarg);
+			break;
+		case 'Y':
+			sync_mb = strtoull(optarg, NULL, 0);
+			break;
+		case 'G':
+			segment_s = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			max_mb = strtoull(optarg, NULL, 0);
+			break;
+		case 'T':
+			stats_file = optarg;
+			break;
+		case 'U':
+			stats_sock = optarg;
+			break;
+		case 'z':
+			if (bg_capture_parse_codec(optarg, &codec, &level) < 0) {
+				bg_warn("cannot compress with '%s': %s", optarg,
+					strerror(errno));
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return c != 'h';
+		}
+	}
+
+	if (!have_cpus && bg_online_cpus(&cpus) <= 0) {
+		bg_warn("cannot read online cpus: %s", strerror(errno));
+		return 1;
+	}
+	/* Before any thread or the probe guard exists, so they all inherit it */
+	if (isolate) {
+		if (bg_isolated_cpus(&isolated) <= 0) {
+			bg_warn("no isolated cpus to avoid");
+			isolate = false;
+		} else if (bg_avoid_cpus(&isolated) < 0) {
+			bg_warn("cannot keep off the isolated cpus: %s",
+				strerror(errno));
+			return 1;
+		}
+	}
+	if (config_path && (nr_events || nr_samples)) {
+		bg_warn("-F replaces -e, -f and -k");
+		return 1;
+	}
+	if (control && !config_path) {
+		bg_warn("-L reloads the config file, which needs -F");
+		return 1;
+	}
+	if (config_path) {
+		cfg = bg_config_load(config_path, &line);
+		if (!cfg) {
+			if (line)
+				bg_warn("%s:%d: bad directive", config_path, line);
+			else
+				bg_warn("cannot read %s: %s", config_path,
+					strerror(errno));
+			return 1;
+		}
+		if (splice && cfg->nr_samples) {
+			bg_warn("sampling needs decoding, which -S skips");
+			bg_config_free(cfg);
+			return 1;
+		}
+	} else if (!nr_events && !nr_probe_lines && !nr_probe_files) {
+		events[nr_events++] = "sched";
+	}
+	if (splice && !output) {
+		bg_warn("-S needs an output file (-o)");
+		return 1;
+	}
+	if (splice && (summarize || nr_samples)) {
+		bg_warn("-s and -k need decoding, which -S skips");
+		return 1;
+	}
+	if (splice && codec != BG_CAP_CODEC_NONE) {
+		bg_warn("-z compresses capture files, which -S does not write");
+		return 1;
+	}
+	if ((uring_depth >= 0 || sync_mb || segment_s || max_mb) &&
+	    (splice || !output)) {
+		bg_warn("-u, -Y, -G and -M write capture files, which need -o without -S");
+		return 1;
+	}
+	if (max_mb && !segment_s) {
+		bg_warn("-M deletes whole segments, which need -G");
+		return 1;
+	}
+	if (uring_depth >= 0 && codec != BG_CAP_CODEC_NONE) {
+		bg_warn("-u writes uncompressed chunks; -z already writes off the consumer");
+		return 1;
+	}
+
+	session = bg_session_create(opts.name);
+	if (!session) {
+		bg_warn("cannot create instance: %s", strerror(errno));
+		bg_config_free(cfg);
+		return 1;
+	}
+	/* The kernel turns a new instance on; nothing piles up until start */
+	tracefs_trace_off(session->instance);
+	bg_config_state_init(&config, session, NULL);
+	config.hist_out = stdout;
+
+	if (nr_probe_lines || nr_probe_files) {
+		probes = bg_probes_alloc();
+		if (!probes)
+			goto out;
+		for (i = 0; i < nr_probe_lines; i++) {
+			if (bg_probes_add(probes, probe_lines[i]) < 0) {
+				bg_warn("bad probe '%s'", probe_lines[i]);
+				goto out;
+			}
+		}
+		for (i = 0; i < nr_probe_files; i++) {
+			if (bg_probes_load(probes, probe_files[i]) < 0) {
+				if (errno != EINVAL)
+					bg_warn("cannot read %s: %s",
+						probe_files[i], strerror(errno));
+				goto out;
+			}
+		}
+		/* Before any thread starts: this forks the probe guard */
+		if (bg_probes_create(probes, session->instance) < 0) {
+			if (probes->failed >= 0)
+				bg_warn("cannot create probe '%s': %s",
+					probes->probes[probes->failed].event,
+					strerror(errno));
+			else
+				bg_warn("cannot create probes: %s",
+					strerror(errno));
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr_events; i++) {
+		if (!filters[i])
+			continue;
+		if (!formats && !(formats = bg_formats_open(NULL)))
+			goto out;
+		if (bg_session_set_filter(session, formats, events[i],
+					  filters[i]) < 0) {
+			bg_warn("cannot filter '%s' with '%s'", events[i],
+				filters[i]);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr_events; i++) {
+		if (bg_session_enable(session, events[i], true) < 0) {
+			bg_warn("cannot enable event '%s'", events[i]);
+			goto out;
+		}
+	}
+
+	if (cfg) {
+		if (!formats && !(formats = bg_formats_open(NULL)))
+			goto out;
+		config.formats = formats;
+		if (bg_config_apply(&config, cfg, &diff) < 0)
+			goto out;
+		cfg = NULL;
+		if (diff.failed)
+			goto out;
+		run.config = &config;
+		run.config_path = config_path;
+	}
+
+	for (i = 0; i < nr_samples; i++) {
+		if (!formats && !(formats = bg_formats_open(NULL)))
+			goto out;
+		if (bg_sample_rules_parse(&rules, formats, samples[i]) < 0) {
+			bg_warn("bad sampling rule '%s': %s", samples[i],
+				strerror(errno));
+			goto out;
+		}
+	}
+
+	if (size_buffers(session, &cpus, &opts) < 0) {
+		bg_warn("cannot size ring buffers: %s", strerror(errno));
+		goto out;
+	}
+
+	readers = bg_readers_alloc(session->instance, &cpus);
+	if (!readers)
+		goto out;
+	if (isolate && bg_readers_avoid(readers, &isolated) < 0) {
+		bg_warn("cannot place readers: %s", strerror(errno));
+		goto out;
+	}
+	if (bg_readers_set_wakeup(readers, wakeup, percent) < 0) {
+		bg_warn("cannot set buffer_percent: %s", strerror(errno));
+		goto out;
+	}
+
+	rcs = calloc(readers->nr_readers, sizeof(*rcs));
+	fds = calloc(readers->nr_readers, sizeof(*fds));
+	if (!rcs || !fds)
+		goto out;
+	if (run.config && !splice) {
+		config.samplers = calloc(readers->nr_readers,
+					 sizeof(*config.samplers));
+		if (!config.samplers)
+			goto out;
+	}
+
+	for (i = 0; i < readers->nr_readers; i++) {
+		rcs[i].fd = -1;
+		readers->readers[i].priv = &rcs[i];
+		if ((summarize || nr_samples || config.samplers) &&
+		    bg_batch_init(&rcs[i].batch, 0) < 0)
+			goto out;
+		if (nr_samples) {
+			if (bg_sampler_init(&rcs[i].sampler, &rules) < 0)
+				goto out;
+			rcs[i].batch.sampler = &rcs[i].sampler;
+		}
+		/* A reload may bring in sampling rules later */
+		if (config.samplers) {
+			if (bg_sampler_init(&rcs[i].sampler, &config.rules) < 0)
+				goto out;
+			config.samplers[config.nr_samplers++] = &rcs[i].sampler;
+			if (!bg_sample_rules_empty(&config.rules))
+				rcs[i].batch.sampler = &rcs[i].sampler;
+		}
+	}
+
+	/* Splicing bypasses the consumer, so it can only write raw per-CPU files */
+	for (i = 0; splice && i < readers->nr_readers; i++) {
+		char *path;
+
+		if (asprintf(&path, "%s.cpu%d", output,
+			     readers->readers[i].cpu) < 0)
+			goto out;
+		rcs[i].fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (rcs[i].fd < 0)
+			bg_warn("cannot create %s: %s", path, strerror(errno));
+		free(path);
+		if (rcs[i].fd < 0)
+			goto out;
+		fds[i] = rcs[i].fd;
+	}
+
+	if (output && !splice && segment_s) {
+		int max_cpu = readers->readers[readers->nr_readers - 1].cpu;
+		struct bg_segments_opts so = {
+			.segment_ms	= segment_s * 1000ULL,
+			.max_bytes	= max_mb << 20,
+			.codec		= codec,
+			.level		= level,
+			.nr_workers	= (readers->nr_readers + 3) / 4,
+			.uring_depth	= uring_depth,
+			.sync_bytes	= sync_mb << 20,
+		};
+
+		if (!formats && !(formats = bg_formats_open(NULL)))
+			goto out;
+		run.segs = bg_segments_create(output, max_cpu + 1,
+					      readers->readers[0].subbuf_size,
+					      &so, formats, session->instance);
+		if (!run.segs) {
+			bg_warn("cannot create %s.000000: %s", output,
+				strerror(errno));
+			goto out;
+		}
+	} else if (output && !splice) {
+		int max_cpu = readers->readers[readers->nr_readers - 1].cpu;
+
+		if (!formats && !(formats = bg_formats_open(NULL)))
+			goto out;
+		run.cap = bg_capture_create(output, max_cpu + 1,
+					    readers->readers[0].subbuf_size);
+		if (!run.cap) {
+			bg_warn("cannot create %s: %s", output, strerror(errno));
+			goto out;
+		}
+		/* Compression threads share the CPUs with the readers */
+		if (bg_capture_set_codec(run.cap, codec, level,
+					 (readers->nr_readers + 3) / 4) < 0) {
+			bg_warn("cannot start compression: %s", strerror(errno));
+			goto out;
+		}
+		/* Not fatal: plain writes still work, they just block */
+		if (uring_depth >= 0 &&
+		    bg_capture_set_uring(run.cap, uring_depth) < 0)
+			bg_warn("cannot write through io_uring, using write(): %s",
+				strerror(errno));
+		bg_capture_set_sync(run.cap, sync_mb << 20);
+		bg_capture_add_formats(run.cap, formats, session->instance);
+	}
+
+	if (control) {
+		if (asprintf(&addr, "unix:%s", control) < 0)
+			goto out;
+		run.control_fd = bg_export_listen(addr);
+		free(addr);
+		if (run.control_fd < 0) {
+			bg_warn("cannot listen on %s: %s", control,
+				strerror(errno));
+			goto out;
+		}
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	if (run.config) {
+		sa.sa_handler = reload_handler;
+		sigaction(SIGHUP, &sa, NULL);
+	}
+
+	if (splice)
+		err = bg_readers_start_splice(readers, fds);
+	else
+		err = bg_readers_start_ring(readers, BG_RING_PAGES);
+	if (err < 0) {
+		bg_warn("cannot start readers: %s", strerror(errno));
+		goto out;
+	}
+
+	if (stats_file || stats_sock) {
+		run.stats = bg_selfstats_start(readers, stats_file, stats_sock,
+					       BG_SELFSTATS_INTERVAL_MS);
+		if (!run.stats)
+			bg_warn("cannot report collector stats: %s",
+				strerror(errno));
+	}
+
+	tracefs_trace_on(session->instance);
+	ret = 0;
+
+	run.session = session;
+	run.splice = splice;
+	if (!splice) {
+		run.readers = readers;
+		run.rcs = rcs;
+		run.summarize = summarize;
+		run.sampling = nr_samples > 0 ||
+			       (run.config && !bg_sample_rules_empty(&config.rules));
+		run.duration = duration;
+		run.start = bg_now_ns();
+		run.kbuf = kbuffer_alloc(KBUFFER_LSIZE_SAME_AS_HOST,
+					 KBUFFER_ENDIAN_SAME_AS_HOST);
+		if (!run.kbuf)
+			run.failed = true;
+		if (window)
+			consume_merged(&run, window);
+		else
+			consume(&run);
+		/* The stats thread reads the readers' clocks until it stops */
+		bg_selfstats_stop(run.stats);
+		run.stats = NULL;
+		bg_readers_stop(readers);
+		if (run.kbuf)
+			kbuffer_free(run.kbuf);
+		if (run.failed)
+			ret = 1;
+	} else {
+		start = bg_now_ns();
+		while (!done) {
+			if (duration &&
+			    bg_now_ns() - start >= duration * NSEC_PER_SEC)
+				break;
+			check_reload(&run);
+			sleep(1);
+		}
+		tracefs_trace_off(session->instance);
+		bg_selfstats_stop(run.stats);
+		run.stats = NULL;
+		bg_readers_stop(readers);
+	}
+
+	for (i = 0; i < readers->nr_readers; i++) {
+		struct bg_reader *r = &readers->readers[i];
+
+		if (splice)
+			printf("cpu %3d: %8llu sub-buffers %12llu bytes spliced\n",
+			       r->cpu, r->subbufs, r->bytes);
+		else
+			printf("cpu %3d: %10llu events %8llu sub-buffers %12llu bytes %6llu stalls %8llu lost %4llu switches\n",
+			       r->cpu, rcs[i].events, r->subbufs, r->bytes,
+			       r->stalls, r->lost, r->switches);
+		total += rcs[i].events;
+		suppressed += rcs[i].sampler.suppressed;
+		if (r->err) {
+			bg_warn("cpu %d: reader failed: %s", r->cpu,
+				strerror(r->err));
+			ret = 1;
+		}
+	}
+	if (!splice)
+		printf("total:   %10llu events\n", total);
+	if (nr_samples || run.sampling)
+		printf("sampled: %10llu events suppressed before decoding\n",
+		       suppressed);
+	if (summarize)
+		print_summary(rcs, readers->nr_readers);
+
+ out:
+	if (run.control_fd >= 0) {
+		close(run.control_fd);
+		unlink(control);
+	}
+	bg_selfstats_stop(run.stats);
+	if (run.segs && bg_segments_close(run.segs) < 0) {
+		bg_warn("cannot finish %s: %s", output, strerror(errno));
+		ret = 1;
+	}
+	if (run.cap && bg_capture_close(run.cap) < 0) {
+		bg_warn("cannot finish %s: %s", output, strerror(errno));
+		ret = 1;
+	}
+	if (rcs) {
+		for (i = 0; i < readers->nr_readers; i++) {
+			if (rcs[i].fd >= 0)
+				close(rcs[i].fd);
+			free(rcs[i].id_counts);
+			bg_batch_free(&rcs[i].batch);
+			bg_sampler_free(&rcs[i].sampler);
+		}
+	}
+	free(rcs);
+	free(fds);
+	bg_readers_free(readers);
+	bg_sample_rules_free(&rules);
+	/* Tables of the config's hists go out before their triggers do */
+	bg_config_state_release(&config);
+	free(config.samplers);
+	bg_config_free(cfg);
+	bg_formats_close(formats);
+	/* Removing the instance also disables its events */
+	bg_session_destroy(session);
+	bg_probes_free(probes);
+	return ret;
+}
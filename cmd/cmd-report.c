@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "batch.h"
+#include "capture.h"
+#include "formats.h"
+#include "render.h"
+#include "scan.h"
+#include "util.h"
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bg-c-perf-tools report [options] file\n"
+		"  -t start,end   only look at this window, in seconds from the\n"
+		"                 first record of the capture\n"
+		"  -j threads     decoding threads (default: one per online CPU)\n"
+		"  -p             print the records as text instead of counting\n"
+		"                 them (in chunk order only with -j 1)\n");
+}
+
+static int parse_window(const char *arg, double *start, double *end)
+{
+	char *p;
+
+	*start = strtod(arg, &p);
+	if (p == arg || *p != ',')
+		return -1;
+	arg = p + 1;
+	*end = strtod(arg, &p);
+	if (p == arg || *p || *end < *start)
+		return -1;
+	return 0;
+}
+
+struct report {
+	unsigned long long	*counts;
+	int			nr_ids;
+	unsigned long long	records;
+};
+
+static int count_id(struct report *rep, unsigned short id,
+		    unsigned long long n)
+{
+	if (id >= rep->nr_ids) {
+		int nr = id + 64;
+		unsigned long long *c;
+
+		c = realloc(rep->counts, nr * sizeof(*c));
+		if (!c)
+			return -1;
+		memset(c + rep->nr_ids, 0, (nr - rep->nr_ids) * sizeof(*c));
+		rep->counts = c;
+		rep->nr_ids = nr;
+	}
+	rep->counts[id] += n;
+	return 0;
+}
+
+/* Each worker counts into its own struct report, summed at the end */
+static int report_init(struct bg_scan_worker *w, void *data)
+{
+	(void)data;
+	w->priv = calloc(1, sizeof(struct report));
+	return w->priv ? 0 : -1;
+}
+
+static int report_batch(struct bg_scan_worker *w, const struct bg_batch *b)
+{
+	struct report *rep = w->priv;
+	unsigned int i;
+
+	for (i = 0; i < b->nr; i++) {
+		if (b->ts[i] < w->start || b->ts[i] > w->end)
+			continue;
+		if (count_id(rep, b->id[i], 1) < 0)
+			return -1;
+		rep->records++;
+	}
+	return 0;
+}
+
+static int report_merge(struct bg_scan_worker *w, void *data)
+{
+	struct report *part = w->priv, *rep = data;
+	int id;
+
+	for (id = part->nr_ids - 1; id >= 0; id--) {
+		if (part->counts[id] && count_id(rep, id, part->counts[id]) < 0)
+			return -1;
+	}
+	rep->records += part->records;
+	return 0;
+}
+
+static void report_fini(struct bg_scan_worker *w)
+{
+	struct report *rep = w->priv;
+
+	free(rep->counts);
+	free(rep);
+}
+
+static const struct bg_scan_ops report_ops = {
+	.init	= report_init,
+	.batch	= report_batch,
+	.merge	= report_merge,
+	.fini	= report_fini,
+};
+
+/* Text export: each worker renders into its own buffer */
+static int print_init(struct bg_scan_worker *w, void *data)
+{
+	struct bg_render *r;
+
+	if (!w->formats)
+		return -1;
+	r = malloc(sizeof(*r));
+	if (!r)
+		return -1;
+	bg_render_init(r, STDOUT_FILENO, data);
+	w->priv = r;
+	return 0;
+}
+
+static int print_batch(struct bg_scan_worker *w, const struct bg_batch *b)
+{
+	struct tep_record record = { .cpu = b->cpu };
+	unsigned int i;
+
+	for (i = 0; i < b->nr; i++) {
+		if (b->ts[i] < w->start || b->ts[i] > w->end)
+			continue;
+		/* Parse the format before tep_print_event() needs it */
+		bg_formats_lookup(w->formats, b->id[i]);
+		record.ts = b->ts[i];
+		record.data = (void *)bg_batch_data(b, i);
+		record.size = b->size[i];
+		if (bg_render_record(w->priv, w->formats->tep, &record) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int print_merge(struct bg_scan_worker *w, void *data)
+{
+	(void)data;
+	return bg_render_flush(w->priv);
+}
+
+static void print_fini(struct bg_scan_worker *w)
+{
+	bg_render_destroy(w->priv);
+	free(w->priv);
+}
+
+static const struct bg_scan_ops print_ops = {
+	.init	= print_init,
+	.batch	= print_batch,
+	.merge	= print_merge,
+	.fini	= print_fini,
+};
+
+static void print_report(struct report *rep, struct bg_formats *formats)
+{
+	struct tep_event *event;
+	int id;
+
+	for (id = 0; id < rep->nr_ids; id++) {
+		if (!rep->counts[id])
+			continue;
+		event = formats ? bg_formats_lookup(formats, id) : NULL;
+		if (event)
+			printf("%12llu %s:%s\n", rep->counts[id],
+			       event->system, event->name);
+		else
+			printf("%12llu <id %d>\n", rep->counts[id], id);
+	}
+	printf("%12llu records\n", rep->records);
+}
+
+int cmd_report(int argc, char **argv)
+{
+	struct bg_capture_file *cf;
+	struct bg_formats *formats;
+	struct report rep = { 0 };
+	pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+	uint64_t start = 0, end = UINT64_MAX, base;
+	double wstart, wend;
+	bool window = false, print = false;
+	int c, jobs = 0, ret = 1;
+
+	while ((c = getopt(argc, argv, "+t:j:ph")) != -1) {
+		switch (c) {
+		case 't':
+			if (parse_window(optarg, &wstart, &wend) < 0) {
+				bg_warn("bad window '%s'", optarg);
+				return 1;
+			}
+			window = true;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'p':
+			print = true;
+			break;
+		default:
+			usage();
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 1;
+	}
+
+	cf = bg_capture_open(argv[optind]);
+	if (!cf) {
+		bg_warn("cannot open %s: %s", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	if (window && cf->nr_index) {
+		base = cf->index[0].first_ts;
+		start = base + (uint64_t)(wstart * NSEC_PER_SEC);
+		end = base + (uint64_t)(wend * NSEC_PER_SEC);
+	}
+
+	if (print) {
+		if (bg_capture_scan(cf, start, end, jobs, &print_ops,
+				    &out_lock) < 0) {
+			bg_warn("cannot print %s", argv[optind]);
+			goto out_file;
+		}
+		ret = 0;
+		goto out_file;
+	}
+
+	formats = bg_capture_formats(cf);
+	if (!formats)
+		bg_warn("capture has no usable formats, printing ids");
+
+	if (bg_capture_scan(cf, start, end, jobs, &report_ops, &rep) < 0) {
+		bg_warn("cannot decode %s", argv[optind]);
+		goto out;
+	}
+
+	print_report(&rep, formats);
+	ret = 0;
+ out:
+	free(rep.counts);
+	bg_formats_close(formats);
+ out_file:
+	bg_capture_file_close(cf);
+	return ret;
+}
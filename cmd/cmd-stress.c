@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "agg.h"
+#include "cpu.h"
+#include "reader.h"
+#include "session.h"
+#include "util.h"
+
+#define MAX_EVENTS		64
+#define MAX_PAYLOAD		1024
+
+#define STRESS_RATE		100000	/* events/s over all generators */
+#define STRESS_STEP_SECS	5
+#define STRESS_RAMP_PCT		150	/* each ramp step's rate, of the last */
+#define STRESS_LOSS_PCT		0.1	/* what counts as breaking */
+#define STRESS_TICK_NS		(100 * 1000ULL)	/* generators catch up this often */
+#define STRESS_SETTLE_MS	200	/* after a step, for readers to catch up */
+
+/* Markers written to trace_marker_raw start with this id */
+#define STRESS_RAW_ID		0x62670001
+
+static volatile sig_atomic_t done;
+
+static void stop_handler(int sig)
+{
+	(void)sig;
+	done = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bg-c-perf-tools stress [options]\n"
+		"  -r events/s   rate over all generator threads (default %d)\n"
+		"  -m events/s   ramp from -r up to this rate, until events are lost\n"
+		"  -g pct        each ramp step runs at pct of the last (default %d)\n"
+		"  -l pct        loss that counts as breaking (default %.1f)\n"
+		"  -d seconds    length of each step (default %d)\n"
+		"  -j threads    generator threads (default: online CPUs / 2)\n"
+		"  -s bytes      marker payload size (default %d)\n"
+		"  -R            write binary markers to trace_marker_raw\n"
+		"  -e system[:event]  also enable these tracepoints (repeatable)\n"
+		"  -b kb         per-CPU buffer size (default %d)\n"
+		"  -N name       tracefs instance name\n"
+		"  -o file       append one key=value line per step\n",
+		STRESS_RATE, STRESS_RAMP_PCT, STRESS_LOSS_PCT, STRESS_STEP_SECS,
+		BG_DEFAULT_EVENT_BYTES, BG_MIN_BUFFER_KB);
+}
+
+/* Counters of the bg_agg, one slot per reader */
+enum {
+	STRESS_EVENTS,
+	STRESS_NR_COUNTERS,
+};
+
+struct generator {
+	pthread_t		thread;
+	int			fd;
+	int			cpu;		/* pinned here, -1 for none */
+	bool			raw;
+	unsigned int		size;
+	double			rate;		/* this thread's share */
+	uint64_t		end;
+	unsigned long long	written;
+	unsigned long long	errors;
+};
+
+struct step {
+	double			target;
+	double			written;	/* events/s */
+	double			collected;
+	unsigned long long	lost;
+	unsigned long long	errors;
+	double			loss_pct;
+};
+
+static int count_events(struct bg_reader *r, struct kbuffer *kbuf, void *data)
+{
+	struct bg_agg *agg = data;
+	int slot = r - r->set->readers;
+	unsigned long long ts, n = 0;
+	void *event;
+
+	for (event = kbuffer_read_event(kbuf, &ts); event;
+	     event = kbuffer_next_event(kbuf, &ts))
+		n++;
+	bg_agg_add(agg, slot, STRESS_EVENTS, n);
+	return 0;
+}
+
+/*
+ * Write at the thread's share of the rate: every tick, catch up with
+ * however many events the elapsed time is owed, so a slow write or a
+ * late wakeup is made up for rather than lowering the rate.
+ */
+static void *generate(void *arg)
+{
+	struct generator *g = arg;
+	char buf[MAX_PAYLOAD];
+	uint32_t id = STRESS_RAW_ID;
+	struct timespec tick;
+	unsigned long long owed;
+	uint64_t start, now;
+
+	if (g->cpu >= 0)
+		bg_pin_self(g->cpu);
+
+	memset(buf, 'x', sizeof(buf));
+	if (g->raw)
+		memcpy(buf, &id, sizeof(id));
+	else if (g->size)
+		buf[g->size - 1] = '\n';
+
+	start = bg_now_ns();
+	clock_gettime(CLOCK_MONOTONIC, &tick);
+	while (!done && (now = bg_now_ns()) < g->end) {
+		owed = (now - start) * g->rate / NSEC_PER_SEC;
+		while (g->written + g->errors < owed && !done) {
+			if (write(g->fd, buf, g->size) == (ssize_t)g->size)
+				g->written++;
+			else
+				g->errors++;
+		}
+
+		tick.tv_nsec += STRESS_TICK_NS;
+		if (tick.tv_nsec >= (long)NSEC_PER_SEC) {
+			tick.tv_sec++;
+			tick.tv_nsec -= NSEC_PER_SEC;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
+	}
+	return NULL;
+}
+
+static unsigned long long total_lost(struct bg_session *session,
+				     cpu_set_t *cpus)
+{
+	struct bg_cpu_stats st;
+	unsigned long long lost = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, cpus) &&
+		    !bg_cpu_stats_read(session->instance, cpu, &st))
+			lost += st.overrun + st.dropped_events;
+	}
+	return lost;
+}
+
+static int run_step(struct bg_session *session, cpu_set_t *cpus,
+		    struct bg_agg *agg, struct generator *gens, int nr_gens,
+		    int secs, struct step *step)
+{
+	struct timespec settle = { .tv_nsec = STRESS_SETTLE_MS * NSEC_PER_MSEC };
+	unsigned long long lost, collected, produced, written = 0;
+	uint64_t start, end;
+	double elapsed;
+	int i;
+
+	lost = total_lost(session, cpus);
+	collected = bg_agg_sum(agg, STRESS_EVENTS);
+	start = bg_now_ns();
+	end = start + secs * NSEC_PER_SEC;
+
+	for (i = 0; i < nr_gens; i++) {
+		gens[i].rate = step->target / nr_gens;
+		gens[i].end = end;
+		gens[i].written = gens[i].errors = 0;
+		errno = pthread_create(&gens[i].thread, NULL, generate, &gens[i]);
+		if (errno) {
+			bg_warn("cannot start generator: %s", strerror(errno));
+			done = 1;
+			while (i--)
+				pthread_join(gens[i].thread, NULL);
+			return -1;
+		}
+	}
+	/* Without generators the tracepoints alone make the load */
+	while (!nr_gens && !done && bg_now_ns() < end)
+		nanosleep(&settle, NULL);
+
+	step->errors = 0;
+	for (i = 0; i < nr_gens; i++) {
+		pthread_join(gens[i].thread, NULL);
+		written += gens[i].written;
+		step->errors += gens[i].errors;
+	}
+	elapsed = (bg_now_ns() - start) / (double)NSEC_PER_SEC;
+	nanosleep(&settle, NULL);
+
+	step->lost = total_lost(session, cpus) - lost;
+	collected = bg_agg_sum(agg, STRESS_EVENTS) - collected;
+	step->written = written / elapsed;
+	step->collected = collected / elapsed;
+	/*
+	 * The ring counts its losses in records, markers and tracepoints
+	 * alike, so they are a share of every record that reached it: what
+	 * arrived plus what was lost, not the marker writes alone.
+	 */
+	produced = collected + step->lost;
+	step->loss_pct = produced ? 100.0 * step->lost / produced : 0;
+	return 0;
+}
+
+static void print_step(FILE *f, int nr, const struct step *step)
+{
+	fprintf(f, "step=%d target_s=%.0f written_s=%.0f collected_s=%.0f lost=%llu loss_pct=%.3f write_errors=%llu\n",
+		nr, step->target, step->written, step->collected, step->lost,
+		step->loss_pct, step->errors);
+}
+
+static int open_marker(struct bg_session *session, bool raw)
+{
+	char *path;
+	int fd;
+
+	path = tracefs_instance_get_file(session->instance,
+					 raw ? "trace_marker_raw" : "trace_marker");
+	if (!path)
+		return -1;
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	tracefs_put_tracing_file(path);
+	return fd;
+}
+
+int cmd_stress(int argc, char **argv)
+{
+	char *events[MAX_EVENTS];
+	struct bg_session *session;
+	struct bg_readers *readers = NULL;
+	struct bg_agg *agg = NULL;
+	struct generator *gens = NULL;
+	struct sigaction sa = { .sa_handler = stop_handler };
+	const char *name = NULL, *output = NULL;
+	double rate = STRESS_RATE, max_rate = 0, loss = STRESS_LOSS_PCT;
+	double sustained = 0, breaking = 0;
+	unsigned int size = BG_DEFAULT_EVENT_BYTES, ramp = STRESS_RAMP_PCT;
+	size_t kb = BG_MIN_BUFFER_KB;
+	int nr_events = 0, nr_gens = -1, secs = STRESS_STEP_SECS;
+	int c, i, cpu, nr, ret = 1;
+	struct step step;
+	bool raw = false;
+	cpu_set_t cpus;
+	FILE *out = NULL;
+
+	while ((c = getopt(argc, argv, "+r:m:g:l:d:j:s:Re:b:N:o:h")) != -1) {
+		switch (c) {
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+		case 'm':
+			max_rate = strtod(optarg, NULL);
+			break;
+		case 'g':
+			ramp = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			loss = strtod(optarg, NULL);
+			break;
+		case 'd':
+			secs = atoi(optarg);
+			break;
+		case 'j':
+			nr_gens = atoi(optarg);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			raw = true;
+			break;
+		case 'e':
+			if (nr_events == MAX_EVENTS) {
+				bg_warn("too many -e options");
+				return 1;
+			}
+			events[nr_events++] = optarg;
+			break;
+		case 'b':
+			kb = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			name = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage();
+			return c != 'h';
+		}
+	}
+
+	if (bg_online_cpus(&cpus) <= 0) {
+		bg_warn("cannot read online cpus: %s", strerror(errno));
+		return 1;
+	}
+	if (nr_gens < 0)
+		nr_gens = CPU_COUNT(&cpus) > 1 ? CPU_COUNT(&cpus) / 2 : 1;
+	if (!nr_gens && !nr_events) {
+		bg_warn("nothing generates load: use -j or -e");
+		return 1;
+	}
+	if (rate <= 0 || secs <= 0 || size > MAX_PAYLOAD ||
+	    size < (raw ? sizeof(uint32_t) : 1) || ramp <= 100) {
+		bg_warn("bad rate, step length, ramp or payload size");
+		return 1;
+	}
+	if (max_rate && (max_rate < rate || !nr_gens)) {
+		bg_warn("-m ramps the generators up from -r");
+		return 1;
+	}
+
+	if (output) {
+		out = fopen(output, "a");
+		if (!out) {
+			bg_warn("cannot open %s: %s", output, strerror(errno));
+			return 1;
+		}
+	}
+
+	session = bg_session_create(name);
+	if (!session) {
+		bg_warn("cannot create instance: %s", strerror(errno));
+		goto out_file;
+	}
+
+	for (i = 0; i < nr_events; i++) {
+		if (bg_session_enable(session, events[i], true) < 0) {
+			bg_warn("cannot enable event '%s'", events[i]);
+			goto out;
+		}
+	}
+	if (bg_session_set_buffer_kb(session, kb, -1) < 0) {
+		bg_warn("cannot size buffers: %s", strerror(errno));
+		goto out;
+	}
+
+	readers = bg_readers_alloc(session->instance, &cpus);
+	agg = readers ? bg_agg_alloc(readers->nr_readers, STRESS_NR_COUNTERS,
+				     0) : NULL;
+	gens = calloc(nr_gens ? nr_gens : 1, sizeof(*gens));
+	if (!agg || !gens) {
+		bg_warn("cannot set up readers: %s", strerror(errno));
+		goto out;
+	}
+
+	/* Spread the generators so every CPU's buffer takes its share */
+	for (i = 0, cpu = -1; i < nr_gens; i++) {
+		do
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		while (!CPU_ISSET(cpu, &cpus));
+		gens[i].cpu = cpu;
+		gens[i].raw = raw;
+		gens[i].size = size;
+		gens[i].fd = open_marker(session, raw);
+		if (gens[i].fd < 0) {
+			bg_warn("cannot open %s: %s",
+				raw ? "trace_marker_raw" : "trace_marker",
+				strerror(errno));
+			nr_gens = i;
+			goto out;
+		}
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (bg_readers_start(readers, count_events, agg) < 0) {
+		bg_warn("cannot start readers: %s", strerror(errno));
+		goto out;
+	}
+
+	step.target = rate;
+	for (nr = 0; !done; nr++) {
+		if (run_step(session, &cpus, agg, gens, nr_gens, secs,
+			     &step) < 0)
+			break;
+		print_step(stdout, nr, &step);
+		if (out) {
+			print_step(out, nr, &step);
+			fflush(out);
+		}
+
+		if (step.loss_pct > loss) {
+			breaking = step.target;
+			break;
+		}
+		sustained = nr_gens ? step.written : step.collected;
+		if (!max_rate || step.target >= max_rate)
+			break;
+		step.target = step.target * ramp / 100;
+		if (step.target > max_rate)
+			step.target = max_rate;
+	}
+	ret = 0;
+
+	printf("sustained_s=%.0f breaking_s=%.0f\n", sustained, breaking);
+	if (out)
+		fprintf(out, "sustained_s=%.0f breaking_s=%.0f\n", sustained,
+			breaking);
+
+ out:
+	if (readers)
+		bg_readers_stop(readers);
+	for (i = 0; gens && i < nr_gens; i++)
+		close(gens[i].fd);
+	bg_readers_free(readers);
+	bg_agg_free(agg);
+	free(gens);
+	bg_session_destroy(session);
+ out_file:
+	if (out)
+		fclose(out);
+	return ret;
+}
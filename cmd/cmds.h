@@ -0,0 +1,19 @@
+#ifndef BG_CMDS_H
+#define BG_CMDS_H
+
+struct bg_cmd {
+	const char	*name;
+	int		(*fn)(int argc, char **argv);
+	const char	*summary;
+};
+
+int cmd_record(int argc, char **argv);
+int cmd_hist(int argc, char **argv);
+int cmd_report(int argc, char **argv);
+int cmd_flight(int argc, char **argv);
+int cmd_stress(int argc, char **argv);
+int cmd_funcgraph(int argc, char **argv);
+int cmd_aggregate(int argc, char **argv);
+int cmd_offcpu(int argc, char **argv);
+
+#endif /* BG_CMDS_H */
@@ -0,0 +1,674 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "accessors.h"
+#include "batch.h"
+#include "cpu.h"
+#include "formats.h"
+#include "merge.h"
+#include "reader.h"
+#include "session.h"
+#include "util.h"
+
+#include "libbg.h"
+
+#define LIB_MAX_RECORDS		4096
+#define LIB_IDLE_US		100	/* between polls of empty rings */
+
+_Static_assert(BG_LIB_FIELD_SIGNED == BG_ACC_SIGNED &&
+	       BG_LIB_FIELD_DATA_LOC == BG_ACC_DATA_LOC &&
+	       BG_LIB_FIELD_REL_LOC == BG_ACC_REL_LOC,
+	       "field flags are the accessor flags");
+
+/*
+ * What backs one handed-out batch. A per-CPU batch is the decoded columns
+ * of a single page; a merged one has columns of its own and a reference on
+ * every page its records point into.
+ */
+struct lib_slot {
+	struct lib_slot		*next;		/* on the free list */
+	struct bg_lib		*lib;
+	struct bg_batch		batch;		/* per-CPU columns */
+	unsigned int		cap;
+	const void		**data;
+	uint64_t		*ts;		/* merged columns from here */
+	int32_t			*pid;
+	uint16_t		*id;
+	uint32_t		*size;
+	int32_t			*cpus;
+	struct bg_page		**pages;	/* referenced */
+	unsigned int		nr_pages;
+	unsigned int		pages_cap;
+};
+
+struct bg_lib {
+	struct bg_session	*session;
+	struct bg_readers	*readers;
+	struct bg_formats	*formats;
+	struct kbuffer		*kbuf;
+	struct bg_merge		*merge;
+	unsigned long long	window;
+	unsigned int		max_records;
+	unsigned int		ring_pages;
+	bool			started;
+	atomic_bool		stopping;
+	int			next_reader;
+
+	/*
+	 * A page goes back to its reader when its count drops to zero: the
+	 * merge holds one while it reads the page, each batch one more.
+	 */
+	atomic_uint		**refs;		/* [reader][page] */
+	struct bg_page		**cur;		/* merge's page of each stream */
+
+	/* Pages released off the consumer thread, put back by the consumer */
+	pthread_mutex_t		lock;
+	struct bg_page		**returned;
+	unsigned int		nr_returned;
+	struct lib_slot		*free_slots;
+	struct lib_slot		**all_slots;
+	unsigned int		nr_slots;
+
+	unsigned long long	records;
+	unsigned long long	batches;
+	atomic_ullong		outstanding;
+};
+
+uint32_t bg_lib_abi_version(void)
+{
+	return BG_LIB_ABI_VERSION;
+}
+
+static atomic_uint *page_ref(struct bg_lib *lib, struct bg_page *page)
+{
+	struct bg_reader *r = page->reader;
+
+	return &lib->refs[r - lib->readers->readers][page - r->pages];
+}
+
+/* Drop a reference; only the consumer thread may refill a reader */
+static void unref_page(struct bg_lib *lib, struct bg_page *page, bool consumer)
+{
+	if (atomic_fetch_sub_explicit(page_ref(lib, page), 1,
+				      memory_order_acq_rel) != 1)
+		return;
+	if (consumer) {
+		bg_page_put(page);
+		return;
+	}
+	pthread_mutex_lock(&lib->lock);
+	lib->returned[lib->nr_returned++] = page;
+	pthread_mutex_unlock(&lib->lock);
+}
+
+static void put_returned(struct bg_lib *lib)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&lib->lock);
+	for (i = 0; i < lib->nr_returned; i++)
+		bg_page_put(lib->returned[i]);
+	lib->nr_returned = 0;
+	pthread_mutex_unlock(&lib->lock);
+}
+
+static struct bg_page *lib_next_page(void *src, int stream)
+{
+	struct bg_lib *lib = src;
+	struct bg_page *page;
+
+	page = bg_reader_next_page(&lib->readers->readers[stream]);
+	if (page) {
+		atomic_store_explicit(page_ref(lib, page), 1,
+				      memory_order_relaxed);
+		lib->cur[stream] = page;
+	}
+	return page;
+}
+
+static bool lib_finished(void *src, int stream)
+{
+	struct bg_lib *lib = src;
+
+	return bg_reader_drained(&lib->readers->readers[stream]);
+}
+
+static void lib_put_page(void *src, struct bg_page *page)
+{
+	unref_page(src, page, true);
+}
+
+static const struct bg_merge_ops lib_merge_ops = {
+	.next_page	= lib_next_page,
+	.finished	= lib_finished,
+	.put_page	= lib_put_page,
+};
+
+static void slot_free(struct lib_slot *s)
+{
+	bg_batch_free(&s->batch);
+	free(s->data);
+	free(s->ts);
+	free(s->pid);
+	free(s->id);
+	free(s->size);
+	free(s->cpus);
+	free(s->pages);
+	free(s);
+}
+
+static int slot_grow(struct lib_slot *s, unsigned int cap, bool merged)
+{
+	void *p;
+
+#define GROW(col)							\
+	do {								\
+		p = realloc(s->col, cap * sizeof(*s->col));		\
+		if (!p)							\
+			return -1;					\
+		s->col = p;						\
+	} while (0)
+
+	GROW(data);
+	if (merged) {
+		GROW(ts);
+		GROW(pid);
+		GROW(id);
+		GROW(size);
+		GROW(cpus);
+	}
+#undef GROW
+
+	s->cap = cap;
+	return 0;
+}
+
+static struct lib_slot *get_slot(struct bg_lib *lib)
+{
+	struct lib_slot *s, **all;
+
+	pthread_mutex_lock(&lib->lock);
+	s = lib->free_slots;
+	if (s)
+		lib->free_slots = s->next;
+	pthread_mutex_unlock(&lib->lock);
+	if (s)
+		return s;
+
+	all = realloc(lib->all_slots, (lib->nr_slots + 1) * sizeof(*all));
+	if (!all)
+		return NULL;
+	lib->all_slots = all;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->lib = lib;
+	s->pages_cap = 16;
+	s->pages = malloc(s->pages_cap * sizeof(*s->pages));
+	if (!s->pages || bg_batch_init(&s->batch, 0) < 0 ||
+	    slot_grow(s, lib->merge ? lib->max_records : 256, lib->merge)) {
+		slot_free(s);
+		return NULL;
+	}
+	pthread_mutex_lock(&lib->lock);
+	lib->all_slots[lib->nr_slots++] = s;
+	pthread_mutex_unlock(&lib->lock);
+	return s;
+}
+
+static void put_slot(struct bg_lib *lib, struct lib_slot *s)
+{
+	pthread_mutex_lock(&lib->lock);
+	s->next = lib->free_slots;
+	lib->free_slots = s;
+	pthread_mutex_unlock(&lib->lock);
+}
+
+static void release_batch(struct bg_lib_batch *batch)
+{
+	struct lib_slot *s = batch->priv;
+	struct bg_lib *lib = s->lib;
+	unsigned int i;
+
+	for (i = 0; i < s->nr_pages; i++)
+		unref_page(lib, s->pages[i], false);
+	s->nr_pages = 0;
+	batch->priv = NULL;
+	batch->nr = 0;
+	put_slot(lib, s);
+	atomic_fetch_sub_explicit(&lib->outstanding, 1, memory_order_relaxed);
+}
+
+static int hold_page(struct lib_slot *s, struct bg_page *page)
+{
+	struct bg_page **pages;
+	unsigned int cap;
+
+	if (s->nr_pages && s->pages[s->nr_pages - 1] == page)
+		return 0;
+	if (s->nr_pages == s->pages_cap) {
+		cap = s->pages_cap ? s->pages_cap * 2 : 16;
+		pages = realloc(s->pages, cap * sizeof(*pages));
+		if (!pages)
+			return -1;
+		s->pages = pages;
+		s->pages_cap = cap;
+	}
+	atomic_fetch_add_explicit(page_ref(s->lib, page), 1,
+				  memory_order_relaxed);
+	s->pages[s->nr_pages++] = page;
+	return 0;
+}
+
+static void hand_out(struct bg_lib *lib, struct lib_slot *s,
+		     struct bg_lib_batch *batch)
+{
+	batch->data = s->data;
+	batch->release = release_batch;
+	batch->priv = s;
+	lib->records += batch->nr;
+	lib->batches++;
+	atomic_fetch_add_explicit(&lib->outstanding, 1, memory_order_relaxed);
+}
+
+/* The next page of any reader, round robin; 1, 0 if none is queued, -1 */
+static int next_cpu_batch(struct bg_lib *lib, struct lib_slot *s,
+			  struct bg_lib_batch *batch)
+{
+	struct bg_readers *set = lib->readers;
+	struct bg_batch *b = &s->batch;
+	struct bg_page *page;
+	unsigned int i;
+	int n, idx;
+
+	for (n = 0; n < set->nr_readers; n++) {
+		idx = (lib->next_reader + n) % set->nr_readers;
+		page = bg_reader_next_page(&set->readers[idx]);
+		if (!page)
+			continue;
+		lib->next_reader = idx + 1;
+
+		if (kbuffer_load_subbuffer(lib->kbuf, page->data) < 0 ||
+		    bg_batch_decode(b, lib->kbuf, page->cpu) <= 0) {
+			/* Padding only (or no memory to decode it) */
+			bg_page_put(page);
+			continue;
+		}
+		if (b->nr > s->cap && slot_grow(s, b->cap, false) < 0) {
+			bg_page_put(page);
+			return -1;
+		}
+		for (i = 0; i < b->nr; i++)
+			s->data[i] = bg_batch_data(b, i);
+
+		atomic_store_explicit(page_ref(lib, page), 1,
+				      memory_order_relaxed);
+		s->pages[0] = page;
+		s->nr_pages = 1;
+
+		batch->nr = b->nr;
+		batch->cpu = b->cpu;
+		batch->missed = b->missed;
+		batch->ts = b->ts;
+		batch->pid = b->pid;
+		batch->id = b->id;
+		batch->size = b->size;
+		batch->cpus = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+/* Up to max_records merged records, fewer if the merge has to wait */
+static int next_merged_batch(struct bg_lib *lib, struct lib_slot *s,
+			     struct bg_lib_batch *batch, bool *finished)
+{
+	struct bg_merge_rec rec;
+	uint16_t id;
+	int32_t pid;
+	unsigned int n = 0;
+	int ret;
+
+	while (n < lib->max_records) {
+		ret = bg_merge_next(lib->merge, &rec);
+		if (ret <= 0) {
+			*finished = ret < 0;
+			break;
+		}
+		if (hold_page(s, lib->cur[rec.stream]) < 0)
+			return -1;
+
+		memcpy(&id, (char *)rec.data + BG_COMMON_TYPE_OFFSET, sizeof(id));
+		memcpy(&pid, (char *)rec.data + BG_COMMON_PID_OFFSET, sizeof(pid));
+		s->ts[n] = rec.ts;
+		s->id[n] = id;
+		s->pid[n] = pid;
+		s->size[n] = rec.size;
+		s->cpus[n] = rec.cpu;
+		s->data[n] = rec.data;
+		n++;
+	}
+	if (!n)
+		return 0;
+
+	batch->nr = n;
+	batch->cpu = -1;
+	batch->missed = 0;
+	batch->ts = s->ts;
+	batch->pid = s->pid;
+	batch->id = s->id;
+	batch->size = s->size;
+	batch->cpus = s->cpus;
+	return 1;
+}
+
+static bool all_drained(struct bg_lib *lib)
+{
+	int i;
+
+	for (i = 0; i < lib->readers->nr_readers; i++) {
+		if (!bg_reader_drained(&lib->readers->readers[i]))
+			return false;
+	}
+	return true;
+}
+
+int bg_lib_next_batch(struct bg_lib *lib, struct bg_lib_batch *batch,
+		      int timeout_ms)
+{
+	struct timespec idle = { .tv_nsec = LIB_IDLE_US * 1000 };
+	uint64_t deadline = bg_now_ns() + (uint64_t)timeout_ms * NSEC_PER_MSEC;
+	bool finished = false;
+	struct lib_slot *s;
+	int ret;
+
+	if (!lib->started) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	s = get_slot(lib);
+	if (!s)
+		return -1;
+
+	for (;;) {
+		put_returned(lib);
+		if (lib->merge)
+			ret = next_merged_batch(lib, s, batch, &finished);
+		else
+			ret = next_cpu_batch(lib, s, batch);
+		if (ret < 0)
+			goto fail;
+		if (ret) {
+			hand_out(lib, s, batch);
+			return 1;
+		}
+
+		if (lib->merge ? finished : all_drained(lib)) {
+			put_slot(lib, s);
+			errno = ENODATA;
+			return -1;
+		}
+		if (timeout_ms >= 0 && bg_now_ns() >= deadline)
+			break;
+		nanosleep(&idle, NULL);
+	}
+
+	put_slot(lib, s);
+	return 0;
+ fail:
+	/* A merged batch may have taken references on the way */
+	while (s->nr_pages)
+		unref_page(lib, s->pages[--s->nr_pages], true);
+	put_slot(lib, s);
+	return -1;
+}
+
+struct bg_lib *bg_lib_open(const struct bg_lib_opts *opts)
+{
+	struct bg_lib_opts o = { 0 };
+	struct bg_lib *lib;
+	cpu_set_t cpus, isolated;
+	uint32_t i;
+
+	if (!opts || opts->size < offsetof(struct bg_lib_opts, nr_events)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	/* Older callers pass a shorter struct; the rest stays defaulted */
+	memcpy(&o, opts, opts->size < sizeof(o) ? opts->size : sizeof(o));
+
+	if (o.cpus ? bg_cpulist_parse(o.cpus, &cpus) <= 0 :
+	    bg_online_cpus(&cpus) <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	lib = calloc(1, sizeof(*lib));
+	if (!lib)
+		return NULL;
+	pthread_mutex_init(&lib->lock, NULL);
+	lib->max_records = o.max_records ? o.max_records : LIB_MAX_RECORDS;
+	lib->ring_pages = o.ring_pages;
+	lib->window = o.merge_window_ns ? o.merge_window_ns : BG_MERGE_WINDOW_NS;
+
+	lib->session = bg_session_create(o.instance);
+	if (!lib->session)
+		goto fail;
+	if (!o.events || !o.nr_events) {
+		if (bg_session_enable(lib->session, "sched", true) < 0)
+			goto fail;
+	}
+	for (i = 0; o.events && i < o.nr_events; i++) {
+		if (bg_session_enable(lib->session, o.events[i], true) < 0)
+			goto fail;
+	}
+	if (o.buffer_kb &&
+	    bg_session_set_buffer_kb(lib->session, o.buffer_kb, -1) < 0)
+		goto fail;
+	/* The kernel turns a new instance on; nothing piles up until start */
+	tracefs_trace_off(lib->session->instance);
+
+	lib->formats = bg_formats_open(NULL);
+	lib->kbuf = kbuffer_alloc(KBUFFER_LSIZE_SAME_AS_HOST,
+				  KBUFFER_ENDIAN_SAME_AS_HOST);
+	if (!lib->formats || !lib->kbuf)
+		goto fail;
+
+	lib->readers = bg_readers_alloc(lib->session->instance, &cpus);
+	if (!lib->readers)
+		goto fail;
+	/* Only the readers: the caller's own threads are its business */
+	if (o.flags & BG_LIB_AVOID_ISOLATED &&
+	    bg_isolated_cpus(&isolated) > 0 &&
+	    bg_readers_avoid(lib->readers, &isolated) < 0)
+		goto fail;
+
+	if (o.flags & BG_LIB_MERGE) {
+		lib->cur = calloc(lib->readers->nr_readers, sizeof(*lib->cur));
+		lib->merge = bg_merge_alloc(lib->readers->nr_readers, lib->window,
+					    &lib_merge_ops, lib);
+		if (!lib->cur || !lib->merge)
+			goto fail;
+	}
+	return lib;
+ fail:
+	bg_lib_close(lib);
+	return NULL;
+}
+
+static void free_refs(struct bg_lib *lib)
+{
+	int i;
+
+	for (i = 0; lib->refs && i < lib->readers->nr_readers; i++)
+		free(lib->refs[i]);
+	free(lib->refs);
+	lib->refs = NULL;
+	free(lib->returned);
+	lib->returned = NULL;
+}
+
+int bg_lib_start(struct bg_lib *lib)
+{
+	struct bg_readers *set = lib->readers;
+	int i, nr_pages;
+
+	if (lib->started) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/*
+	 * Sized for the rings bg_readers_start_ring() is about to give every
+	 * reader, so nothing is left to fail once the readers run.
+	 */
+	nr_pages = lib->ring_pages > 0 ? lib->ring_pages : BG_RING_PAGES;
+	lib->refs = calloc(set->nr_readers, sizeof(*lib->refs));
+	lib->returned = calloc((size_t)set->nr_readers * nr_pages,
+			       sizeof(*lib->returned));
+	if (!lib->refs || !lib->returned)
+		goto fail;
+	for (i = 0; i < set->nr_readers; i++) {
+		lib->refs[i] = calloc(nr_pages, sizeof(**lib->refs));
+		if (!lib->refs[i])
+			goto fail;
+	}
+
+	if (bg_readers_start_ring(set, lib->ring_pages) < 0)
+		goto fail;
+	lib->started = true;
+	/* Once every reader is draining, as record does */
+	tracefs_trace_on(lib->session->instance);
+	return 0;
+ fail:
+	free_refs(lib);
+	return -1;
+}
+
+void bg_lib_stop(struct bg_lib *lib)
+{
+	if (atomic_exchange(&lib->stopping, true))
+		return;
+	tracefs_trace_off(lib->session->instance);
+	bg_readers_signal_stop(lib->readers);
+}
+
+void bg_lib_close(struct bg_lib *lib)
+{
+	struct timespec idle = { .tv_nsec = LIB_IDLE_US * 1000 };
+	struct bg_readers *set;
+	struct bg_page *page;
+	unsigned int i;
+	int r;
+
+	if (!lib)
+		return;
+	set = lib->readers;
+
+	if (lib->started) {
+		bg_lib_stop(lib);
+		/* Returns the merge's pages */
+		bg_merge_free(lib->merge);
+		lib->merge = NULL;
+		/* The readers' last flush needs free pages, so keep draining */
+		while (!all_drained(lib)) {
+			put_returned(lib);
+			for (r = 0; r < set->nr_readers; r++) {
+				while ((page = bg_reader_next_page(&set->readers[r])))
+					bg_page_put(page);
+			}
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	bg_merge_free(lib->merge);
+	bg_readers_free(set);
+	for (r = 0; lib->refs && set && r < set->nr_readers; r++)
+		free(lib->refs[r]);
+	free(lib->refs);
+	for (i = 0; i < lib->nr_slots; i++)
+		slot_free(lib->all_slots[i]);
+	free(lib->all_slots);
+	free(lib->returned);
+	free(lib->cur);
+	if (lib->kbuf)
+		kbuffer_free(lib->kbuf);
+	bg_formats_close(lib->formats);
+	bg_session_destroy(lib->session);
+	pthread_mutex_destroy(&lib->lock);
+	free(lib);
+}
+
+int bg_lib_get_stats(struct bg_lib *lib, struct bg_lib_stats *stats,
+		     uint32_t size)
+{
+	struct bg_lib_stats st = { 0 };
+	struct bg_merge_stats ms;
+	struct bg_reader *r;
+	int i;
+
+	st.records = lib->records;
+	st.batches = lib->batches;
+	st.outstanding = atomic_load_explicit(&lib->outstanding,
+					      memory_order_relaxed);
+	for (i = 0; i < lib->readers->nr_readers; i++) {
+		r = &lib->readers->readers[i];
+		st.subbufs += r->subbufs;
+		st.bytes += r->bytes;
+		st.lost += r->lost;
+		st.stalls += r->stalls;
+	}
+	if (lib->merge) {
+		bg_merge_get_stats(lib->merge, &ms);
+		st.late = ms.late;
+		st.delayed = ms.delayed;
+	}
+
+	memcpy(stats, &st, size < sizeof(st) ? size : sizeof(st));
+	return 0;
+}
+
+int bg_lib_field(struct bg_lib *lib, uint16_t id, const char *name,
+		 struct bg_lib_field *field)
+{
+	struct tep_event *event;
+	struct bg_acc acc;
+
+	event = bg_formats_lookup(lib->formats, id);
+	if (!event) {
+		errno = ENOENT;
+		return -1;
+	}
+	bg_acc_resolve(&acc, event, name, false);
+	if (!bg_acc_valid(&acc)) {
+		errno = ENOENT;
+		return -1;
+	}
+	field->offset = acc.offset;
+	field->size = acc.size;
+	field->flags = acc.flags & ~BG_ACC_VALID;
+	return 0;
+}
+
+const char *bg_lib_event_name(struct bg_lib *lib, uint16_t id,
+			      const char **system)
+{
+	struct tep_event *event;
+
+	event = bg_formats_lookup(lib->formats, id);
+	if (!event) {
+		errno = ENOENT;
+		return NULL;
+	}
+	if (system)
+		*system = event->system;
+	return event->name;
+}
@@ -0,0 +1,140 @@
+#ifndef LIBBG_H
+#define LIBBG_H
+
+#include <stdint.h>
+
+/*
+ * libbg: the collector's hot path (per-CPU ring readers, batched decode and
+ * the k-way merge) behind a stable C ABI, for consumers in other languages.
+ *
+ * Only fixed-width types and opaque handles cross the boundary, so the
+ * header can be fed to bindgen as is. Records are never copied: a batch
+ * borrows the ring pages its records live in and the columns describing
+ * them until its release callback is called. Pages held by unreleased
+ * batches are pages the readers cannot refill, so hold batches briefly;
+ * once every page is held the readers wait and the kernel ring buffer
+ * takes up the backlog.
+ *
+ * Every call but a batch's release is made from one consumer thread.
+ * release may be called from any thread, in any order.
+ *
+ * Calls that fail return -1 (or NULL) and set errno.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BG_LIB_API	__attribute__((visibility("default")))
+
+/* Bumped whenever a struct below changes incompatibly */
+#define BG_LIB_ABI_VERSION	1
+
+/* bg_lib_opts::flags */
+#define BG_LIB_MERGE		(1u << 0)	/* one time-ordered stream */
+#define BG_LIB_AVOID_ISOLATED	(1u << 1)	/* readers off isolcpus/nohz_full */
+
+struct bg_lib_opts {
+	uint32_t		size;		/* sizeof(struct bg_lib_opts) */
+	uint32_t		flags;
+	const char		*instance;	/* NULL: bg-c-perf-tools.<pid> */
+	const char		*cpus;		/* cpulist, NULL: all online */
+	const char *const	*events;	/* "system[:event]", NULL: sched */
+	uint32_t		nr_events;
+	uint32_t		buffer_kb;	/* per CPU, 0: leave as is */
+	uint32_t		ring_pages;	/* per reader, 0: default */
+	uint32_t		max_records;	/* per merged batch, 0: default */
+	uint64_t		merge_window_ns; /* 0: default */
+};
+
+/*
+ * Records as columns; record i is ts[i], pid[i], ... A per-CPU batch is
+ * one ring sub-buffer of @cpu. A merged batch spans CPUs: @cpu is -1 and
+ * @cpus has each record's CPU. @missed is only known per CPU and is 0 for
+ * merged batches; bg_lib_get_stats() has the totals.
+ */
+struct bg_lib_batch {
+	uint32_t		nr;
+	int32_t			cpu;
+	uint64_t		missed;		/* lost just before this batch */
+	const uint64_t		*ts;
+	const int32_t		*pid;
+	const uint16_t		*id;		/* event id, see bg_lib_field() */
+	const uint32_t		*size;		/* payload bytes */
+	const void *const	*data;		/* payloads, common fields first */
+	const int32_t		*cpus;		/* merged batches only, else NULL */
+	/* Give the batch back; every pointer above dies with it */
+	void			(*release)(struct bg_lib_batch *batch);
+	void			*priv;
+};
+
+struct bg_lib_stats {
+	uint64_t		records;	/* handed out in batches */
+	uint64_t		batches;
+	uint64_t		outstanding;	/* not yet released */
+	uint64_t		subbufs;	/* read from the ring buffers */
+	uint64_t		bytes;
+	uint64_t		lost;		/* overrun + dropped in the kernel */
+	uint64_t		stalls;		/* readers waiting for a free page */
+	uint64_t		late;		/* merged out of order */
+	uint64_t		delayed;	/* reached the merge a window late */
+};
+
+/* bg_lib_field::flags */
+#define BG_LIB_FIELD_SIGNED	(1u << 1)
+#define BG_LIB_FIELD_DATA_LOC	(1u << 3)	/* u32 locator: len << 16 | offset */
+#define BG_LIB_FIELD_REL_LOC	(1u << 4)	/* same, offset from the field end */
+
+/* Where a field sits in a record's payload */
+struct bg_lib_field {
+	uint16_t		offset;
+	uint16_t		size;
+	uint32_t		flags;
+};
+
+struct bg_lib;
+
+BG_LIB_API uint32_t bg_lib_abi_version(void);
+
+/*
+ * Create a private tracefs instance with @opts's events and open a reader
+ * on each CPU. Nothing is traced until bg_lib_start().
+ */
+BG_LIB_API struct bg_lib *bg_lib_open(const struct bg_lib_opts *opts);
+
+BG_LIB_API int bg_lib_start(struct bg_lib *lib);
+
+/*
+ * Wait up to @timeout_ms (-1: forever, 0: not at all) for the next batch.
+ * Returns 1 with @batch filled, 0 on timeout, or -1 with errno ENODATA
+ * once stopped and every reader's last page was handed out.
+ */
+BG_LIB_API int bg_lib_next_batch(struct bg_lib *lib, struct bg_lib_batch *batch,
+				 int timeout_ms);
+
+/*
+ * Stop tracing; may be called from any thread. Keep calling
+ * bg_lib_next_batch() until ENODATA to get what was still buffered.
+ */
+BG_LIB_API void bg_lib_stop(struct bg_lib *lib);
+
+/* Stop and free everything. Every batch must have been released. */
+BG_LIB_API void bg_lib_close(struct bg_lib *lib);
+
+/* Copy up to @size bytes of the counters into @stats. */
+BG_LIB_API int bg_lib_get_stats(struct bg_lib *lib, struct bg_lib_stats *stats,
+				uint32_t size);
+
+/* Locate field @name of event @id, parsing its format on first use. */
+BG_LIB_API int bg_lib_field(struct bg_lib *lib, uint16_t id, const char *name,
+			    struct bg_lib_field *field);
+
+/* Name of event @id, and its system in @system (may be NULL). */
+BG_LIB_API const char *bg_lib_event_name(struct bg_lib *lib, uint16_t id,
+					 const char **system);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBBG_H */
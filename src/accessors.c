@@ -0,0 +1,164 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "accessors.h"
+#include "formats.h"
+#include "util.h"
+
+struct acc_field {
+	const char	*name;
+	size_t		offset;		/* of the struct bg_acc */
+};
+
+struct acc_event {
+	const char		*system;
+	const char		*name;
+	size_t			offset;	/* of the per-event struct */
+	const struct acc_field	*fields;
+	int			nr_fields;
+};
+
+#define F(type, field)	{ #field, offsetof(type, field) }
+
+static const struct acc_field sched_switch_fields[] = {
+	F(struct bg_sched_switch_acc, prev_comm),
+	F(struct bg_sched_switch_acc, prev_pid),
+	F(struct bg_sched_switch_acc, prev_prio),
+	F(struct bg_sched_switch_acc, prev_state),
+	F(struct bg_sched_switch_acc, next_comm),
+	F(struct bg_sched_switch_acc, next_pid),
+	F(struct bg_sched_switch_acc, next_prio),
+};
+
+static const struct acc_field sched_wakeup_fields[] = {
+	F(struct bg_sched_wakeup_acc, comm),
+	F(struct bg_sched_wakeup_acc, pid),
+	F(struct bg_sched_wakeup_acc, prio),
+	F(struct bg_sched_wakeup_acc, target_cpu),
+};
+
+static const struct acc_field irq_handler_entry_fields[] = {
+	F(struct bg_irq_handler_entry_acc, irq),
+	F(struct bg_irq_handler_entry_acc, name),
+};
+
+static const struct acc_field block_rq_issue_fields[] = {
+	F(struct bg_block_rq_issue_acc, dev),
+	F(struct bg_block_rq_issue_acc, sector),
+	F(struct bg_block_rq_issue_acc, nr_sector),
+	F(struct bg_block_rq_issue_acc, bytes),
+	F(struct bg_block_rq_issue_acc, rwbs),
+	F(struct bg_block_rq_issue_acc, comm),
+};
+
+static const struct acc_field funcgraph_entry_fields[] = {
+	F(struct bg_funcgraph_entry_acc, func),
+	F(struct bg_funcgraph_entry_acc, depth),
+};
+
+static const struct acc_field funcgraph_exit_fields[] = {
+	F(struct bg_funcgraph_exit_acc, func),
+	F(struct bg_funcgraph_exit_acc, depth),
+	F(struct bg_funcgraph_exit_acc, calltime),
+	F(struct bg_funcgraph_exit_acc, rettime),
+};
+
+#undef F
+
+#define E(sys, ev)	{ #sys, #ev, offsetof(struct bg_accessors, ev),	\
+			  ev##_fields, ARRAY_SIZE(ev##_fields) }
+
+static const struct acc_event hot_events[] = {
+	E(sched, sched_switch),
+	E(sched, sched_wakeup),
+	E(irq, irq_handler_entry),
+	E(block, block_rq_issue),
+	E(ftrace, funcgraph_entry),
+	E(ftrace, funcgraph_exit),
+};
+
+#undef E
+
+void bg_accessors_init(struct bg_accessors *acc)
+{
+	size_t i;
+
+	memset(acc, 0, sizeof(*acc));
+	/* Every per-event struct starts with its id */
+	for (i = 0; i < ARRAY_SIZE(hot_events); i++)
+		*(int *)((char *)acc + hot_events[i].offset) = -1;
+}
+
+void bg_acc_resolve(struct bg_acc *a, struct tep_event *event,
+		    const char *name, bool swap)
+{
+	struct tep_format_field *field;
+
+	memset(a, 0, sizeof(*a));
+
+	field = tep_find_field(event, name);
+	if (!field)
+		return;
+
+	a->offset = field->offset;
+	a->size = field->size;
+	a->flags = BG_ACC_VALID;
+	if (field->flags & TEP_FIELD_IS_SIGNED)
+		a->flags |= BG_ACC_SIGNED;
+	if (field->flags & TEP_FIELD_IS_DYNAMIC) {
+		/* The accessor reads the 32 bit locator, not the array */
+		a->size = 4;
+		a->flags |= field->flags & TEP_FIELD_IS_RELATIVE ?
+			    BG_ACC_REL_LOC : BG_ACC_DATA_LOC;
+	}
+	if (swap)
+		a->flags |= BG_ACC_SWAP;
+}
+
+int bg_accessors_resolve(struct bg_accessors *acc, struct tep_event *event)
+{
+	const struct acc_event *ae;
+	struct tep_handle *tep = event->tep;
+	bool swap;
+	char *base;
+	size_t i;
+	int f;
+
+	for (i = 0; i < ARRAY_SIZE(hot_events); i++) {
+		ae = &hot_events[i];
+		if (!strcmp(ae->name, event->name) &&
+		    !strcmp(ae->system, event->system))
+			break;
+	}
+	if (i == ARRAY_SIZE(hot_events))
+		return 0;
+
+	swap = tep_is_file_bigendian(tep) != tep_is_local_bigendian(tep);
+	base = (char *)acc + ae->offset;
+	*(int *)base = event->id;
+
+	for (f = 0; f < ae->nr_fields; f++)
+		bg_acc_resolve((struct bg_acc *)(base + ae->fields[f].offset),
+			       event, ae->fields[f].name, swap);
+	return 1;
+}
+
+void bg_accessors_load(struct bg_accessors *acc, struct bg_formats *f)
+{
+	struct tep_event *event;
+	size_t i;
+	int id;
+
+	f->acc = acc;
+
+	for (i = 0; i < ARRAY_SIZE(hot_events); i++) {
+		id = bg_formats_find_id(f, hot_events[i].system,
+					hot_events[i].name);
+		if (id < 0)
+			continue;
+		event = bg_formats_lookup(f, id);
+		/* A format parsed before the hook was set */
+		if (event)
+			bg_accessors_resolve(acc, event);
+	}
+}
@@ -0,0 +1,173 @@
+#ifndef BG_ACCESSORS_H
+#define BG_ACCESSORS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <event-parse.h>
+
+struct bg_formats;
+
+#define BG_ACC_VALID	(1 << 0)
+#define BG_ACC_SIGNED	(1 << 1)
+#define BG_ACC_SWAP	(1 << 2)	/* record is foreign-endian */
+#define BG_ACC_DATA_LOC	(1 << 3)	/* __data_loc: u32 len << 16 | offset */
+#define BG_ACC_REL_LOC	(1 << 4)	/* __rel_loc: offset from field end */
+
+/*
+ * A field location resolved once when the format is loaded, so reading
+ * a record never goes through tep_find_field() and a string compare.
+ */
+struct bg_acc {
+	uint16_t	offset;
+	uint16_t	size;
+	uint32_t	flags;
+};
+
+/*
+ * Resolve field @name of @event into @a; left invalid when the format has
+ * no such field. @swap for records of the other byte order.
+ */
+void bg_acc_resolve(struct bg_acc *a, struct tep_event *event,
+		    const char *name, bool swap);
+
+static inline bool bg_acc_valid(const struct bg_acc *a)
+{
+	return a->flags & BG_ACC_VALID;
+}
+
+static inline uint64_t bg_acc_u64(const struct bg_acc *a, const void *data)
+{
+	const unsigned char *p = (const unsigned char *)data + a->offset;
+	bool swap = a->flags & BG_ACC_SWAP;
+	uint64_t v;
+
+	switch (a->size) {
+	case 1:
+		return *p;
+	case 2: {
+		uint16_t v16;
+
+		memcpy(&v16, p, 2);
+		return swap ? __builtin_bswap16(v16) : v16;
+	}
+	case 4: {
+		uint32_t v32;
+
+		memcpy(&v32, p, 4);
+		return swap ? __builtin_bswap32(v32) : v32;
+	}
+	default:
+		memcpy(&v, p, 8);
+		return swap ? __builtin_bswap64(v) : v;
+	}
+}
+
+static inline int64_t bg_acc_s64(const struct bg_acc *a, const void *data)
+{
+	uint64_t v = bg_acc_u64(a, data);
+	unsigned int shift = 64 - a->size * 8;
+
+	if (!(a->flags & BG_ACC_SIGNED) || !shift)
+		return (int64_t)v;
+	return (int64_t)(v << shift) >> shift;
+}
+
+/*
+ * Fixed arrays (char comm[16]) and dynamic strings alike. @len gets the
+ * array size, which for fixed arrays includes the NUL padding.
+ */
+static inline const char *bg_acc_str(const struct bg_acc *a, const void *data,
+				     unsigned int *len)
+{
+	uint32_t loc;
+
+	if (!(a->flags & (BG_ACC_DATA_LOC | BG_ACC_REL_LOC))) {
+		*len = a->size;
+		return (const char *)data + a->offset;
+	}
+
+	loc = (uint32_t)bg_acc_u64(a, data);
+	*len = loc >> 16;
+	if (a->flags & BG_ACC_REL_LOC)
+		return (const char *)data + a->offset + a->size + (loc & 0xffff);
+	return (const char *)data + (loc & 0xffff);
+}
+
+struct bg_sched_switch_acc {
+	int		id;
+	struct bg_acc	prev_comm;
+	struct bg_acc	prev_pid;
+	struct bg_acc	prev_prio;
+	struct bg_acc	prev_state;
+	struct bg_acc	next_comm;
+	struct bg_acc	next_pid;
+	struct bg_acc	next_prio;
+};
+
+struct bg_sched_wakeup_acc {
+	int		id;
+	struct bg_acc	comm;
+	struct bg_acc	pid;
+	struct bg_acc	prio;
+	struct bg_acc	target_cpu;
+};
+
+struct bg_irq_handler_entry_acc {
+	int		id;
+	struct bg_acc	irq;
+	struct bg_acc	name;
+};
+
+struct bg_block_rq_issue_acc {
+	int		id;
+	struct bg_acc	dev;
+	struct bg_acc	sector;
+	struct bg_acc	nr_sector;
+	struct bg_acc	bytes;
+	struct bg_acc	rwbs;
+	struct bg_acc	comm;
+};
+
+/* Written by the function_graph tracer (ftrace system) */
+struct bg_funcgraph_entry_acc {
+	int		id;
+	struct bg_acc	func;
+	struct bg_acc	depth;
+};
+
+struct bg_funcgraph_exit_acc {
+	int		id;
+	struct bg_acc	func;
+	struct bg_acc	depth;
+	struct bg_acc	calltime;
+	struct bg_acc	rettime;
+};
+
+/* Accessors of the hot events; an id of -1 means "not loaded". */
+struct bg_accessors {
+	struct bg_sched_switch_acc	sched_switch;
+	struct bg_sched_wakeup_acc	sched_wakeup;
+	struct bg_irq_handler_entry_acc	irq_handler_entry;
+	struct bg_block_rq_issue_acc	block_rq_issue;
+	struct bg_funcgraph_entry_acc	funcgraph_entry;
+	struct bg_funcgraph_exit_acc	funcgraph_exit;
+};
+
+void bg_accessors_init(struct bg_accessors *acc);
+
+/*
+ * If @event is one of the hot events, resolve its accessors. Fields the
+ * running kernel's format lacks stay invalid. Returns 1 when @event was
+ * one of them, 0 otherwise.
+ */
+int bg_accessors_resolve(struct bg_accessors *acc, struct tep_event *event);
+
+/*
+ * Resolve all hot events through @f right away and hook @acc into it so
+ * any later reload of them resolves again. Only these formats get parsed.
+ */
+void bg_accessors_load(struct bg_accessors *acc, struct bg_formats *f);
+
+#endif /* BG_ACCESSORS_H */
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "agg.h"
+
+static size_t line_round(size_t size)
+{
+	return (size + BG_CACHELINE - 1) & ~(size_t)(BG_CACHELINE - 1);
+}
+
+struct bg_agg *bg_agg_alloc(int nr_slots, unsigned int nr_counters,
+			    unsigned int nr_hists)
+{
+	size_t counters = line_round(nr_counters * sizeof(uint64_t));
+	size_t hists = nr_hists * sizeof(struct bg_agg_hist);
+	struct bg_agg_slot *s;
+	struct bg_agg *a;
+	void *mem;
+	int i;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+	a->nr_slots = nr_slots;
+	a->nr_counters = nr_counters;
+	a->nr_hists = nr_hists;
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+
+	a->slots = calloc(nr_slots, sizeof(*a->slots));
+	a->snap.counters = calloc(nr_counters + 1, sizeof(uint64_t));
+	a->snap.delta = calloc(nr_counters + 1, sizeof(uint64_t));
+	a->snap.hists = calloc(nr_hists + 1, sizeof(struct bg_loghist));
+	a->out.counters = calloc(nr_counters + 1, sizeof(uint64_t));
+	a->out.delta = calloc(nr_counters + 1, sizeof(uint64_t));
+	a->out.hists = calloc(nr_hists + 1, sizeof(struct bg_loghist));
+	if (!a->slots || !a->snap.counters || !a->snap.delta ||
+	    !a->snap.hists || !a->out.counters || !a->out.delta ||
+	    !a->out.hists)
+		goto fail;
+
+	/* One block per slot, so no two slots ever share a cache line */
+	for (i = 0; i < nr_slots; i++) {
+		s = &a->slots[i];
+		mem = aligned_alloc(BG_CACHELINE, counters + hists ?
+				    counters + hists : BG_CACHELINE);
+		if (!mem)
+			goto fail;
+		memset(mem, 0, counters + hists);
+		s->counters = mem;
+		s->hists = (struct bg_agg_hist *)((char *)mem + counters);
+	}
+	return a;
+ fail:
+	bg_agg_free(a);
+	return NULL;
+}
+
+void bg_agg_free(struct bg_agg *a)
+{
+	int i;
+
+	if (!a)
+		return;
+	bg_agg_stop(a);
+	for (i = 0; a->slots && i < a->nr_slots; i++)
+		free(a->slots[i].counters);
+	free(a->slots);
+	free(a->snap.counters);
+	free(a->snap.delta);
+	free(a->snap.hists);
+	free(a->out.counters);
+	free(a->out.delta);
+	free(a->out.hists);
+	pthread_cond_destroy(&a->cond);
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+}
+
+static uint64_t load(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+uint64_t bg_agg_sum(struct bg_agg *a, unsigned int counter)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < a->nr_slots; i++)
+		sum += load(&a->slots[i].counters[counter]);
+	return sum;
+}
+
+/* Totals are rebuilt from the buckets so they always agree with them */
+static void fold_hist(struct bg_agg *a, unsigned int h, struct bg_loghist *out)
+{
+	const struct bg_agg_hist *src;
+	unsigned int b;
+	uint64_t max;
+	int i;
+
+	bg_loghist_reset(out);
+	for (i = 0; i < a->nr_slots; i++) {
+		src = &a->slots[i].hists[h];
+		for (b = 0; b < BG_LOGHIST_BUCKETS; b++)
+			out->count[b] += load(&src->count[b]);
+		out->sum += load(&src->sum);
+		max = load(&src->max);
+		if (max > out->max)
+			out->max = max;
+	}
+
+	for (b = 0; b < BG_LOGHIST_BUCKETS; b++) {
+		if (out->count[b] && !out->total)
+			out->min = bg_loghist_low(b);
+		out->total += out->count[b];
+	}
+}
+
+/* Called with a->lock held */
+static void fold(struct bg_agg *a)
+{
+	struct bg_agg_snapshot *snap = &a->snap;
+	uint64_t total;
+	unsigned int i;
+
+	snap->time = bg_now_ns();
+	for (i = 0; i < a->nr_counters; i++) {
+		total = bg_agg_sum(a, i);
+		snap->delta[i] = total - snap->counters[i];
+		snap->counters[i] = total;
+	}
+	for (i = 0; i < a->nr_hists; i++)
+		fold_hist(a, i, &snap->hists[i]);
+}
+
+/* Called with a->lock held */
+static void copy_snap(struct bg_agg *a)
+{
+	a->out.time = a->snap.time;
+	memcpy(a->out.counters, a->snap.counters,
+	       a->nr_counters * sizeof(uint64_t));
+	memcpy(a->out.delta, a->snap.delta, a->nr_counters * sizeof(uint64_t));
+	memcpy(a->out.hists, a->snap.hists,
+	       a->nr_hists * sizeof(struct bg_loghist));
+}
+
+const struct bg_agg_snapshot *bg_agg_fold(struct bg_agg *a)
+{
+	pthread_mutex_lock(&a->lock);
+	fold(a);
+	pthread_mutex_unlock(&a->lock);
+	return &a->snap;
+}
+
+static void *fold_thread(void *arg)
+{
+	struct bg_agg *a = arg;
+	struct timespec deadline;
+	bool stopping;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	pthread_mutex_lock(&a->lock);
+	for (;;) {
+		deadline.tv_sec += a->interval_ms / 1000;
+		deadline.tv_nsec += (a->interval_ms % 1000) * NSEC_PER_MSEC;
+		if (deadline.tv_nsec >= (long)NSEC_PER_SEC) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= NSEC_PER_SEC;
+		}
+		while (!a->stopping &&
+		       pthread_cond_timedwait(&a->cond, &a->lock, &deadline) != ETIMEDOUT)
+			;
+		stopping = a->stopping;
+		fold(a);
+		if (a->fn) {
+			copy_snap(a);
+			pthread_mutex_unlock(&a->lock);
+			a->fn(&a->out, a->data);
+			pthread_mutex_lock(&a->lock);
+		}
+		if (stopping)
+			break;
+	}
+	pthread_mutex_unlock(&a->lock);
+	return NULL;
+}
+
+int bg_agg_start(struct bg_agg *a, unsigned int interval_ms, bg_agg_fold_fn fn,
+		 void *data)
+{
+	pthread_condattr_t attr;
+	sigset_t all, old;
+
+	if (a->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* Timed waits on the monotonic clock, like everything else here */
+	pthread_cond_destroy(&a->cond);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&a->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	a->interval_ms = interval_ms ? interval_ms : BG_AGG_INTERVAL_MS;
+	a->fn = fn;
+	a->data = data;
+	a->stopping = false;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	errno = pthread_create(&a->thread, NULL, fold_thread, a);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (errno)
+		return -1;
+	a->running = true;
+	return 0;
+}
+
+void bg_agg_stop(struct bg_agg *a)
+{
+	if (!a->running)
+		return;
+	pthread_mutex_lock(&a->lock);
+	a->stopping = true;
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+	pthread_join(a->thread, NULL);
+	a->running = false;
+}
+
+void bg_agg_read(struct bg_agg *a, uint64_t *counters, struct bg_loghist *hists)
+{
+	pthread_mutex_lock(&a->lock);
+	if (counters)
+		memcpy(counters, a->snap.counters,
+		       a->nr_counters * sizeof(*counters));
+	if (hists)
+		memcpy(hists, a->snap.hists, a->nr_hists * sizeof(*hists));
+	pthread_mutex_unlock(&a->lock);
+}
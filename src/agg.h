@@ -0,0 +1,115 @@
+#ifndef BG_AGG_H
+#define BG_AGG_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "loghist.h"
+#include "util.h"
+
+/*
+ * Counters and log-linear histograms for analyses running on several
+ * threads (reader callbacks, scan workers). Every writer gets a slot of
+ * its own, in cache lines no other slot touches, and updates it with
+ * plain loads and stores: with a single writer per slot there is nothing
+ * to lock and no cache line bouncing between CPUs. A folding thread sums
+ * the slots into a global snapshot every so often; its relaxed loads may
+ * see a slot mid-update, which at worst puts a record in the next fold.
+ */
+struct bg_agg_hist {
+	uint64_t		count[BG_LOGHIST_BUCKETS];
+	uint64_t		sum;
+	uint64_t		max;
+} __bg_aligned;
+
+struct bg_agg_slot {
+	uint64_t		*counters;	/* cache line aligned */
+	struct bg_agg_hist	*hists;
+};
+
+struct bg_agg_snapshot {
+	uint64_t		time;		/* bg_now_ns() of the fold */
+	uint64_t		*counters;	/* totals since the start */
+	uint64_t		*delta;		/* since the previous fold */
+	struct bg_loghist	*hists;		/* totals since the start */
+};
+
+typedef void (*bg_agg_fold_fn)(const struct bg_agg_snapshot *snap, void *data);
+
+struct bg_agg {
+	int			nr_slots;
+	unsigned int		nr_counters;
+	unsigned int		nr_hists;
+	struct bg_agg_slot	*slots;
+	struct bg_agg_snapshot	snap;
+	struct bg_agg_snapshot	out;		/* what @fn is handed */
+
+	/* Folding thread */
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	bool			running;
+	bool			stopping;
+	unsigned int		interval_ms;
+	bg_agg_fold_fn		fn;
+	void			*data;
+};
+
+/* Default folding interval */
+#define BG_AGG_INTERVAL_MS	1000
+
+struct bg_agg *bg_agg_alloc(int nr_slots, unsigned int nr_counters,
+			    unsigned int nr_hists);
+void bg_agg_free(struct bg_agg *a);
+
+/* Single-writer update: no other thread ever writes this slot */
+static inline void bg_agg_store(uint64_t *p, uint64_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+static inline void bg_agg_add(struct bg_agg *a, int slot, unsigned int counter,
+			      uint64_t v)
+{
+	uint64_t *p = &a->slots[slot].counters[counter];
+
+	bg_agg_store(p, *p + v);
+}
+
+static inline void bg_agg_record(struct bg_agg *a, int slot, unsigned int hist,
+				 uint64_t v)
+{
+	struct bg_agg_hist *h = &a->slots[slot].hists[hist];
+	uint64_t *c = &h->count[bg_loghist_bucket(v)];
+
+	bg_agg_store(c, *c + 1);
+	bg_agg_store(&h->sum, h->sum + v);
+	if (v > h->max)
+		bg_agg_store(&h->max, v);
+}
+
+/* Current total of @counter over all slots, without a fold */
+uint64_t bg_agg_sum(struct bg_agg *a, unsigned int counter);
+
+/*
+ * Fold the slots into a->snap right now and return it. Only for callers
+ * not running the folding thread.
+ */
+const struct bg_agg_snapshot *bg_agg_fold(struct bg_agg *a);
+
+/*
+ * Fold every @interval_ms on a thread of its own and hand each snapshot
+ * to @fn there (may be NULL, see bg_agg_read()). @fn gets a copy and runs
+ * without the lock, so a slow one never holds up bg_agg_read().
+ */
+int bg_agg_start(struct bg_agg *a, unsigned int interval_ms, bg_agg_fold_fn fn,
+		 void *data);
+
+/* Fold a last time, so @fn sees everything written so far, and join. */
+void bg_agg_stop(struct bg_agg *a);
+
+/* Copy the totals of the last fold into @counters and/or @hists. */
+void bg_agg_read(struct bg_agg *a, uint64_t *counters, struct bg_loghist *hists);
+
+#endif /* BG_AGG_H */
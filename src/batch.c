@@ -0,0 +1,146 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "sample.h"
+#include "util.h"
+
+static int batch_resize(struct bg_batch *b, unsigned int cap)
+{
+	void *p;
+
+#define GROW(col)							\
+	do {								\
+		p = realloc(b->col, cap * sizeof(*b->col));		\
+		if (!p)							\
+			return -1;					\
+		b->col = p;						\
+	} while (0)
+
+	GROW(ts);
+	GROW(pid);
+	GROW(id);
+	GROW(off);
+	GROW(size);
+#undef GROW
+
+	b->cap = cap;
+	return 0;
+}
+
+int bg_batch_init(struct bg_batch *b, unsigned int cap)
+{
+	memset(b, 0, sizeof(*b));
+	if (batch_resize(b, cap ? cap : 256) < 0) {
+		bg_batch_free(b);
+		return -1;
+	}
+	return 0;
+}
+
+void bg_batch_free(struct bg_batch *b)
+{
+	free(b->ts);
+	free(b->pid);
+	free(b->id);
+	free(b->off);
+	free(b->size);
+	memset(b, 0, sizeof(*b));
+}
+
+int bg_batch_decode(struct bg_batch *b, struct kbuffer *kbuf, int cpu)
+{
+	const unsigned char *data;
+	unsigned long long ts;
+	unsigned int n = 0;
+	uint16_t id;
+	int32_t pid;
+
+	b->page = kbuffer_subbuffer(kbuf);
+	b->cpu = cpu;
+	b->missed = kbuffer_missed_events(kbuf);
+
+	for (data = kbuffer_read_event(kbuf, &ts); data;
+	     data = kbuffer_next_event(kbuf, &ts)) {
+		if (unlikely(n == b->cap) && batch_resize(b, b->cap * 2) < 0)
+			return -1;
+
+		memcpy(&id, data + BG_COMMON_TYPE_OFFSET, sizeof(id));
+		if (b->swap)
+			id = __builtin_bswap16(id);
+		if (b->sampler && !bg_sample_keep(b->sampler, id, ts))
+			continue;
+
+		memcpy(&pid, data + BG_COMMON_PID_OFFSET, sizeof(pid));
+		if (b->swap)
+			pid = __builtin_bswap32(pid);
+
+		b->ts[n] = ts;
+		b->id[n] = id;
+		b->pid[n] = pid;
+		b->off[n] = data - b->page;
+		b->size[n] = kbuffer_event_size(kbuf);
+		n++;
+	}
+
+	b->nr = n;
+	return n;
+}
+
+/*
+ * One loop per field width so the load is a constant-size memcpy the
+ * compiler turns into a plain move.
+ */
+#define GATHER(type, bswap)						\
+	for (i = 0; i < b->nr; i++) {					\
+		type v;							\
+		if (b->id[i] != id)					\
+			continue;					\
+		memcpy(&v, b->page + b->off[i] + offset, sizeof(v));	\
+		if (b->swap)						\
+			v = bswap(v);					\
+		vals[n] = v;						\
+		if (idx)						\
+			idx[n] = i;					\
+		n++;							\
+	}
+
+#define nop_swap(v)	(v)
+
+unsigned int bg_batch_field(const struct bg_batch *b,
+			    const struct tep_format_field *field,
+			    uint64_t *vals, uint32_t *idx)
+{
+	uint16_t id = field->event->id;
+	int offset = field->offset;
+	unsigned int i, n = 0;
+
+	switch (field->size) {
+	case 1:
+		GATHER(uint8_t, nop_swap);
+		break;
+	case 2:
+		GATHER(uint16_t, __builtin_bswap16);
+		break;
+	case 4:
+		GATHER(uint32_t, __builtin_bswap32);
+		break;
+	case 8:
+		GATHER(uint64_t, __builtin_bswap64);
+		break;
+	default:
+		errno = EINVAL;
+		return 0;
+	}
+
+	/* Sign extend so callers can cast the column to int64_t */
+	if ((field->flags & TEP_FIELD_IS_SIGNED) && field->size < 8) {
+		unsigned int shift = 64 - field->size * 8;
+
+		for (i = 0; i < n; i++)
+			vals[i] = (uint64_t)((int64_t)(vals[i] << shift) >> shift);
+	}
+
+	return n;
+}
@@ -0,0 +1,64 @@
+#ifndef BG_BATCH_H
+#define BG_BATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event-parse.h>
+#include <kbuffer.h>
+
+struct bg_sampler;
+
+/*
+ * Every event starts with the same common fields; their layout has not
+ * changed since ftrace events were introduced, so the batch decoder reads
+ * them at fixed offsets instead of going through tep for each record.
+ */
+#define BG_COMMON_TYPE_OFFSET	0	/* unsigned short common_type */
+#define BG_COMMON_PID_OFFSET	4	/* int common_pid */
+
+/*
+ * One sub-buffer's worth of records as columns. Offsets are relative to
+ * @page, which must stay valid for as long as the batch is used.
+ */
+struct bg_batch {
+	unsigned int		nr;
+	unsigned int		cap;
+	int			cpu;
+	bool			swap;		/* records are foreign-endian */
+	const unsigned char	*page;
+	unsigned long long	missed;		/* lost before this sub-buffer */
+	struct bg_sampler	*sampler;	/* drops records before decoding */
+	uint64_t		*ts;
+	int32_t			*pid;
+	uint16_t		*id;
+	uint32_t		*off;		/* record payload in @page */
+	uint32_t		*size;		/* payload bytes */
+};
+
+int bg_batch_init(struct bg_batch *b, unsigned int cap);
+void bg_batch_free(struct bg_batch *b);
+
+/*
+ * Replace the contents of @b with every record of the sub-buffer loaded
+ * in @kbuf that @b->sampler (if set) keeps. Returns the number of records
+ * or -1 on allocation failure.
+ */
+int bg_batch_decode(struct bg_batch *b, struct kbuffer *kbuf, int cpu);
+
+/*
+ * Gather the numeric @field of every record in @b whose event id matches
+ * the field's event into @vals, and the record indexes into @idx (may be
+ * NULL). Both must hold b->nr entries. Returns the number gathered.
+ */
+unsigned int bg_batch_field(const struct bg_batch *b,
+			    const struct tep_format_field *field,
+			    uint64_t *vals, uint32_t *idx);
+
+static inline const void *bg_batch_data(const struct bg_batch *b,
+					unsigned int i)
+{
+	return b->page + b->off[i];
+}
+
+#endif /* BG_BATCH_H */
@@ -0,0 +1,1087 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <tracefs.h>
+#ifdef BG_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef BG_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef BG_HAVE_URING
+#include <liburing.h>
+#endif
+
+#include "capture.h"
+#include "formats.h"
+#include "util.h"
+
+#define HOST_BIG_ENDIAN	(__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+
+/*
+ * A chunk being filled by one CPU, or queued for a compression worker or
+ * in flight on the ring. The pages directly follow the chunk header, so
+ * the two go out in one write.
+ */
+struct cap_buf {
+	struct cap_buf		*next;
+	int			idx;		/* registered buffer */
+	uint64_t		offset;		/* in the file, once queued */
+	struct bg_cap_chunk	chunk;
+	unsigned char		pages[];
+};
+
+struct cap_cpu {
+	struct cap_buf		*buf;
+	int			nr_pages;
+	uint64_t		first_ts;
+};
+
+struct bg_capture {
+	int				fd;
+	uint64_t			offset;
+	int				page_size;
+	int				nr_cpus;
+	struct cap_cpu			*cpus;
+	struct bg_cap_index_entry	*index;
+	size_t				nr_index;
+	size_t				alloc_index;
+	struct kbuffer			*kbuf;
+	struct bg_formats		*formats;
+	char				*formats_buf;	/* frozen, see below */
+	size_t				formats_len;
+
+	/* Compression, see bg_capture_set_codec() */
+	enum bg_cap_codec		codec;
+	int				level;
+	pthread_t			*workers;
+	int				nr_workers;
+
+	/* io_uring writes, see bg_capture_set_uring() */
+#ifdef BG_HAVE_URING
+	struct io_uring			ring;
+#endif
+	bool				uring;
+	void				*buf_mem;	/* every cap_buf, registered */
+	size_t				buf_mem_size;
+	int				inflight;
+	uint64_t			sync_bytes;
+	uint64_t			unsynced;
+
+	/* Serializes the file, the index and the buffer lists below */
+	pthread_mutex_t			lock;
+	pthread_cond_t			work_cond;
+	pthread_cond_t			free_cond;
+	struct cap_buf			*queue;
+	struct cap_buf			**queue_tail;
+	struct cap_buf			*free_bufs;
+	int				nr_bufs;
+	int				max_bufs;
+	bool				stopping;
+	bool				failed;
+};
+
+struct bg_capture *bg_capture_create(const char *path, int nr_cpus,
+				     int page_size)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return NULL;
+	return bg_capture_create_fd(fd, nr_cpus, page_size);
+}
+
+struct bg_capture *bg_capture_create_fd(int fd, int nr_cpus, int page_size)
+{
+	struct bg_cap_header hdr = {
+		.magic		= BG_CAP_MAGIC,
+		.version	= BG_CAP_VERSION,
+		.flags		= HOST_BIG_ENDIAN ? BG_CAP_F_BIG_ENDIAN : 0,
+		.page_size	= page_size,
+		.long_size	= sizeof(long),
+		.nr_cpus	= nr_cpus,
+	};
+	struct bg_capture *cap;
+
+	cap = calloc(1, sizeof(*cap));
+	if (!cap) {
+		close(fd);
+		return NULL;
+	}
+
+	cap->fd = fd;
+	cap->page_size = page_size;
+	cap->nr_cpus = nr_cpus;
+	cap->max_bufs = nr_cpus;
+	cap->queue_tail = &cap->queue;
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->work_cond, NULL);
+	pthread_cond_init(&cap->free_cond, NULL);
+	cap->cpus = calloc(nr_cpus, sizeof(*cap->cpus));
+	cap->kbuf = kbuffer_alloc(KBUFFER_LSIZE_SAME_AS_HOST,
+				  KBUFFER_ENDIAN_SAME_AS_HOST);
+	if (!cap->cpus || !cap->kbuf)
+		goto fail;
+
+	if (bg_write_all(cap->fd, &hdr, sizeof(hdr)) < 0)
+		goto fail;
+	cap->offset = sizeof(hdr);
+
+	return cap;
+ fail:
+	close(cap->fd);
+	if (cap->kbuf)
+		kbuffer_free(cap->kbuf);
+	free(cap->cpus);
+	free(cap);
+	return NULL;
+}
+
+/* Timestamp of the last record in @page, or @dflt for an empty page */
+static uint64_t last_page_ts(struct bg_capture *cap, void *page, uint64_t dflt)
+{
+	unsigned long long ts, last = dflt;
+
+	if (kbuffer_load_subbuffer(cap->kbuf, page) < 0)
+		return dflt;
+	for (void *data = kbuffer_read_event(cap->kbuf, &ts); data;
+	     data = kbuffer_next_event(cap->kbuf, &ts))
+		last = ts;
+	return last;
+}
+
+static int add_index(struct bg_capture *cap, const struct bg_cap_chunk *chunk,
+		     uint64_t offset)
+{
+	struct bg_cap_index_entry *e;
+	size_t n;
+
+	if (cap->nr_index == cap->alloc_index) {
+		n = cap->alloc_index ? cap->alloc_index * 2 : 256;
+		e = realloc(cap->index, n * sizeof(*e));
+		if (!e)
+			return -1;
+		cap->index = e;
+		cap->alloc_index = n;
+	}
+
+	e = &cap->index[cap->nr_index++];
+	memset(e, 0, sizeof(*e));
+	e->cpu = chunk->cpu;
+	e->nr_pages = chunk->nr_pages;
+	e->codec = chunk->codec;
+	e->first_ts = chunk->first_ts;
+	e->last_ts = chunk->last_ts;
+	e->offset = offset;
+	e->size = chunk->size;
+	e->raw_size = chunk->raw_size;
+	return 0;
+}
+
+/* Append a chunk and index it; called with cap->lock held */
+static int write_chunk(struct bg_capture *cap, const struct bg_cap_chunk *chunk,
+		       const void *data)
+{
+	struct iovec iov[2];
+	size_t done = 0, len = chunk->size;
+	ssize_t n;
+
+	iov[0].iov_base = (void *)chunk;
+	iov[0].iov_len = sizeof(*chunk);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+
+	while (done < sizeof(*chunk) + len) {
+		n = writev(cap->fd, iov, 2);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+		/* Short write: move the vector past what went out */
+		if ((size_t)n >= iov[0].iov_len) {
+			n -= iov[0].iov_len;
+			iov[0].iov_len = 0;
+			iov[1].iov_base = (char *)iov[1].iov_base + n;
+			iov[1].iov_len -= n;
+		} else {
+			iov[0].iov_base = (char *)iov[0].iov_base + n;
+			iov[0].iov_len -= n;
+		}
+	}
+
+	if (add_index(cap, chunk, cap->offset) < 0)
+		return -1;
+	cap->offset += sizeof(*chunk) + len;
+
+	cap->unsynced += sizeof(*chunk) + len;
+	if (cap->sync_bytes && cap->unsynced >= cap->sync_bytes) {
+		cap->unsynced = 0;
+		return fdatasync(cap->fd);
+	}
+	return 0;
+}
+
+static bool codec_supported(enum bg_cap_codec codec)
+{
+	switch (codec) {
+	case BG_CAP_CODEC_NONE:
+#ifdef BG_HAVE_ZSTD
+	case BG_CAP_CODEC_ZSTD:
+#endif
+#ifdef BG_HAVE_LZ4
+	case BG_CAP_CODEC_LZ4:
+#endif
+		return true;
+	default:
+		return false;
+	}
+}
+
+static size_t codec_bound(enum bg_cap_codec codec, size_t len)
+{
+	switch (codec) {
+#ifdef BG_HAVE_ZSTD
+	case BG_CAP_CODEC_ZSTD:
+		return ZSTD_compressBound(len);
+#endif
+#ifdef BG_HAVE_LZ4
+	case BG_CAP_CODEC_LZ4:
+		return LZ4_compressBound(len);
+#endif
+	default:
+		return len;
+	}
+}
+
+/* Compressed size, or 0 if the chunk is better stored as it is */
+static size_t codec_compress(struct bg_capture *cap, void *ctx, void *dst,
+			     size_t dst_size, const void *src, size_t len)
+{
+	size_t n = 0;
+
+	switch (cap->codec) {
+#ifdef BG_HAVE_ZSTD
+	case BG_CAP_CODEC_ZSTD:
+		n = ZSTD_compressCCtx(ctx, dst, dst_size, src, len, cap->level);
+		if (ZSTD_isError(n))
+			n = 0;
+		break;
+#endif
+#ifdef BG_HAVE_LZ4
+	case BG_CAP_CODEC_LZ4: {
+		int ret = LZ4_compress_default(src, dst, len, dst_size);
+
+		n = ret > 0 ? (size_t)ret : 0;
+		break;
+	}
+#endif
+	default:
+		break;
+	}
+	return n < len ? n : 0;
+}
+
+static int codec_decompress(enum bg_cap_codec codec, void *dst, size_t raw_size,
+			    const void *src, size_t size)
+{
+	switch (codec) {
+#ifdef BG_HAVE_ZSTD
+	case BG_CAP_CODEC_ZSTD:
+		if (ZSTD_decompress(dst, raw_size, src, size) != raw_size)
+			break;
+		return 0;
+#endif
+#ifdef BG_HAVE_LZ4
+	case BG_CAP_CODEC_LZ4:
+		if (LZ4_decompress_safe(src, dst, size, raw_size) != (int)raw_size)
+			break;
+		return 0;
+#endif
+	default:
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Each worker compresses one chunk at a time into its own output buffer
+ * and only takes the lock to append it, so chunks land in the file in
+ * completion order; the index, sorted at close, does not care.
+ */
+static void *compress_thread(void *arg)
+{
+	struct bg_capture *cap = arg;
+	size_t raw = (size_t)BG_CAP_CHUNK_PAGES * cap->page_size;
+	size_t out_size = codec_bound(cap->codec, raw), n;
+	struct bg_cap_chunk chunk;
+	struct cap_buf *b;
+	void *out, *ctx = NULL;
+	sigset_t mask;
+
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	out = malloc(out_size);
+#ifdef BG_HAVE_ZSTD
+	if (cap->codec == BG_CAP_CODEC_ZSTD)
+		ctx = ZSTD_createCCtx();
+#endif
+
+	pthread_mutex_lock(&cap->lock);
+	if (!out)
+		cap->failed = true;
+	for (;;) {
+		while (!cap->queue && !cap->stopping)
+			pthread_cond_wait(&cap->work_cond, &cap->lock);
+		b = cap->queue;
+		if (!b)
+			break;
+		cap->queue = b->next;
+		if (!cap->queue)
+			cap->queue_tail = &cap->queue;
+		pthread_mutex_unlock(&cap->lock);
+
+		chunk = b->chunk;
+		n = 0;
+		if (out && (ctx || cap->codec != BG_CAP_CODEC_ZSTD))
+			n = codec_compress(cap, ctx, out, out_size, b->pages,
+					   chunk.raw_size);
+		if (n) {
+			chunk.codec = cap->codec;
+			chunk.size = n;
+		}
+
+		pthread_mutex_lock(&cap->lock);
+		if (!cap->failed &&
+		    write_chunk(cap, &chunk, n ? out : (void *)b->pages) < 0)
+			cap->failed = true;
+		b->next = cap->free_bufs;
+		cap->free_bufs = b;
+		pthread_cond_signal(&cap->free_cond);
+	}
+	pthread_mutex_unlock(&cap->lock);
+
+#ifdef BG_HAVE_ZSTD
+	if (ctx)
+		ZSTD_freeCCtx(ctx);
+#endif
+	free(out);
+	return NULL;
+}
+
+int bg_capture_set_codec(struct bg_capture *cap, enum bg_cap_codec codec,
+			 int level, int nr_workers)
+{
+	int i;
+
+	if (!codec_supported(codec) || cap->nr_bufs) {
+		errno = codec_supported(codec) ? EBUSY : EPROTONOSUPPORT;
+		return -1;
+	}
+	cap->codec = codec;
+	cap->level = level;
+	if (codec == BG_CAP_CODEC_NONE)
+		return 0;
+
+	if (nr_workers < 1)
+		nr_workers = 1;
+	cap->workers = calloc(nr_workers, sizeof(*cap->workers));
+	if (!cap->workers)
+		return -1;
+
+	for (i = 0; i < nr_workers; i++) {
+		errno = pthread_create(&cap->workers[i], NULL, compress_thread,
+				       cap);
+		if (errno)
+			break;
+		cap->nr_workers++;
+	}
+	if (!cap->nr_workers)
+		return -1;
+
+	/* Two chunks in flight per worker before the producer waits */
+	cap->max_bufs = cap->nr_cpus + 2 * cap->nr_workers;
+	return 0;
+}
+
+int bg_capture_parse_codec(const char *spec, enum bg_cap_codec *codec,
+			   int *level)
+{
+	const char *sep = strchr(spec, ':');
+	size_t len = sep ? (size_t)(sep - spec) : strlen(spec);
+
+	if (len == 4 && !strncmp(spec, "zstd", len)) {
+		*codec = BG_CAP_CODEC_ZSTD;
+		*level = 3;
+	} else if (len == 3 && !strncmp(spec, "lz4", len)) {
+		*codec = BG_CAP_CODEC_LZ4;
+		*level = 0;
+	} else if (len == 4 && !strncmp(spec, "none", len)) {
+		*codec = BG_CAP_CODEC_NONE;
+		*level = 0;
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+	if (sep)
+		*level = atoi(sep + 1);
+	if (!codec_supported(*codec)) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	return 0;
+}
+
+int bg_capture_set_sync(struct bg_capture *cap, uint64_t bytes)
+{
+	cap->sync_bytes = bytes;
+	return 0;
+}
+
+#ifdef BG_HAVE_URING
+static int write_at(int fd, const void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		buf = (const char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* One write or fdatasync done; called with cap->lock held */
+static void complete(struct bg_capture *cap, struct io_uring_cqe *cqe)
+{
+	struct cap_buf *b = io_uring_cqe_get_data(cqe);
+	int res = cqe->res;
+	size_t len;
+
+	io_uring_cqe_seen(&cap->ring, cqe);
+	cap->inflight--;
+	if (res < 0) {
+		errno = -res;
+		cap->failed = true;
+	}
+	if (!b)
+		return;
+
+	/* A short write is finished off synchronously; it is rare on files */
+	len = sizeof(b->chunk) + b->chunk.size;
+	if (res >= 0 && (size_t)res < len &&
+	    write_at(cap->fd, (char *)&b->chunk + res, len - res,
+		     b->offset + res) < 0)
+		cap->failed = true;
+	b->next = cap->free_bufs;
+	cap->free_bufs = b;
+}
+
+static void reap(struct bg_capture *cap, bool wait)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	while (cap->inflight) {
+		if (wait)
+			ret = io_uring_wait_cqe(&cap->ring, &cqe);
+		else
+			ret = io_uring_peek_cqe(&cap->ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret == -EAGAIN && !wait)
+			break;
+		if (ret < 0) {
+			errno = -ret;
+			cap->failed = true;
+			break;
+		}
+		complete(cap, cqe);
+		wait = false;
+	}
+}
+
+/*
+ * Queue @b's chunk at its final offset, so it can be indexed right away
+ * and writes may complete in any order. Called with cap->lock held. @b
+ * is the ring's from then on, even if the submit fails: the write stays
+ * queued and goes in with the next one. If it never got queued, @b goes
+ * back on the free list.
+ */
+static int submit_chunk(struct bg_capture *cap, struct cap_buf *b)
+{
+	size_t len = sizeof(b->chunk) + b->chunk.size;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	sqe = io_uring_get_sqe(&cap->ring);
+	if (!sqe) {
+		errno = EBUSY;
+		goto unused;
+	}
+	if (add_index(cap, &b->chunk, cap->offset) < 0)
+		goto unused;
+	io_uring_prep_write_fixed(sqe, cap->fd, &b->chunk, len, cap->offset,
+				  b->idx);
+	io_uring_sqe_set_data(sqe, b);
+	b->offset = cap->offset;
+	cap->offset += len;
+	cap->inflight++;
+
+	cap->unsynced += len;
+	if (cap->sync_bytes && cap->unsynced >= cap->sync_bytes &&
+	    (sqe = io_uring_get_sqe(&cap->ring))) {
+		/* Drained: it runs once every write queued before it is done */
+		io_uring_prep_fsync(sqe, cap->fd, IORING_FSYNC_DATASYNC);
+		io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN);
+		io_uring_sqe_set_data(sqe, NULL);
+		cap->inflight++;
+		cap->unsynced = 0;
+	}
+
+	ret = io_uring_submit(&cap->ring);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+ unused:
+	b->next = cap->free_bufs;
+	cap->free_bufs = b;
+	return -1;
+}
+
+/* Chunk buffers are this far apart in the registered region */
+static size_t buf_stride(struct bg_capture *cap)
+{
+	size_t len = sizeof(struct cap_buf) +
+		     (size_t)BG_CAP_CHUNK_PAGES * cap->page_size;
+	size_t page = getpagesize();
+
+	return (len + page - 1) / page * page;
+}
+#endif
+
+int bg_capture_set_uring(struct bg_capture *cap, int depth)
+{
+#ifdef BG_HAVE_URING
+	size_t stride = buf_stride(cap);
+	struct iovec *iov;
+	struct cap_buf *b;
+	int i, nr, ret;
+
+	if (cap->nr_workers || cap->nr_bufs) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (depth < 1)
+		depth = BG_CAP_URING_DEPTH;
+
+	/* One buffer filling per CPU, @depth in flight */
+	nr = cap->nr_cpus + depth;
+	iov = calloc(nr, sizeof(*iov));
+	if (!iov)
+		return -1;
+	cap->buf_mem_size = nr * stride;
+	cap->buf_mem = mmap(NULL, cap->buf_mem_size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (cap->buf_mem == MAP_FAILED) {
+		cap->buf_mem = NULL;
+		free(iov);
+		return -1;
+	}
+	for (i = nr - 1; i >= 0; i--) {
+		b = (struct cap_buf *)((char *)cap->buf_mem + i * stride);
+		b->idx = i;
+		b->next = cap->free_bufs;
+		cap->free_bufs = b;
+		iov[i].iov_base = &b->chunk;
+		iov[i].iov_len = sizeof(b->chunk) +
+				 (size_t)BG_CAP_CHUNK_PAGES * cap->page_size;
+	}
+
+	/* Every write may have an fdatasync behind it */
+	ret = io_uring_queue_init(2 * nr, &cap->ring, 0);
+	if (!ret) {
+		ret = io_uring_register_buffers(&cap->ring, iov, nr);
+		if (ret)
+			io_uring_queue_exit(&cap->ring);
+	}
+	free(iov);
+	if (ret) {
+		munmap(cap->buf_mem, cap->buf_mem_size);
+		cap->buf_mem = NULL;
+		cap->free_bufs = NULL;
+		errno = -ret;
+		return -1;
+	}
+
+	cap->nr_bufs = cap->max_bufs = nr;
+	cap->uring = true;
+	return 0;
+#else
+	(void)cap;
+	(void)depth;
+	errno = EPROTONOSUPPORT;
+	return -1;
+#endif
+}
+
+/*
+ * A buffer to fill; waits for a worker to free one, or for a write to
+ * complete, if all are queued
+ */
+static struct cap_buf *get_buf(struct bg_capture *cap)
+{
+	struct cap_buf *b = NULL;
+
+	pthread_mutex_lock(&cap->lock);
+	for (;;) {
+		if (cap->failed) {
+			errno = EIO;
+			break;
+		}
+#ifdef BG_HAVE_URING
+		if (cap->uring)
+			reap(cap, !cap->free_bufs);
+#endif
+		if (cap->free_bufs) {
+			b = cap->free_bufs;
+			cap->free_bufs = b->next;
+			break;
+		}
+		if (cap->uring) {
+			if (cap->inflight)
+				continue;
+			errno = ENOBUFS;
+			break;
+		}
+		if (cap->nr_bufs < cap->max_bufs) {
+			b = malloc(sizeof(*b) +
+				   (size_t)BG_CAP_CHUNK_PAGES * cap->page_size);
+			if (b)
+				cap->nr_bufs++;
+			break;
+		}
+		pthread_cond_wait(&cap->free_cond, &cap->lock);
+	}
+	pthread_mutex_unlock(&cap->lock);
+	return b;
+}
+
+static int flush_cpu(struct bg_capture *cap, int cpu)
+{
+	struct cap_cpu *cc = &cap->cpus[cpu];
+	struct cap_buf *b = cc->buf;
+	struct bg_cap_chunk *chunk;
+	size_t len;
+	int ret = 0;
+
+	if (!cc->nr_pages)
+		return 0;
+
+	len = (size_t)cc->nr_pages * cap->page_size;
+	chunk = &b->chunk;
+	memset(chunk, 0, sizeof(*chunk));
+	chunk->magic = BG_CAP_CHUNK_MAGIC;
+	chunk->cpu = cpu;
+	chunk->nr_pages = cc->nr_pages;
+	chunk->codec = BG_CAP_CODEC_NONE;
+	chunk->size = len;
+	chunk->raw_size = len;
+	chunk->first_ts = cc->first_ts;
+	chunk->last_ts = last_page_ts(cap, b->pages + len - cap->page_size,
+				      cc->first_ts);
+	cc->nr_pages = 0;
+
+	pthread_mutex_lock(&cap->lock);
+	if (cap->failed) {
+		errno = EIO;
+		ret = -1;
+#ifdef BG_HAVE_URING
+	} else if (cap->uring) {
+		ret = submit_chunk(cap, b);
+		cc->buf = NULL;
+#endif
+	} else if (!cap->nr_workers) {
+		ret = write_chunk(cap, chunk, b->pages);
+	} else {
+		b->next = NULL;
+		*cap->queue_tail = b;
+		cap->queue_tail = &b->next;
+		cc->buf = NULL;
+		pthread_cond_signal(&cap->work_cond);
+	}
+	pthread_mutex_unlock(&cap->lock);
+	return ret;
+}
+
+int bg_capture_add_page(struct bg_capture *cap, int cpu, const void *page,
+			int size)
+{
+	struct cap_cpu *cc;
+	unsigned char *dst;
+
+	if (cpu < 0 || cpu >= cap->nr_cpus || size > cap->page_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cc = &cap->cpus[cpu];
+	if (!cc->buf && !(cc->buf = get_buf(cap)))
+		return -1;
+
+	dst = cc->buf->pages + (size_t)cc->nr_pages * cap->page_size;
+	memcpy(dst, page, size);
+	if (size < cap->page_size)
+		memset(dst + size, 0, cap->page_size - size);
+
+	if (!cc->nr_pages)
+		cc->first_ts = kbuffer_subbuf_timestamp(cap->kbuf, dst);
+
+	if (++cc->nr_pages == BG_CAP_CHUNK_PAGES && flush_cpu(cap, cpu) < 0) {
+		cap->failed = true;
+		return -1;
+	}
+	return 0;
+}
+
+static void add_system(struct bg_formats *f, const char *system)
+{
+	int id;
+
+	for (id = 0; id < f->nr_ids; id++) {
+		if (f->ids[id].name && !strcmp(f->ids[id].system, system))
+			bg_formats_load_text(f, id);
+	}
+}
+
+int bg_capture_add_formats(struct bg_capture *cap, struct bg_formats *f,
+			   struct tracefs_instance *instance)
+{
+	char *list, *line, *sep, *save = NULL;
+	int id;
+
+	cap->formats = f;
+
+	/* Fills the id map, so system-wide lookups below see everything */
+	bg_formats_find_id(f, "ftrace", "print");
+	add_system(f, "ftrace");
+
+	/* One "system:event" per line */
+	list = tracefs_instance_file_read(instance, "set_event", NULL);
+	if (!list)
+		return 0;
+
+	for (line = strtok_r(list, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		sep = strchr(line, ':');
+		if (!sep)
+			continue;
+		*sep = '\0';
+		id = bg_formats_find_id(f, line, sep + 1);
+		if (id >= 0)
+			bg_formats_load_text(f, id);
+	}
+
+	free(list);
+	return 0;
+}
+
+int bg_capture_freeze_formats(struct bg_capture *cap)
+{
+	if (!cap->formats)
+		return 0;
+	if (bg_formats_dump(cap->formats, &cap->formats_buf,
+			    &cap->formats_len) < 0)
+		return -1;
+	cap->formats = NULL;
+	return 0;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	const struct bg_cap_index_entry *ea = a, *eb = b;
+
+	if (ea->first_ts != eb->first_ts)
+		return ea->first_ts < eb->first_ts ? -1 : 1;
+	return ea->cpu < eb->cpu ? -1 : ea->cpu > eb->cpu;
+}
+
+int bg_capture_close(struct bg_capture *cap)
+{
+	struct bg_cap_trailer trailer = { .magic = BG_CAP_TRAILER_MAGIC };
+	char *formats = cap->formats_buf;
+	size_t formats_len = cap->formats_len;
+	struct cap_buf *b;
+	int cpu, i, ret = cap->failed ? -1 : 0;
+
+	for (cpu = 0; cpu < cap->nr_cpus && !ret; cpu++)
+		ret = flush_cpu(cap, cpu);
+
+	/* Workers drain the queue before they exit */
+	pthread_mutex_lock(&cap->lock);
+	cap->stopping = true;
+	pthread_cond_broadcast(&cap->work_cond);
+	pthread_mutex_unlock(&cap->lock);
+	for (i = 0; i < cap->nr_workers; i++)
+		pthread_join(cap->workers[i], NULL);
+#ifdef BG_HAVE_URING
+	if (cap->uring) {
+		pthread_mutex_lock(&cap->lock);
+		/* Writes left queued by a failed submit */
+		io_uring_submit(&cap->ring);
+		while (cap->inflight)
+			reap(cap, true);
+		pthread_mutex_unlock(&cap->lock);
+		/* Ring writes go to explicit offsets, not the file position */
+		if (lseek(cap->fd, cap->offset, SEEK_SET) < 0)
+			ret = -1;
+		io_uring_queue_exit(&cap->ring);
+	}
+#endif
+	if (cap->failed)
+		ret = -1;
+
+	if (!ret && cap->formats)
+		ret = bg_formats_dump(cap->formats, &formats, &formats_len);
+
+	if (!ret) {
+		trailer.formats_offset = cap->offset;
+		trailer.formats_size = formats_len;
+		trailer.index_offset = cap->offset + formats_len;
+		trailer.nr_entries = cap->nr_index;
+
+		qsort(cap->index, cap->nr_index, sizeof(*cap->index), cmp_entry);
+
+		if ((formats_len &&
+		     bg_write_all(cap->fd, formats, formats_len) < 0) ||
+		    bg_write_all(cap->fd, cap->index,
+				 cap->nr_index * sizeof(*cap->index)) < 0 ||
+		    bg_write_all(cap->fd, &trailer, sizeof(trailer)) < 0)
+			ret = -1;
+	}
+
+	if (close(cap->fd) < 0)
+		ret = -1;
+
+	if (cap->buf_mem) {
+		munmap(cap->buf_mem, cap->buf_mem_size);
+	} else {
+		for (cpu = 0; cpu < cap->nr_cpus; cpu++)
+			free(cap->cpus[cpu].buf);
+		while ((b = cap->free_bufs)) {
+			cap->free_bufs = b->next;
+			free(b);
+		}
+	}
+	pthread_mutex_destroy(&cap->lock);
+	pthread_cond_destroy(&cap->work_cond);
+	pthread_cond_destroy(&cap->free_cond);
+	free(cap->workers);
+	free(cap->cpus);
+	free(cap->index);
+	free(formats);
+	kbuffer_free(cap->kbuf);
+	free(cap);
+	return ret;
+}
+
+static int read_at(int fd, void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (!n)
+				errno = EIO;
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+struct bg_capture_file *bg_capture_open(const char *path)
+{
+	struct bg_capture_file *cf;
+	struct stat st;
+	size_t i;
+
+	cf = calloc(1, sizeof(*cf));
+	if (!cf)
+		return NULL;
+
+	cf->fd = open(path, O_RDONLY);
+	if (cf->fd < 0 || fstat(cf->fd, &st) < 0)
+		goto fail;
+	cf->size = st.st_size;
+
+	if (cf->size < sizeof(cf->hdr) + sizeof(cf->trailer) ||
+	    read_at(cf->fd, &cf->hdr, sizeof(cf->hdr), 0) < 0 ||
+	    read_at(cf->fd, &cf->trailer, sizeof(cf->trailer),
+		    cf->size - sizeof(cf->trailer)) < 0)
+		goto bad;
+
+	if (memcmp(cf->hdr.magic, BG_CAP_MAGIC, sizeof(cf->hdr.magic)) ||
+	    memcmp(cf->trailer.magic, BG_CAP_TRAILER_MAGIC,
+		   sizeof(cf->trailer.magic)) ||
+	    cf->hdr.version != BG_CAP_VERSION)
+		goto bad;
+
+	/* The container itself is written in host order */
+	if (!!(cf->hdr.flags & BG_CAP_F_BIG_ENDIAN) != HOST_BIG_ENDIAN) {
+		errno = EPROTONOSUPPORT;
+		goto fail;
+	}
+
+	if (cf->trailer.index_offset + cf->trailer.nr_entries *
+	    sizeof(*cf->index) > cf->size ||
+	    cf->trailer.formats_offset + cf->trailer.formats_size > cf->size)
+		goto bad;
+
+	cf->nr_index = cf->trailer.nr_entries;
+	cf->index = malloc(cf->nr_index * sizeof(*cf->index) + 1);
+	cf->max_last_ts = malloc(cf->nr_index * sizeof(*cf->max_last_ts) + 1);
+	cf->formats = malloc(cf->trailer.formats_size + 1);
+	if (!cf->index || !cf->max_last_ts || !cf->formats)
+		goto fail;
+
+	if (read_at(cf->fd, cf->index, cf->nr_index * sizeof(*cf->index),
+		    cf->trailer.index_offset) < 0 ||
+	    read_at(cf->fd, cf->formats, cf->trailer.formats_size,
+		    cf->trailer.formats_offset) < 0)
+		goto fail;
+
+	/*
+	 * Chunks are handed to decoders straight from the page cache; readers
+	 * fall back to pread() where the file cannot be mapped.
+	 */
+	cf->map = mmap(NULL, cf->size, PROT_READ, MAP_SHARED, cf->fd, 0);
+	if (cf->map == MAP_FAILED)
+		cf->map = NULL;
+
+	for (i = 0; i < cf->nr_index; i++) {
+		if (cf->index[i].offset + sizeof(struct bg_cap_chunk) +
+		    cf->index[i].size > cf->size)
+			goto bad;
+		cf->max_last_ts[i] = cf->index[i].last_ts;
+		if (i && cf->max_last_ts[i - 1] > cf->max_last_ts[i])
+			cf->max_last_ts[i] = cf->max_last_ts[i - 1];
+	}
+
+	return cf;
+ bad:
+	errno = EINVAL;
+ fail:
+	bg_capture_file_close(cf);
+	return NULL;
+}
+
+void bg_capture_file_close(struct bg_capture_file *cf)
+{
+	if (!cf)
+		return;
+	if (cf->map)
+		munmap(cf->map, cf->size);
+	if (cf->fd >= 0)
+		close(cf->fd);
+	free(cf->index);
+	free(cf->max_last_ts);
+	free(cf->formats);
+	free(cf);
+}
+
+/*
+ * The index is sorted by first_ts, and max_last_ts is non-decreasing, so
+ * the first entry whose running max of last_ts reaches @start bounds
+ * every chunk that can overlap a window starting there.
+ */
+size_t bg_capture_find(struct bg_capture_file *cf, uint64_t start)
+{
+	size_t lo = 0, hi = cf->nr_index, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cf->max_last_ts[mid] < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int bg_capture_read_chunk(struct bg_capture_file *cf,
+			  const struct bg_cap_index_entry *e, void *buf)
+{
+	uint64_t off = e->offset + sizeof(struct bg_cap_chunk);
+	const void *src;
+	void *tmp = NULL;
+	int ret;
+
+	if (e->codec == BG_CAP_CODEC_NONE) {
+		if (e->size != e->raw_size) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (cf->map) {
+			memcpy(buf, (char *)cf->map + off, e->size);
+			return 0;
+		}
+		return read_at(cf->fd, buf, e->size, off);
+	}
+
+	/* Every chunk is a frame of its own, so it decompresses alone */
+	if (cf->map) {
+		src = (char *)cf->map + off;
+	} else {
+		tmp = malloc(e->size);
+		if (!tmp || read_at(cf->fd, tmp, e->size, off) < 0) {
+			free(tmp);
+			return -1;
+		}
+		src = tmp;
+	}
+	ret = codec_decompress(e->codec, buf, e->raw_size, src, e->size);
+	free(tmp);
+	return ret;
+}
+
+struct bg_formats *bg_capture_formats(struct bg_capture_file *cf)
+{
+	struct bg_formats *f;
+
+	f = bg_formats_open_buf(cf->formats, cf->trailer.formats_size);
+	if (!f)
+		return NULL;
+
+	tep_set_file_bigendian(f->tep, !!(cf->hdr.flags & BG_CAP_F_BIG_ENDIAN));
+	tep_set_long_size(f->tep, cf->hdr.long_size);
+	tep_set_page_size(f->tep, cf->hdr.page_size);
+	return f;
+}
@@ -0,0 +1,196 @@
+#ifndef BG_CAPTURE_H
+#define BG_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct bg_formats;
+struct tracefs_instance;
+
+/*
+ * Capture file layout, all fields in the byte order of the recording host:
+ *
+ *	struct bg_cap_header
+ *	chunk*		struct bg_cap_chunk + nr_pages raw sub-buffers of one CPU
+ *	formats		bg_formats_dump() of every event the capture may hold
+ *	index		struct bg_cap_index_entry[], sorted by first_ts
+ *	struct bg_cap_trailer
+ *
+ * The trailer sits at a fixed distance from the end of the file, so a
+ * reader finds the index with one seek and can go straight to the chunks
+ * overlapping a time window.
+ */
+#define BG_CAP_MAGIC		"BGCAPTR"
+#define BG_CAP_TRAILER_MAGIC	"BGCAPIDX"
+#define BG_CAP_CHUNK_MAGIC	0x4b4e4843	/* "CHNK" */
+#define BG_CAP_VERSION		1
+#define BG_CAP_CHUNK_PAGES	64
+
+#define BG_CAP_F_BIG_ENDIAN	(1 << 0)
+
+enum bg_cap_codec {
+	BG_CAP_CODEC_NONE	= 0,
+	BG_CAP_CODEC_ZSTD	= 1,	/* with BG_HAVE_ZSTD */
+	BG_CAP_CODEC_LZ4	= 2,	/* with BG_HAVE_LZ4 */
+};
+
+struct bg_cap_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		flags;
+	uint32_t		page_size;
+	uint32_t		long_size;
+	uint32_t		nr_cpus;
+	uint32_t		reserved;
+};
+
+struct bg_cap_chunk {
+	uint32_t		magic;
+	uint32_t		cpu;
+	uint32_t		nr_pages;
+	uint32_t		codec;
+	uint64_t		size;		/* stored bytes that follow */
+	uint64_t		raw_size;	/* nr_pages * page_size */
+	uint64_t		first_ts;
+	uint64_t		last_ts;
+};
+
+struct bg_cap_index_entry {
+	uint32_t		cpu;
+	uint32_t		nr_pages;
+	uint32_t		codec;
+	uint32_t		reserved;
+	uint64_t		first_ts;
+	uint64_t		last_ts;
+	uint64_t		offset;		/* of the struct bg_cap_chunk */
+	uint64_t		size;
+	uint64_t		raw_size;
+};
+
+struct bg_cap_trailer {
+	uint64_t		formats_offset;
+	uint64_t		formats_size;
+	uint64_t		index_offset;
+	uint64_t		nr_entries;
+	char			magic[8];
+};
+
+struct bg_capture;
+
+/* Start a capture of CPUs 0..@nr_cpus-1 with @page_size sub-buffers. */
+struct bg_capture *bg_capture_create(const char *path, int nr_cpus,
+				     int page_size);
+
+/* The same on an open, empty file; @fd is the capture's from now on. */
+struct bg_capture *bg_capture_create_fd(int fd, int nr_cpus, int page_size);
+
+/*
+ * Compress every chunk with @codec on @nr_workers threads. Each chunk is
+ * a frame of its own, so the index still leads straight to any of them;
+ * chunks that do not shrink are stored as they are. Call before the
+ * first page. Fails with EPROTONOSUPPORT for codecs not built in.
+ */
+int bg_capture_set_codec(struct bg_capture *cap, enum bg_cap_codec codec,
+			 int level, int nr_workers);
+
+/* Chunk writes in flight on the ring beyond one buffer per CPU */
+#define BG_CAP_URING_DEPTH	16
+
+/*
+ * Write chunks through io_uring (with BG_HAVE_URING). The chunk buffers are
+ * allocated once and registered with the ring; a full chunk is queued as a
+ * fixed-buffer write at its final offset and its buffer recycled when the
+ * write completes, so bg_capture_add_page() returns without waiting for
+ * the disk unless all @depth (0: BG_CAP_URING_DEPTH) writes are still in
+ * flight. Call before the first page. Fails with EBUSY once compression
+ * is on (its workers already write off the caller's thread) and with
+ * EPROTONOSUPPORT when not built in.
+ */
+int bg_capture_set_uring(struct bg_capture *cap, int depth);
+
+/*
+ * fdatasync() the file after every @bytes of chunks (0: never). With
+ * io_uring the sync is queued behind the writes instead of waited for.
+ */
+int bg_capture_set_sync(struct bg_capture *cap, uint64_t bytes);
+
+/* "zstd[:level]", "lz4" or "none" */
+int bg_capture_parse_codec(const char *spec, enum bg_cap_codec *codec,
+			   int *level);
+
+/*
+ * Queue one sub-buffer of @cpu. Pages are written out in chunks of
+ * BG_CAP_CHUNK_PAGES per CPU, each chunk indexed by its time range.
+ */
+int bg_capture_add_page(struct bg_capture *cap, int cpu, const void *page,
+			int size);
+
+/*
+ * Make sure the formats of every event enabled on @instance (and of the
+ * ftrace system's own events) end up embedded in the capture.
+ */
+int bg_capture_add_formats(struct bg_capture *cap, struct bg_formats *f,
+			   struct tracefs_instance *instance);
+
+/*
+ * Serialize the formats now, so that bg_capture_close() no longer touches
+ * the bg_formats and can run on another thread.
+ */
+int bg_capture_freeze_formats(struct bg_capture *cap);
+
+/* Flush all chunks, write formats, index and trailer, and free @cap. */
+int bg_capture_close(struct bg_capture *cap);
+
+/* Offline side */
+struct bg_capture_file {
+	int				fd;
+	uint64_t			size;
+	void				*map;		/* whole file, or NULL */
+	struct bg_cap_header		hdr;
+	struct bg_cap_trailer		trailer;
+	struct bg_cap_index_entry	*index;
+	uint64_t			*max_last_ts;	/* prefix max over index */
+	size_t				nr_index;
+	char				*formats;
+};
+
+struct bg_capture_file *bg_capture_open(const char *path);
+void bg_capture_file_close(struct bg_capture_file *cf);
+
+/*
+ * Index of the first chunk that may overlap [@start, @end]. Chunks
+ * overlapping the window are among the following entries up to the
+ * first whose first_ts is past @end; check each with bg_capture_overlaps().
+ */
+size_t bg_capture_find(struct bg_capture_file *cf, uint64_t start);
+
+static inline int bg_capture_overlaps(const struct bg_cap_index_entry *e,
+				      uint64_t start, uint64_t end)
+{
+	return e->first_ts <= end && e->last_ts >= start;
+}
+
+/*
+ * The pages of an uncompressed chunk in place in the mapping, or NULL if
+ * they have to be read with bg_capture_read_chunk().
+ */
+static inline const void *
+bg_capture_chunk_pages(const struct bg_capture_file *cf,
+		       const struct bg_cap_index_entry *e)
+{
+	if (!cf->map || e->codec != BG_CAP_CODEC_NONE)
+		return NULL;
+	return (const char *)cf->map + e->offset + sizeof(struct bg_cap_chunk);
+}
+
+/*
+ * Read the pages of @e into @buf, which holds e->raw_size bytes,
+ * decompressing them if needed.
+ */
+int bg_capture_read_chunk(struct bg_capture_file *cf,
+			  const struct bg_cap_index_entry *e, void *buf);
+
+/* The embedded formats, with the capture's byte order and long size. */
+struct bg_formats *bg_capture_formats(struct bg_capture_file *cf);
+
+#endif /* BG_CAPTURE_H */
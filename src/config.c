@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "formats.h"
+#include "khist.h"
+#include "session.h"
+#include "util.h"
+
+static char *skip_space(char *p)
+{
+	while (isspace((unsigned char)*p))
+		p++;
+	return p;
+}
+
+static void trim(char *p)
+{
+	char *end = p + strlen(p);
+
+	while (end > p && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+}
+
+static int push(char ***list, int *nr, const char *str)
+{
+	char **l;
+
+	l = realloc(*list, (*nr + 1) * sizeof(*l));
+	if (!l)
+		return -1;
+	*list = l;
+	if (!str) {
+		l[(*nr)++] = NULL;
+		return 0;
+	}
+	l[*nr] = strdup(str);
+	if (!l[*nr])
+		return -1;
+	(*nr)++;
+	return 0;
+}
+
+/* "event system[:event] [filter]", "sample rule" or "hist spec" */
+static int parse_line(struct bg_config *c, char *line)
+{
+	char *word, *arg, *filter;
+	int nr;
+
+	word = skip_space(line);
+	trim(word);
+	if (!*word || *word == '#')
+		return 0;
+
+	arg = word + strcspn(word, " \t");
+	if (*arg)
+		*arg++ = '\0';
+	arg = skip_space(arg);
+	if (!*arg)
+		goto bad;
+
+	if (!strcmp(word, "event")) {
+		filter = arg + strcspn(arg, " \t");
+		if (*filter)
+			*filter++ = '\0';
+		filter = skip_space(filter);
+		/* filters[i] goes with events[i]: both or neither */
+		nr = c->nr_events;
+		if (push(&c->events, &c->nr_events, arg) < 0)
+			return -1;
+		if (push(&c->filters, &nr, *filter ? filter : NULL) < 0) {
+			free(c->events[--c->nr_events]);
+			return -1;
+		}
+		return 0;
+	}
+	if (!strcmp(word, "sample"))
+		return push(&c->samples, &c->nr_samples, arg);
+	if (!strcmp(word, "hist"))
+		return push(&c->hists, &c->nr_hists, arg);
+ bad:
+	errno = EINVAL;
+	return -1;
+}
+
+struct bg_config *bg_config_load(const char *path, int *line)
+{
+	struct bg_config *c;
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f;
+	int err = 0;
+
+	*line = 0;
+	f = fopen(path, "re");
+	if (!f)
+		return NULL;
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		fclose(f);
+		return NULL;
+	}
+
+	while (getline(&buf, &size, f) >= 0) {
+		++*line;
+		if (parse_line(c, buf) < 0) {
+			err = errno;
+			break;
+		}
+	}
+	if (!err && ferror(f))
+		err = EIO;
+	free(buf);
+	fclose(f);
+
+	if (err) {
+		bg_config_free(c);
+		errno = err;
+		return NULL;
+	}
+	*line = 0;
+	return c;
+}
+
+static void free_list(char **list, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		free(list[i]);
+	free(list);
+}
+
+void bg_config_free(struct bg_config *c)
+{
+	if (!c)
+		return;
+	free_list(c->events, c->nr_events);
+	free_list(c->filters, c->nr_events);
+	free_list(c->samples, c->nr_samples);
+	free_list(c->hists, c->nr_hists);
+	free(c);
+}
+
+void bg_config_state_init(struct bg_config_state *st, struct bg_session *s,
+			  struct bg_formats *f)
+{
+	memset(st, 0, sizeof(*st));
+	st->session = s;
+	st->formats = f;
+}
+
+struct files {
+	struct bg_config_file	*f;
+	int			nr;
+};
+
+static struct bg_config_file *find_file(const struct files *fs,
+					const char *system, const char *event)
+{
+	int i;
+
+	for (i = 0; i < fs->nr; i++) {
+		if (!strcmp(fs->f[i].system, system) &&
+		    !strcmp(fs->f[i].event, event))
+			return &fs->f[i];
+	}
+	return NULL;
+}
+
+/* A later directive for the same event overrides an earlier one */
+static int add_file(struct files *fs, const char *system, const char *event,
+		    const char *filter, bool from_system)
+{
+	struct bg_config_file *file;
+
+	file = find_file(fs, system, event);
+	if (!file) {
+		file = realloc(fs->f, (fs->nr + 1) * sizeof(*file));
+		if (!file)
+			return -1;
+		fs->f = file;
+		file = &fs->f[fs->nr];
+		file->system = strdup(system);
+		file->event = strdup(event);
+		if (!file->system || !file->event) {
+			free(file->system);
+			free(file->event);
+			return -1;
+		}
+		fs->nr++;
+	}
+	file->filter = filter;
+	file->from_system = from_system;
+	return 0;
+}
+
+static void free_files(struct bg_config_file *f, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		free(f[i].system);
+		free(f[i].event);
+	}
+	free(f);
+}
+
+/* Every event file @spec names, or ENOENT */
+static int expand(struct bg_config_state *st, struct files *fs,
+		  const char *spec, const char *filter)
+{
+	char *system, *event, *dir, **events = NULL;
+	int i, ret = -1;
+
+	system = strdup(spec);
+	if (!system)
+		return -1;
+	event = strchr(system, ':');
+	if (event) {
+		*event++ = '\0';
+		if (tracefs_event_file_exists(st->session->instance, system,
+					      event, "enable"))
+			ret = add_file(fs, system, event, filter, false);
+		else
+			errno = ENOENT;
+		free(system);
+		return ret;
+	}
+
+	/* The session's own events directory, not the top level's */
+	dir = tracefs_instance_get_dir(st->session->instance);
+	if (!dir)
+		goto out;
+	events = tracefs_system_events(dir, system);
+	tracefs_put_tracing_file(dir);
+	if (!events || !events[0]) {
+		errno = ENOENT;
+		goto out;
+	}
+	for (i = 0; events[i]; i++) {
+		if (add_file(fs, system, events[i], filter, true) < 0)
+			goto out;
+	}
+	ret = 0;
+ out:
+	tracefs_list_free(events);
+	free(system);
+	return ret;
+}
+
+/* The first line of an event's enable or filter file; "none" reads as "" */
+static char *read_event_file(struct bg_config_state *st,
+			     const struct bg_config_file *file,
+			     const char *name)
+{
+	char path[256], *buf;
+
+	snprintf(path, sizeof(path), "events/%s/%s/%s", file->system,
+		 file->event, name);
+	buf = tracefs_instance_file_read(st->session->instance, path, NULL);
+	if (!buf)
+		return NULL;
+	buf[strcspn(buf, "\n")] = '\0';
+	if (!strcmp(buf, "none"))
+		buf[0] = '\0';
+	return buf;
+}
+
+static int write_event_file(struct bg_config_state *st,
+			    const struct bg_config_file *file,
+			    const char *name, const char *str)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "events/%s/%s/%s", file->system,
+		 file->event, name);
+	return tracefs_instance_file_write(st->session->instance, path,
+					   str) < 0 ? -1 : 0;
+}
+
+/*
+ * Bring one event's filter and enable files to what is asked, writing
+ * only what differs. Filters go in before the event is enabled and come
+ * out after it is disabled, so no unfiltered record slips through.
+ */
+static void apply_file(struct bg_config_state *st,
+		       const struct bg_config_file *file, bool on,
+		       struct bg_config_diff *diff)
+{
+	const char *want = on && file->filter ? file->filter : "";
+	char *enable, *filter;
+	bool was_on, changed = false;
+
+	enable = read_event_file(st, file, "enable");
+	filter = read_event_file(st, file, "filter");
+	if (!enable || !filter) {
+		bg_warn("cannot read %s:%s: %s", file->system, file->event,
+			strerror(errno));
+		diff->failed++;
+		goto out;
+	}
+	was_on = enable[0] == '1';
+
+	if (!on && was_on) {
+		if (write_event_file(st, file, "enable", "0") < 0)
+			goto fail;
+		diff->disabled++;
+		changed = true;
+	}
+
+	if (strcmp(filter, want)) {
+		if (!write_event_file(st, file, "filter", *want ? want : "0")) {
+			diff->filtered++;
+			changed = true;
+		} else if (file->from_system && errno == EINVAL) {
+			/* As the system filter file would: no such fields here */
+			diff->skipped++;
+		} else {
+			/* Not enabled either, rather than enabled unfiltered */
+			bg_warn("cannot filter %s:%s with '%s': %s",
+				file->system, file->event, want,
+				strerror(errno));
+			diff->failed++;
+			goto out;
+		}
+	}
+
+	if (on && !was_on) {
+		if (write_event_file(st, file, "enable", "1") < 0)
+			goto fail;
+		diff->enabled++;
+		changed = true;
+	}
+
+	if (!changed)
+		diff->unchanged++;
+	goto out;
+ fail:
+	bg_warn("cannot %s %s:%s: %s", on ? "enable" : "disable",
+		file->system, file->event, strerror(errno));
+	diff->failed++;
+ out:
+	free(enable);
+	free(filter);
+}
+
+static struct bg_config_hist *find_hist(struct bg_config_hist *list,
+					const char *spec,
+					struct bg_config_hist **taken, int nr)
+{
+	int i;
+
+	for (; list; list = list->next) {
+		if (strcmp(list->spec, spec))
+			continue;
+		for (i = 0; i < nr && taken[i] != list; i++)
+			;
+		if (i == nr)
+			return list;
+	}
+	return NULL;
+}
+
+static void remove_hist(struct bg_config_state *st, struct bg_config_hist *h)
+{
+	char *table;
+
+	if (st->hist_out && h->kh->started &&
+	    (table = bg_khist_read(h->kh))) {
+		fprintf(st->hist_out, "hist %s:\n%s\n", h->spec, table);
+		free(table);
+	}
+	bg_khist_destroy(h->kh);
+	free(h->spec);
+	free(h);
+}
+
+static bool is_old(const struct bg_config_hist *h,
+		   const struct bg_config_hist *list)
+{
+	for (; list; list = list->next) {
+		if (list == h)
+			return true;
+	}
+	return false;
+}
+
+int bg_config_apply(struct bg_config_state *st, struct bg_config *c,
+		    struct bg_config_diff *diff)
+{
+	struct bg_sample_rules rules = { 0 }, prev;
+	struct bg_config_hist **hists = NULL, *h, *next, **tail;
+	struct files fs = { NULL, 0 }, old = { st->files, st->nr_files };
+	int i, nr_hists = 0, ret = -1;
+
+	memset(diff, 0, sizeof(*diff));
+
+	/* Everything that can be refused is checked before anything changes */
+	for (i = 0; i < c->nr_samples; i++) {
+		if (bg_sample_rules_parse(&rules, st->formats, c->samples[i]) < 0) {
+			bg_warn("bad sampling rule '%s': %s", c->samples[i],
+				strerror(errno));
+			goto fail;
+		}
+	}
+	for (i = 0; i < c->nr_events; i++) {
+		if (expand(st, &fs, c->events[i], c->filters[i]) < 0) {
+			bg_warn("cannot find event '%s'", c->events[i]);
+			goto fail;
+		}
+	}
+	hists = calloc(c->nr_hists ? c->nr_hists : 1, sizeof(*hists));
+	if (!hists)
+		goto fail;
+	for (; nr_hists < c->nr_hists; nr_hists++) {
+		h = find_hist(st->hists, c->hists[nr_hists], hists, nr_hists);
+		if (!h && (h = calloc(1, sizeof(*h)))) {
+			h->spec = strdup(c->hists[nr_hists]);
+			h->kh = bg_khist_parse(st->session->instance, st->formats,
+					       c->hists[nr_hists]);
+			if (!h->spec || !h->kh) {
+				bg_warn("bad histogram '%s'", c->hists[nr_hists]);
+				bg_khist_destroy(h->kh);
+				free(h->spec);
+				free(h);
+				h = NULL;
+			}
+		}
+		if (!h)
+			goto fail;
+		hists[nr_hists] = h;
+	}
+	/* The samplers keep a pointer to the rules, so they must live in @st */
+	prev = st->rules;
+	st->rules = rules;
+	for (i = 0; i < st->nr_samplers; i++) {
+		if (bg_sampler_set_rules(st->samplers[i], &st->rules) < 0)
+			goto fail_samplers;
+	}
+
+	/* Events the new config dropped go first, then the ones it wants */
+	for (i = 0; i < old.nr; i++) {
+		if (!find_file(&fs, old.f[i].system, old.f[i].event))
+			apply_file(st, &old.f[i], false, diff);
+	}
+	for (i = 0; i < fs.nr; i++)
+		apply_file(st, &fs.f[i], true, diff);
+
+	for (h = st->hists; h; h = next) {
+		next = h->next;
+		for (i = 0; i < nr_hists && hists[i] != h; i++)
+			;
+		if (i == nr_hists) {
+			remove_hist(st, h);
+			diff->hists_removed++;
+		}
+	}
+	tail = &st->hists;
+	for (i = 0; i < nr_hists; i++) {
+		h = hists[i];
+		if (!h->kh->started) {
+			if (bg_khist_start(h->kh) < 0) {
+				bg_warn("cannot start histogram '%s': %s",
+					h->spec, strerror(errno));
+				remove_hist(st, h);
+				diff->failed++;
+				continue;
+			}
+			diff->hists_added++;
+		}
+		*tail = h;
+		tail = &h->next;
+	}
+	*tail = NULL;
+
+	bg_sample_rules_free(&prev);
+	free_files(st->files, st->nr_files);
+	st->files = fs.f;
+	st->nr_files = fs.nr;
+	bg_config_free(st->config);
+	st->config = c;
+	free(hists);
+	return 0;
+
+ fail_samplers:
+	rules = st->rules;
+	st->rules = prev;
+	while (i--)
+		bg_sampler_set_rules(st->samplers[i], &st->rules);
+ fail:
+	for (i = 0; i < nr_hists; i++) {
+		if (!is_old(hists[i], st->hists))
+			remove_hist(st, hists[i]);
+	}
+	free(hists);
+	free_files(fs.f, fs.nr);
+	bg_sample_rules_free(&rules);
+	return ret;
+}
+
+void bg_config_state_release(struct bg_config_state *st)
+{
+	struct bg_config_hist *h, *next;
+
+	for (h = st->hists; h; h = next) {
+		next = h->next;
+		remove_hist(st, h);
+	}
+	st->hists = NULL;
+	bg_sample_rules_free(&st->rules);
+	free_files(st->files, st->nr_files);
+	st->files = NULL;
+	st->nr_files = 0;
+	bg_config_free(st->config);
+	st->config = NULL;
+}
@@ -0,0 +1,103 @@
+#ifndef BG_CONFIG_H
+#define BG_CONFIG_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "sample.h"
+
+struct bg_formats;
+struct bg_khist;
+struct bg_session;
+
+/*
+ * What a collector traces, one directive per line:
+ *
+ *	event sched:sched_switch prev_state & 3
+ *	event irq
+ *	sample sched:sched_wakeup=1/10
+ *	hist kmem:kmalloc:bytes_req.log2
+ *
+ * "event" enables system[:event], filtered in the kernel by the rest of
+ * the line if there is one; "sample" takes a bg_sample_rules_parse() rule
+ * and "hist" a bg_khist_parse() spec. Blank lines and lines starting with
+ * '#' are ignored.
+ */
+struct bg_config {
+	char		**events;
+	char		**filters;	/* NULL: unfiltered */
+	int		nr_events;
+	char		**samples;
+	int		nr_samples;
+	char		**hists;
+	int		nr_hists;
+};
+
+/*
+ * Returns NULL with errno EINVAL, and *line set to the offending line, for
+ * a directive that does not parse.
+ */
+struct bg_config *bg_config_load(const char *path, int *line);
+void bg_config_free(struct bg_config *c);
+
+/* One event file a config enabled */
+struct bg_config_file {
+	char		*system;
+	char		*event;
+	const char	*filter;	/* points into the applied config */
+	bool		from_system;	/* a whole-system directive named it */
+};
+
+struct bg_config_hist {
+	struct bg_config_hist	*next;
+	char			*spec;
+	struct bg_khist		*kh;
+};
+
+/*
+ * A config as applied to a live session. Applying another one only
+ * writes the enable and filter files whose contents differ from what it
+ * asks for, and only adds and removes the histograms that changed, so
+ * the instance, its buffers and the readers draining them carry on.
+ */
+struct bg_config_state {
+	struct bg_session	*session;
+	struct bg_formats	*formats;
+	struct bg_config	*config;	/* applied, owned */
+	struct bg_config_file	*files;
+	int			nr_files;
+	struct bg_sample_rules	rules;
+	struct bg_sampler	**samplers;	/* given the rules as they change */
+	int			nr_samplers;
+	struct bg_config_hist	*hists;
+	FILE			*hist_out;	/* tables of removed hists, or NULL */
+};
+
+struct bg_config_diff {
+	int	enabled;
+	int	disabled;
+	int	filtered;	/* filters set, changed or cleared */
+	int	unchanged;	/* files already as asked */
+	int	skipped;	/* system filters an event has no fields for */
+	int	hists_added;
+	int	hists_removed;
+	int	failed;
+};
+
+void bg_config_state_init(struct bg_config_state *st, struct bg_session *s,
+			  struct bg_formats *f);
+
+/*
+ * Make @c the applied config; @st takes ownership of it. Sampling rules,
+ * event specs and histograms are all checked before anything is changed:
+ * on -1 the session is exactly as it was and @c is left to the caller.
+ * Files the kernel then refuses are counted in @diff->failed and the rest
+ * still applied.
+ */
+int bg_config_apply(struct bg_config_state *st, struct bg_config *c,
+		    struct bg_config_diff *diff);
+
+/* Write the remaining hist tables to @st->hist_out and remove them. */
+void bg_config_state_release(struct bg_config_state *st);
+
+#endif /* BG_CONFIG_H */
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/mempolicy.h>
+
+#include "cpu.h"
+
+#define CPU_DIR		"/sys/devices/system/cpu"
+#define CPU_ONLINE_FILE	CPU_DIR "/online"
+#define NODE_DIR	"/sys/devices/system/node"
+
+/* Nodes an mbind() mask covers */
+#define BG_MAX_NODES	1024
+
+int bg_cpulist_parse(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+
+	while (*p && !isspace(*p)) {
+		lo = strtol(p, &end, 10);
+		if (end == p || lo < 0)
+			goto fail;
+		hi = lo;
+		p = end;
+		if (*p == '-') {
+			hi = strtol(++p, &end, 10);
+			if (end == p || hi < lo)
+				goto fail;
+			p = end;
+		}
+		if (hi >= CPU_SETSIZE)
+			goto fail;
+		for (; lo <= hi; lo++)
+			CPU_SET(lo, set);
+		if (*p == ',')
+			p++;
+	}
+
+	return CPU_COUNT(set);
+ fail:
+	errno = EINVAL;
+	return -1;
+}
+
+static int read_cpulist(const char *path, cpu_set_t *set)
+{
+	char buf[4096];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	if (!fgets(buf, sizeof(buf), fp)) {
+		fclose(fp);
+		errno = EIO;
+		return -1;
+	}
+	fclose(fp);
+
+	return bg_cpulist_parse(buf, set);
+}
+
+int bg_online_cpus(cpu_set_t *set)
+{
+	return read_cpulist(CPU_ONLINE_FILE, set);
+}
+
+int bg_pin_self(int cpu)
+{
+	cpu_set_t set;
+	int ret;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+int bg_pin_self_set(const cpu_set_t *set)
+{
+	int ret;
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(*set), set);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+/* cpuN has a nodeM link to its node */
+int bg_cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent *d;
+	DIR *dir;
+	int node = 0;
+
+	snprintf(path, sizeof(path), CPU_DIR "/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, "node", 4) && isdigit(d->d_name[4])) {
+			node = atoi(d->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+int bg_cpu_siblings(int cpu, cpu_set_t *set)
+{
+	char path[96];
+
+	snprintf(path, sizeof(path),
+		 CPU_DIR "/cpu%d/topology/thread_siblings_list", cpu);
+	if (read_cpulist(path, set) > 0)
+		return CPU_COUNT(set);
+	CPU_ZERO(set);
+	CPU_SET(cpu, set);
+	return 1;
+}
+
+int bg_node_cpus(int node, cpu_set_t *set)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", node);
+	if (read_cpulist(path, set) >= 0)
+		return CPU_COUNT(set);
+	/* No NUMA: everything is node 0 */
+	if (!node)
+		return bg_online_cpus(set);
+	return -1;
+}
+
+int bg_isolated_cpus(cpu_set_t *set)
+{
+	cpu_set_t nohz;
+
+	if (read_cpulist(CPU_DIR "/isolated", set) < 0)
+		CPU_ZERO(set);
+	/* Reads "(null)" when nohz_full= was not given */
+	if (read_cpulist(CPU_DIR "/nohz_full", &nohz) > 0)
+		CPU_OR(set, set, &nohz);
+	return CPU_COUNT(set);
+}
+
+/* @set minus @avoid, within the online CPUs */
+static int usable(cpu_set_t *set, const cpu_set_t *avoid,
+		  const cpu_set_t *online)
+{
+	cpu_set_t tmp;
+
+	CPU_AND(set, set, online);
+	CPU_XOR(&tmp, set, avoid);
+	CPU_AND(set, set, &tmp);
+	return CPU_COUNT(set);
+}
+
+int bg_cpu_housekeeping(int cpu, const cpu_set_t *avoid, cpu_set_t *set)
+{
+	cpu_set_t online;
+
+	if (bg_online_cpus(&online) <= 0)
+		return -1;
+
+	CPU_ZERO(set);
+	CPU_SET(cpu, set);
+	if (usable(set, avoid, &online))
+		return 0;
+	/* Same core first: shares the caches the ring buffer pages sit in */
+	bg_cpu_siblings(cpu, set);
+	if (usable(set, avoid, &online))
+		return 0;
+	if (bg_node_cpus(bg_cpu_node(cpu), set) > 0 &&
+	    usable(set, avoid, &online))
+		return 0;
+	*set = online;
+	if (usable(set, avoid, &online))
+		return 0;
+	errno = ENOENT;
+	return -1;
+}
+
+int bg_avoid_cpus(const cpu_set_t *avoid)
+{
+	cpu_set_t online, set;
+
+	if (bg_online_cpus(&online) <= 0)
+		return -1;
+	set = online;
+	if (!usable(&set, avoid, &online)) {
+		errno = ENOENT;
+		return -1;
+	}
+	return bg_pin_self_set(&set);
+}
+
+int bg_mem_prefer_node(void *addr, size_t len, int node)
+{
+	unsigned long mask[BG_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+	const size_t bits = 8 * sizeof(unsigned long);
+
+	if (node < 0 || node >= BG_MAX_NODES) {
+		errno = EINVAL;
+		return -1;
+	}
+	mask[node / bits] |= 1UL << (node % bits);
+	/* The kernel reads one bit less than maxnode says */
+	return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+		       BG_MAX_NODES + 1, 0) < 0 ? -1 : 0;
+}
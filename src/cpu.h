@@ -0,0 +1,57 @@
+#ifndef BG_CPU_H
+#define BG_CPU_H
+
+#include <sched.h>
+#include <stddef.h>
+
+/*
+ * Parse a kernel cpu list ("0-3,8,10-11") into @set.
+ * Returns the number of CPUs in the list or -1 on a malformed list.
+ */
+int bg_cpulist_parse(const char *list, cpu_set_t *set);
+
+/* Fill @set with the CPUs listed in /sys/devices/system/cpu/online. */
+int bg_online_cpus(cpu_set_t *set);
+
+/* Pin the calling thread to @cpu. */
+int bg_pin_self(int cpu);
+
+/* Restrict the calling thread, and the threads it starts later, to @set. */
+int bg_pin_self_set(const cpu_set_t *set);
+
+/* NUMA node of @cpu, 0 on a kernel without NUMA */
+int bg_cpu_node(int cpu);
+
+/* The hardware threads sharing @cpu's core, @cpu included */
+int bg_cpu_siblings(int cpu, cpu_set_t *set);
+
+/* The CPUs of NUMA node @node */
+int bg_node_cpus(int node, cpu_set_t *set);
+
+/*
+ * CPUs kept for isolated workloads: the isolcpus= domain
+ * (/sys/devices/system/cpu/isolated) and nohz_full= CPUs. An empty set is
+ * not an error.
+ */
+int bg_isolated_cpus(cpu_set_t *set);
+
+/*
+ * Where to run a thread serving @cpu without landing on @avoid: @cpu
+ * itself, else an SMT sibling, else the node's other CPUs, else any online
+ * CPU outside @avoid. Returns -1 with ENOENT when every CPU is avoided.
+ */
+int bg_cpu_housekeeping(int cpu, const cpu_set_t *avoid, cpu_set_t *set);
+
+/*
+ * Keep the calling thread, and every thread it starts from now on, off
+ * @avoid. Returns -1 with ENOENT when every online CPU is in @avoid.
+ */
+int bg_avoid_cpus(const cpu_set_t *avoid);
+
+/*
+ * Prefer @node's memory for the pages of [addr, addr + len) not touched
+ * yet; mbind(MPOL_PREFERRED) without libnuma. Page aligned.
+ */
+int bg_mem_prefer_node(void *addr, size_t len, int node);
+
+#endif /* BG_CPU_H */
@@ -0,0 +1,595 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "agg.h"
+#include "export.h"
+#include "util.h"
+
+#define EXPORT_RETRY_NS		NSEC_PER_SEC
+#define EXPORT_SEND_TIMEOUT	1	/* seconds */
+#define EXPORT_CONNECT_MS	1000
+#define FRAME_HEADER		5	/* u32 length, type */
+#define VARINT_MAX		10
+
+static uint8_t *put_uv(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static uint8_t *put_str(uint8_t *p, const char *s)
+{
+	size_t len = strlen(s);
+
+	p = put_uv(p, len);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+static void put_u32le(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* Fill in the header of the frame starting at @frame and ending at @end */
+static size_t end_frame(uint8_t *frame, uint8_t *end, uint8_t type)
+{
+	put_u32le(frame, end - frame - 4);
+	frame[4] = type;
+	return end - frame;
+}
+
+static int build_hello(struct bg_export *x, const char *host,
+		       const char * const *counters,
+		       const struct bg_export_hist_def *hists)
+{
+	size_t size = FRAME_HEADER + 4 + 3 * VARINT_MAX + strlen(host);
+	unsigned int i;
+	uint8_t *p;
+
+	for (i = 0; i < x->nr_counters; i++)
+		size += VARINT_MAX + strlen(counters[i]);
+	for (i = 0; i < x->nr_hists; i++)
+		size += 3 * VARINT_MAX + strlen(hists[i].name) +
+			strlen(hists[i].unit);
+
+	x->hello = malloc(size);
+	if (!x->hello)
+		return -1;
+	p = x->hello + FRAME_HEADER;
+	put_u32le(p, BG_EXPORT_MAGIC);
+	p = put_uv(p + 4, BG_EXPORT_VERSION);
+	p = put_str(p, host);
+	p = put_uv(p, x->nr_counters);
+	for (i = 0; i < x->nr_counters; i++)
+		p = put_str(p, counters[i]);
+	p = put_uv(p, x->nr_hists);
+	for (i = 0; i < x->nr_hists; i++) {
+		p = put_str(p, hists[i].name);
+		p = put_uv(p, hists[i].div ? hists[i].div : 1);
+		p = put_str(p, hists[i].unit);
+	}
+	x->hello_len = end_frame(x->hello, p, BG_EXPORT_HELLO);
+	return 0;
+}
+
+struct bg_export *bg_export_open(const char *addr, const char *host,
+				 const char * const *counters,
+				 unsigned int nr_counters,
+				 const struct bg_export_hist_def *hists,
+				 unsigned int nr_hists)
+{
+	struct bg_export *x;
+
+	x = calloc(1, sizeof(*x));
+	if (!x)
+		return NULL;
+	x->fd = -1;
+	x->nr_counters = nr_counters;
+	x->nr_hists = nr_hists;
+	/* Worst case: every counter and every bucket changed */
+	x->buf_size = FRAME_HEADER + 4 * VARINT_MAX +
+		      nr_counters * 2 * VARINT_MAX +
+		      nr_hists * (3 + 2 * BG_LOGHIST_BUCKETS) * VARINT_MAX;
+
+	x->addr = strdup(addr);
+	x->prev_counters = calloc(nr_counters + 1, sizeof(uint64_t));
+	x->pending_counters = calloc(nr_counters + 1, sizeof(uint64_t));
+	x->prev_hists = calloc(nr_hists + 1, sizeof(struct bg_loghist));
+	x->pending_hists = calloc(nr_hists + 1, sizeof(struct bg_loghist));
+	x->buf = malloc(x->buf_size);
+	if (!x->addr || !x->prev_counters || !x->pending_counters ||
+	    !x->prev_hists || !x->pending_hists || !x->buf ||
+	    build_hello(x, host, counters, hists) < 0) {
+		bg_export_close(x);
+		return NULL;
+	}
+	return x;
+}
+
+void bg_export_close(struct bg_export *x)
+{
+	if (!x)
+		return;
+	if (x->fd >= 0)
+		close(x->fd);
+	free(x->addr);
+	free(x->hello);
+	free(x->prev_counters);
+	free(x->prev_hists);
+	free(x->pending_counters);
+	free(x->pending_hists);
+	free(x->buf);
+	free(x);
+}
+
+static int send_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int reconnect(struct bg_export *x)
+{
+	struct timeval tv = { .tv_sec = EXPORT_SEND_TIMEOUT };
+	uint64_t now = bg_now_ns();
+
+	if (now < x->next_connect)
+		return -1;
+	x->next_connect = now + EXPORT_RETRY_NS;
+
+	x->fd = bg_export_connect(x->addr);
+	if (x->fd < 0)
+		return -1;
+	/* A stuck aggregator must not stall the folding thread for long */
+	setsockopt(x->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (send_all(x->fd, x->hello, x->hello_len) < 0) {
+		close(x->fd);
+		x->fd = -1;
+		return -1;
+	}
+	x->connects++;
+	return 0;
+}
+
+static size_t build_delta(struct bg_export *x)
+{
+	const struct bg_loghist *h;
+	uint8_t *p = x->buf + FRAME_HEADER;
+	unsigned int i, b, last, nr;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	p = put_uv(p, (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec);
+	p = put_uv(p, x->seq);
+
+	for (i = nr = 0; i < x->nr_counters; i++)
+		nr += !!x->pending_counters[i];
+	p = put_uv(p, nr);
+	for (i = 0; i < x->nr_counters; i++) {
+		if (!x->pending_counters[i])
+			continue;
+		p = put_uv(p, i);
+		p = put_uv(p, x->pending_counters[i]);
+	}
+
+	for (i = nr = 0; i < x->nr_hists; i++)
+		nr += !!x->pending_hists[i].total;
+	p = put_uv(p, nr);
+	for (i = 0; i < x->nr_hists; i++) {
+		h = &x->pending_hists[i];
+		if (!h->total)
+			continue;
+		p = put_uv(p, i);
+		p = put_uv(p, h->sum);
+		for (b = nr = 0; b < BG_LOGHIST_BUCKETS; b++)
+			nr += !!h->count[b];
+		p = put_uv(p, nr);
+		/* Gaps between buckets mostly fit a byte, indexes would not */
+		for (b = last = 0; b < BG_LOGHIST_BUCKETS; b++) {
+			if (!h->count[b])
+				continue;
+			p = put_uv(p, b - last);
+			p = put_uv(p, h->count[b]);
+			last = b;
+		}
+	}
+	return end_frame(x->buf, p, BG_EXPORT_DELTA);
+}
+
+static int flush(struct bg_export *x)
+{
+	size_t len;
+
+	if (x->fd < 0 && reconnect(x) < 0)
+		return -1;
+
+	len = build_delta(x);
+	if (send_all(x->fd, x->buf, len) < 0) {
+		/* Half a frame may be out: start over on a new connection */
+		close(x->fd);
+		x->fd = -1;
+		return -1;
+	}
+	x->seq++;
+	x->sent_bytes += len;
+	memset(x->pending_counters, 0, x->nr_counters * sizeof(uint64_t));
+	memset(x->pending_hists, 0, x->nr_hists * sizeof(struct bg_loghist));
+	return 0;
+}
+
+int bg_export_update(struct bg_export *x, const uint64_t *counters,
+		     const struct bg_loghist *hists)
+{
+	struct bg_loghist *pend, *prev;
+	const struct bg_loghist *cur;
+	unsigned int i, b;
+
+	for (i = 0; i < x->nr_counters; i++) {
+		x->pending_counters[i] += counters[i] - x->prev_counters[i];
+		x->prev_counters[i] = counters[i];
+	}
+	for (i = 0; i < x->nr_hists; i++) {
+		cur = &hists[i];
+		prev = &x->prev_hists[i];
+		pend = &x->pending_hists[i];
+		for (b = 0; b < BG_LOGHIST_BUCKETS; b++)
+			pend->count[b] += cur->count[b] - prev->count[b];
+		pend->total += cur->total - prev->total;
+		pend->sum += cur->sum - prev->sum;
+		*prev = *cur;
+	}
+	return flush(x);
+}
+
+void bg_export_rebase(struct bg_export *x)
+{
+	memset(x->prev_hists, 0, x->nr_hists * sizeof(struct bg_loghist));
+}
+
+void bg_export_fold(const struct bg_agg_snapshot *snap, void *x)
+{
+	bg_export_update(x, snap->counters, snap->hists);
+}
+
+/* "unix:/path"; "host:port", "[v6addr]:port", ":port" or "*:port" */
+static int resolve(const char *addr, bool passive, struct addrinfo **res,
+		   struct sockaddr_un *un)
+{
+	struct addrinfo hints = {
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = passive ? AI_PASSIVE : AI_ADDRCONFIG,
+	};
+	char *host, *port;
+	int ret;
+
+	if (!strncmp(addr, "unix:", 5)) {
+		if (strlen(addr + 5) >= sizeof(un->sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(un, 0, sizeof(*un));
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, addr + 5);
+		*res = NULL;
+		return 0;
+	}
+
+	host = strdup(addr);
+	if (!host)
+		return -1;
+	port = strrchr(host, ':');
+	if (!port) {
+		free(host);
+		errno = EINVAL;
+		return -1;
+	}
+	*port++ = '\0';
+	if (*host == '[' && host[strlen(host) - 1] == ']') {
+		memmove(host, host + 1, strlen(host));
+		host[strlen(host) - 1] = '\0';
+	}
+	ret = getaddrinfo(*host && strcmp(host, "*") ? host : NULL, port,
+			  &hints, res);
+	free(host);
+	if (ret) {
+		errno = ret == EAI_SYSTEM ? errno : EHOSTUNREACH;
+		return -1;
+	}
+	return 0;
+}
+
+/* connect() that gives up after EXPORT_CONNECT_MS instead of the SYN retries */
+static int connect_timeout(int fd, const struct sockaddr *sa, socklen_t len)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	socklen_t errlen = sizeof(int);
+	int flags, err = 0, ret;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+	ret = connect(fd, sa, len);
+	if (ret < 0 && errno == EINPROGRESS) {
+		do
+			ret = poll(&pfd, 1, EXPORT_CONNECT_MS);
+		while (ret < 0 && errno == EINTR);
+		if (!ret)
+			err = ETIMEDOUT;
+		else if (ret < 0 ||
+			 getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+			err = errno;
+		ret = err ? -1 : 0;
+	}
+	if (ret < 0) {
+		if (err)
+			errno = err;
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags);
+}
+
+int bg_export_connect(const char *addr)
+{
+	struct sockaddr_un un;
+	struct addrinfo *res, *ai;
+	int fd = -1, one = 1;
+
+	if (resolve(addr, false, &res, &un) < 0)
+		return -1;
+	if (!res) {
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && connect_timeout(fd, (struct sockaddr *)&un,
+					       sizeof(un)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect_timeout(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	/* Deltas are small and late ones are useless */
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+int bg_export_listen(const char *addr)
+{
+	struct sockaddr_un un;
+	struct addrinfo *res, *ai;
+	int fd = -1, one = 1;
+
+	if (resolve(addr, true, &res, &un) < 0)
+		return -1;
+	if (!res) {
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    0);
+		if (fd < 0)
+			return -1;
+		/* A socket left behind by an aggregator that died */
+		unlink(un.sun_path);
+		if (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0 ||
+		    listen(fd, SOMAXCONN) < 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+			    SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, SOMAXCONN) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+struct cursor {
+	const uint8_t	*p;
+	const uint8_t	*end;
+	bool		bad;
+};
+
+static uint64_t get_uv(struct cursor *c)
+{
+	unsigned int shift = 0;
+	uint64_t v = 0;
+
+	while (c->p < c->end && shift < 64) {
+		v |= (uint64_t)(*c->p & 0x7f) << shift;
+		if (!(*c->p++ & 0x80))
+			return v;
+		shift += 7;
+	}
+	c->bad = true;
+	return 0;
+}
+
+static struct bg_export_str get_str(struct cursor *c)
+{
+	struct bg_export_str s = { NULL, 0 };
+	uint64_t len = get_uv(c);
+
+	if (c->bad || len > (uint64_t)(c->end - c->p)) {
+		c->bad = true;
+		return s;
+	}
+	s.s = (const char *)c->p;
+	s.len = len;
+	c->p += len;
+	return s;
+}
+
+/* Far more than anyone exports; bounds what a bad HELLO makes us allocate */
+#define EXPORT_MAX_METRICS	4096
+
+int bg_export_parse_hello(const uint8_t *p, size_t len,
+			  struct bg_export_hello *h)
+{
+	struct cursor c = { p + 4, p + len, len < 4 };
+	uint64_t n;
+	unsigned int i;
+
+	memset(h, 0, sizeof(*h));
+	if (c.bad || (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) !=
+	    BG_EXPORT_MAGIC || get_uv(&c) != BG_EXPORT_VERSION)
+		goto bad;
+	h->host = get_str(&c);
+
+	n = get_uv(&c);
+	if (c.bad || n > EXPORT_MAX_METRICS)
+		goto bad;
+	h->nr_counters = n;
+	h->counters = calloc(n + 1, sizeof(*h->counters));
+	if (!h->counters)
+		return -1;
+	for (i = 0; i < h->nr_counters; i++)
+		h->counters[i] = get_str(&c);
+
+	n = get_uv(&c);
+	if (c.bad || n > EXPORT_MAX_METRICS)
+		goto bad;
+	h->nr_hists = n;
+	h->hists = calloc(n + 1, sizeof(*h->hists));
+	h->divs = calloc(n + 1, sizeof(*h->divs));
+	h->units = calloc(n + 1, sizeof(*h->units));
+	if (!h->hists || !h->divs || !h->units) {
+		bg_export_hello_free(h);
+		return -1;
+	}
+	for (i = 0; i < h->nr_hists; i++) {
+		h->hists[i] = get_str(&c);
+		h->divs[i] = get_uv(&c);
+		h->units[i] = get_str(&c);
+		if (!h->divs[i])
+			h->divs[i] = 1;
+	}
+	if (c.bad)
+		goto bad;
+	return 0;
+ bad:
+	bg_export_hello_free(h);
+	errno = EPROTO;
+	return -1;
+}
+
+void bg_export_hello_free(struct bg_export_hello *h)
+{
+	free(h->counters);
+	free(h->hists);
+	free(h->divs);
+	free(h->units);
+	memset(h, 0, sizeof(*h));
+}
+
+/* One pass over a DELTA; with no @counters it only checks the frame */
+static int walk_delta(const uint8_t *p, size_t len,
+		      const struct bg_export_hello *h, uint64_t *time,
+		      uint64_t *counters, struct bg_loghist *hists)
+{
+	struct cursor c = { p, p + len, false };
+	struct bg_loghist *hist;
+	uint64_t nr, nb, idx, b, count, v;
+
+	*time = get_uv(&c);
+	get_uv(&c);			/* seq */
+
+	for (nr = get_uv(&c); nr && !c.bad; nr--) {
+		idx = get_uv(&c);
+		if (idx >= h->nr_counters)
+			goto bad;
+		v = get_uv(&c);
+		if (counters)
+			counters[idx] += v;
+	}
+
+	for (nr = get_uv(&c); nr && !c.bad; nr--) {
+		idx = get_uv(&c);
+		if (idx >= h->nr_hists)
+			goto bad;
+		hist = counters ? &hists[idx] : NULL;
+		v = get_uv(&c);
+		if (hist)
+			hist->sum += v;
+		for (nb = get_uv(&c), b = 0; nb && !c.bad; nb--) {
+			b += get_uv(&c);
+			count = get_uv(&c);
+			if (b >= BG_LOGHIST_BUCKETS)
+				goto bad;
+			if (!hist)
+				continue;
+			/* Only buckets travel: bound min and max by them */
+			if (!hist->total || bg_loghist_low(b) < hist->min)
+				hist->min = bg_loghist_low(b);
+			if (bg_loghist_low(b) > hist->max)
+				hist->max = bg_loghist_low(b);
+			hist->count[b] += count;
+			hist->total += count;
+		}
+	}
+	if (c.bad)
+		goto bad;
+	return 0;
+ bad:
+	errno = EPROTO;
+	return -1;
+}
+
+/* Checked whole first, so a bad frame adds nothing at all */
+int bg_export_parse_delta(const uint8_t *p, size_t len,
+			  const struct bg_export_hello *h, uint64_t *time,
+			  uint64_t *counters, struct bg_loghist *hists)
+{
+	if (walk_delta(p, len, h, time, NULL, NULL) < 0)
+		return -1;
+	return walk_delta(p, len, h, time, counters, hists);
+}
@@ -0,0 +1,126 @@
+#ifndef BG_EXPORT_H
+#define BG_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "loghist.h"
+
+struct bg_agg_snapshot;
+
+/*
+ * Wire format, all integers LEB128 varints unless noted. Every frame is
+ * a little-endian u32 length of what follows, a type byte and a payload:
+ *
+ *	HELLO	magic (u32 LE), version, host, nr_counters, names...,
+ *		nr_hists, { name, div, unit }...
+ *	DELTA	wall time ns, seq, nr, { counter, delta }...,
+ *		nr, { hist, sum, nr, { bucket - previous bucket, count }... }...
+ *
+ * Strings are a varint length and the bytes. A DELTA only carries what
+ * changed since the previous one, so an idle host sends a few bytes.
+ * HELLO is sent again on every reconnection.
+ */
+#define BG_EXPORT_MAGIC		0x31584742	/* "BGX1" */
+#define BG_EXPORT_VERSION	1
+#define BG_EXPORT_HELLO		1
+#define BG_EXPORT_DELTA		2
+#define BG_EXPORT_MAX_FRAME	(1 << 20)
+
+/* Default interval between deltas */
+#define BG_EXPORT_INTERVAL_MS	1000
+
+struct bg_export_hist_def {
+	const char	*name;
+	uint64_t	div;		/* values are printed divided by this */
+	const char	*unit;
+};
+
+/*
+ * The edge side: deltas of a fixed set of counters and histograms, sent
+ * over one persistent connection to an aggregator. A delta that cannot be
+ * sent stays pending and is folded into the next one, so a lost connection
+ * delays data but does not lose it.
+ */
+struct bg_export {
+	char				*addr;
+	int				fd;
+	uint64_t			next_connect;	/* bg_now_ns() */
+	uint64_t			seq;
+	unsigned int			nr_counters;
+	unsigned int			nr_hists;
+	uint8_t				*hello;
+	size_t				hello_len;
+	uint64_t			*prev_counters;	/* totals last seen */
+	struct bg_loghist		*prev_hists;
+	uint64_t			*pending_counters;
+	struct bg_loghist		*pending_hists;
+	uint8_t				*buf;
+	size_t				buf_size;
+	unsigned long long		sent_bytes;
+	unsigned long long		connects;
+};
+
+/*
+ * @addr is "unix:/path" or "host:port". Not connecting yet is not an
+ * error: the connection is (re)tried, at most once a second, as deltas
+ * are sent.
+ */
+struct bg_export *bg_export_open(const char *addr, const char *host,
+				 const char * const *counters,
+				 unsigned int nr_counters,
+				 const struct bg_export_hist_def *hists,
+				 unsigned int nr_hists);
+void bg_export_close(struct bg_export *x);
+
+/*
+ * Queue the change of the caller's running totals since the last update
+ * and try to send everything pending. Returns 0 once sent, -1 while it
+ * stays pending.
+ */
+int bg_export_update(struct bg_export *x, const uint64_t *counters,
+		     const struct bg_loghist *hists);
+
+/* The caller starts its totals over from zero (a histogram reset). */
+void bg_export_rebase(struct bg_export *x);
+
+/* A bg_agg_fold_fn: bg_export_update() with the fold's totals */
+void bg_export_fold(const struct bg_agg_snapshot *snap, void *x);
+
+/* Sockets for either end: "unix:/path" or "host:port" */
+int bg_export_connect(const char *addr);
+int bg_export_listen(const char *addr);
+
+/*
+ * The aggregator side. A HELLO as parsed; the strings point into the
+ * frame, which must outlive it.
+ */
+struct bg_export_str {
+	const char	*s;
+	size_t		len;
+};
+
+struct bg_export_hello {
+	struct bg_export_str	host;
+	unsigned int		nr_counters;
+	unsigned int		nr_hists;
+	struct bg_export_str	*counters;
+	struct bg_export_str	*hists;
+	uint64_t		*divs;
+	struct bg_export_str	*units;
+};
+
+/* Returns 0, or -1 with EPROTO for a malformed frame. */
+int bg_export_parse_hello(const uint8_t *p, size_t len,
+			  struct bg_export_hello *h);
+void bg_export_hello_free(struct bg_export_hello *h);
+
+/*
+ * Add a DELTA payload into @counters and @hists, sized by the sender's
+ * HELLO. Returns 0, or -1 with EPROTO and nothing added.
+ */
+int bg_export_parse_delta(const uint8_t *p, size_t len,
+			  const struct bg_export_hello *h, uint64_t *time,
+			  uint64_t *counters, struct bg_loghist *hists);
+
+#endif /* BG_EXPORT_H */
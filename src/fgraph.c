@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "accessors.h"
+#include "batch.h"
+#include "fgraph.h"
+
+#define FGRAPH_FUNCS	1024
+
+struct bg_fgraph *bg_fgraph_alloc(unsigned int nr_tasks)
+{
+	struct bg_fgraph *g;
+	unsigned int n = 16;
+
+	if (!nr_tasks)
+		nr_tasks = BG_FGRAPH_TASKS;
+	while (n < nr_tasks)
+		n <<= 1;
+
+	g = calloc(1, sizeof(*g));
+	if (!g)
+		return NULL;
+	g->tasks = calloc(n, sizeof(*g->tasks));
+	g->funcs = calloc(FGRAPH_FUNCS, sizeof(*g->funcs));
+	if (!g->tasks || !g->funcs) {
+		bg_fgraph_free(g);
+		return NULL;
+	}
+	g->task_mask = n - 1;
+	g->func_mask = FGRAPH_FUNCS - 1;
+	return g;
+}
+
+void bg_fgraph_free(struct bg_fgraph *g)
+{
+	if (!g)
+		return;
+	free(g->tasks);
+	free(g->funcs);
+	free(g);
+}
+
+void bg_fgraph_reset(struct bg_fgraph *g)
+{
+	memset(g->funcs, 0, (g->func_mask + 1) * sizeof(*g->funcs));
+	g->nr_funcs = 0;
+}
+
+static unsigned int task_home(const struct bg_fgraph *g, int32_t key)
+{
+	return ((uint32_t)key * 0x9e3779b1u) & g->task_mask;
+}
+
+static struct bg_fgraph_task *task_lookup(struct bg_fgraph *g, int32_t key)
+{
+	unsigned int i = task_home(g, key);
+
+	while (g->tasks[i].key) {
+		if (g->tasks[i].key == key)
+			return &g->tasks[i];
+		i = (i + 1) & g->task_mask;
+	}
+	return NULL;
+}
+
+/* Backward-shift delete, as in schedlat.c */
+static void task_remove(struct bg_fgraph *g, struct bg_fgraph_task *t)
+{
+	unsigned int hole = t - g->tasks, i = hole, h;
+
+	for (;;) {
+		i = (i + 1) & g->task_mask;
+		if (!g->tasks[i].key)
+			break;
+		h = task_home(g, g->tasks[i].key);
+		if (hole <= i ? hole < h && h <= i : hole < h || h <= i)
+			continue;
+		g->tasks[hole] = g->tasks[i];
+		hole = i;
+	}
+	g->tasks[hole].key = 0;
+	g->nr_tasks--;
+}
+
+static struct bg_fgraph_task *task_get(struct bg_fgraph *g, int32_t key)
+{
+	struct bg_fgraph_task *t;
+	unsigned int i;
+
+	t = task_lookup(g, key);
+	if (t)
+		return t;
+	/* Keep probes short; a full table drops the newcomer */
+	if (g->nr_tasks >= (g->task_mask + 1) / 4 * 3) {
+		g->dropped++;
+		return NULL;
+	}
+	for (i = task_home(g, key); g->tasks[i].key; i = (i + 1) & g->task_mask)
+		;
+	t = &g->tasks[i];
+	memset(t, 0, sizeof(*t));
+	t->key = key;
+	g->nr_tasks++;
+	return t;
+}
+
+static unsigned int func_home(uint64_t addr, unsigned int mask)
+{
+	return (unsigned int)((addr * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+}
+
+static int func_grow(struct bg_fgraph *g)
+{
+	unsigned int mask = g->func_mask * 2 + 1, i, j;
+	struct bg_fgraph_func *funcs;
+
+	funcs = calloc(mask + 1, sizeof(*funcs));
+	if (!funcs)
+		return -1;
+	for (i = 0; i <= g->func_mask; i++) {
+		if (!g->funcs[i].addr)
+			continue;
+		for (j = func_home(g->funcs[i].addr, mask); funcs[j].addr;
+		     j = (j + 1) & mask)
+			;
+		funcs[j] = g->funcs[i];
+	}
+	free(g->funcs);
+	g->funcs = funcs;
+	g->func_mask = mask;
+	return 0;
+}
+
+static struct bg_fgraph_func *func_get(struct bg_fgraph *g, uint64_t addr)
+{
+	struct bg_fgraph_func *f;
+	unsigned int i;
+
+	for (i = func_home(addr, g->func_mask); g->funcs[i].addr;
+	     i = (i + 1) & g->func_mask) {
+		if (g->funcs[i].addr == addr)
+			return &g->funcs[i];
+	}
+
+	/* Half full at most */
+	if (g->nr_funcs >= (g->func_mask + 1) / 2) {
+		if (func_grow(g) < 0)
+			return NULL;
+		for (i = func_home(addr, g->func_mask); g->funcs[i].addr;
+		     i = (i + 1) & g->func_mask)
+			;
+	}
+	f = &g->funcs[i];
+	f->addr = addr;
+	g->nr_funcs++;
+	return f;
+}
+
+static int32_t task_key(int pid, int cpu)
+{
+	return pid ? pid : -1 - cpu;
+}
+
+void bg_fgraph_entry(struct bg_fgraph *g, int pid, int cpu, uint64_t ts,
+		     unsigned int depth)
+{
+	struct bg_fgraph_task *t;
+
+	g->entries++;
+	t = task_get(g, task_key(pid, cpu));
+	if (!t || depth >= BG_FGRAPH_MAX_DEPTH)
+		return;
+	/* Also clears callee time left by an exit the tracer lost */
+	t->frames[depth].entry_ts = ts;
+	t->frames[depth].child = 0;
+}
+
+int bg_fgraph_exit(struct bg_fgraph *g, int pid, int cpu, uint64_t ts,
+		   unsigned int depth, uint64_t func, uint64_t calltime,
+		   uint64_t rettime)
+{
+	struct bg_fgraph_frame *frame = NULL;
+	struct bg_fgraph_task *t;
+	struct bg_fgraph_func *f;
+	uint64_t incl = 0, child = 0;
+
+	g->exits++;
+	t = task_lookup(g, task_key(pid, cpu));
+	if (t && depth < BG_FGRAPH_MAX_DEPTH)
+		frame = &t->frames[depth];
+
+	if (calltime && rettime >= calltime)
+		incl = rettime - calltime;
+	else if (frame && frame->entry_ts && ts >= frame->entry_ts)
+		incl = ts - frame->entry_ts;
+	else
+		g->unmatched++;
+
+	if (frame) {
+		child = frame->child;
+		frame->entry_ts = frame->child = 0;
+	}
+	if (t && depth && depth - 1 < BG_FGRAPH_MAX_DEPTH)
+		t->frames[depth - 1].child += incl;
+	if (t && !depth)
+		task_remove(g, t);
+
+	f = func_get(g, func);
+	if (!f)
+		return -1;
+	f->calls++;
+	f->incl += incl;
+	f->excl += incl > child ? incl - child : 0;
+	if (incl > f->max)
+		f->max = incl;
+	return 0;
+}
+
+int bg_fgraph_record(struct bg_fgraph *g, const struct bg_accessors *acc,
+		     int id, int cpu, const void *data, uint64_t ts)
+{
+	const struct bg_funcgraph_entry_acc *en = &acc->funcgraph_entry;
+	const struct bg_funcgraph_exit_acc *ex = &acc->funcgraph_exit;
+	int32_t pid;
+
+	if (id != en->id && id != ex->id)
+		return 0;
+	memcpy(&pid, (const char *)data + BG_COMMON_PID_OFFSET, sizeof(pid));
+
+	if (id == en->id) {
+		bg_fgraph_entry(g, pid, cpu, ts, bg_acc_u64(&en->depth, data));
+		return 1;
+	}
+	if (bg_fgraph_exit(g, pid, cpu, ts, bg_acc_u64(&ex->depth, data),
+			   bg_acc_u64(&ex->func, data),
+			   bg_acc_valid(&ex->calltime) ?
+			   bg_acc_u64(&ex->calltime, data) : 0,
+			   bg_acc_valid(&ex->rettime) ?
+			   bg_acc_u64(&ex->rettime, data) : 0) < 0)
+		return -1;
+	return 1;
+}
@@ -0,0 +1,80 @@
+#ifndef BG_FGRAPH_H
+#define BG_FGRAPH_H
+
+#include <stdint.h>
+
+struct bg_accessors;
+
+/* Default size of the table of tasks inside a traced call; a power of two */
+#define BG_FGRAPH_TASKS		4096
+
+/* Call depths followed per task; deeper calls count as leaves */
+#define BG_FGRAPH_MAX_DEPTH	32
+
+struct bg_fgraph_frame {
+	uint64_t	entry_ts;	/* 0: entry not seen */
+	uint64_t	child;		/* inclusive time of returned callees */
+};
+
+struct bg_fgraph_task {
+	int32_t			key;		/* pid, -1 - cpu for idle; 0: empty */
+	uint32_t		pad;
+	struct bg_fgraph_frame	frames[BG_FGRAPH_MAX_DEPTH];
+};
+
+struct bg_fgraph_func {
+	uint64_t		addr;		/* 0: empty */
+	unsigned long long	calls;
+	uint64_t		incl;		/* ns, callees included */
+	uint64_t		excl;		/* ns in the function itself */
+	uint64_t		max;		/* longest inclusive call */
+};
+
+/*
+ * Per-function inclusive and exclusive time from the function_graph
+ * tracer's entry and exit records, in one pass over a time-ordered
+ * stream. Each task inside a traced call keeps a stack of the time its
+ * returned callees took, so a function's own time is its duration less
+ * theirs; the task is forgotten when it returns from depth 0. Functions
+ * are keyed by address and only named when reported.
+ */
+struct bg_fgraph {
+	struct bg_fgraph_task	*tasks;
+	unsigned int		task_mask;
+	unsigned int		nr_tasks;
+	struct bg_fgraph_func	*funcs;
+	unsigned int		func_mask;
+	unsigned int		nr_funcs;
+	unsigned long long	entries;
+	unsigned long long	exits;
+	unsigned long long	unmatched;	/* exit without its entry */
+	unsigned long long	dropped;	/* no room for the task */
+};
+
+/* @nr_tasks is rounded up to a power of two; 0 for the default. */
+struct bg_fgraph *bg_fgraph_alloc(unsigned int nr_tasks);
+void bg_fgraph_free(struct bg_fgraph *g);
+
+/* @pid 0 (the idle tasks) is told apart by @cpu. */
+void bg_fgraph_entry(struct bg_fgraph *g, int pid, int cpu, uint64_t ts,
+		     unsigned int depth);
+
+/*
+ * @calltime and @rettime from the exit record when the kernel has them,
+ * else 0 and the duration comes from the entry's timestamp.
+ */
+int bg_fgraph_exit(struct bg_fgraph *g, int pid, int cpu, uint64_t ts,
+		   unsigned int depth, uint64_t func, uint64_t calltime,
+		   uint64_t rettime);
+
+/*
+ * Feed one record if it is a funcgraph_entry or funcgraph_exit resolved
+ * in @acc. Returns 1 if it was one of them, -1 when out of memory.
+ */
+int bg_fgraph_record(struct bg_fgraph *g, const struct bg_accessors *acc,
+		     int id, int cpu, const void *data, uint64_t ts);
+
+/* Start over the function table; calls in flight carry over. */
+void bg_fgraph_reset(struct bg_fgraph *g);
+
+#endif /* BG_FGRAPH_H */
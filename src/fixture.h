@@ -0,0 +1,112 @@
+#ifndef BG_FIXTURE_H
+#define BG_FIXTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "merge.h"
+
+/*
+ * Fixtures shared by bench/bench.c and tests/replay.c: synthetic ring
+ * buffer sub-buffers, and merge streams over pages already in memory.
+ */
+
+/* Records of one event, @delta_ns apart, filling whole sub-buffers */
+struct bg_synth {
+	int		page_size;
+	int		event_size;	/* payload, a multiple of 4, >= 16 */
+	uint16_t	id;
+	uint32_t	delta_ns;
+	const char	*comm;		/* at offset 20 if there is room */
+};
+
+#define BG_SYNTH_HEADER		(sizeof(uint64_t) + sizeof(long))
+
+static inline int bg_synth_per_page(const struct bg_synth *sy)
+{
+	return (sy->page_size - BG_SYNTH_HEADER) / (4 + sy->event_size);
+}
+
+/*
+ * One sub-buffer: u64 timestamp, long commit, then type_len records. The
+ * payload is common_type, the common fields with @pid, a u64 from @value,
+ * which counts up, then an int target and @sy->comm where they fit.
+ */
+static inline void bg_synth_page(const struct bg_synth *sy, void *page,
+				 uint64_t ts, int pid, uint64_t *value)
+{
+	size_t off = BG_SYNTH_HEADER, rec = 4 + sy->event_size;
+	unsigned char *p, *start = page;
+	uint32_t head;
+	int32_t target;
+	long commit;
+	int n = 0;
+
+	memcpy(start, &ts, sizeof(ts));
+	while (off + rec <= (size_t)sy->page_size) {
+		p = start + off;
+		/* type_len in the low 5 bits, time delta in the upper 27 */
+		head = (sy->event_size / 4) | ((n ? sy->delta_ns : 0) << 5);
+		memcpy(p, &head, 4);
+		p += 4;
+		memset(p, 0, sy->event_size);
+		memcpy(p, &sy->id, 2);
+		memcpy(p + 4, &pid, 4);
+		memcpy(p + 8, value, 8);
+		if (sy->event_size >= 20) {
+			target = n & 63;
+			memcpy(p + 16, &target, 4);
+		}
+		if (sy->comm && sy->event_size >= 32)
+			strncpy((char *)p + 20, sy->comm, 12);
+		(*value)++;
+		off += rec;
+		n++;
+	}
+	commit = off - BG_SYNTH_HEADER;
+	memcpy(start + sizeof(uint64_t), &commit, sizeof(commit));
+	memset(start + off, 0, sy->page_size - off);
+}
+
+/*
+ * A bg_merge source over pages in memory, grouped by stream: stream s is
+ * pages[first[s]] up to count[s] pages on. Zero @next before each merge.
+ */
+struct bg_page_streams {
+	struct bg_page	*pages;
+	const int	*first;
+	const int	*count;
+	int		*next;		/* merge cursors */
+};
+
+static inline struct bg_page *bg_page_streams_next(void *src, int stream)
+{
+	struct bg_page_streams *ps = src;
+
+	if (ps->next[stream] == ps->count[stream])
+		return NULL;
+	return &ps->pages[ps->first[stream] + ps->next[stream]++];
+}
+
+static inline bool bg_page_streams_finished(void *src, int stream)
+{
+	struct bg_page_streams *ps = src;
+
+	return ps->next[stream] == ps->count[stream];
+}
+
+/* The pages stay where they are */
+static inline void bg_page_streams_put(void *src, struct bg_page *page)
+{
+	(void)src;
+	(void)page;
+}
+
+static const struct bg_merge_ops bg_page_streams_ops = {
+	.next_page	= bg_page_streams_next,
+	.finished	= bg_page_streams_finished,
+	.put_page	= bg_page_streams_put,
+};
+
+#endif /* BG_FIXTURE_H */
@@ -0,0 +1,567 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <tracefs.h>
+
+#include "accessors.h"
+#include "formats.h"
+#include "util.h"
+
+#define KERNEL_NOTES	"/sys/kernel/notes"
+#define NT_GNU_BUILD_ID	3
+#define CACHE_MAGIC	"bgfmt 1\n"
+
+static size_t align4(size_t n)
+{
+	return (n + 3) & ~3UL;
+}
+
+int bg_kernel_build_id(char *buf, size_t size)
+{
+	unsigned char notes[4096];
+	struct utsname uts;
+	uint32_t namesz, descsz, type;
+	size_t off = 0, i;
+	ssize_t len;
+	int fd;
+
+	fd = open(KERNEL_NOTES, O_RDONLY);
+	len = fd >= 0 ? read(fd, notes, sizeof(notes)) : -1;
+	if (fd >= 0)
+		close(fd);
+
+	while (len > 0 && off + 12 <= (size_t)len) {
+		memcpy(&namesz, notes + off, 4);
+		memcpy(&descsz, notes + off + 4, 4);
+		memcpy(&type, notes + off + 8, 4);
+		off += 12;
+		if (off + align4(namesz) + descsz > (size_t)len)
+			break;
+		if (type == NT_GNU_BUILD_ID && namesz == 4 &&
+		    !memcmp(notes + off, "GNU", 4) && descsz * 2 < size) {
+			off += align4(namesz);
+			for (i = 0; i < descsz; i++)
+				sprintf(buf + i * 2, "%02x", notes[off + i]);
+			return 0;
+		}
+		off += align4(namesz) + align4(descsz);
+	}
+
+	/* No build ID note: fall back to something that changes per build */
+	if (uname(&uts) < 0)
+		return -1;
+	snprintf(buf, size, "%s-%.16s", uts.release, uts.version);
+	for (i = 0; buf[i]; i++) {
+		if (buf[i] == ' ' || buf[i] == '/' || buf[i] == '#')
+			buf[i] = '_';
+	}
+	return 0;
+}
+
+static int grow_ids(struct bg_formats *f, int id)
+{
+	struct bg_format *ids;
+	int nr = f->nr_ids ? f->nr_ids : 1024;
+
+	if (id < f->nr_ids)
+		return 0;
+	while (nr <= id)
+		nr *= 2;
+
+	ids = realloc(f->ids, nr * sizeof(*ids));
+	if (!ids)
+		return -1;
+	memset(ids + f->nr_ids, 0, (nr - f->nr_ids) * sizeof(*ids));
+	f->ids = ids;
+	f->nr_ids = nr;
+	return 0;
+}
+
+static void clear_id(struct bg_format *fmt)
+{
+	free(fmt->system);
+	free(fmt->name);
+	free(fmt->text);
+	memset(fmt, 0, sizeof(*fmt));
+}
+
+static int set_id(struct bg_formats *f, int id, const char *system,
+		  const char *name)
+{
+	struct bg_format *fmt;
+
+	if (id < 0 || grow_ids(f, id) < 0)
+		return -1;
+
+	fmt = &f->ids[id];
+	fmt->seen = true;
+	if (fmt->name && !strcmp(fmt->name, name) && !strcmp(fmt->system, system))
+		return 0;
+
+	/* The id was reused (dynamic events come and go) */
+	clear_id(fmt);
+
+	fmt->system = strdup(system);
+	fmt->name = strdup(name);
+	fmt->seen = true;
+	return fmt->system && fmt->name ? 0 : -1;
+}
+
+/*
+ * Read events/<sys>/<event>/id for every event. Costly: done on a cold
+ * cache, or when the cache turns out to be stale, at most once per run.
+ */
+static int scan_ids(struct bg_formats *f)
+{
+	char **systems, **events;
+	char *buf;
+	int s, e, id;
+
+	f->scanned = true;
+	if (f->offline)
+		return -1;
+
+	systems = tracefs_event_systems(NULL);
+	if (!systems)
+		return -1;
+
+	for (id = 0; id < f->nr_ids; id++)
+		f->ids[id].seen = false;
+
+	for (s = 0; systems[s]; s++) {
+		events = tracefs_system_events(NULL, systems[s]);
+		for (e = 0; events && events[e]; e++) {
+			buf = tracefs_event_file_read(NULL, systems[s], events[e],
+						      "id", NULL);
+			if (!buf)
+				continue;
+			set_id(f, atoi(buf), systems[s], events[e]);
+			free(buf);
+		}
+		tracefs_list_free(events);
+	}
+	tracefs_list_free(systems);
+
+	/* Drop whatever the cache remembered that no longer exists */
+	for (id = 0; id < f->nr_ids; id++) {
+		if (f->ids[id].name && !f->ids[id].seen)
+			clear_id(&f->ids[id]);
+	}
+
+	f->dirty = true;
+	return 0;
+}
+
+/* Does the cached id -> name mapping still hold on this boot? */
+static bool id_is_current(struct bg_formats *f, int id)
+{
+	struct bg_format *fmt = &f->ids[id];
+	bool ok;
+	char *buf;
+
+	if (f->scanned || fmt->event)
+		return true;
+
+	buf = tracefs_event_file_read(NULL, fmt->system, fmt->name, "id", NULL);
+	ok = buf && atoi(buf) == id;
+	free(buf);
+	return ok;
+}
+
+static char *read_cache(const char *path, size_t *size)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	buf = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		buf = malloc(st.st_size + 1);
+		if (buf && read(fd, buf, st.st_size) != st.st_size) {
+			free(buf);
+			buf = NULL;
+		}
+	}
+	close(fd);
+
+	if (buf) {
+		buf[st.st_size] = '\0';
+		*size = st.st_size;
+	}
+	return buf;
+}
+
+static char *dup_bytes(const char *p, size_t len)
+{
+	char *s = malloc(len + 1);
+
+	if (s) {
+		memcpy(s, p, len);
+		s[len] = '\0';
+	}
+	return s;
+}
+
+/*
+ * The cache is a line per entry, each followed by a raw blob:
+ *
+ *	bgfmt 1
+ *	header <len>\n<header_page>
+ *	event <id> <system> <name> <len>\n<format>
+ *
+ * A zero length means the id was known but its format never needed.
+ */
+static void parse_blob(struct bg_formats *f, char *buf, size_t size)
+{
+	char system[256], name[256];
+	char *p, *end, *nl;
+	size_t len;
+	int id;
+
+	if (size < strlen(CACHE_MAGIC) ||
+	    strncmp(buf, CACHE_MAGIC, strlen(CACHE_MAGIC)))
+		return;
+
+	p = buf + strlen(CACHE_MAGIC);
+	end = buf + size;
+
+	while (p < end && (nl = memchr(p, '\n', end - p))) {
+		*nl = '\0';
+		if (sscanf(p, "header %zu", &len) == 1) {
+			if (len > (size_t)(end - nl - 1))
+				break;
+			free(f->header_page);
+			f->header_page = dup_bytes(nl + 1, len);
+			f->header_len = len;
+		} else if (sscanf(p, "event %d %255s %255s %zu",
+				  &id, system, name, &len) == 4) {
+			if (len > (size_t)(end - nl - 1) ||
+			    set_id(f, id, system, name) < 0)
+				break;
+			if (len) {
+				free(f->ids[id].text);
+				f->ids[id].text = dup_bytes(nl + 1, len);
+				f->ids[id].len = len;
+			}
+		} else {
+			break;
+		}
+		p = nl + 1 + len;
+	}
+}
+
+static void load_cache(struct bg_formats *f)
+{
+	size_t size;
+	char *buf;
+
+	buf = read_cache(f->cache_path, &size);
+	if (!buf)
+		return;
+
+	parse_blob(f, buf, size);
+	free(buf);
+}
+
+static char *default_cache_dir(void)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	char *dir;
+
+	if (base && *base) {
+		if (asprintf(&dir, "%s/bg-c-perf-tools", base) < 0)
+			return NULL;
+	} else {
+		base = getenv("HOME");
+		if (!base)
+			base = "/tmp";
+		if (asprintf(&dir, "%s/.cache/bg-c-perf-tools", base) < 0)
+			return NULL;
+	}
+	return dir;
+}
+
+static void setup_tep(struct bg_formats *f)
+{
+	tep_set_long_size(f->tep, sizeof(long));
+	tep_set_page_size(f->tep, getpagesize());
+	tep_set_file_bigendian(f->tep, __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+	tep_set_local_bigendian(f->tep, __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+
+	if (!f->header_page && !f->offline) {
+		int size;
+
+		f->header_page = tracefs_instance_file_read(NULL,
+							    "events/header_page",
+							    &size);
+		if (f->header_page) {
+			f->header_len = size;
+			f->dirty = true;
+		}
+	}
+	if (f->header_page)
+		tep_parse_header_page(f->tep, f->header_page, f->header_len,
+				      sizeof(long));
+}
+
+struct bg_formats *bg_formats_open(const char *cache_dir)
+{
+	struct bg_formats *f;
+	char *dir = NULL;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+
+	f->tep = tep_alloc();
+	if (!f->tep)
+		goto fail;
+
+	if (!cache_dir)
+		cache_dir = dir = default_cache_dir();
+
+	if (cache_dir && bg_kernel_build_id(f->build_id, sizeof(f->build_id)) == 0 &&
+	    asprintf(&f->cache_path, "%s/%s.formats", cache_dir, f->build_id) < 0)
+		f->cache_path = NULL;
+	free(dir);
+
+	if (f->cache_path)
+		load_cache(f);
+
+	setup_tep(f);
+	return f;
+ fail:
+	free(f);
+	return NULL;
+}
+
+struct bg_formats *bg_formats_open_buf(const void *buf, size_t size)
+{
+	struct bg_formats *f;
+	char *copy;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return NULL;
+
+	f->tep = tep_alloc();
+	copy = dup_bytes(buf, size);
+	if (!f->tep || !copy) {
+		free(copy);
+		bg_formats_close(f);
+		return NULL;
+	}
+
+	/* Everything there is to know is in the blob */
+	f->offline = true;
+	f->scanned = true;
+	parse_blob(f, copy, size);
+	free(copy);
+
+	setup_tep(f);
+	return f;
+}
+
+int bg_formats_load_text(struct bg_formats *f, int id)
+{
+	struct bg_format *fmt;
+	int size;
+
+	if (id < 0 || id >= f->nr_ids || !f->ids[id].name) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	fmt = &f->ids[id];
+	if (fmt->text)
+		return 0;
+	if (f->offline) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	fmt->text = tracefs_event_file_read(NULL, fmt->system, fmt->name,
+					    "format", &size);
+	if (!fmt->text)
+		return -1;
+	fmt->len = size;
+	f->dirty = true;
+	return 0;
+}
+
+struct tep_event *bg_formats_event(struct bg_formats *f, int id)
+{
+	struct bg_format *fmt;
+	struct tep_event *event;
+
+	if (id < 0)
+		return NULL;
+
+	/*
+	 * An id we have never heard of (a new dynamic event or a cold cache)
+	 * or one the cache maps to the wrong event: rescan them all, once.
+	 */
+	if ((id >= f->nr_ids || !f->ids[id].name || !id_is_current(f, id)) &&
+	    !f->scanned)
+		scan_ids(f);
+	if (id >= f->nr_ids || !f->ids[id].name)
+		return NULL;
+
+	fmt = &f->ids[id];
+	if (fmt->event)
+		return fmt->event;
+
+	if (bg_formats_load_text(f, id) < 0)
+		return NULL;
+
+	if (tep_parse_format(f->tep, &event, fmt->text, fmt->len,
+			     fmt->system) != TEP_ERRNO__SUCCESS)
+		return NULL;
+
+	fmt->event = event;
+	if (f->acc)
+		bg_accessors_resolve(f->acc, event);
+	return event;
+}
+
+int bg_formats_find_id(struct bg_formats *f, const char *system,
+		       const char *name)
+{
+	int pass, id;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (id = 0; id < f->nr_ids; id++) {
+			if (f->ids[id].name && !strcmp(f->ids[id].name, name) &&
+			    !strcmp(f->ids[id].system, system))
+				return id;
+		}
+		if (f->scanned || scan_ids(f) < 0)
+			break;
+	}
+	return -1;
+}
+
+struct tep_event *bg_formats_event_by_name(struct bg_formats *f,
+					   const char *system,
+					   const char *name)
+{
+	int id = bg_formats_find_id(f, system, name);
+
+	return id < 0 ? NULL : bg_formats_lookup(f, id);
+}
+
+static int mkdir_p(const char *path)
+{
+	char *dir, *p;
+	int ret = 0;
+
+	dir = strdup(path);
+	if (!dir)
+		return -1;
+
+	for (p = dir + 1; *p && !ret; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+			ret = -1;
+		*p = '/';
+	}
+	free(dir);
+	return ret;
+}
+
+static void write_blob(struct bg_formats *f, FILE *fp, bool text_only)
+{
+	struct bg_format *fmt;
+	int id;
+
+	fputs(CACHE_MAGIC, fp);
+	if (f->header_page) {
+		fprintf(fp, "header %zu\n", f->header_len);
+		fwrite(f->header_page, 1, f->header_len, fp);
+	}
+	for (id = 0; id < f->nr_ids; id++) {
+		fmt = &f->ids[id];
+		if (!fmt->name || (text_only && !fmt->text))
+			continue;
+		fprintf(fp, "event %d %s %s %zu\n", id, fmt->system, fmt->name,
+			fmt->text ? fmt->len : 0);
+		if (fmt->text)
+			fwrite(fmt->text, 1, fmt->len, fp);
+	}
+}
+
+int bg_formats_dump(struct bg_formats *f, char **buf, size_t *size)
+{
+	FILE *fp;
+
+	fp = open_memstream(buf, size);
+	if (!fp)
+		return -1;
+	write_blob(f, fp, true);
+	return fclose(fp) ? -1 : 0;
+}
+
+int bg_formats_save(struct bg_formats *f)
+{
+	char *tmp;
+	FILE *fp;
+	int ret;
+
+	if (!f->dirty || !f->cache_path)
+		return 0;
+
+	if (mkdir_p(f->cache_path) < 0)
+		return -1;
+	if (asprintf(&tmp, "%s.%d", f->cache_path, getpid()) < 0)
+		return -1;
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		free(tmp);
+		return -1;
+	}
+
+	write_blob(f, fp, false);
+
+	/* Readers only ever see a complete cache */
+	ret = fclose(fp) ? -1 : rename(tmp, f->cache_path);
+	if (ret < 0)
+		unlink(tmp);
+	else
+		f->dirty = false;
+
+	free(tmp);
+	return ret;
+}
+
+void bg_formats_close(struct bg_formats *f)
+{
+	int id;
+
+	if (!f)
+		return;
+
+	bg_formats_save(f);
+
+	for (id = 0; id < f->nr_ids; id++)
+		clear_id(&f->ids[id]);
+	free(f->ids);
+	free(f->header_page);
+	free(f->cache_path);
+	tep_free(f->tep);
+	free(f);
+}
@@ -0,0 +1,100 @@
+#ifndef BG_FORMATS_H
+#define BG_FORMATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <event-parse.h>
+
+struct bg_accessors;
+
+struct bg_format {
+	char			*system;
+	char			*name;
+	char			*text;		/* format file, NULL until needed */
+	size_t			len;
+	struct tep_event	*event;		/* NULL until parsed into tep */
+	bool			seen;		/* still present in the last scan */
+};
+
+/*
+ * Event formats parsed on demand. Nothing is parsed at open time: a
+ * format only goes through tep_parse_event() the first time its id is
+ * looked up. The id -> system/name map and every format text ever needed
+ * are kept in a cache file keyed by the kernel build ID, so a warm start
+ * only reads the id file of each event it actually meets (ids of module
+ * and dynamic events can differ between boots of the same build).
+ *
+ * Not thread safe (neither is the tep_handle); use one per thread.
+ */
+struct bg_formats {
+	struct tep_handle	*tep;
+	struct bg_format	*ids;		/* indexed by event id */
+	int			nr_ids;
+	char			build_id[64];
+	char			*cache_path;
+	char			*header_page;
+	size_t			header_len;
+	struct bg_accessors	*acc;		/* resolved as formats load */
+	bool			scanned;	/* ids read from tracefs this run */
+	bool			offline;	/* from a capture, never use tracefs */
+	bool			dirty;
+};
+
+/*
+ * Open the format cache in @cache_dir, or $XDG_CACHE_HOME/bg-c-perf-tools
+ * (~/.cache/bg-c-perf-tools) for NULL. A missing or stale cache is not an
+ * error; it is rebuilt as formats are used.
+ */
+struct bg_formats *bg_formats_open(const char *cache_dir);
+
+/*
+ * Formats embedded in a capture file (see bg_formats_dump()). They are
+ * parsed just as lazily, but never looked up in the running kernel.
+ */
+struct bg_formats *bg_formats_open_buf(const void *buf, size_t size);
+
+/* Serialize the header page and every format text loaded so far. */
+int bg_formats_dump(struct bg_formats *f, char **buf, size_t *size);
+
+/* Fetch the format text of @id without parsing it. */
+int bg_formats_load_text(struct bg_formats *f, int id);
+
+/* The parsed event for @id, loading and parsing it on first use. */
+struct tep_event *bg_formats_event(struct bg_formats *f, int id);
+
+static inline struct tep_event *bg_formats_lookup(struct bg_formats *f, int id)
+{
+	if (id >= 0 && id < f->nr_ids && f->ids[id].event)
+		return f->ids[id].event;
+	return bg_formats_event(f, id);
+}
+
+/* Find an event id by name without parsing its format. -1 if unknown. */
+int bg_formats_find_id(struct bg_formats *f, const char *system,
+		       const char *name);
+
+/* bg_formats_find_id() + bg_formats_lookup() */
+struct tep_event *bg_formats_event_by_name(struct bg_formats *f,
+					   const char *system,
+					   const char *name);
+
+/*
+ * Allow one more id rescan this run, for callers that just created
+ * dynamic or synthetic events.
+ */
+static inline void bg_formats_invalidate(struct bg_formats *f)
+{
+	f->scanned = false;
+}
+
+/* Write the cache back if anything new was loaded. */
+int bg_formats_save(struct bg_formats *f);
+
+/* Save and free. */
+void bg_formats_close(struct bg_formats *f);
+
+/* Hex GNU build ID of the running kernel from /sys/kernel/notes. */
+int bg_kernel_build_id(char *buf, size_t size);
+
+#endif /* BG_FORMATS_H */
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "formats.h"
+#include "khist.h"
+#include "util.h"
+
+struct key_mod {
+	const char			*name;
+	enum tracefs_hist_key_type	type;
+};
+
+static const struct key_mod key_mods[] = {
+	{ "log2",	TRACEFS_HIST_KEY_LOG },
+	{ "hex",	TRACEFS_HIST_KEY_HEX },
+	{ "sym",	TRACEFS_HIST_KEY_SYM },
+	{ "execname",	TRACEFS_HIST_KEY_EXECNAME },
+	{ "usecs",	TRACEFS_HIST_KEY_USECS },
+	{ "buckets",	TRACEFS_HIST_KEY_BUCKETS },
+};
+
+struct cmp_op {
+	const char		*op;
+	enum tracefs_compare	compare;
+};
+
+/* Two character operators first, so "<=" is not read as "<" */
+static const struct cmp_op cmp_ops[] = {
+	{ "==",	TRACEFS_COMPARE_EQ },
+	{ "!=",	TRACEFS_COMPARE_NE },
+	{ ">=",	TRACEFS_COMPARE_GE },
+	{ "<=",	TRACEFS_COMPARE_LE },
+	{ ">",	TRACEFS_COMPARE_GT },
+	{ "<",	TRACEFS_COMPARE_LT },
+	{ "~",	TRACEFS_COMPARE_RE },
+	{ "&",	TRACEFS_COMPARE_AND },
+};
+
+static struct bg_khist *khist_alloc(struct tracefs_instance *instance,
+				    const char *system, const char *event)
+{
+	struct bg_khist *kh;
+
+	kh = calloc(1, sizeof(*kh));
+	if (!kh)
+		return NULL;
+
+	kh->instance = instance;
+	kh->system = strdup(system);
+	kh->event = strdup(event);
+	if (!kh->system || !kh->event) {
+		bg_khist_destroy(kh);
+		return NULL;
+	}
+	return kh;
+}
+
+/* "bytes.log2" -> ("bytes", TRACEFS_HIST_KEY_LOG, 0) */
+static int parse_key(char *key, enum tracefs_hist_key_type *type, int *cnt)
+{
+	char *mod = strchr(key, '.');
+	char *val;
+	size_t i;
+
+	*type = TRACEFS_HIST_KEY_NORMAL;
+	*cnt = 0;
+	if (!mod)
+		return 0;
+	*mod++ = '\0';
+
+	val = strchr(mod, '=');
+	if (val)
+		*val++ = '\0';
+
+	for (i = 0; i < ARRAY_SIZE(key_mods); i++) {
+		if (strcmp(mod, key_mods[i].name))
+			continue;
+		*type = key_mods[i].type;
+		if (*type == TRACEFS_HIST_KEY_BUCKETS) {
+			*cnt = val ? atoi(val) : 0;
+			if (*cnt <= 0)
+				break;
+		}
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static int append_compare(struct tracefs_hist *hist, char *cmp)
+{
+	const char *op;
+	char *pos;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(cmp_ops); i++) {
+		op = cmp_ops[i].op;
+		pos = strstr(cmp, op);
+		if (!pos || pos == cmp)
+			continue;
+		*pos = '\0';
+		return tracefs_hist_append_filter(hist, TRACEFS_FILTER_COMPARE,
+						  cmp, cmp_ops[i].compare,
+						  pos + strlen(op));
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+/* "pid>100&&prio<10||comm~bash*" */
+static int append_filter(struct tracefs_hist *hist, char *filter)
+{
+	enum tracefs_filter join;
+	char *and, *or, *next;
+
+	while (filter && *filter) {
+		and = strstr(filter, "&&");
+		or = strstr(filter, "||");
+		if (and && (!or || and < or)) {
+			next = and;
+			join = TRACEFS_FILTER_AND;
+		} else {
+			next = or;
+			join = TRACEFS_FILTER_OR;
+		}
+		if (next)
+			*next = '\0';
+
+		if (append_compare(hist, filter) < 0)
+			return -1;
+		if (!next)
+			break;
+		if (tracefs_hist_append_filter(hist, join, NULL, 0, NULL) < 0)
+			return -1;
+		filter = next + 2;
+	}
+	return 0;
+}
+
+static int add_keys(struct bg_khist *kh, struct tep_handle *tep, char *keys)
+{
+	enum tracefs_hist_key_type type;
+	char *key, *save = NULL;
+	int cnt;
+
+	for (key = strtok_r(keys, ",", &save); key;
+	     key = strtok_r(NULL, ",", &save)) {
+		if (parse_key(key, &type, &cnt) < 0)
+			return -1;
+		if (!kh->hist)
+			kh->hist = tracefs_hist_alloc(tep, kh->system, kh->event,
+						      key, type);
+		else if (cnt)
+			tracefs_hist_add_key_cnt(kh->hist, key, type, cnt);
+		else
+			tracefs_hist_add_key(kh->hist, key, type);
+		if (!kh->hist)
+			return -1;
+	}
+	return kh->hist ? 0 : -1;
+}
+
+struct bg_khist *bg_khist_parse(struct tracefs_instance *instance,
+				struct bg_formats *f, const char *spec)
+{
+	char *buf, *system, *event, *keys, *filter;
+	struct bg_khist *kh = NULL;
+
+	buf = strdup(spec);
+	if (!buf)
+		return NULL;
+
+	system = buf;
+	event = strchr(system, ':');
+	keys = event ? strchr(++event, ':') : NULL;
+	if (!keys) {
+		errno = EINVAL;
+		goto out;
+	}
+	*(event - 1) = '\0';
+	*keys++ = '\0';
+	filter = strchr(keys, ':');
+	if (filter)
+		*filter++ = '\0';
+
+	/* tracefs_hist_alloc() checks the keys against the parsed format */
+	if (!bg_formats_event_by_name(f, system, event)) {
+		errno = ENOENT;
+		goto out;
+	}
+
+	kh = khist_alloc(instance, system, event);
+	if (!kh)
+		goto out;
+	if (add_keys(kh, f->tep, keys) < 0 ||
+	    (filter && append_filter(kh->hist, filter) < 0)) {
+		bg_khist_destroy(kh);
+		kh = NULL;
+	}
+ out:
+	free(buf);
+	return kh;
+}
+
+struct bg_khist *bg_khist_wakeup_latency(struct tracefs_instance *instance,
+					 struct bg_formats *f)
+{
+	struct bg_khist *kh;
+	char *name;
+
+	if (!bg_formats_event_by_name(f, "sched", "sched_waking") ||
+	    !bg_formats_event_by_name(f, "sched", "sched_switch"))
+		return NULL;
+
+	/* Unique per collector, so concurrent sessions do not collide */
+	if (asprintf(&name, "bg_wakeup_lat_%d", getpid()) < 0)
+		return NULL;
+
+	kh = khist_alloc(instance, "synthetic", name);
+	free(name);
+	if (!kh)
+		return NULL;
+
+	kh->synth = tracefs_synth_alloc(f->tep, kh->event,
+					"sched", "sched_waking",
+					"sched", "sched_switch",
+					"pid", "next_pid", "pid");
+	if (!kh->synth ||
+	    (instance && tracefs_synth_set_instance(kh->synth, instance) < 0) ||
+	    tracefs_synth_add_compare_field(kh->synth, TRACEFS_TIMESTAMP_USECS,
+					    TRACEFS_TIMESTAMP_USECS,
+					    TRACEFS_SYNTH_DELTA_END,
+					    "delta") < 0 ||
+	    tracefs_synth_create(kh->synth) < 0)
+		goto fail;
+
+	/* The synthetic event only has a format now */
+	bg_formats_invalidate(f);
+	if (!bg_formats_event_by_name(f, kh->system, kh->event))
+		goto fail;
+
+	kh->hist = tracefs_hist_alloc(f->tep, kh->system, kh->event, "pid",
+				      TRACEFS_HIST_KEY_NORMAL);
+	if (!kh->hist ||
+	    tracefs_hist_add_key(kh->hist, "delta", TRACEFS_HIST_KEY_LOG) < 0)
+		goto fail;
+
+	return kh;
+ fail:
+	bg_khist_destroy(kh);
+	return NULL;
+}
+
+struct bg_khist *bg_khist_io_sizes(struct tracefs_instance *instance,
+				   struct bg_formats *f)
+{
+	return bg_khist_parse(instance, f, "block:block_rq_issue:dev,bytes.log2");
+}
+
+int bg_khist_start(struct bg_khist *kh)
+{
+	if (tracefs_hist_start(kh->instance, kh->hist) < 0)
+		return -1;
+	kh->started = true;
+	return 0;
+}
+
+/* The trigger as written, and the form that removes it */
+static int snapshot_trigger(struct bg_khist *kh, bool remove, char **str)
+{
+	return asprintf(str, "%ssnapshot:1 if %s", remove ? "!" : "",
+			kh->snapshot);
+}
+
+int bg_khist_snapshot_if(struct bg_khist *kh, const char *filter)
+{
+	char *str;
+	int ret;
+
+	free(kh->snapshot);
+	kh->snapshot = strdup(filter);
+	if (!kh->snapshot || snapshot_trigger(kh, false, &str) < 0)
+		return -1;
+	ret = tracefs_event_file_append(kh->instance, kh->system, kh->event,
+					"trigger", str);
+	free(str);
+	if (ret < 0)
+		return -1;
+	kh->armed = true;
+	return 0;
+}
+
+/* A fired count trigger reads back as "snapshot:count=0 ..." */
+bool bg_khist_snapshot_fired(struct bg_khist *kh)
+{
+	bool fired;
+	char *list;
+
+	if (!kh->armed)
+		return false;
+	list = tracefs_event_file_read(kh->instance, kh->system, kh->event,
+				       "trigger", NULL);
+	if (!list)
+		return false;
+	fired = strstr(list, "snapshot:count=0") != NULL;
+	free(list);
+	return fired;
+}
+
+int bg_khist_snapshot_disarm(struct bg_khist *kh)
+{
+	char *str;
+	int ret;
+
+	if (!kh->armed)
+		return 0;
+	if (snapshot_trigger(kh, true, &str) < 0)
+		return -1;
+	ret = tracefs_event_file_append(kh->instance, kh->system, kh->event,
+					"trigger", str);
+	free(str);
+	if (ret < 0)
+		return -1;
+	kh->armed = false;
+	return 0;
+}
+
+int bg_khist_snapshot_rearm(struct bg_khist *kh)
+{
+	char *filter;
+	int ret;
+
+	if (bg_khist_snapshot_disarm(kh) < 0)
+		return -1;
+	/* bg_khist_snapshot_if() replaces kh->snapshot */
+	filter = strdup(kh->snapshot);
+	if (!filter)
+		return -1;
+	ret = bg_khist_snapshot_if(kh, filter);
+	free(filter);
+	return ret;
+}
+
+char *bg_khist_read(struct bg_khist *kh)
+{
+	return tracefs_event_file_read(kh->instance, kh->system, kh->event,
+				       "hist", NULL);
+}
+
+void bg_khist_destroy(struct bg_khist *kh)
+{
+	if (!kh)
+		return;
+
+	if (kh->hist) {
+		if (kh->started)
+			tracefs_hist_destroy(kh->instance, kh->hist);
+		tracefs_hist_free(kh->hist);
+	}
+	/* The event cannot go while a trigger still hangs off it */
+	bg_khist_snapshot_disarm(kh);
+	if (kh->synth) {
+		/* Removes the matching triggers and the event itself */
+		tracefs_synth_destroy(kh->synth);
+		tracefs_synth_free(kh->synth);
+	}
+	free(kh->snapshot);
+	free(kh->system);
+	free(kh->event);
+	free(kh);
+}
@@ -0,0 +1,66 @@
+#ifndef BG_KHIST_H
+#define BG_KHIST_H
+
+#include <tracefs.h>
+
+struct bg_formats;
+
+/*
+ * An aggregation that runs entirely in the kernel as a hist: trigger,
+ * optionally fed by a synthetic event. Nothing reaches the ring buffer;
+ * only the final table is read back.
+ */
+struct bg_khist {
+	struct bg_khist		*next;
+	struct tracefs_instance	*instance;	/* NULL: top level */
+	struct tracefs_synth	*synth;
+	struct tracefs_hist	*hist;
+	char			*system;
+	char			*event;
+	char			*snapshot;	/* filter of the snapshot trigger */
+	bool			started;
+	bool			armed;
+};
+
+/*
+ * Declare a histogram from "system:event:key[.mod][,key[.mod]...][:filter]".
+ * Modifiers are log2, hex, sym, execname, usecs, buckets=N. The filter is
+ * a chain of "field<op>value" joined by && or ||, with ==, !=, <, <=, >,
+ * >=, ~ (glob) and & (bit test).
+ */
+struct bg_khist *bg_khist_parse(struct tracefs_instance *instance,
+				struct bg_formats *f, const char *spec);
+
+/*
+ * Per-pid wakeup-to-run latency in usecs, log2 buckets: a synthetic event
+ * pairs sched_waking(pid) with sched_switch(next_pid). The kernel emits a
+ * synthetic event into the instance that hosts its matching triggers,
+ * so the triggers, the synthetic event and its histogram all live in
+ * @instance (NULL: top level).
+ */
+struct bg_khist *bg_khist_wakeup_latency(struct tracefs_instance *instance,
+					 struct bg_formats *f);
+
+/* Per-device request sizes of block_rq_issue in log2 buckets. */
+struct bg_khist *bg_khist_io_sizes(struct tracefs_instance *instance,
+				   struct bg_formats *f);
+
+int bg_khist_start(struct bg_khist *kh);
+
+/*
+ * Have the kernel snapshot the instance's buffer the first time an event
+ * of @kh matches @filter ("delta > 500"). The trigger fires once; poll
+ * bg_khist_snapshot_fired() and bg_khist_snapshot_rearm() after dumping.
+ */
+int bg_khist_snapshot_if(struct bg_khist *kh, const char *filter);
+bool bg_khist_snapshot_fired(struct bg_khist *kh);
+int bg_khist_snapshot_rearm(struct bg_khist *kh);
+int bg_khist_snapshot_disarm(struct bg_khist *kh);
+
+/* The kernel's rendering of the table; free() it. */
+char *bg_khist_read(struct bg_khist *kh);
+
+/* Remove the trigger (and synthetic event) and free @kh. */
+void bg_khist_destroy(struct bg_khist *kh);
+
+#endif /* BG_KHIST_H */
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ksyms.h"
+
+static int add_name(struct bg_ksyms *k, size_t *cap, const char *name,
+		    const char *mod)
+{
+	size_t len = strlen(name) + 1 + (mod ? strlen(mod) + 3 : 0);
+	char *p;
+
+	if (k->names_len + len > *cap) {
+		while (k->names_len + len > *cap)
+			*cap = *cap ? *cap * 2 : 1 << 20;
+		p = realloc(k->names, *cap);
+		if (!p)
+			return -1;
+		k->names = p;
+	}
+	p = k->names + k->names_len;
+	if (mod)
+		sprintf(p, "%s [%s]", name, mod);
+	else
+		memcpy(p, name, len);
+	k->names_len += len;
+	return 0;
+}
+
+static int cmp_sym(const void *a, const void *b)
+{
+	const struct bg_ksym *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	/* Aliases: keep the one listed first */
+	return x->name < y->name ? -1 : x->name > y->name;
+}
+
+struct bg_ksyms *bg_ksyms_load(const char *path)
+{
+	size_t cap = 0, names_cap = 0, len = 0, i, n;
+	char *line = NULL, *name, *end, *mod, type;
+	unsigned long long addr;
+	struct bg_ksyms *k;
+	struct bg_ksym *s;
+	bool nonzero = false;
+	FILE *fp;
+	int pos;
+
+	fp = fopen(path ? path : BG_KALLSYMS, "r");
+	if (!fp)
+		return NULL;
+	k = calloc(1, sizeof(*k));
+	if (!k)
+		goto fail;
+
+	while (getline(&line, &len, fp) > 0) {
+		if (sscanf(line, "%llx %c %n", &addr, &type, &pos) != 2)
+			continue;
+		/* Functions only: the tracer never reports data addresses */
+		if (type != 't' && type != 'T' && type != 'w' && type != 'W')
+			continue;
+		name = line + pos;
+		end = name + strcspn(name, " \t\n");
+		mod = NULL;
+		if (*end) {
+			*end = '\0';
+			mod = strchr(end + 1, '[');
+		}
+		if (mod) {
+			mod++;
+			mod[strcspn(mod, "]")] = '\0';
+		}
+
+		if (k->nr == cap) {
+			cap = cap ? cap * 2 : 65536;
+			s = realloc(k->syms, cap * sizeof(*s));
+			if (!s)
+				goto fail;
+			k->syms = s;
+		}
+		s = &k->syms[k->nr++];
+		s->addr = addr;
+		s->name = k->names_len;
+		s->pad = 0;
+		if (add_name(k, &names_cap, name, mod) < 0)
+			goto fail;
+		nonzero |= addr != 0;
+	}
+	free(line);
+	line = NULL;
+	fclose(fp);
+	fp = NULL;
+
+	if (!nonzero) {
+		bg_ksyms_free(k);
+		errno = EPERM;
+		return NULL;
+	}
+
+	qsort(k->syms, k->nr, sizeof(*k->syms), cmp_sym);
+	for (i = n = 0; i < k->nr; i++) {
+		if (n && k->syms[n - 1].addr == k->syms[i].addr)
+			continue;
+		k->syms[n++] = k->syms[i];
+	}
+	k->nr = n;
+	return k;
+ fail:
+	free(line);
+	if (fp)
+		fclose(fp);
+	bg_ksyms_free(k);
+	return NULL;
+}
+
+void bg_ksyms_free(struct bg_ksyms *k)
+{
+	if (!k)
+		return;
+	free(k->syms);
+	free(k->names);
+	free(k);
+}
+
+const char *bg_ksyms_lookup(const struct bg_ksyms *k, uint64_t addr,
+			    uint64_t *off)
+{
+	size_t lo = 0, hi = k->nr, mid;
+
+	/* First symbol above @addr; the one before it holds @addr */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (k->syms[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return NULL;
+	if (off)
+		*off = addr - k->syms[lo - 1].addr;
+	return k->names + k->syms[lo - 1].name;
+}
@@ -0,0 +1,41 @@
+#ifndef BG_KSYMS_H
+#define BG_KSYMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BG_KALLSYMS	"/proc/kallsyms"
+
+struct bg_ksym {
+	uint64_t	addr;
+	uint32_t	name;		/* offset into names */
+	uint32_t	pad;
+};
+
+/*
+ * The kernel's text symbols, read once and sorted by address, so an
+ * address resolves with a binary search rather than a walk of tep's
+ * function list. Module symbols are named "func [module]".
+ */
+struct bg_ksyms {
+	struct bg_ksym	*syms;
+	size_t		nr;
+	char		*names;
+	size_t		names_len;
+};
+
+/*
+ * Load @path, or BG_KALLSYMS for NULL. Fails with EPERM when every
+ * address reads as zero (kptr_restrict, or not root).
+ */
+struct bg_ksyms *bg_ksyms_load(const char *path);
+void bg_ksyms_free(struct bg_ksyms *k);
+
+/*
+ * Symbol containing @addr, that is the last one at or below it, with the
+ * offset into it in @off (may be NULL). NULL below the first symbol.
+ */
+const char *bg_ksyms_lookup(const struct bg_ksyms *k, uint64_t addr,
+			    uint64_t *off);
+
+#endif /* BG_KSYMS_H */
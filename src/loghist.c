@@ -0,0 +1,115 @@
+#include <string.h>
+
+#include "loghist.h"
+
+#define BAR_WIDTH	40
+
+void bg_loghist_reset(struct bg_loghist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+uint64_t bg_loghist_low(unsigned int b)
+{
+	unsigned int e;
+
+	if (b < BG_LOGHIST_SUB)
+		return b;
+	e = b / BG_LOGHIST_SUB + BG_LOGHIST_SUB_BITS - 1;
+	return (uint64_t)(BG_LOGHIST_SUB + b % BG_LOGHIST_SUB) <<
+	       (e - BG_LOGHIST_SUB_BITS);
+}
+
+static uint64_t bucket_high(unsigned int b)
+{
+	return b + 1 < BG_LOGHIST_BUCKETS ? bg_loghist_low(b + 1) - 1 : UINT64_MAX;
+}
+
+void bg_loghist_merge(struct bg_loghist *dst, const struct bg_loghist *src)
+{
+	unsigned int i;
+
+	if (!src->total)
+		return;
+	for (i = 0; i < BG_LOGHIST_BUCKETS; i++)
+		dst->count[i] += src->count[i];
+	if (!dst->total || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->total += src->total;
+	dst->sum += src->sum;
+}
+
+uint64_t bg_loghist_percentile(const struct bg_loghist *h, double pct)
+{
+	uint64_t want, seen = 0;
+	unsigned int i;
+
+	if (!h->total)
+		return 0;
+	want = h->total * pct / 100;
+	if (want >= h->total)
+		return h->max;
+
+	for (i = 0; i < BG_LOGHIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen > want)
+			break;
+	}
+	/* Never claim more than was actually seen */
+	return bucket_high(i) < h->max ? bucket_high(i) : h->max;
+}
+
+/* Power of two that bucket @b belongs to; values 0 and 1 share row 0 */
+static unsigned int bucket_log2(unsigned int b)
+{
+	uint64_t low = bg_loghist_low(b);
+
+	return low > 1 ? 63 - __builtin_clzll(low) : 0;
+}
+
+void bg_loghist_print(FILE *f, const char *title, const struct bg_loghist *h,
+		      uint64_t div, const char *unit)
+{
+	uint64_t rows[64] = { 0 }, max = 0;
+	unsigned int i, lo = 64, hi = 0, r;
+	int width;
+
+	fprintf(f, "%s: %llu samples", title, (unsigned long long)h->total);
+	if (!h->total) {
+		fputc('\n', f);
+		return;
+	}
+	fprintf(f, ", mean %.1f %s, p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu %s\n",
+		(double)h->sum / h->total / div, unit,
+		(unsigned long long)(bg_loghist_percentile(h, 50) / div),
+		(unsigned long long)(bg_loghist_percentile(h, 90) / div),
+		(unsigned long long)(bg_loghist_percentile(h, 99) / div),
+		(unsigned long long)(bg_loghist_percentile(h, 99.9) / div),
+		(unsigned long long)(h->max / div), unit);
+
+	for (i = 0; i < BG_LOGHIST_BUCKETS; i++) {
+		if (!h->count[i])
+			continue;
+		r = bucket_log2(i);
+		rows[r] += h->count[i];
+		if (r < lo)
+			lo = r;
+		if (r > hi)
+			hi = r;
+	}
+	for (r = lo; r <= hi; r++) {
+		if (rows[r] > max)
+			max = rows[r];
+	}
+
+	for (r = lo; r <= hi; r++) {
+		width = rows[r] * BAR_WIDTH / max;
+		fprintf(f, "  %12llu -> %-12llu : %10llu |%-*.*s|\n",
+			(unsigned long long)((r ? 1ULL << r : 0) / div),
+			(unsigned long long)((r < 63 ? (2ULL << r) - 1 : UINT64_MAX) / div),
+			(unsigned long long)rows[r], BAR_WIDTH, width,
+			"****************************************");
+	}
+}
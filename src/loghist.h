@@ -0,0 +1,68 @@
+#ifndef BG_LOGHIST_H
+#define BG_LOGHIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Log-linear histogram of 64 bit values: every power of two is split into
+ * 2^BG_LOGHIST_SUB_BITS equal buckets, so a bucket's width is at most
+ * 1/2^BG_LOGHIST_SUB_BITS of its value (12.5% with 3 bits) and the whole
+ * range fits a fixed array. Values below 2^BG_LOGHIST_SUB_BITS get a
+ * bucket each.
+ */
+#define BG_LOGHIST_SUB_BITS	3
+#define BG_LOGHIST_SUB		(1 << BG_LOGHIST_SUB_BITS)
+#define BG_LOGHIST_BUCKETS	((64 - BG_LOGHIST_SUB_BITS + 1) * BG_LOGHIST_SUB)
+
+struct bg_loghist {
+	uint64_t	count[BG_LOGHIST_BUCKETS];
+	uint64_t	total;
+	uint64_t	sum;
+	uint64_t	min;
+	uint64_t	max;
+};
+
+static inline unsigned int bg_loghist_bucket(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < BG_LOGHIST_SUB)
+		return v;
+	/* e >= SUB_BITS: the top SUB_BITS + 1 bits pick the bucket */
+	e = 63 - __builtin_clzll(v);
+	return (e - BG_LOGHIST_SUB_BITS + 1) * BG_LOGHIST_SUB +
+	       ((v >> (e - BG_LOGHIST_SUB_BITS)) - BG_LOGHIST_SUB);
+}
+
+static inline void bg_loghist_add(struct bg_loghist *h, uint64_t v)
+{
+	h->count[bg_loghist_bucket(v)]++;
+	if (!h->total || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->total++;
+	h->sum += v;
+}
+
+void bg_loghist_reset(struct bg_loghist *h);
+
+/* Smallest value that lands in bucket @b */
+uint64_t bg_loghist_low(unsigned int b);
+
+/* Add every count of @src into @dst. */
+void bg_loghist_merge(struct bg_loghist *dst, const struct bg_loghist *src);
+
+/* Upper bound of the bucket holding the @pct percentile, 0 when empty */
+uint64_t bg_loghist_percentile(const struct bg_loghist *h, double pct);
+
+/*
+ * Print count, mean and percentiles, then a bar per power of two from the
+ * lowest to the highest non-empty one. Values are divided by @div for
+ * printing, in @unit.
+ */
+void bg_loghist_print(FILE *f, const char *title, const struct bg_loghist *h,
+		      uint64_t div, const char *unit);
+
+#endif /* BG_LOGHIST_H */
@@ -0,0 +1,345 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "merge.h"
+#include "util.h"
+
+enum cursor_state {
+	CURSOR_READY,		/* holds a record, is in the heap */
+	CURSOR_WAITING,		/* no page available right now */
+	CURSOR_DONE,		/* stream finished */
+};
+
+struct cursor {
+	struct kbuffer		*kbuf;
+	struct bg_page		*page;
+	void			*data;
+	unsigned long long	ts;
+	unsigned long long	delayed_ts;	/* records up to this came in late */
+	enum cursor_state	state;
+};
+
+struct bg_merge {
+	const struct bg_merge_ops	*ops;
+	void				*src;
+	struct cursor			*cursors;
+	int				*heap;
+	int				nr_heap;
+	int				nr_streams;
+	int				nr_waiting;
+	int				last;		/* emitted, not yet advanced */
+	unsigned int			since_poll;
+	unsigned long long		window;
+	unsigned long long		high_ts;	/* newest loaded */
+	uint64_t			wait_mark;	/* a stream last ran dry */
+	unsigned long long		emitted_ts;
+	struct bg_merge_stats		stats;
+};
+
+/* How many records may go by before idle streams are polled again */
+#define POLL_INTERVAL	64
+
+static bool before(struct bg_merge *m, int a, int b)
+{
+	struct cursor *ca = &m->cursors[a], *cb = &m->cursors[b];
+
+	/* Equal stamps come out in CPU order, so the output is reproducible */
+	if (ca->ts != cb->ts)
+		return ca->ts < cb->ts;
+	return a < b;
+}
+
+static void sift_up(struct bg_merge *m, int i)
+{
+	int parent, tmp;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!before(m, m->heap[i], m->heap[parent]))
+			break;
+		tmp = m->heap[i];
+		m->heap[i] = m->heap[parent];
+		m->heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+static void sift_down(struct bg_merge *m, int i)
+{
+	int l, r, min, tmp;
+
+	for (;;) {
+		l = 2 * i + 1;
+		r = l + 1;
+		min = i;
+		if (l < m->nr_heap && before(m, m->heap[l], m->heap[min]))
+			min = l;
+		if (r < m->nr_heap && before(m, m->heap[r], m->heap[min]))
+			min = r;
+		if (min == i)
+			break;
+		tmp = m->heap[i];
+		m->heap[i] = m->heap[min];
+		m->heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void heap_push(struct bg_merge *m, int stream)
+{
+	m->heap[m->nr_heap] = stream;
+	sift_up(m, m->nr_heap++);
+}
+
+static void set_ready(struct bg_merge *m, int stream)
+{
+	struct cursor *c = &m->cursors[stream];
+
+	if (c->ts > m->high_ts)
+		m->high_ts = c->ts;
+	c->state = CURSOR_READY;
+}
+
+/* Load pages into a cursor until it has a record or runs dry */
+static void refill(struct bg_merge *m, int stream)
+{
+	struct cursor *c = &m->cursors[stream];
+	struct bg_page *page;
+
+	for (;;) {
+		page = m->ops->next_page(m->src, stream);
+		if (!page) {
+			c->state = m->ops->finished(m->src, stream) ?
+				   CURSOR_DONE : CURSOR_WAITING;
+			return;
+		}
+		c->page = page;
+		if (kbuffer_load_subbuffer(c->kbuf, page->data) == 0) {
+			c->data = kbuffer_read_event(c->kbuf, &c->ts);
+			if (c->data) {
+				set_ready(m, stream);
+				return;
+			}
+		}
+		/* Padding-only page */
+		m->ops->put_page(m->src, page);
+		c->page = NULL;
+	}
+}
+
+/* Step past the record just emitted from @stream */
+static void advance(struct bg_merge *m, int stream)
+{
+	struct cursor *c = &m->cursors[stream];
+
+	c->data = kbuffer_next_event(c->kbuf, &c->ts);
+	if (c->data) {
+		set_ready(m, stream);
+		return;
+	}
+
+	m->ops->put_page(m->src, c->page);
+	c->page = NULL;
+	refill(m, stream);
+}
+
+/* Update the heap after the top cursor changed state */
+static void reseat_top(struct bg_merge *m, int stream)
+{
+	struct cursor *c = &m->cursors[stream];
+
+	if (c->state == CURSOR_READY) {
+		sift_down(m, 0);
+		return;
+	}
+
+	m->heap[0] = m->heap[--m->nr_heap];
+	if (m->nr_heap)
+		sift_down(m, 0);
+	if (c->state == CURSOR_WAITING) {
+		m->nr_waiting++;
+		m->wait_mark = bg_now_ns();
+	}
+}
+
+/*
+ * A stream coming back from idle with records a whole window behind the
+ * newest one seen before this poll delivered them too late for the window
+ * to order them, e.g. a quiet CPU whose reader sat on the watermark. Those
+ * records are counted as delayed when they go out, late or not.
+ */
+static void poll_waiting(struct bg_merge *m)
+{
+	unsigned long long high = m->high_ts;
+	struct cursor *c;
+	int i;
+
+	m->since_poll = 0;
+	for (i = 0; i < m->nr_streams && m->nr_waiting; i++) {
+		c = &m->cursors[i];
+		if (c->state != CURSOR_WAITING)
+			continue;
+		refill(m, i);
+		if (c->state == CURSOR_WAITING)
+			continue;
+		m->nr_waiting--;
+		if (c->state != CURSOR_READY)
+			continue;
+		if (high >= m->window && c->ts <= high - m->window)
+			c->delayed_ts = high - m->window;
+		heap_push(m, i);
+	}
+}
+
+/*
+ * The head can go once no idle stream could still deliver something
+ * older: either it trails the newest record seen by the window, or every
+ * idle stream has stayed idle for a whole window of real time.
+ */
+static bool can_emit(struct bg_merge *m)
+{
+	unsigned long long ts;
+
+	if (!m->nr_heap)
+		return false;
+	if (!m->nr_waiting)
+		return true;
+
+	ts = m->cursors[m->heap[0]].ts;
+	if (ts + m->window <= m->high_ts)
+		return true;
+	return bg_now_ns() - m->wait_mark >= m->window;
+}
+
+struct bg_merge *bg_merge_alloc(int nr_streams, unsigned long long window_ns,
+				const struct bg_merge_ops *ops, void *src)
+{
+	struct bg_merge *m;
+	int i;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->cursors = calloc(nr_streams, sizeof(*m->cursors));
+	m->heap = calloc(nr_streams, sizeof(*m->heap));
+	if (!m->cursors || !m->heap)
+		goto fail;
+
+	m->ops = ops;
+	m->src = src;
+	m->window = window_ns;
+	m->nr_streams = nr_streams;
+	m->last = -1;
+
+	for (i = 0; i < nr_streams; i++) {
+		m->cursors[i].kbuf = kbuffer_alloc(KBUFFER_LSIZE_SAME_AS_HOST,
+						   KBUFFER_ENDIAN_SAME_AS_HOST);
+		if (!m->cursors[i].kbuf)
+			goto fail;
+		m->cursors[i].state = CURSOR_WAITING;
+	}
+	/* Every stream starts idle: give them all a window to deliver */
+	m->nr_waiting = nr_streams;
+	m->wait_mark = bg_now_ns();
+
+	return m;
+ fail:
+	bg_merge_free(m);
+	return NULL;
+}
+
+void bg_merge_free(struct bg_merge *m)
+{
+	int i;
+
+	if (!m)
+		return;
+
+	for (i = 0; m->cursors && i < m->nr_streams; i++) {
+		if (m->cursors[i].page)
+			m->ops->put_page(m->src, m->cursors[i].page);
+		if (m->cursors[i].kbuf)
+			kbuffer_free(m->cursors[i].kbuf);
+	}
+	free(m->cursors);
+	free(m->heap);
+	free(m);
+}
+
+int bg_merge_next(struct bg_merge *m, struct bg_merge_rec *rec)
+{
+	struct cursor *c;
+	int stream;
+
+	if (m->last >= 0) {
+		stream = m->last;
+		m->last = -1;
+		advance(m, stream);
+		reseat_top(m, stream);
+	}
+
+	if (m->nr_waiting &&
+	    (++m->since_poll >= POLL_INTERVAL || !can_emit(m)))
+		poll_waiting(m);
+
+	if (!can_emit(m)) {
+		if (!m->nr_heap && !m->nr_waiting)
+			return -1;
+		if (m->nr_heap)
+			m->stats.window_waits++;
+		return 0;
+	}
+
+	stream = m->heap[0];
+	c = &m->cursors[stream];
+
+	if (c->ts < m->emitted_ts)
+		m->stats.late++;
+	else
+		m->emitted_ts = c->ts;
+	if (c->ts <= c->delayed_ts)
+		m->stats.delayed++;
+	m->stats.records++;
+
+	rec->ts = c->ts;
+	rec->data = c->data;
+	rec->size = kbuffer_event_size(c->kbuf);
+	rec->cpu = c->page->cpu;
+	rec->stream = stream;
+
+	/* Advanced on the next call, so @rec->data stays valid until then */
+	m->last = stream;
+	return 1;
+}
+
+void bg_merge_get_stats(struct bg_merge *m, struct bg_merge_stats *stats)
+{
+	*stats = m->stats;
+}
+
+static struct bg_page *reader_next_page(void *src, int stream)
+{
+	struct bg_readers *set = src;
+
+	return bg_reader_next_page(&set->readers[stream]);
+}
+
+static bool reader_finished(void *src, int stream)
+{
+	struct bg_readers *set = src;
+
+	return bg_reader_drained(&set->readers[stream]);
+}
+
+static void reader_put_page(void *src, struct bg_page *page)
+{
+	(void)src;
+	bg_page_put(page);
+}
+
+const struct bg_merge_ops bg_merge_reader_ops = {
+	.next_page	= reader_next_page,
+	.finished	= reader_finished,
+	.put_page	= reader_put_page,
+};
@@ -0,0 +1,67 @@
+#ifndef BG_MERGE_H
+#define BG_MERGE_H
+
+#include <stdbool.h>
+
+#include <kbuffer.h>
+
+#include "reader.h"
+
+#define BG_MERGE_WINDOW_NS	(10 * 1000 * 1000ULL)
+
+/* Where the merge gets the pages of each per-CPU stream from */
+struct bg_merge_ops {
+	/* Next page of @stream, NULL if none is available right now */
+	struct bg_page	*(*next_page)(void *src, int stream);
+	/* @stream will never produce another page */
+	bool		(*finished)(void *src, int stream);
+	/* The merge is done with every record of @page */
+	void		(*put_page)(void *src, struct bg_page *page);
+};
+
+struct bg_merge_rec {
+	unsigned long long	ts;
+	void			*data;
+	int			size;
+	int			cpu;
+	int			stream;
+};
+
+struct bg_merge_stats {
+	unsigned long long	records;
+	unsigned long long	late;		/* older than a record already emitted */
+	unsigned long long	delayed;	/* came in a window behind the newest */
+	unsigned long long	window_waits;	/* held back for an idle stream */
+};
+
+struct bg_merge;
+
+/*
+ * K-way merge of per-CPU streams, each already in timestamp order, into
+ * one globally ordered stream. A tournament over a binary min-heap of
+ * cursors needs only the current page of each stream in memory.
+ *
+ * A stream with nothing queued cannot prove it has nothing older, so while
+ * one is idle the head of the heap is held until it is @window_ns older
+ * than the newest record seen, or until the idle streams have been idle
+ * for @window_ns. Records arriving later than that are still emitted,
+ * and counted as delayed, and as late too if something newer already went
+ * out.
+ */
+struct bg_merge *bg_merge_alloc(int nr_streams, unsigned long long window_ns,
+				const struct bg_merge_ops *ops, void *src);
+void bg_merge_free(struct bg_merge *m);
+
+/*
+ * Fetch the next record. Returns 1 with @rec filled, 0 if the next record
+ * is not known yet (poll again later), or -1 once every stream finished
+ * and was fully emitted. @rec->data is valid until the next call.
+ */
+int bg_merge_next(struct bg_merge *m, struct bg_merge_rec *rec);
+
+void bg_merge_get_stats(struct bg_merge *m, struct bg_merge_stats *stats);
+
+/* Ops for merging the rings of a bg_readers set running BG_READ_RING */
+extern const struct bg_merge_ops bg_merge_reader_ops;
+
+#endif /* BG_MERGE_H */
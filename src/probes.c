@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "probes.h"
+#include "util.h"
+
+static const struct {
+	const char	*name;
+	char		cmd;		/* dynamic_events command letter */
+} probe_types[] = {
+	[BG_PROBE_KPROBE]	= { "kprobe",		'p' },
+	[BG_PROBE_KRETPROBE]	= { "kretprobe",	'r' },
+	[BG_PROBE_UPROBE]	= { "uprobe",		'p' },
+	[BG_PROBE_URETPROBE]	= { "uretprobe",	'r' },
+	[BG_PROBE_EPROBE]	= { "eprobe",		'e' },
+};
+
+struct bg_probes *bg_probes_alloc(void)
+{
+	struct bg_probes *p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+	p->failed = -1;
+	p->guard = -1;
+	p->guard_fd = -1;
+	return p;
+}
+
+void bg_probes_free(struct bg_probes *p)
+{
+	int i;
+
+	if (!p)
+		return;
+	bg_probes_destroy(p);
+	for (i = 0; i < p->nr_probes; i++) {
+		free(p->probes[i].event);
+		free(p->probes[i].target);
+		free(p->probes[i].args);
+	}
+	free(p->probes);
+	tracefs_put_tracing_file(p->dynevents_path);
+	tracefs_put_tracing_file(p->enable_path);
+	tracefs_put_tracing_file(p->instance_dir);
+	free(p->create);
+	free(p->remove);
+	free(p);
+}
+
+static bool valid_name(const char *s)
+{
+	if (!*s || isdigit((unsigned char)*s))
+		return false;
+	for (; *s; s++)
+		if (!isalnum((unsigned char)*s) && *s != '_')
+			return false;
+	return true;
+}
+
+static bool valid_target(enum bg_probe_type type, const char *t)
+{
+	switch (type) {
+	case BG_PROBE_UPROBE:
+	case BG_PROBE_URETPROBE:
+		return *t == '/' && strrchr(t, ':');
+	case BG_PROBE_EPROBE:
+		return strchr(t, '.') && !strchr(t, '/');
+	default:
+		return !strchr(t, '/');
+	}
+}
+
+int bg_probes_add(struct bg_probes *p, const char *line)
+{
+	char *copy, *s, *event, *target, *args, *end;
+	struct bg_probe *probe;
+	size_t i, len;
+	int ret = -1;
+
+	copy = strdup(line);
+	if (!copy)
+		return -1;
+	for (s = copy; isspace((unsigned char)*s); s++)
+		;
+	for (end = s + strlen(s); end > s && isspace((unsigned char)end[-1]); )
+		*--end = '\0';
+	if (!*s || *s == '#') {
+		free(copy);
+		return 0;
+	}
+
+	errno = EINVAL;
+	event = strchr(s, ':');
+	if (!event)
+		goto out;
+	*event++ = '\0';
+	for (i = 0; i < ARRAY_SIZE(probe_types); i++)
+		if (!strcmp(s, probe_types[i].name))
+			break;
+	if (i == ARRAY_SIZE(probe_types))
+		goto out;
+
+	len = strcspn(event, " \t");
+	if (!event[len])
+		goto out;
+	event[len] = '\0';
+	target = event + len + 1;
+	target += strspn(target, " \t");
+	len = strcspn(target, " \t");
+	args = target[len] ? target + len + 1 : NULL;
+	target[len] = '\0';
+	if (args) {
+		args += strspn(args, " \t");
+		if (!*args)
+			args = NULL;
+	}
+	if (!valid_name(event) || !valid_target(i, target))
+		goto out;
+
+	probe = realloc(p->probes, (p->nr_probes + 1) * sizeof(*probe));
+	if (!probe)
+		goto out;
+	p->probes = probe;
+	probe = &p->probes[p->nr_probes];
+	probe->type = i;
+	probe->event = strdup(event);
+	probe->target = strdup(target);
+	probe->args = args ? strdup(args) : NULL;
+	if (!probe->event || !probe->target || (args && !probe->args)) {
+		free(probe->event);
+		free(probe->target);
+		free(probe->args);
+		goto out;
+	}
+	p->nr_probes++;
+	ret = 0;
+ out:
+	free(copy);
+	return ret;
+}
+
+int bg_probes_load(struct bg_probes *p, const char *path)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int ret = 0, nr = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	while (getline(&line, &len, fp) > 0) {
+		nr++;
+		if (bg_probes_add(p, line) < 0) {
+			bg_warn("%s:%d: bad probe", path, nr);
+			ret = -1;
+			break;
+		}
+	}
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Everything from here to the guard sticks to open(), write() and close()
+ * on buffers built beforehand, so the guard can run it after a fork().
+ */
+static int write_file(const char *path, const char *buf, size_t len)
+{
+	int fd, ret;
+
+	/* Never O_TRUNC: truncating dynamic_events removes every probe */
+	fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = bg_write_all(fd, buf, len);
+	close(fd);
+	return ret;
+}
+
+/*
+ * One write() per line, for when a batch failed somewhere: returns the
+ * index of the first line that fails in @failed, or keeps going.
+ */
+static int write_lines(const char *path, const char *buf, size_t len,
+		       bool keep_going, int *failed)
+{
+	const char *end, *nl;
+	int fd, i, ret = 0;
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	for (i = 0, end = buf + len; buf < end; buf = nl + 1, i++) {
+		nl = memchr(buf, '\n', end - buf);
+		if (!nl)
+			nl = end - 1;
+		if (bg_write_all(fd, buf, nl + 1 - buf) < 0) {
+			ret = -1;
+			if (failed && *failed < 0)
+				*failed = i;
+			if (!keep_going)
+				break;
+		}
+	}
+	close(fd);
+	return ret;
+}
+
+static void teardown(struct bg_probes *p, bool crashed)
+{
+	/* Enabled probes cannot be removed */
+	if (p->enable_path)
+		write_file(p->enable_path, "0", 1);
+	if (crashed && p->instance_dir)
+		rmdir(p->instance_dir);
+	if (write_file(p->dynevents_path, p->remove, p->remove_len) < 0)
+		write_lines(p->dynevents_path, p->remove, p->remove_len, true,
+			    NULL);
+}
+
+static int start_guard(struct bg_probes *p)
+{
+	int fds[2];
+	ssize_t n;
+	pid_t pid;
+	char c;
+
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		return -1;
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (!pid) {
+		/* ^C and the like are for the collector, which cleans up */
+		signal(SIGINT, SIG_IGN);
+		signal(SIGTERM, SIG_IGN);
+		signal(SIGHUP, SIG_IGN);
+		close(fds[1]);
+		do
+			n = read(fds[0], &c, 1);
+		while (n < 0 && errno == EINTR);
+		/* EOF without a word first: the collector died */
+		if (n <= 0)
+			teardown(p, true);
+		_exit(0);
+	}
+	close(fds[0]);
+	p->guard = pid;
+	p->guard_fd = fds[1];
+	return 0;
+}
+
+static void dismiss_guard(struct bg_probes *p)
+{
+	if (p->guard < 0)
+		return;
+	if (write(p->guard_fd, "x", 1) != 1)
+		bg_warn("cannot dismiss the probe guard: %s", strerror(errno));
+	close(p->guard_fd);
+	waitpid(p->guard, NULL, 0);
+	p->guard = p->guard_fd = -1;
+}
+
+static int build_commands(struct bg_probes *p)
+{
+	const struct bg_probe *probe;
+	FILE *create, *remove;
+	int i, ret = 0;
+
+	free(p->create);
+	free(p->remove);
+	create = open_memstream(&p->create, &p->create_len);
+	remove = open_memstream(&p->remove, &p->remove_len);
+	if (!create || !remove) {
+		if (create)
+			fclose(create);
+		return -1;
+	}
+	for (i = 0; i < p->nr_probes; i++) {
+		probe = &p->probes[i];
+		fprintf(create, "%c:%s/%s %s%s%s\n", probe_types[probe->type].cmd,
+			p->group, probe->event, probe->target,
+			probe->args ? " " : "", probe->args ? probe->args : "");
+		fprintf(remove, "-:%s/%s\n", p->group, probe->event);
+	}
+	if (fclose(create) == EOF)
+		ret = -1;
+	if (fclose(remove) == EOF)
+		ret = -1;
+	return ret;
+}
+
+int bg_probes_create(struct bg_probes *p, struct tracefs_instance *instance)
+{
+	char *file;
+	int err;
+
+	if (!p->nr_probes || p->created) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bg_probes_sweep();
+
+	snprintf(p->group, sizeof(p->group), BG_PROBE_GROUP "%d", getpid());
+	if (build_commands(p) < 0)
+		return -1;
+	if (asprintf(&file, "events/%s/enable", p->group) < 0)
+		return -1;
+	p->dynevents_path = tracefs_get_tracing_file("dynamic_events");
+	p->enable_path = tracefs_instance_get_file(instance, file);
+	free(file);
+	if (instance && tracefs_instance_get_name(instance))
+		p->instance_dir = tracefs_instance_get_dir(instance);
+	if (!p->dynevents_path || !p->enable_path)
+		return -1;
+
+	/* Guarded before the first probe exists */
+	if (start_guard(p) < 0)
+		return -1;
+
+	p->failed = -1;
+	if (write_file(p->dynevents_path, p->create, p->create_len) < 0) {
+		err = errno;
+		/* The ones before the culprit were created; find which it was */
+		teardown(p, false);
+		write_lines(p->dynevents_path, p->create, p->create_len, false,
+			    &p->failed);
+		teardown(p, false);
+		dismiss_guard(p);
+		errno = err;
+		return -1;
+	}
+	p->created = true;
+
+	if (write_file(p->enable_path, "1", 1) < 0) {
+		err = errno;
+		bg_probes_destroy(p);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void bg_probes_destroy(struct bg_probes *p)
+{
+	if (!p->created)
+		return;
+	teardown(p, false);
+	dismiss_guard(p);
+	p->created = false;
+}
+
+static int disable_in(const char *name, void *group)
+{
+	struct tracefs_instance *instance;
+
+	instance = tracefs_instance_alloc(NULL, name);
+	if (instance) {
+		tracefs_event_disable(instance, group, NULL);
+		tracefs_instance_free(instance);
+	}
+	return 0;
+}
+
+/* "p:bg_1234/open do_sys_openat2 ..." -> group and event of a stale owner */
+static bool stale_probe(char *line, char **group, char **event)
+{
+	char *slash, *end;
+	long pid;
+
+	*group = strchr(line, ':');
+	if (!*group)
+		return false;
+	(*group)++;
+	slash = strchr(*group, '/');
+	if (!slash || strncmp(*group, BG_PROBE_GROUP, strlen(BG_PROBE_GROUP)))
+		return false;
+	*slash = '\0';
+	*event = slash + 1;
+	(*event)[strcspn(*event, " \t")] = '\0';
+
+	pid = strtol(*group + strlen(BG_PROBE_GROUP), &end, 10);
+	if (end != slash || pid <= 0 || pid == getpid())
+		return false;
+	/* A reused pid keeps its group until that process is gone too */
+	return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+int bg_probes_sweep(void)
+{
+	char *list, *line, *save, *group, *event, *cmd, *path;
+	char last[32] = "";
+	int removed = 0;
+
+	list = tracefs_instance_file_read(NULL, "dynamic_events", NULL);
+	if (!list)
+		return 0;
+	path = tracefs_get_tracing_file("dynamic_events");
+	if (!path) {
+		free(list);
+		return 0;
+	}
+
+	for (line = strtok_r(list, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		if (!stale_probe(line, &group, &event))
+			continue;
+		if (strcmp(group, last)) {
+			tracefs_event_disable(NULL, group, NULL);
+			tracefs_instances_walk(disable_in, group);
+			snprintf(last, sizeof(last), "%s", group);
+		}
+		if (asprintf(&cmd, "-:%s/%s\n", group, event) < 0)
+			break;
+		if (write_file(path, cmd, strlen(cmd)) == 0)
+			removed++;
+		free(cmd);
+	}
+	if (removed)
+		bg_warn("removed %d probes left behind by earlier runs", removed);
+	tracefs_put_tracing_file(path);
+	free(list);
+	return removed;
+}
@@ -0,0 +1,98 @@
+#ifndef BG_PROBES_H
+#define BG_PROBES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <tracefs.h>
+
+/* Probe groups are named BG_PROBE_GROUP "<pid>" after their owner */
+#define BG_PROBE_GROUP		"bg_"
+
+enum bg_probe_type {
+	BG_PROBE_KPROBE,
+	BG_PROBE_KRETPROBE,
+	BG_PROBE_UPROBE,
+	BG_PROBE_URETPROBE,
+	BG_PROBE_EPROBE,
+};
+
+struct bg_probe {
+	enum bg_probe_type	type;
+	char			*event;
+	char			*target;	/* sym[+off], /path:offset, sys.event */
+	char			*args;		/* fetchargs, may be NULL */
+};
+
+/*
+ * A set of dynamic events living in a group of their own. The whole set is
+ * created by one write of every definition to dynamic_events and enabled
+ * by one write to the group's enable file, instead of a tracefs_dynevent
+ * and an enable write per probe.
+ *
+ * Teardown does not depend on the collector exiting cleanly: a guard
+ * process forked at creation waits for the collector's end of a pipe to
+ * close and, unless it was told the probes are already gone, disables and
+ * removes them itself. Groups left behind by owners that no longer exist
+ * (both killed) are swept by the next bg_probes_create().
+ */
+struct bg_probes {
+	char			group[32];
+	struct bg_probe		*probes;
+	int			nr_probes;
+	int			failed;		/* probe the kernel refused, or -1 */
+
+	/* Precomputed, so the guard only has to open() and write() */
+	char			*dynevents_path;
+	char			*enable_path;
+	char			*instance_dir;
+	char			*create;	/* definitions, one per line */
+	size_t			create_len;
+	char			*remove;	/* "-:group/event" lines */
+	size_t			remove_len;
+
+	pid_t			guard;
+	int			guard_fd;	/* closing it wakes the guard */
+	bool			created;
+};
+
+struct bg_probes *bg_probes_alloc(void);
+void bg_probes_free(struct bg_probes *p);
+
+/*
+ * Add one probe from a config line, "<type>:<event> <target> [fetchargs]":
+ *
+ *	kprobe:open do_sys_openat2 dfd=%di path=+0(%si):string
+ *	kretprobe:open_ret do_sys_openat2 ret=$retval
+ *	uprobe:malloc /usr/lib/libc.so.6:0x9a0b0 size=%di
+ *	uretprobe:malloc_ret /usr/lib/libc.so.6:0x9a0b0 ptr=$retval
+ *	eprobe:wake sched.sched_waking pid=$pid
+ *
+ * Blank lines and lines starting with '#' are ignored. Returns 0, or -1
+ * with errno EINVAL for a line that does not parse.
+ */
+int bg_probes_add(struct bg_probes *p, const char *line);
+
+/* bg_probes_add() every line of @path. */
+int bg_probes_load(struct bg_probes *p, const char *path);
+
+/*
+ * Sweep stale groups, start the guard, create every probe and enable the
+ * group in @instance (NULL: top level). The guard also removes @instance
+ * if the collector dies. Call before starting any thread: the guard is
+ * forked. On failure nothing is left behind and p->failed names the probe
+ * the kernel refused, when known.
+ */
+int bg_probes_create(struct bg_probes *p, struct tracefs_instance *instance);
+
+/* Disable and remove the probes, and dismiss the guard. */
+void bg_probes_destroy(struct bg_probes *p);
+
+/*
+ * Remove the probe groups of owners that are no longer running, disabling
+ * them in every instance first. Returns the number of probes removed.
+ */
+int bg_probes_sweep(void);
+
+#endif /* BG_PROBES_H */
@@ -0,0 +1,485 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "reader.h"
+#include "util.h"
+
+struct bg_readers *bg_readers_alloc(struct tracefs_instance *instance,
+				    cpu_set_t *cpus)
+{
+	struct bg_readers *set;
+	struct bg_reader *r;
+	int cpu;
+
+	set = calloc(1, sizeof(*set));
+	if (!set)
+		return NULL;
+
+	set->instance = instance;
+	set->readers = calloc(CPU_COUNT(cpus), sizeof(*set->readers));
+	if (!set->readers)
+		goto fail;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, cpus))
+			continue;
+
+		r = &set->readers[set->nr_readers];
+		r->set = set;
+		r->cpu = cpu;
+		r->node = bg_cpu_node(cpu);
+		CPU_ZERO(&r->affinity);
+		CPU_SET(cpu, &r->affinity);
+		r->out_fd = -1;
+		r->tcpu = tracefs_cpu_open(instance, cpu, false);
+		if (!r->tcpu) {
+			bg_warn("cannot open ring buffer of cpu %d: %s",
+				cpu, strerror(errno));
+			goto fail;
+		}
+		r->subbuf_size = tracefs_cpu_read_size(r->tcpu);
+		set->nr_readers++;
+	}
+
+	return set;
+ fail:
+	bg_readers_free(set);
+	return NULL;
+}
+
+int bg_readers_set_wakeup(struct bg_readers *set, enum bg_wakeup wakeup,
+			  int percent)
+{
+	char val[16];
+	int i;
+
+	if (percent < 0 || percent > 100) {
+		errno = EINVAL;
+		return -1;
+	}
+	set->wakeup = wakeup;
+	for (i = 0; i < set->nr_readers; i++)
+		set->readers[i].busy = wakeup == BG_WAKE_BUSY;
+
+	snprintf(val, sizeof(val), "%d", percent);
+	return tracefs_instance_file_write(set->instance, "buffer_percent",
+					   val) < 0 ? -1 : 0;
+}
+
+int bg_readers_avoid(struct bg_readers *set, const cpu_set_t *avoid)
+{
+	struct bg_reader *r;
+	int i;
+
+	for (i = 0; i < set->nr_readers; i++) {
+		r = &set->readers[i];
+		if (bg_cpu_housekeeping(r->cpu, avoid, &r->affinity) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void update_stats(struct bg_reader *r)
+{
+	if (bg_cpu_stats_read(r->set->instance, r->cpu, &r->stats) < 0)
+		return;
+	r->lost = r->stats.overrun + r->stats.dropped_events;
+}
+
+/*
+ * Once per BG_WAKE_INTERVAL_MS of reading: poll when this CPU lost events
+ * or produced BG_WAKE_BUSY_PAGES pages in an interval, block again after
+ * BG_WAKE_QUIET_INTERVALS intervals at a quarter of that without losses.
+ * A blocked reader only gets here when it wakes, which is fine: it is
+ * only blocked while its CPU is quiet.
+ */
+static void adapt(struct bg_reader *r)
+{
+	uint64_t now = bg_now_ns(), elapsed = now - r->window_start;
+	unsigned long long lost = r->lost, rate;
+
+	if (elapsed < BG_WAKE_INTERVAL_MS * NSEC_PER_MSEC)
+		return;
+
+	update_stats(r);
+	rate = r->window_pages * BG_WAKE_INTERVAL_MS * NSEC_PER_MSEC / elapsed;
+	r->window_start = now;
+	r->window_pages = 0;
+
+	if (r->set->wakeup != BG_WAKE_ADAPTIVE)
+		return;
+
+	if (!r->busy) {
+		if (r->lost > lost || rate >= BG_WAKE_BUSY_PAGES) {
+			r->busy = true;
+			r->switches++;
+		}
+		return;
+	}
+
+	if (r->lost > lost || rate >= BG_WAKE_BUSY_PAGES / 4) {
+		r->quiet = 0;
+	} else if (++r->quiet >= BG_WAKE_QUIET_INTERVALS) {
+		r->busy = false;
+		r->switches++;
+		r->quiet = 0;
+	}
+}
+
+/* Nothing to read: when polling, back off briefly before the next try */
+static void empty_read(struct bg_reader *r)
+{
+	struct timespec pause = { .tv_nsec = BG_BUSY_PAUSE_US * 1000 };
+
+	if (r->busy)
+		nanosleep(&pause, NULL);
+	adapt(r);
+}
+
+static int deliver(struct bg_reader *r, struct kbuffer *kbuf)
+{
+	r->window_pages++;
+	r->subbufs++;
+	r->bytes += kbuffer_subbuffer_size(kbuf);
+	return r->set->fn(r, kbuf, r->set->data);
+}
+
+/*
+ * tracefs_cpu_pipe() is a single splice from the internal pipe and needs
+ * a pipe on the other end; for regular files tracefs_cpu_write() does the
+ * double splice through that internal pipe. Either way the pages never
+ * enter user space.
+ */
+static int splice_once(struct bg_reader *r)
+{
+	if (r->out_is_pipe)
+		return tracefs_cpu_pipe(r->tcpu, r->out_fd, false);
+	return tracefs_cpu_write(r->tcpu, r->out_fd, false);
+}
+
+static void account_spliced(struct bg_reader *r, int bytes)
+{
+	r->bytes += bytes;
+	if (r->subbuf_size > 0)
+		r->subbufs = r->bytes / r->subbuf_size;
+}
+
+static void *splice_loop(struct bg_reader *r)
+{
+	struct bg_readers *set = r->set;
+	int ret;
+
+	while (!atomic_load_explicit(&set->stopping, memory_order_relaxed)) {
+		ret = splice_once(r);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			if (!atomic_load(&set->stopping))
+				r->err = errno;
+			break;
+		}
+		account_spliced(r, ret);
+	}
+
+	ret = tracefs_cpu_flush_write(r->tcpu, r->out_fd);
+	if (ret > 0)
+		account_spliced(r, ret);
+
+	return NULL;
+}
+
+static struct bg_page *get_free_page(struct bg_reader *r)
+{
+	struct timespec wait = { .tv_nsec = 50 * 1000 };
+	struct bg_page *page;
+
+	page = bg_spsc_pop(&r->free);
+	if (likely(page))
+		return page;
+
+	r->stalls++;
+	while (!(page = bg_spsc_pop(&r->free)))
+		nanosleep(&wait, NULL);
+	return page;
+}
+
+static void publish(struct bg_reader *r, struct bg_page *page, int size)
+{
+	page->size = size;
+	r->subbufs++;
+	r->bytes += size;
+	r->window_pages++;
+	/* Never full: it has room for every page in the pool */
+	bg_spsc_push(&r->full, page);
+}
+
+static void *ring_loop(struct bg_reader *r)
+{
+	struct bg_readers *set = r->set;
+	struct bg_page *page = NULL;
+	int n;
+
+	update_stats(r);
+	r->window_start = bg_now_ns();
+	while (!atomic_load_explicit(&set->stopping, memory_order_relaxed)) {
+		if (!page)
+			page = get_free_page(r);
+		n = tracefs_cpu_read(r->tcpu, page->data, r->busy);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				empty_read(r);
+				continue;
+			}
+			if (!atomic_load(&set->stopping))
+				r->err = errno;
+			break;
+		}
+		if (n == 0) {
+			empty_read(r);
+			continue;
+		}
+		publish(r, page, n);
+		page = NULL;
+		adapt(r);
+	}
+
+	for (;;) {
+		if (!page)
+			page = get_free_page(r);
+		n = tracefs_cpu_flush(r->tcpu, page->data);
+		if (n <= 0)
+			break;
+		publish(r, page, n);
+		page = NULL;
+	}
+
+	update_stats(r);
+	/* A page still held here stays out of the rings; it is freed with the pool */
+	atomic_store_explicit(&r->exited, true, memory_order_release);
+	return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct bg_reader *r = arg;
+	struct bg_readers *set = r->set;
+	struct kbuffer *kbuf;
+
+	/* Not fatal: an unpinned reader still works, it just migrates */
+	if (bg_pin_self_set(&r->affinity) < 0)
+		bg_warn("cannot pin reader of cpu %d: %s", r->cpu, strerror(errno));
+
+	if (set->mode == BG_READ_SPLICE)
+		return splice_loop(r);
+	if (set->mode == BG_READ_RING)
+		return ring_loop(r);
+
+	update_stats(r);
+	r->window_start = bg_now_ns();
+	while (!atomic_load_explicit(&set->stopping, memory_order_relaxed)) {
+		kbuf = tracefs_cpu_read_buf(r->tcpu, r->busy);
+		if (!kbuf) {
+			if (errno == EINTR || errno == EAGAIN) {
+				empty_read(r);
+				continue;
+			}
+			/* tracefs_cpu_stop() also lands here */
+			if (!atomic_load(&set->stopping))
+				r->err = errno;
+			break;
+		}
+		if (deliver(r, kbuf))
+			return NULL;
+		adapt(r);
+	}
+
+	while ((kbuf = tracefs_cpu_flush_buf(r->tcpu))) {
+		if (deliver(r, kbuf))
+			break;
+	}
+
+	update_stats(r);
+	return NULL;
+}
+
+static int start_threads(struct bg_readers *set)
+{
+	sigset_t all, old;
+	int i, ret = 0;
+
+	atomic_store(&set->stopping, false);
+
+	/* Signals are for the controlling thread, not the readers */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i = 0; i < set->nr_readers; i++) {
+		ret = pthread_create(&set->readers[i].thread, NULL,
+				     reader_thread, &set->readers[i]);
+		if (ret)
+			break;
+		set->readers[i].running = true;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		bg_readers_stop(set);
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+int bg_readers_start(struct bg_readers *set, bg_subbuf_fn fn, void *data)
+{
+	set->mode = BG_READ_COPY;
+	set->fn = fn;
+	set->data = data;
+	return start_threads(set);
+}
+
+int bg_readers_start_splice(struct bg_readers *set, const int *fds)
+{
+	struct stat st;
+	int i;
+
+	for (i = 0; i < set->nr_readers; i++) {
+		if (fstat(fds[i], &st) < 0)
+			return -1;
+		set->readers[i].out_fd = fds[i];
+		set->readers[i].out_is_pipe = S_ISFIFO(st.st_mode);
+	}
+
+	set->mode = BG_READ_SPLICE;
+	set->fn = NULL;
+	set->data = NULL;
+	return start_threads(set);
+}
+
+static void free_ring(struct bg_reader *r)
+{
+	bg_spsc_free(&r->full);
+	bg_spsc_free(&r->free);
+	free(r->pages);
+	if (r->page_mem)
+		munmap(r->page_mem, r->page_mem_size);
+	r->pages = NULL;
+	r->page_mem = NULL;
+	r->nr_pages = 0;
+}
+
+static int alloc_ring(struct bg_reader *r, int nr_pages)
+{
+	int i;
+
+	if (bg_spsc_init(&r->full, nr_pages) < 0 ||
+	    bg_spsc_init(&r->free, nr_pages) < 0)
+		goto fail;
+
+	r->pages = calloc(nr_pages, sizeof(*r->pages));
+	if (!r->pages)
+		goto fail;
+	/*
+	 * Fresh pages, so nothing was touched yet and all of them can go on
+	 * the node of the ring buffer they copy from, wherever the reader
+	 * thread itself runs.
+	 */
+	r->page_mem_size = (size_t)nr_pages * r->subbuf_size;
+	r->page_mem = mmap(NULL, r->page_mem_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->page_mem == MAP_FAILED) {
+		r->page_mem = NULL;
+		goto fail;
+	}
+	/* Not fatal either: without NUMA there is only one node */
+	bg_mem_prefer_node(r->page_mem, r->page_mem_size, r->node);
+
+	r->nr_pages = nr_pages;
+	for (i = 0; i < nr_pages; i++) {
+		r->pages[i].reader = r;
+		r->pages[i].cpu = r->cpu;
+		r->pages[i].data = (char *)r->page_mem + (size_t)i * r->subbuf_size;
+		bg_spsc_push(&r->free, &r->pages[i]);
+	}
+	atomic_init(&r->exited, false);
+	return 0;
+ fail:
+	free_ring(r);
+	return -1;
+}
+
+int bg_readers_start_ring(struct bg_readers *set, int nr_pages)
+{
+	int i;
+
+	if (nr_pages <= 0)
+		nr_pages = BG_RING_PAGES;
+
+	for (i = 0; i < set->nr_readers; i++) {
+		if (alloc_ring(&set->readers[i], nr_pages) < 0)
+			return -1;
+	}
+
+	set->mode = BG_READ_RING;
+	set->fn = NULL;
+	set->data = NULL;
+	return start_threads(set);
+}
+
+void bg_readers_signal_stop(struct bg_readers *set)
+{
+	struct bg_reader *r;
+	int i;
+
+	atomic_store(&set->stopping, true);
+
+	for (i = 0; i < set->nr_readers; i++) {
+		r = &set->readers[i];
+		if (r->running)
+			tracefs_cpu_stop(r->tcpu);
+	}
+}
+
+void bg_readers_stop(struct bg_readers *set)
+{
+	struct bg_reader *r;
+	int i;
+
+	bg_readers_signal_stop(set);
+
+	for (i = 0; i < set->nr_readers; i++) {
+		r = &set->readers[i];
+		if (!r->running)
+			continue;
+		pthread_join(r->thread, NULL);
+		r->running = false;
+	}
+}
+
+void bg_readers_free(struct bg_readers *set)
+{
+	int i;
+
+	if (!set)
+		return;
+
+	bg_readers_stop(set);
+
+	for (i = 0; i < set->nr_readers; i++) {
+		tracefs_cpu_close(set->readers[i].tcpu);
+		free_ring(&set->readers[i]);
+	}
+
+	free(set->readers);
+	free(set);
+}
@@ -0,0 +1,187 @@
+#ifndef BG_READER_H
+#define BG_READER_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include <tracefs.h>
+
+#include "session.h"
+#include "spsc.h"
+
+/* Default number of sub-buffer pages each reader cycles through */
+#define BG_RING_PAGES	64
+
+/*
+ * How readers wait for data. A blocking read sleeps until the ring buffer
+ * is buffer_percent full, which is cheap on a quiet CPU but risks
+ * overruns on a busy one; non-blocking reads in a loop keep up with any
+ * rate but cost CPU time when there is nothing to read.
+ */
+enum bg_wakeup {
+	BG_WAKE_ADAPTIVE,	/* per CPU, switch on rate and overruns */
+	BG_WAKE_WATERMARK,	/* always block until the watermark */
+	BG_WAKE_BUSY,		/* always poll without blocking */
+};
+
+#define BG_WAKE_PERCENT		50	/* default watermark */
+#define BG_WAKE_INTERVAL_MS	100	/* the adaptive policy looks this often */
+#define BG_WAKE_BUSY_PAGES	64	/* per interval, to start busy polling */
+#define BG_WAKE_QUIET_INTERVALS	10	/* quiet intervals before blocking again */
+#define BG_BUSY_PAUSE_US	20	/* between empty non-blocking reads */
+
+struct bg_reader;
+struct bg_readers;
+
+/*
+ * Called on the reader thread of a CPU for every sub-buffer drained from
+ * that CPU's ring buffer. @kbuf is loaded with the sub-buffer and is only
+ * valid until the callback returns. A non-zero return stops that reader.
+ */
+typedef int (*bg_subbuf_fn)(struct bg_reader *reader, struct kbuffer *kbuf,
+			    void *data);
+
+enum bg_read_mode {
+	BG_READ_COPY,		/* sub-buffers are handed to a bg_subbuf_fn */
+	BG_READ_SPLICE,		/* pages are spliced into bg_reader::out_fd */
+	BG_READ_RING,		/* pages are handed to a consumer thread */
+};
+
+/* A sub-buffer read in BG_READ_RING mode; @size bytes are valid */
+struct bg_page {
+	struct bg_reader	*reader;
+	void			*data;
+	int			size;
+	int			cpu;
+};
+
+struct bg_reader {
+	struct bg_readers	*set;
+	struct tracefs_cpu	*tcpu;
+	pthread_t		thread;
+	int			cpu;
+	int			node;		/* of @cpu: where its pages live */
+	cpu_set_t		affinity;	/* where the thread runs */
+	int			subbuf_size;
+	int			err;
+	int			out_fd;		/* BG_READ_SPLICE target */
+	bool			out_is_pipe;
+	bool			running;
+	void			*priv;		/* owned by the caller */
+	unsigned long long	subbufs;
+	unsigned long long	bytes;
+
+	/* BG_READ_RING */
+	struct bg_spsc		full;		/* reader -> consumer */
+	struct bg_spsc		free;		/* consumer -> reader */
+	struct bg_page		*pages;
+	void			*page_mem;	/* on @node's memory */
+	size_t			page_mem_size;
+	int			nr_pages;
+	atomic_bool		exited;
+	unsigned long long	stalls;		/* waits for a recycled page */
+
+	/* Wakeup policy state, see enum bg_wakeup */
+	bool			busy;
+	unsigned long long	switches;	/* between blocking and polling */
+	unsigned long long	lost;		/* overrun + dropped, per stats */
+	struct bg_cpu_stats	stats;		/* last per_cpu/cpuN/stats read */
+	uint64_t		window_start;
+	unsigned long long	window_pages;
+	int			quiet;
+};
+
+struct bg_readers {
+	struct tracefs_instance	*instance;
+	struct bg_reader	*readers;
+	int			nr_readers;
+	enum bg_read_mode	mode;
+	bg_subbuf_fn		fn;
+	void			*data;
+	enum bg_wakeup		wakeup;
+	atomic_bool		stopping;
+};
+
+/*
+ * Open one tracefs_cpu handle per CPU in @cpus on @instance (NULL for the
+ * top-level instance). Nothing is read until bg_readers_start().
+ */
+struct bg_readers *bg_readers_alloc(struct tracefs_instance *instance,
+				    cpu_set_t *cpus);
+
+/*
+ * Choose how the readers wait (default BG_WAKE_ADAPTIVE) and set the
+ * instance's buffer_percent watermark to @percent. Call before starting.
+ */
+int bg_readers_set_wakeup(struct bg_readers *set, enum bg_wakeup wakeup,
+			  int percent);
+
+/*
+ * Keep the reader threads off @avoid (the isolated CPUs): a reader whose
+ * CPU is avoided runs on a housekeeping SMT sibling, or else on its NUMA
+ * node's housekeeping CPUs, or else anywhere outside @avoid. Its page
+ * buffers stay on the node of the CPU it drains either way. Call before
+ * starting.
+ */
+int bg_readers_avoid(struct bg_readers *set, const cpu_set_t *avoid);
+
+/*
+ * Spawn one reader thread per CPU, each pinned to the CPU it drains (see
+ * bg_readers_avoid()).
+ */
+int bg_readers_start(struct bg_readers *set, bg_subbuf_fn fn, void *data);
+
+/*
+ * Like bg_readers_start(), but each reader splices raw pages from its
+ * trace_pipe_raw straight into @fds[i] (indexed like set->readers) without
+ * copying them through user space. Nothing is decoded; the output is the
+ * ring buffer's own sub-buffer format, to be parsed offline.
+ */
+int bg_readers_start_splice(struct bg_readers *set, const int *fds);
+
+/*
+ * Like bg_readers_start(), but each reader reads into a private pool of
+ * @nr_pages page buffers and hands them to one consumer thread through a
+ * lock-free SPSC ring. The consumer returns every page it is done with
+ * through bg_page_put(), which refills that reader's free ring. A reader
+ * with no free page waits for one rather than dropping data; the kernel
+ * ring buffer absorbs the backlog meanwhile.
+ */
+int bg_readers_start_ring(struct bg_readers *set, int nr_pages);
+
+/* Consumer side of BG_READ_RING; NULL when the reader has nothing queued */
+static inline struct bg_page *bg_reader_next_page(struct bg_reader *r)
+{
+	return bg_spsc_pop(&r->full);
+}
+
+static inline void bg_page_put(struct bg_page *page)
+{
+	bg_spsc_push(&page->reader->free, page);
+}
+
+/* The reader thread has exited and every page it read was consumed */
+static inline bool bg_reader_drained(struct bg_reader *r)
+{
+	return atomic_load_explicit(&r->exited, memory_order_acquire) &&
+	       !bg_spsc_count(&r->full);
+}
+
+/*
+ * Ask all readers to stop without waiting for them. In BG_READ_RING mode
+ * the consumer must keep draining until every reader is drained, because
+ * the final flush needs recycled pages; then call bg_readers_stop().
+ */
+void bg_readers_signal_stop(struct bg_readers *set);
+
+/*
+ * Wake all readers, let each flush what is left in its ring buffer and
+ * join the threads. Safe to call on a set that was never started.
+ */
+void bg_readers_stop(struct bg_readers *set);
+
+void bg_readers_free(struct bg_readers *set);
+
+#endif /* BG_READER_H */
@@ -0,0 +1,55 @@
+#include <errno.h>
+
+#include "render.h"
+#include "util.h"
+
+void bg_render_init(struct bg_render *r, int fd, pthread_mutex_t *lock)
+{
+	trace_seq_init(&r->seq);
+	r->fd = fd;
+	r->lock = lock;
+	r->records = 0;
+}
+
+int bg_render_record(struct bg_render *r, struct tep_handle *tep,
+		     struct tep_record *record)
+{
+	tep_print_event(tep, &r->seq, record, "%6.1000d [%03d] %6d %s: %s\n",
+			TEP_PRINT_TS, TEP_PRINT_CPU, TEP_PRINT_PID,
+			TEP_PRINT_NAME, TEP_PRINT_INFO);
+	if (r->seq.state != TRACE_SEQ__GOOD) {
+		errno = ENOMEM;
+		return -1;
+	}
+	r->records++;
+
+	if (r->seq.len >= BG_RENDER_FLUSH)
+		return bg_render_flush(r);
+	return 0;
+}
+
+int bg_render_flush(struct bg_render *r)
+{
+	int ret;
+
+	if (!r->seq.len)
+		return 0;
+
+	if (r->lock)
+		pthread_mutex_lock(r->lock);
+	ret = bg_write_all(r->fd, r->seq.buffer, r->seq.len);
+	if (r->lock)
+		pthread_mutex_unlock(r->lock);
+
+	/* Keeps the buffer */
+	trace_seq_reset(&r->seq);
+	return ret;
+}
+
+int bg_render_destroy(struct bg_render *r)
+{
+	int ret = bg_render_flush(r);
+
+	trace_seq_destroy(&r->seq);
+	return ret;
+}
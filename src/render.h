@@ -0,0 +1,38 @@
+#ifndef BG_RENDER_H
+#define BG_RENDER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <event-parse.h>
+#include <trace-seq.h>
+
+/* Text is written out once this much has piled up */
+#define BG_RENDER_FLUSH		(256 * 1024)
+
+/*
+ * Text rendering without allocator churn: records are printed back to
+ * back into one trace_seq per thread, which is reset rather than
+ * destroyed after each flush, so it only grows until it fits a batch.
+ * A batch goes out in a single write() under @lock (may be NULL), so
+ * renderers on several threads never interleave within a batch.
+ */
+struct bg_render {
+	struct trace_seq	seq;
+	int			fd;
+	pthread_mutex_t		*lock;
+	unsigned long long	records;
+};
+
+void bg_render_init(struct bg_render *r, int fd, pthread_mutex_t *lock);
+
+/* Render one record; may flush. */
+int bg_render_record(struct bg_render *r, struct tep_handle *tep,
+		     struct tep_record *record);
+
+int bg_render_flush(struct bg_render *r);
+
+/* Flush and free; returns the result of the last flush. */
+int bg_render_destroy(struct bg_render *r);
+
+#endif /* BG_RENDER_H */
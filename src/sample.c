@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "formats.h"
+#include "sample.h"
+
+static bool rule_set(const struct bg_sample_rule *r)
+{
+	return r->every || r->rate;
+}
+
+/* "1/10", "5000/s" or "1/10,5000/s" */
+static int parse_spec(const char *spec, struct bg_sample_rule *rule)
+{
+	unsigned long n, d;
+	char *end;
+
+	memset(rule, 0, sizeof(*rule));
+	for (;;) {
+		n = strtoul(spec, &end, 10);
+		if (end == spec || *end != '/' || !n)
+			return -1;
+		spec = end + 1;
+		if (*spec == 's') {
+			rule->rate = n;
+			spec++;
+		} else if (n == 1) {
+			d = strtoul(spec, &end, 10);
+			if (end == spec || !d)
+				return -1;
+			rule->every = d;
+			spec = end;
+		} else {
+			return -1;
+		}
+		if (!*spec)
+			return 0;
+		if (*spec++ != ',')
+			return -1;
+	}
+}
+
+static int set_rule(struct bg_sample_rules *rules, int id,
+		    const struct bg_sample_rule *rule)
+{
+	struct bg_sample_rule *ids;
+
+	if (id >= rules->nr_ids) {
+		ids = realloc(rules->ids, (id + 1) * sizeof(*ids));
+		if (!ids)
+			return -1;
+		memset(ids + rules->nr_ids, 0,
+		       (id + 1 - rules->nr_ids) * sizeof(*ids));
+		rules->ids = ids;
+		rules->nr_ids = id + 1;
+	}
+	rules->ids[id] = *rule;
+	return 0;
+}
+
+int bg_sample_rules_parse(struct bg_sample_rules *rules, struct bg_formats *f,
+			  const char *arg)
+{
+	struct bg_sample_rule rule;
+	char *system, *name, *spec;
+	int id, ret = -1;
+
+	system = strdup(arg);
+	if (!system)
+		return -1;
+
+	spec = strchr(system, '=');
+	if (!spec || parse_spec(spec + 1, &rule) < 0) {
+		errno = EINVAL;
+		goto out;
+	}
+	*spec = '\0';
+
+	if (!strcmp(system, "*")) {
+		rules->any = rule;
+		ret = 0;
+		goto out;
+	}
+
+	name = strchr(system, ':');
+	if (!name) {
+		errno = EINVAL;
+		goto out;
+	}
+	*name++ = '\0';
+	id = bg_formats_find_id(f, system, name);
+	if (id < 0) {
+		errno = ENOENT;
+		goto out;
+	}
+	ret = set_rule(rules, id, &rule);
+ out:
+	free(system);
+	return ret;
+}
+
+void bg_sample_rules_free(struct bg_sample_rules *rules)
+{
+	free(rules->ids);
+	memset(rules, 0, sizeof(*rules));
+}
+
+static void init_states(struct bg_sampler *s, int from, int to)
+{
+	const struct bg_sample_rules *rules = s->rules;
+	const struct bg_sample_rule *rule;
+	int id;
+
+	memset(s->st + from, 0, (to - from) * sizeof(*s->st));
+	for (id = from; id < to; id++) {
+		rule = id < rules->nr_ids && rule_set(&rules->ids[id]) ?
+		       &rules->ids[id] : &rules->any;
+		s->st[id].every = rule->every;
+		s->st[id].rate = rule->rate;
+	}
+}
+
+int bg_sampler_init(struct bg_sampler *s, const struct bg_sample_rules *rules)
+{
+	memset(s, 0, sizeof(*s));
+	s->rules = rules;
+	if (!rules->nr_ids)
+		return 0;
+
+	s->st = calloc(rules->nr_ids, sizeof(*s->st));
+	if (!s->st)
+		return -1;
+	s->nr = rules->nr_ids;
+	init_states(s, 0, s->nr);
+	return 0;
+}
+
+void bg_sampler_free(struct bg_sampler *s)
+{
+	free(s->st);
+	memset(s, 0, sizeof(*s));
+}
+
+int bg_sampler_set_rules(struct bg_sampler *s,
+			 const struct bg_sample_rules *rules)
+{
+	const struct bg_sample_rule *rule;
+	struct bg_sample_state *st;
+	int id, nr = s->nr;
+
+	if (rules->nr_ids > nr) {
+		st = realloc(s->st, rules->nr_ids * sizeof(*st));
+		if (!st)
+			return -1;
+		memset(st + nr, 0, (rules->nr_ids - nr) * sizeof(*st));
+		s->st = st;
+		s->nr = rules->nr_ids;
+	}
+	s->rules = rules;
+
+	/* Windows and skips restart; the counts carry on */
+	for (id = 0; id < s->nr; id++) {
+		rule = id < rules->nr_ids && rule_set(&rules->ids[id]) ?
+		       &rules->ids[id] : &rules->any;
+		st = &s->st[id];
+		st->every = rule->every;
+		st->rate = rule->rate;
+		st->skip = 0;
+		st->window_kept = 0;
+	}
+	return 0;
+}
+
+struct bg_sample_state *bg_sampler_state(struct bg_sampler *s, uint16_t id)
+{
+	struct bg_sample_state *st;
+	int nr;
+
+	/* Past the explicit rules only the rule for any event applies */
+	if (!rule_set(&s->rules->any))
+		return NULL;
+
+	nr = id < 1024 ? 1024 : id + 1;
+	st = realloc(s->st, nr * sizeof(*st));
+	if (!st)
+		return NULL;
+	s->st = st;
+	init_states(s, s->nr, nr);
+	s->nr = nr;
+	return &s->st[id];
+}
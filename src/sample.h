@@ -0,0 +1,121 @@
+#ifndef BG_SAMPLE_H
+#define BG_SAMPLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "util.h"
+
+struct bg_formats;
+
+/*
+ * Keep one in @every records of an event and at most @rate of them per
+ * second of trace time, per CPU. Zero in both means "no rule"; every = 1
+ * keeps all, and overrides a rule for any event.
+ */
+struct bg_sample_rule {
+	unsigned int	every;
+	unsigned int	rate;
+};
+
+struct bg_sample_rules {
+	struct bg_sample_rule	*ids;		/* indexed by event id */
+	int			nr_ids;
+	struct bg_sample_rule	any;		/* ids without a rule of their own */
+};
+
+struct bg_sample_state {
+	unsigned int		every;
+	unsigned int		rate;
+	unsigned int		skip;		/* to go before the next 1-in-N */
+	unsigned int		window_kept;
+	uint64_t		window;		/* second of trace time */
+	unsigned long long	kept;
+	unsigned long long	suppressed;
+};
+
+/*
+ * The per-CPU side: decided on the event id alone, right after the common
+ * header, so suppressed records are never decoded. Every suppressed record
+ * is counted per id, so kept counts scale back up by
+ * (kept + suppressed) / kept.
+ */
+struct bg_sampler {
+	const struct bg_sample_rules	*rules;
+	struct bg_sample_state		*st;	/* indexed by event id */
+	int				nr;
+	unsigned long long		suppressed;
+};
+
+/*
+ * Add "system:event=spec" or "*=spec", with spec "1/N", "K/s" or both
+ * separated by a comma ("1/10,5000/s"). @f resolves the event id.
+ */
+int bg_sample_rules_parse(struct bg_sample_rules *rules, struct bg_formats *f,
+			  const char *arg);
+void bg_sample_rules_free(struct bg_sample_rules *rules);
+
+static inline bool bg_sample_rules_empty(const struct bg_sample_rules *rules)
+{
+	return !rules->nr_ids && !rules->any.every && !rules->any.rate;
+}
+
+int bg_sampler_init(struct bg_sampler *s, const struct bg_sample_rules *rules);
+void bg_sampler_free(struct bg_sampler *s);
+
+/*
+ * Switch @s over to @rules, keeping the kept and suppressed counts of every
+ * id. The previous rules may be freed once this returns.
+ */
+int bg_sampler_set_rules(struct bg_sampler *s,
+			 const struct bg_sample_rules *rules);
+
+/* State of an id past the end of @s->st; NULL when no rule can apply */
+struct bg_sample_state *bg_sampler_state(struct bg_sampler *s, uint16_t id);
+
+static inline bool bg_sample_keep(struct bg_sampler *s, uint16_t id,
+				  uint64_t ts)
+{
+	struct bg_sample_state *st;
+	uint64_t window;
+
+	if (likely(id < s->nr))
+		st = &s->st[id];
+	else if (!(st = bg_sampler_state(s, id)))
+		return true;
+	if (st->every <= 1 && !st->rate)
+		return true;
+
+	if (st->every > 1) {
+		if (st->skip) {
+			st->skip--;
+			goto drop;
+		}
+		st->skip = st->every - 1;
+	}
+	if (st->rate) {
+		window = ts / NSEC_PER_SEC;
+		if (window != st->window) {
+			st->window = window;
+			st->window_kept = 0;
+		}
+		if (st->window_kept == st->rate)
+			goto drop;
+		st->window_kept++;
+	}
+	st->kept++;
+	return true;
+ drop:
+	st->suppressed++;
+	s->suppressed++;
+	return false;
+}
+
+/* Records of @id suppressed so far, 0 for ids without a rule */
+static inline unsigned long long bg_sample_suppressed(const struct bg_sampler *s,
+						      int id)
+{
+	return id < s->nr ? s->st[id].suppressed : 0;
+}
+
+#endif /* BG_SAMPLE_H */
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <kbuffer.h>
+
+#include "capture.h"
+#include "formats.h"
+#include "scan.h"
+#include "util.h"
+
+struct scan {
+	struct bg_capture_file		*cf;
+	const struct bg_scan_ops	*ops;
+	void				*data;
+	size_t				*chunks;	/* index entries to decode */
+	size_t				nr_chunks;
+	atomic_size_t			next;
+	atomic_bool			failed;
+};
+
+struct scan_thread {
+	struct scan			*scan;
+	struct bg_scan_worker		w;
+	pthread_t			thread;
+	bool				started;
+	bool				ready;		/* init succeeded */
+};
+
+static int scan_chunk(struct scan *s, struct bg_scan_worker *w,
+		      const struct bg_cap_index_entry *e, struct kbuffer *kbuf,
+		      struct bg_batch *b, void **buf, size_t *buf_size)
+{
+	const size_t page_size = s->cf->hdr.page_size;
+	const unsigned char *pages;
+	unsigned int p;
+
+	pages = bg_capture_chunk_pages(s->cf, e);
+	if (!pages) {
+		if (e->raw_size > *buf_size) {
+			free(*buf);
+			*buf = malloc(e->raw_size);
+			*buf_size = *buf ? e->raw_size : 0;
+			if (!*buf)
+				return -1;
+		}
+		if (bg_capture_read_chunk(s->cf, e, *buf) < 0)
+			return -1;
+		pages = *buf;
+	}
+
+	for (p = 0; p < e->nr_pages; p++) {
+		/* kbuffer only reads the sub-buffer it is given */
+		if (kbuffer_load_subbuffer(kbuf, (void *)(pages + p * page_size)) < 0 ||
+		    bg_batch_decode(b, kbuf, e->cpu) < 0 ||
+		    s->ops->batch(w, b) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void *scan_thread(void *arg)
+{
+	struct scan_thread *t = arg;
+	struct scan *s = t->scan;
+	const struct bg_cap_header *hdr = &s->cf->hdr;
+	bool big = hdr->flags & BG_CAP_F_BIG_ENDIAN;
+	struct kbuffer *kbuf;
+	struct bg_batch b;
+	void *buf = NULL;
+	size_t i, buf_size = 0;
+
+	t->w.formats = bg_capture_formats(s->cf);
+	kbuf = kbuffer_alloc(hdr->long_size == 4 ? KBUFFER_LSIZE_4 :
+						   KBUFFER_LSIZE_8,
+			     big ? KBUFFER_ENDIAN_BIG : KBUFFER_ENDIAN_LITTLE);
+	if (!kbuf)
+		goto fail;
+	if (bg_batch_init(&b, 256) < 0)
+		goto fail_kbuf;
+	b.swap = big != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+
+	if (s->ops->init && s->ops->init(&t->w, s->data) < 0)
+		goto fail_batch;
+	t->ready = true;
+
+	/* Claim chunks one at a time; they are big enough to amortize it */
+	while (!atomic_load_explicit(&s->failed, memory_order_relaxed)) {
+		i = atomic_fetch_add_explicit(&s->next, 1, memory_order_relaxed);
+		if (i >= s->nr_chunks)
+			break;
+		if (scan_chunk(s, &t->w, &s->cf->index[s->chunks[i]], kbuf, &b,
+			       &buf, &buf_size) < 0) {
+			bg_warn("chunk at offset %llu: %s",
+				(unsigned long long)s->cf->index[s->chunks[i]].offset,
+				strerror(errno));
+			goto fail_batch;
+		}
+	}
+
+	free(buf);
+	bg_batch_free(&b);
+	kbuffer_free(kbuf);
+	return NULL;
+
+ fail_batch:
+	free(buf);
+	bg_batch_free(&b);
+ fail_kbuf:
+	kbuffer_free(kbuf);
+ fail:
+	atomic_store(&s->failed, true);
+	return NULL;
+}
+
+static int online_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+int bg_capture_scan(struct bg_capture_file *cf, uint64_t start, uint64_t end,
+		    int nr_workers, const struct bg_scan_ops *ops, void *data)
+{
+	struct scan s = { .cf = cf, .ops = ops, .data = data };
+	struct scan_thread *threads;
+	size_t i;
+	int ret = -1;
+
+	s.chunks = malloc(cf->nr_index * sizeof(*s.chunks) + 1);
+	if (!s.chunks)
+		return -1;
+	for (i = bg_capture_find(cf, start); i < cf->nr_index; i++) {
+		if (cf->index[i].first_ts > end)
+			break;
+		if (bg_capture_overlaps(&cf->index[i], start, end))
+			s.chunks[s.nr_chunks++] = i;
+	}
+
+	if (nr_workers <= 0)
+		nr_workers = online_cpus();
+	if ((size_t)nr_workers > s.nr_chunks)
+		nr_workers = s.nr_chunks ? s.nr_chunks : 1;
+
+	threads = calloc(nr_workers, sizeof(*threads));
+	if (!threads)
+		goto out;
+
+	for (i = 0; i < (size_t)nr_workers; i++) {
+		threads[i].scan = &s;
+		threads[i].w.id = i;
+		threads[i].w.start = start;
+		threads[i].w.end = end;
+		errno = pthread_create(&threads[i].thread, NULL, scan_thread,
+				       &threads[i]);
+		if (errno) {
+			atomic_store(&s.failed, true);
+			break;
+		}
+		threads[i].started = true;
+	}
+
+	for (i = 0; i < (size_t)nr_workers && threads[i].started; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	ret = atomic_load(&s.failed) ? -1 : 0;
+
+	/* Serially, so @merge needs no locking */
+	for (i = 0; i < (size_t)nr_workers; i++) {
+		if (threads[i].ready) {
+			if (!ret && ops->merge && ops->merge(&threads[i].w, data) < 0)
+				ret = -1;
+			if (ops->fini)
+				ops->fini(&threads[i].w);
+		}
+		bg_formats_close(threads[i].w.formats);
+	}
+	free(threads);
+ out:
+	free(s.chunks);
+	return ret;
+}
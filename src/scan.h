@@ -0,0 +1,45 @@
+#ifndef BG_SCAN_H
+#define BG_SCAN_H
+
+#include <stdint.h>
+
+#include "batch.h"
+
+struct bg_capture_file;
+struct bg_formats;
+
+/*
+ * One decoding thread of a capture scan. Every worker parses its own
+ * copy of the embedded formats, so no tep state is shared between them;
+ * @formats is NULL if the capture's formats could not be parsed.
+ */
+struct bg_scan_worker {
+	int			id;
+	struct bg_formats	*formats;
+	uint64_t		start;		/* window, inclusive */
+	uint64_t		end;
+	void			*priv;		/* for the ops */
+};
+
+/*
+ * @batch sees every sub-buffer of the chunks overlapping the window, in
+ * no particular order across workers; records outside the window are
+ * left for it to skip. Once all workers are done, @merge folds each
+ * worker's partial result into @data, one worker at a time.
+ */
+struct bg_scan_ops {
+	int	(*init)(struct bg_scan_worker *w, void *data);
+	int	(*batch)(struct bg_scan_worker *w, const struct bg_batch *b);
+	int	(*merge)(struct bg_scan_worker *w, void *data);
+	void	(*fini)(struct bg_scan_worker *w);
+};
+
+/*
+ * Decode the chunks of @cf overlapping [@start, @end] on @nr_workers
+ * threads (0: one per online CPU). Returns 0, or -1 if any callback or
+ * chunk failed.
+ */
+int bg_capture_scan(struct bg_capture_file *cf, uint64_t start, uint64_t end,
+		    int nr_workers, const struct bg_scan_ops *ops, void *data);
+
+#endif /* BG_SCAN_H */
@@ -0,0 +1,232 @@
+#include <stdlib.h>
+
+#include "accessors.h"
+#include "agg.h"
+#include "schedlat.h"
+#include "util.h"
+
+/* Low bits of prev_state are the TASK_REPORT states; none set means "R" */
+#define TASK_REPORT_MASK	0x7f
+
+struct bg_schedlat *bg_schedlat_alloc(unsigned int nr_tasks)
+{
+	struct bg_schedlat *s;
+	unsigned int n = 16;
+
+	if (!nr_tasks)
+		nr_tasks = BG_SCHEDLAT_TASKS;
+	while (n < nr_tasks)
+		n <<= 1;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->slots = calloc(n, sizeof(*s->slots));
+	if (!s->slots) {
+		free(s);
+		return NULL;
+	}
+	s->mask = n - 1;
+	s->limit = n / 4 * 3;
+	return s;
+}
+
+void bg_schedlat_free(struct bg_schedlat *s)
+{
+	if (!s)
+		return;
+	free(s->slots);
+	free(s);
+}
+
+void bg_schedlat_set_agg(struct bg_schedlat *s, struct bg_agg *agg, int slot)
+{
+	s->agg = agg;
+	s->agg_slot = slot;
+}
+
+static void count(struct bg_schedlat *s, unsigned int counter)
+{
+	if (s->agg)
+		bg_agg_add(s->agg, s->agg_slot, counter, 1);
+}
+
+static void add_hist(struct bg_schedlat *s, struct bg_loghist *h,
+		     unsigned int hist, uint64_t v)
+{
+	bg_loghist_add(h, v);
+	if (s->agg)
+		bg_agg_record(s->agg, s->agg_slot, hist, v);
+}
+
+void bg_schedlat_reset(struct bg_schedlat *s)
+{
+	bg_loghist_reset(&s->offcpu);
+	bg_loghist_reset(&s->runq);
+}
+
+static unsigned int home(const struct bg_schedlat *s, int pid)
+{
+	return ((uint32_t)pid * 0x9e3779b1u) & s->mask;
+}
+
+static struct bg_task_slot *lookup(struct bg_schedlat *s, int pid)
+{
+	unsigned int i = home(s, pid);
+
+	while (s->slots[i].pid) {
+		if (s->slots[i].pid == pid)
+			return &s->slots[i];
+		i = (i + 1) & s->mask;
+	}
+	return NULL;
+}
+
+/*
+ * Linear probing without tombstones: after emptying a slot, move back
+ * every entry of the run behind it that may live there, so lookups can
+ * still stop at the first empty slot.
+ */
+static void remove_slot(struct bg_schedlat *s, struct bg_task_slot *slot)
+{
+	unsigned int hole = slot - s->slots, i = hole, h;
+
+	for (;;) {
+		i = (i + 1) & s->mask;
+		if (!s->slots[i].pid)
+			break;
+		h = home(s, s->slots[i].pid);
+		/* Stays put if its home lies cyclically in (hole, i] */
+		if (hole <= i ? hole < h && h <= i : hole < h || h <= i)
+			continue;
+		s->slots[hole] = s->slots[i];
+		hole = i;
+	}
+	s->slots[hole].pid = 0;
+	s->used--;
+}
+
+static uint64_t last_seen(const struct bg_task_slot *slot)
+{
+	return slot->off_ts > slot->queued_ts ? slot->off_ts : slot->queued_ts;
+}
+
+/* Forget tasks not seen for BG_SCHEDLAT_MAX_AGE_NS; rare and O(table) */
+static void expire(struct bg_schedlat *s)
+{
+	struct bg_task_slot *slot;
+	unsigned int i;
+
+	if (s->now < BG_SCHEDLAT_MAX_AGE_NS)
+		return;
+	for (i = 0; i <= s->mask; ) {
+		slot = &s->slots[i];
+		if (slot->pid &&
+		    last_seen(slot) + BG_SCHEDLAT_MAX_AGE_NS <= s->now) {
+			remove_slot(s, slot);
+			s->expired++;
+			count(s, BG_SCHEDLAT_EXPIRED);
+			/* An entry may have been shifted into this slot */
+			continue;
+		}
+		i++;
+	}
+}
+
+static struct bg_task_slot *get_slot(struct bg_schedlat *s, int pid)
+{
+	struct bg_task_slot *slot;
+	unsigned int i;
+
+	slot = lookup(s, pid);
+	if (slot)
+		return slot;
+
+	if (s->used >= s->limit) {
+		expire(s);
+		if (s->used >= s->limit) {
+			s->dropped++;
+			count(s, BG_SCHEDLAT_DROPPED);
+			return NULL;
+		}
+	}
+
+	for (i = home(s, pid); s->slots[i].pid; i = (i + 1) & s->mask)
+		;
+	slot = &s->slots[i];
+	slot->pid = pid;
+	slot->off_ts = slot->queued_ts = 0;
+	s->used++;
+	return slot;
+}
+
+void bg_schedlat_switch(struct bg_schedlat *s, uint64_t ts, int prev_pid,
+			uint64_t prev_state, int next_pid)
+{
+	struct bg_task_slot *slot;
+
+	s->switches++;
+	count(s, BG_SCHEDLAT_SWITCHES);
+	if (ts > s->now)
+		s->now = ts;
+
+	/* The idle tasks (pid 0 on every CPU) are not tasks to follow */
+	if (next_pid) {
+		slot = lookup(s, next_pid);
+		if (slot) {
+			if (slot->off_ts && ts >= slot->off_ts)
+				add_hist(s, &s->offcpu, BG_SCHEDLAT_OFFCPU,
+					 ts - slot->off_ts);
+			if (slot->queued_ts && ts >= slot->queued_ts)
+				add_hist(s, &s->runq, BG_SCHEDLAT_RUNQ,
+					 ts - slot->queued_ts);
+			/* Nothing to remember while it runs */
+			remove_slot(s, slot);
+		}
+	}
+
+	if (prev_pid) {
+		slot = get_slot(s, prev_pid);
+		if (!slot)
+			return;
+		slot->off_ts = ts;
+		/* Preempted: back on the run queue right away */
+		slot->queued_ts = prev_state & TASK_REPORT_MASK ? 0 : ts;
+	}
+}
+
+void bg_schedlat_wakeup(struct bg_schedlat *s, uint64_t ts, int pid)
+{
+	struct bg_task_slot *slot;
+
+	s->wakeups++;
+	count(s, BG_SCHEDLAT_WAKEUPS);
+	if (ts > s->now)
+		s->now = ts;
+	if (!pid)
+		return;
+
+	slot = get_slot(s, pid);
+	/* A second wakeup of a queued task does not restart its wait */
+	if (slot && !slot->queued_ts)
+		slot->queued_ts = ts;
+}
+
+int bg_schedlat_record(struct bg_schedlat *s, const struct bg_accessors *acc,
+		       int id, const void *data, uint64_t ts)
+{
+	const struct bg_sched_switch_acc *sw = &acc->sched_switch;
+	const struct bg_sched_wakeup_acc *wk = &acc->sched_wakeup;
+
+	if (id == sw->id) {
+		bg_schedlat_switch(s, ts, bg_acc_s64(&sw->prev_pid, data),
+				   bg_acc_u64(&sw->prev_state, data),
+				   bg_acc_s64(&sw->next_pid, data));
+		return 1;
+	}
+	if (id == wk->id) {
+		bg_schedlat_wakeup(s, ts, bg_acc_s64(&wk->pid, data));
+		return 1;
+	}
+	return 0;
+}
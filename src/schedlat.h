@@ -0,0 +1,90 @@
+#ifndef BG_SCHEDLAT_H
+#define BG_SCHEDLAT_H
+
+#include <stdint.h>
+
+#include "loghist.h"
+
+struct bg_accessors;
+struct bg_agg;
+
+/* Default per-task table size; a power of two */
+#define BG_SCHEDLAT_TASKS	65536
+
+/*
+ * A task not seen for this long of trace time may be forgotten to make
+ * room, once the table is full (most likely it exited).
+ */
+#define BG_SCHEDLAT_MAX_AGE_NS	(60 * 1000000000ULL)
+
+/* What bg_schedlat_set_agg() counts into */
+enum {
+	BG_SCHEDLAT_SWITCHES,
+	BG_SCHEDLAT_WAKEUPS,
+	BG_SCHEDLAT_EXPIRED,
+	BG_SCHEDLAT_DROPPED,
+	BG_SCHEDLAT_NR_COUNTERS,
+};
+
+enum {
+	BG_SCHEDLAT_OFFCPU,
+	BG_SCHEDLAT_RUNQ,
+	BG_SCHEDLAT_NR_HISTS,
+};
+
+struct bg_task_slot {
+	int32_t		pid;		/* 0: empty */
+	uint32_t	pad;
+	uint64_t	off_ts;		/* switched out, 0 while running */
+	uint64_t	queued_ts;	/* woken or preempted, 0 if not queued */
+};
+
+/*
+ * Off-CPU time (switch out to switch back in) and run-queue latency
+ * (wakeup, or preemption, to switch in) of every task, computed as the
+ * records go by from a time-ordered stream. Per-task state lives in a
+ * fixed open-addressing table keyed by pid, so memory never grows and no
+ * record is kept once it was looked at.
+ */
+struct bg_schedlat {
+	struct bg_task_slot	*slots;
+	unsigned int		mask;
+	unsigned int		used;
+	unsigned int		limit;		/* used slots before forgetting */
+	uint64_t		now;		/* newest record seen */
+	struct bg_loghist	offcpu;
+	struct bg_loghist	runq;
+	unsigned long long	switches;
+	unsigned long long	wakeups;
+	unsigned long long	expired;	/* forgotten while off CPU */
+	unsigned long long	dropped;	/* no room even after forgetting */
+	struct bg_agg		*agg;		/* optional, see bg_schedlat_set_agg() */
+	int			agg_slot;
+};
+
+/* @nr_tasks is rounded up to a power of two; 0 for the default. */
+struct bg_schedlat *bg_schedlat_alloc(unsigned int nr_tasks);
+void bg_schedlat_free(struct bg_schedlat *s);
+
+void bg_schedlat_switch(struct bg_schedlat *s, uint64_t ts, int prev_pid,
+			uint64_t prev_state, int next_pid);
+void bg_schedlat_wakeup(struct bg_schedlat *s, uint64_t ts, int pid);
+
+/*
+ * Feed one record if it is a sched_switch or sched_wakeup resolved in
+ * @acc. Returns 1 if it was one of them.
+ */
+int bg_schedlat_record(struct bg_schedlat *s, const struct bg_accessors *acc,
+		       int id, const void *data, uint64_t ts);
+
+/*
+ * Also count everything into @slot of @agg, which has BG_SCHEDLAT_NR_*
+ * counters and histograms. Its totals are never reset, so another thread
+ * can fold them while the records go by.
+ */
+void bg_schedlat_set_agg(struct bg_schedlat *s, struct bg_agg *agg, int slot);
+
+/* Start new histograms; task state carries over. */
+void bg_schedlat_reset(struct bg_schedlat *s);
+
+#endif /* BG_SCHEDLAT_H */
@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "segments.h"
+#include "util.h"
+
+static char *seg_path(struct bg_segments *s, unsigned int seq)
+{
+	char *path;
+
+	if (asprintf(&path, "%s.%06u", s->prefix, seq) < 0)
+		return NULL;
+	return path;
+}
+
+/* What the next segment gets fallocate()d to; called with s->lock held */
+static uint64_t prealloc_size(struct bg_segments *s)
+{
+	uint64_t prealloc = s->largest ? s->largest : BG_SEG_PREALLOC;
+
+	if (s->opts.max_bytes && prealloc > s->opts.max_bytes / 2)
+		prealloc = s->opts.max_bytes / 2;
+	return prealloc;
+}
+
+/*
+ * Open, preallocate and set up the capture of a segment. Whether io_uring
+ * works is settled by the first one, in bg_segments_create(); a later one
+ * it fails for just uses write() and leaves s->opts alone.
+ */
+static struct bg_capture *prepare(struct bg_segments *s, const char *path,
+				  bool first)
+{
+	struct bg_capture *cap;
+	uint64_t prealloc;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+
+	pthread_mutex_lock(&s->lock);
+	prealloc = prealloc_size(s);
+	pthread_mutex_unlock(&s->lock);
+	/*
+	 * KEEP_SIZE, as the trailer has to end the file. Not fatal: where
+	 * the filesystem cannot, blocks are allocated as chunks go out.
+	 */
+	if (prealloc)
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, prealloc);
+
+	cap = bg_capture_create_fd(fd, s->nr_cpus, s->page_size);
+	if (!cap)
+		return NULL;
+	if (bg_capture_set_codec(cap, s->opts.codec, s->opts.level,
+				 s->opts.nr_workers) < 0) {
+		bg_capture_close(cap);
+		return NULL;
+	}
+	if (s->opts.uring_depth >= 0 &&
+	    bg_capture_set_uring(cap, s->opts.uring_depth) < 0) {
+		bg_warn("cannot write %s through io_uring, using write(): %s",
+			path, strerror(errno));
+		if (first)
+			s->opts.uring_depth = -1;
+	}
+	bg_capture_set_sync(cap, s->opts.sync_bytes);
+	return cap;
+}
+
+/* Delete the oldest segments until the rest and @reserve bytes fit */
+static void enforce_cap(struct bg_segments *s, uint64_t reserve)
+{
+	while (s->opts.max_bytes && s->nr_done &&
+	       s->total + reserve > s->opts.max_bytes) {
+		if (unlink(s->done[0].path) < 0 && errno != ENOENT)
+			bg_warn("cannot delete %s: %s", s->done[0].path,
+				strerror(errno));
+		s->total -= s->done[0].size;
+		free(s->done[0].path);
+		memmove(s->done, s->done + 1, --s->nr_done * sizeof(*s->done));
+		s->deleted++;
+	}
+}
+
+/*
+ * Close a finished segment, give back what was preallocated past its end
+ * and account for it. Takes @path. Unless it is the @last, room is kept
+ * for the current one, as large as the largest so far, and for the next
+ * one the helper thread is about to fallocate().
+ */
+static int finish(struct bg_segments *s, struct bg_capture *cap, char *path,
+		  bool last)
+{
+	struct bg_segment *done;
+	struct stat st;
+	int ret;
+
+	ret = bg_capture_close(cap);
+	if (ret < 0)
+		bg_warn("cannot finish %s: %s", path, strerror(errno));
+	if (stat(path, &st) < 0)
+		st.st_size = 0;
+	else if (truncate(path, st.st_size) < 0)
+		bg_warn("cannot trim %s: %s", path, strerror(errno));
+
+	pthread_mutex_lock(&s->lock);
+	done = realloc(s->done, (s->nr_done + 1) * sizeof(*done));
+	if (done) {
+		s->done = done;
+		done[s->nr_done].path = path;
+		done[s->nr_done++].size = st.st_size;
+		s->total += st.st_size;
+		path = NULL;
+	}
+	if ((uint64_t)st.st_size > s->largest)
+		s->largest = st.st_size;
+	enforce_cap(s, last ? 0 : s->largest + prealloc_size(s));
+	if (ret < 0) {
+		s->failed = true;
+		s->err = errno;
+	}
+	pthread_mutex_unlock(&s->lock);
+	free(path);
+	return ret;
+}
+
+static void *segments_thread(void *arg)
+{
+	struct bg_segments *s = arg;
+	struct bg_capture *cap;
+	bool prepare_failed = false;
+	sigset_t mask;
+	char *path;
+
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (!s->stopping && !s->closing &&
+		       (s->next || prepare_failed))
+			pthread_cond_wait(&s->cond, &s->lock);
+
+		/* Closing first frees the memory the next one will use */
+		if (s->closing) {
+			cap = s->closing;
+			path = s->closing_path;
+			s->closing = NULL;
+			pthread_mutex_unlock(&s->lock);
+			finish(s, cap, path, false);
+			pthread_mutex_lock(&s->lock);
+			continue;
+		}
+		if (s->stopping)
+			break;
+
+		path = seg_path(s, ++s->seq);
+		pthread_mutex_unlock(&s->lock);
+		cap = path ? prepare(s, path, false) : NULL;
+		pthread_mutex_lock(&s->lock);
+		if (cap) {
+			s->next = cap;
+			s->next_path = path;
+			continue;
+		}
+		/* The current segment just keeps growing */
+		bg_warn("cannot prepare %s: %s", path ? path : s->prefix,
+			strerror(errno));
+		free(path);
+		prepare_failed = true;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+struct bg_segments *bg_segments_create(const char *prefix, int nr_cpus,
+				       int page_size,
+				       const struct bg_segments_opts *opts,
+				       struct bg_formats *f,
+				       struct tracefs_instance *instance)
+{
+	struct bg_segments *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->prefix = strdup(prefix);
+	s->nr_cpus = nr_cpus;
+	s->page_size = page_size;
+	s->opts = *opts;
+	s->formats = f;
+	s->instance = instance;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	if (!s->prefix)
+		goto fail;
+
+	s->cur_path = seg_path(s, 0);
+	if (!s->cur_path)
+		goto fail;
+	s->cur = prepare(s, s->cur_path, true);
+	if (!s->cur)
+		goto fail;
+	if (f && bg_capture_add_formats(s->cur, f, instance) < 0)
+		goto fail;
+	s->cur_start = bg_now_ns();
+
+	/* A single segment needs no one to prepare the next */
+	if (!opts->segment_ms)
+		return s;
+	errno = pthread_create(&s->thread, NULL, segments_thread, s);
+	if (errno)
+		goto fail;
+	return s;
+ fail:
+	if (s->cur)
+		bg_capture_close(s->cur);
+	free(s->cur_path);
+	free(s->prefix);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+	return NULL;
+}
+
+/* Hand the current segment over for closing and carry on in the next */
+static int rotate(struct bg_segments *s)
+{
+	struct bg_capture *next;
+	char *path;
+
+	pthread_mutex_lock(&s->lock);
+	next = s->closing ? NULL : s->next;
+	path = s->next_path;
+	if (next)
+		s->next = NULL;
+	pthread_mutex_unlock(&s->lock);
+	if (!next)
+		return 0;
+
+	/* The formats are ours alone; the helper thread never sees them */
+	if (bg_capture_freeze_formats(s->cur) < 0 ||
+	    (s->formats &&
+	     bg_capture_add_formats(next, s->formats, s->instance) < 0)) {
+		pthread_mutex_lock(&s->lock);
+		s->next = next;
+		pthread_mutex_unlock(&s->lock);
+		return -1;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->closing = s->cur;
+	s->closing_path = s->cur_path;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	s->cur = next;
+	s->cur_path = path;
+	s->cur_start = bg_now_ns();
+	return 0;
+}
+
+int bg_segments_add_page(struct bg_segments *s, int cpu, const void *page,
+			 int size)
+{
+	if (s->opts.segment_ms &&
+	    bg_now_ns() - s->cur_start >= s->opts.segment_ms * NSEC_PER_MSEC &&
+	    rotate(s) < 0)
+		return -1;
+	return bg_capture_add_page(s->cur, cpu, page, size);
+}
+
+int bg_segments_add_formats(struct bg_segments *s)
+{
+	if (!s->formats)
+		return 0;
+	return bg_capture_add_formats(s->cur, s->formats, s->instance);
+}
+
+int bg_segments_close(struct bg_segments *s)
+{
+	int i, ret;
+
+	if (s->opts.segment_ms) {
+		pthread_mutex_lock(&s->lock);
+		s->stopping = true;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->thread, NULL);
+	}
+
+	/* Prepared but never written to */
+	if (s->next) {
+		bg_capture_close(s->next);
+		unlink(s->next_path);
+		free(s->next_path);
+	}
+
+	ret = finish(s, s->cur, s->cur_path, true);
+	if (!ret && s->failed) {
+		errno = s->err;
+		ret = -1;
+	}
+
+	for (i = 0; i < s->nr_done; i++)
+		free(s->done[i].path);
+	free(s->done);
+	free(s->prefix);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+	free(s);
+	return ret;
+}
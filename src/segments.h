@@ -0,0 +1,97 @@
+#ifndef BG_SEGMENTS_H
+#define BG_SEGMENTS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "capture.h"
+
+struct bg_formats;
+struct tracefs_instance;
+
+/* Preallocated for a segment before any has been closed to go by */
+#define BG_SEG_PREALLOC		(64ULL << 20)
+
+struct bg_segments_opts {
+	uint64_t		segment_ms;	/* per file, 0: a single one */
+	uint64_t		max_bytes;	/* all files together, 0: no cap */
+	enum bg_cap_codec	codec;
+	int			level;
+	int			nr_workers;
+	int			uring_depth;	/* -1: plain writes */
+	uint64_t		sync_bytes;
+};
+
+struct bg_segment {
+	char			*path;
+	uint64_t		size;
+};
+
+/*
+ * A capture cut into <prefix>.NNNNNN files of a fixed duration each, every
+ * one a complete capture with its own formats and index. Rotation costs
+ * the consumer a pointer swap: a helper thread opens and fallocate()s the
+ * next file (and starts its compression or io_uring) ahead of time, and
+ * closes the one just finished behind it. Once a segment is closed, the
+ * oldest ones are deleted for the rest to fit in max_bytes, keeping room
+ * for the current one and the preallocated next.
+ */
+struct bg_segments {
+	char			*prefix;
+	int			nr_cpus;
+	int			page_size;
+	struct bg_segments_opts	opts;
+	struct bg_formats	*formats;
+	struct tracefs_instance	*instance;
+
+	struct bg_capture	*cur;		/* consumer only */
+	uint64_t		cur_start;	/* bg_now_ns() */
+
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct bg_capture	*next;		/* ready for the consumer */
+	char			*next_path;
+	struct bg_capture	*closing;	/* handed to the thread */
+	char			*closing_path;
+	char			*cur_path;
+	unsigned int		seq;
+	struct bg_segment	*done;		/* closed, oldest first */
+	int			nr_done;
+	uint64_t		total;		/* bytes in done */
+	uint64_t		largest;
+	unsigned long long	deleted;
+	bool			stopping;
+	bool			failed;
+	int			err;
+};
+
+/*
+ * Start writing <prefix>.000000. The formats of @instance's events go into
+ * every segment, so @f must not be used by another thread meanwhile.
+ */
+struct bg_segments *bg_segments_create(const char *prefix, int nr_cpus,
+				       int page_size,
+				       const struct bg_segments_opts *opts,
+				       struct bg_formats *f,
+				       struct tracefs_instance *instance);
+
+/*
+ * bg_capture_add_page() into the current segment, moving to the next one
+ * when it is due and ready. A next file that is not ready yet only makes
+ * the current one run long; the consumer never waits for it.
+ */
+int bg_segments_add_page(struct bg_segments *s, int cpu, const void *page,
+			 int size);
+
+/*
+ * Load the formats of events enabled since the current segment started
+ * into it; later segments pick them up as they start.
+ */
+int bg_segments_add_formats(struct bg_segments *s);
+
+/* Close every segment, remove the unused next file and free @s. */
+int bg_segments_close(struct bg_segments *s);
+
+#endif /* BG_SEGMENTS_H */
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "reader.h"
+#include "selfstats.h"
+
+#define MAX_CLIENTS	16
+
+struct stage_snap {
+	unsigned long long	records;
+	unsigned long long	bytes;
+	unsigned long long	ns;
+};
+
+struct snap {
+	uint64_t		wall;
+	uint64_t		cpu;
+	struct stage_snap	stage[BG_NR_STAGES];
+	unsigned long long	stalls;
+	unsigned long long	lost;
+	unsigned long long	drops;
+	unsigned int		queue;
+	unsigned int		queue_max;
+};
+
+struct stats_thread {
+	struct bg_selfstats	st;		/* first, see bg_selfstats_stop() */
+	struct bg_readers	*readers;
+	unsigned int		interval_ms;
+	pthread_t		thread;
+	int			file_fd;
+	int			listen_fd;
+	int			wake_fd;
+	int			clients[MAX_CLIENTS];
+	int			nr_clients;
+	char			*sock_path;
+	uint64_t		start;
+	struct snap		last;
+	int			nr_cpus;
+};
+
+static const char *const stage_names[BG_NR_STAGES] = {
+	[BG_STAGE_READ]		= "read",
+	[BG_STAGE_DECODE]	= "decode",
+	[BG_STAGE_MERGE]	= "merge",
+	[BG_STAGE_WRITE]	= "write",
+};
+
+static uint64_t clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clk, &ts) < 0)
+		return 0;
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Reader counters are plain fields owned by the reader threads, so these
+ * are approximate while they run; the read stage's time is the CPU time
+ * of the reader threads themselves, which costs them nothing to keep.
+ */
+static void take_snap(struct stats_thread *t, struct snap *s)
+{
+	struct bg_readers *set = t->readers;
+	struct stage_snap *read = &s->stage[BG_STAGE_READ];
+	struct bg_stage_stats *st;
+	struct bg_reader *r;
+	clockid_t clk;
+	unsigned int q;
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	s->wall = bg_now_ns();
+	s->cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+	for (i = BG_STAGE_DECODE; i < BG_NR_STAGES; i++) {
+		st = &t->st.stage[i];
+		s->stage[i].records = atomic_load_explicit(&st->records,
+							   memory_order_relaxed);
+		s->stage[i].bytes = atomic_load_explicit(&st->bytes,
+							 memory_order_relaxed);
+		s->stage[i].ns = atomic_load_explicit(&st->ns,
+						      memory_order_relaxed);
+	}
+	s->drops = atomic_load_explicit(&t->st.drops, memory_order_relaxed);
+
+	for (i = 0; set && i < set->nr_readers; i++) {
+		r = &set->readers[i];
+		read->records += r->subbufs;
+		read->bytes += r->bytes;
+		if (r->running && !pthread_getcpuclockid(r->thread, &clk))
+			read->ns += clock_ns(clk);
+		s->stalls += r->stalls;
+		s->lost += r->lost;
+		if (r->nr_pages) {
+			q = bg_spsc_count(&r->full);
+			s->queue += q;
+			if (q > s->queue_max)
+				s->queue_max = q;
+		}
+	}
+	/* A reader that exited takes its clock with it; never go backwards */
+	if (read->ns < t->last.stage[BG_STAGE_READ].ns)
+		read->ns = t->last.stage[BG_STAGE_READ].ns;
+}
+
+static int format_line(struct stats_thread *t, const struct snap *now,
+		       char *buf, size_t size)
+{
+	const struct snap *prev = &t->last;
+	double secs = (now->wall - prev->wall) / (double)NSEC_PER_SEC;
+	double cpu_pct;
+	int i, n, len;
+
+	if (secs <= 0)
+		secs = 1e-9;
+	cpu_pct = (now->cpu - prev->cpu) / (double)NSEC_PER_SEC / secs * 100;
+
+	len = snprintf(buf, size, "time=%.3f cpu_pct=%.2f host_pct=%.3f",
+		       (now->wall - t->start) / (double)NSEC_PER_SEC, cpu_pct,
+		       cpu_pct / t->nr_cpus);
+
+	for (i = 0; i < BG_NR_STAGES && len < (int)size; i++) {
+		const struct stage_snap *a = &prev->stage[i], *b = &now->stage[i];
+
+		n = snprintf(buf + len, size - len,
+			     " %s_%s_s=%.0f %s_bytes_s=%.0f %s_ns=%llu",
+			     stage_names[i],
+			     i == BG_STAGE_READ || i == BG_STAGE_WRITE ?
+			     "pages" : "records",
+			     (b->records - a->records) / secs, stage_names[i],
+			     (b->bytes - a->bytes) / secs, stage_names[i],
+			     b->ns - a->ns);
+		len += n;
+	}
+	if (len < (int)size)
+		len += snprintf(buf + len, size - len,
+				" queue=%u queue_max=%u stalls=%llu overrun=%llu drops=%llu\n",
+				now->queue, now->queue_max,
+				now->stalls - prev->stalls, now->lost - prev->lost,
+				now->drops - prev->drops);
+	return len < (int)size ? len : (int)size - 1;
+}
+
+static void report(struct stats_thread *t)
+{
+	char line[1024];
+	struct snap now;
+	int i, len;
+
+	take_snap(t, &now);
+	len = format_line(t, &now, line, sizeof(line));
+	t->last = now;
+
+	if (t->file_fd >= 0 && bg_write_all(t->file_fd, line, len) < 0) {
+		bg_warn("stats file: %s", strerror(errno));
+		close(t->file_fd);
+		t->file_fd = -1;
+	}
+
+	/* A client that cannot keep up is dropped, never waited for */
+	for (i = 0; i < t->nr_clients; i++) {
+		if (send(t->clients[i], line, len, MSG_NOSIGNAL | MSG_DONTWAIT) == len)
+			continue;
+		close(t->clients[i]);
+		t->clients[i--] = t->clients[--t->nr_clients];
+	}
+}
+
+static void accept_clients(struct stats_thread *t)
+{
+	int fd;
+
+	while ((fd = accept4(t->listen_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (t->nr_clients == MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		t->clients[t->nr_clients++] = fd;
+	}
+}
+
+static void *stats_thread(void *arg)
+{
+	struct stats_thread *t = arg;
+	uint64_t next = t->start + t->interval_ms * NSEC_PER_MSEC, now;
+	struct pollfd pfd[2];
+	int timeout;
+
+	pfd[0].fd = t->wake_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = t->listen_fd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		now = bg_now_ns();
+		if (now >= next) {
+			report(t);
+			next += t->interval_ms * NSEC_PER_MSEC;
+			if (next <= now)
+				next = now + t->interval_ms * NSEC_PER_MSEC;
+			continue;
+		}
+		timeout = (next - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+		if (poll(pfd, t->listen_fd >= 0 ? 2 : 1, timeout) < 0 &&
+		    errno != EINTR)
+			break;
+		if (pfd[0].revents & POLLIN)
+			break;
+		if (t->listen_fd >= 0 && pfd[1].revents & POLLIN)
+			accept_clients(t);
+	}
+
+	report(t);
+	return NULL;
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	/* A socket left behind by a collector that died */
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, MAX_CLIENTS) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+struct bg_selfstats *bg_selfstats_start(struct bg_readers *readers,
+					const char *file, const char *sock_path,
+					unsigned int interval_ms)
+{
+	struct stats_thread *t;
+	sigset_t all, old;
+	long n;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->readers = readers;
+	t->interval_ms = interval_ms ? interval_ms : BG_SELFSTATS_INTERVAL_MS;
+	t->file_fd = t->listen_fd = -1;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	t->nr_cpus = n > 0 ? n : 1;
+
+	t->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (t->wake_fd < 0)
+		goto fail;
+	if (file) {
+		t->file_fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+				  0644);
+		if (t->file_fd < 0)
+			goto fail;
+	}
+	if (sock_path) {
+		t->listen_fd = listen_unix(sock_path);
+		if (t->listen_fd < 0)
+			goto fail;
+		t->sock_path = strdup(sock_path);
+		if (!t->sock_path)
+			goto fail;
+	}
+
+	t->start = bg_now_ns();
+	take_snap(t, &t->last);
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	errno = pthread_create(&t->thread, NULL, stats_thread, t);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (errno)
+		goto fail;
+
+	return &t->st;
+ fail:
+	if (t->wake_fd >= 0)
+		close(t->wake_fd);
+	if (t->file_fd >= 0)
+		close(t->file_fd);
+	if (t->listen_fd >= 0) {
+		close(t->listen_fd);
+		unlink(sock_path);
+	}
+	free(t->sock_path);
+	free(t);
+	return NULL;
+}
+
+void bg_selfstats_stop(struct bg_selfstats *st)
+{
+	struct stats_thread *t = (struct stats_thread *)st;
+	uint64_t one = 1;
+	int i;
+
+	if (!st)
+		return;
+
+	if (write(t->wake_fd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(t->thread, NULL);
+
+	for (i = 0; i < t->nr_clients; i++)
+		close(t->clients[i]);
+	if (t->listen_fd >= 0) {
+		close(t->listen_fd);
+		unlink(t->sock_path);
+	}
+	if (t->file_fd >= 0)
+		close(t->file_fd);
+	close(t->wake_fd);
+	free(t->sock_path);
+	free(t);
+}
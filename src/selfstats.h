@@ -0,0 +1,86 @@
+#ifndef BG_SELFSTATS_H
+#define BG_SELFSTATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "util.h"
+
+struct bg_readers;
+
+/* How often a stats line is produced */
+#define BG_SELFSTATS_INTERVAL_MS	1000
+
+enum bg_stage {
+	BG_STAGE_READ,		/* reader threads, from their CPU clocks */
+	BG_STAGE_DECODE,
+	BG_STAGE_MERGE,
+	BG_STAGE_WRITE,
+	BG_NR_STAGES,
+};
+
+struct bg_stage_stats {
+	atomic_ullong		records;
+	atomic_ullong		bytes;
+	atomic_ullong		ns;
+};
+
+/*
+ * The collector's own cost. The consumer adds to each stage as it goes;
+ * a stats thread turns the totals into one line of rates per interval,
+ * appended to a file and sent to every client of a Unix socket:
+ *
+ *	time=3.000 cpu_pct=0.84 host_pct=0.11 read_pages_s=... read_bytes_s=...
+ *	read_ns=... decode_records_s=... ... write_pages_s=... queue=5
+ *	queue_max=3 stalls=0 overrun=0 drops=0
+ *
+ * *_ns is the time spent in the stage during the interval; cpu_pct is
+ * the whole process's CPU time over wall time, of one CPU, and host_pct
+ * the same over all online CPUs.
+ */
+struct bg_selfstats {
+	struct bg_stage_stats	stage[BG_NR_STAGES];
+	atomic_ullong		drops;		/* pages user space threw away */
+};
+
+/*
+ * Start reporting on @readers every @interval_ms to @file and/or clients
+ * of the Unix socket @sock_path (either may be NULL).
+ */
+struct bg_selfstats *bg_selfstats_start(struct bg_readers *readers,
+					const char *file, const char *sock_path,
+					unsigned int interval_ms);
+
+/* Write a last line, stop the thread and remove the socket. */
+void bg_selfstats_stop(struct bg_selfstats *st);
+
+/* Start of a timed stretch of work; free when stats are off */
+static inline uint64_t bg_stage_clock(const struct bg_selfstats *st)
+{
+	return st ? bg_now_ns() : 0;
+}
+
+static inline void bg_stage_add(struct bg_selfstats *st, enum bg_stage stage,
+				unsigned long long records,
+				unsigned long long bytes, uint64_t start)
+{
+	struct bg_stage_stats *s;
+
+	if (!st)
+		return;
+	s = &st->stage[stage];
+	atomic_fetch_add_explicit(&s->records, records, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->bytes, bytes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->ns, bg_now_ns() - start,
+				  memory_order_relaxed);
+}
+
+static inline void bg_selfstats_drop(struct bg_selfstats *st,
+				     unsigned long long pages)
+{
+	if (st)
+		atomic_fetch_add_explicit(&st->drops, pages,
+					  memory_order_relaxed);
+}
+
+#endif /* BG_SELFSTATS_H */
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "formats.h"
+#include "session.h"
+#include "util.h"
+
+struct bg_session *bg_session_create(const char *name)
+{
+	struct bg_session *s;
+	int ret;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	if (name)
+		ret = (s->name = strdup(name)) ? 0 : -1;
+	else
+		ret = asprintf(&s->name, "bg-c-perf-tools.%d", getpid());
+	if (ret < 0) {
+		free(s);
+		return NULL;
+	}
+
+	/* tracefs_instance_create() would silently reuse an existing one */
+	if (tracefs_instance_exists(s->name)) {
+		bg_warn("instance '%s' already exists", s->name);
+		errno = EEXIST;
+		goto fail;
+	}
+
+	s->instance = tracefs_instance_create(s->name);
+	if (!s->instance)
+		goto fail;
+
+	return s;
+ fail:
+	free(s->name);
+	free(s);
+	return NULL;
+}
+
+void bg_session_destroy(struct bg_session *s)
+{
+	if (!s)
+		return;
+
+	if (s->instance) {
+		tracefs_trace_off(s->instance);
+		tracefs_instance_destroy(s->instance);
+		tracefs_instance_free(s->instance);
+	}
+	free(s->name);
+	free(s);
+}
+
+/* "sched:sched_switch" -> ("sched", "sched_switch"); "sched" -> ("sched", NULL) */
+int bg_session_enable(struct bg_session *s, const char *spec, bool on)
+{
+	char *system, *sep;
+	const char *event = NULL;
+	int ret;
+
+	system = strdup(spec);
+	if (!system)
+		return -1;
+
+	sep = strchr(system, ':');
+	if (sep) {
+		*sep = '\0';
+		event = sep + 1;
+	}
+	if (on)
+		ret = tracefs_event_enable(s->instance, system, event);
+	else
+		ret = tracefs_event_disable(s->instance, system, event);
+
+	free(system);
+	return ret;
+}
+
+int bg_session_set_filter(struct bg_session *s, struct bg_formats *f,
+			  const char *spec, const char *filter)
+{
+	struct tep_event *event;
+	char *system, *sep, *file;
+	int ret = -1;
+
+	system = strdup(spec);
+	if (!system)
+		return -1;
+
+	sep = strchr(system, ':');
+	if (sep) {
+		*sep = '\0';
+		/* tracefs checks the expression against the event's fields */
+		event = bg_formats_event_by_name(f, system, sep + 1);
+		if (event)
+			ret = tracefs_event_filter_apply(s->instance, event,
+							 filter);
+		else
+			errno = ENOENT;
+	} else if (asprintf(&file, "events/%s/filter", system) >= 0) {
+		/* A whole system: the kernel applies it to every event that has the fields */
+		ret = tracefs_instance_file_write(s->instance, file, filter);
+		ret = ret < 0 ? -1 : 0;
+		free(file);
+	}
+
+	free(system);
+	return ret;
+}
+
+int bg_session_set_buffer_kb(struct bg_session *s, size_t kb, int cpu)
+{
+	return tracefs_instance_set_buffer_size(s->instance, kb, cpu);
+}
+
+static int stat_field(const char *buf, const char *key, unsigned long long *val)
+{
+	const char *p = buf;
+	size_t len = strlen(key);
+
+	while (p) {
+		if (!strncmp(p, key, len) && p[len] == ':') {
+			*val = strtoull(p + len + 1, NULL, 10);
+			return 0;
+		}
+		p = strchr(p, '\n');
+		if (p)
+			p++;
+	}
+	return -1;
+}
+
+int bg_cpu_stats_read(struct tracefs_instance *instance, int cpu,
+		      struct bg_cpu_stats *st)
+{
+	char file[64];
+	char *buf;
+
+	snprintf(file, sizeof(file), "per_cpu/cpu%d/stats", cpu);
+	buf = tracefs_instance_file_read(instance, file, NULL);
+	if (!buf)
+		return -1;
+
+	memset(st, 0, sizeof(*st));
+	stat_field(buf, "entries", &st->entries);
+	stat_field(buf, "overrun", &st->overrun);
+	stat_field(buf, "commit overrun", &st->commit_overrun);
+	stat_field(buf, "bytes", &st->bytes);
+	/* Older kernels do not report these two */
+	stat_field(buf, "dropped events", &st->dropped_events);
+	stat_field(buf, "read events", &st->read_events);
+
+	free(buf);
+	return 0;
+}
+
+size_t bg_buffer_kb_for_rate(double rate, unsigned int event_bytes,
+			     unsigned int burst_ms)
+{
+	double bytes = rate * event_bytes * burst_ms / 1000.0 * 2;
+	size_t kb = (size_t)(bytes / 1024) + 1;
+
+	if (kb < BG_MIN_BUFFER_KB)
+		return BG_MIN_BUFFER_KB;
+	if (kb > BG_MAX_BUFFER_KB)
+		return BG_MAX_BUFFER_KB;
+	return kb;
+}
+
+int bg_session_calibrate(struct bg_session *s, cpu_set_t *cpus,
+			 unsigned int ms, struct bg_calibration *cal)
+{
+	struct bg_cpu_stats st;
+	unsigned long long events;
+	int cpu, i = 0;
+	uint64_t start, elapsed;
+
+	tracefs_instance_file_clear(s->instance, "trace");
+
+	start = bg_now_ns();
+	if (tracefs_trace_on(s->instance) < 0)
+		return -1;
+	usleep(ms * 1000);
+	tracefs_trace_off(s->instance);
+	elapsed = bg_now_ns() - start;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, cpus))
+			continue;
+
+		cal[i].cpu = cpu;
+		cal[i].rate = 0;
+		cal[i].event_bytes = BG_DEFAULT_EVENT_BYTES;
+
+		if (bg_cpu_stats_read(s->instance, cpu, &st) == 0) {
+			/* Whatever the buffer already overwrote counts too */
+			events = st.entries + st.overrun;
+			cal[i].rate = events * (double)NSEC_PER_SEC / elapsed;
+			if (st.entries)
+				cal[i].event_bytes = st.bytes / st.entries;
+		}
+		i++;
+	}
+
+	tracefs_instance_file_clear(s->instance, "trace");
+	return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef BG_SESSION_H
+#define BG_SESSION_H
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <tracefs.h>
+
+/* Sizing defaults used when neither a rate nor a calibration is given */
+#define BG_DEFAULT_RATE		20000	/* events/s per CPU */
+#define BG_DEFAULT_EVENT_BYTES	64
+#define BG_DEFAULT_BURST_MS	1000
+#define BG_MIN_BUFFER_KB	1024
+#define BG_MAX_BUFFER_KB	(1024 * 1024)
+
+/* Counters from per_cpu/cpuN/stats */
+struct bg_cpu_stats {
+	unsigned long long	entries;
+	unsigned long long	overrun;
+	unsigned long long	commit_overrun;
+	unsigned long long	bytes;
+	unsigned long long	dropped_events;
+	unsigned long long	read_events;
+};
+
+/*
+ * A collector session owns a private tracefs instance, so its ring
+ * buffers, event set and buffer sizes never interfere with other tools
+ * using the top-level instance.
+ */
+struct bg_session {
+	char			*name;
+	struct tracefs_instance	*instance;
+};
+
+/* Create the instance @name, or "bg-c-perf-tools.<pid>" for NULL. */
+struct bg_session *bg_session_create(const char *name);
+
+/* Remove the instance and free @s. */
+void bg_session_destroy(struct bg_session *s);
+
+/* Enable or disable "system[:event]" on the session's instance. */
+int bg_session_enable(struct bg_session *s, const char *spec, bool on);
+
+struct bg_formats;
+
+/*
+ * Filter "system[:event]" in the kernel with an ftrace filter expression
+ * ("prev_pid != 0 && prev_state & 3"). Records that do not match are
+ * never written to the ring buffer.
+ */
+int bg_session_set_filter(struct bg_session *s, struct bg_formats *f,
+			  const char *spec, const char *filter);
+
+/* Set the per-CPU buffer size of @cpu, or of all CPUs for -1. */
+int bg_session_set_buffer_kb(struct bg_session *s, size_t kb, int cpu);
+
+int bg_cpu_stats_read(struct tracefs_instance *instance, int cpu,
+		      struct bg_cpu_stats *st);
+
+/*
+ * Buffer size that absorbs @burst_ms of traffic at @rate events/s of
+ * @event_bytes each, with 2x headroom, clamped to the BG_*_BUFFER_KB range.
+ */
+size_t bg_buffer_kb_for_rate(double rate, unsigned int event_bytes,
+			     unsigned int burst_ms);
+
+struct bg_calibration {
+	int		cpu;
+	double		rate;		/* events/s */
+	unsigned int	event_bytes;	/* average, header included */
+};
+
+/*
+ * With the session's events enabled, trace for @ms without reading and
+ * derive each CPU's event rate and average event size from the ring
+ * buffer stats. @cal is indexed in @cpus order. The buffers are cleared
+ * afterwards so the real capture starts empty.
+ */
+int bg_session_calibrate(struct bg_session *s, cpu_set_t *cpus,
+			 unsigned int ms, struct bg_calibration *cal);
+
+#endif /* BG_SESSION_H */
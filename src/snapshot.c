@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+
+#include "capture.h"
+#include "snapshot.h"
+#include "util.h"
+
+int bg_snapshot_prepare(struct tracefs_instance *instance)
+{
+	if (tracefs_instance_file_write(instance, "options/overwrite", "1") < 0)
+		return -1;
+	/*
+	 * "1" allocates the snapshot buffer, "2" empties it again; allocating
+	 * now means a snapshot never has to find memory during an incident.
+	 */
+	if (tracefs_instance_file_write(instance, "snapshot", "1") < 0 ||
+	    tracefs_instance_file_write(instance, "snapshot", "2") < 0)
+		return -1;
+	return 0;
+}
+
+int bg_snapshot_take(struct tracefs_instance *instance)
+{
+	return tracefs_instance_file_write(instance, "snapshot", "1") < 0 ? -1 : 0;
+}
+
+static int max_cpu(const cpu_set_t *cpus)
+{
+	int cpu, max = -1;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, cpus))
+			max = cpu;
+	}
+	return max;
+}
+
+long bg_snapshot_dump(struct tracefs_instance *instance, struct bg_formats *f,
+		      const cpu_set_t *cpus, const char *path)
+{
+	struct bg_capture *cap = NULL;
+	struct tracefs_cpu *tcpu;
+	void *page = NULL;
+	long pages = 0;
+	int cpu, n, size;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, cpus))
+			continue;
+
+		tcpu = tracefs_cpu_snapshot_open(instance, cpu, true);
+		if (!tcpu)
+			goto fail;
+
+		if (!cap) {
+			size = tracefs_cpu_read_size(tcpu);
+			page = malloc(size);
+			cap = page ? bg_capture_create(path, max_cpu(cpus) + 1,
+						       size) : NULL;
+			if (!cap) {
+				tracefs_cpu_close(tcpu);
+				goto fail;
+			}
+		}
+
+		/* snapshot_raw reads are consuming, so this also drains it */
+		while ((n = tracefs_cpu_read(tcpu, page, true)) > 0) {
+			if (bg_capture_add_page(cap, cpu, page, n) < 0) {
+				tracefs_cpu_close(tcpu);
+				goto fail;
+			}
+			pages++;
+		}
+		tracefs_cpu_close(tcpu);
+	}
+
+	if (!cap) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (f)
+		bg_capture_add_formats(cap, f, instance);
+	free(page);
+	if (bg_capture_close(cap) < 0)
+		return -1;
+
+	tracefs_instance_file_write(instance, "snapshot", "2");
+	return pages;
+ fail:
+	if (cap)
+		bg_capture_close(cap);
+	free(page);
+	return -1;
+}
@@ -0,0 +1,31 @@
+#ifndef BG_SNAPSHOT_H
+#define BG_SNAPSHOT_H
+
+#include <sched.h>
+
+#include <tracefs.h>
+
+struct bg_formats;
+
+/*
+ * Flight recording: the instance runs in overwrite mode and nothing is
+ * read until an incident, when the live buffer is swapped into the
+ * snapshot buffer (by us or by a snapshot trigger in the kernel) and the
+ * snapshot is written out as a capture file.
+ */
+
+/* Keep the oldest events overwritten, and have a snapshot buffer ready. */
+int bg_snapshot_prepare(struct tracefs_instance *instance);
+
+/* Swap the live buffer into the snapshot buffer now. */
+int bg_snapshot_take(struct tracefs_instance *instance);
+
+/*
+ * Write the snapshot of @cpus to the capture file @path, with the formats
+ * of the events enabled on @instance, then clear it. Returns the number
+ * of sub-buffers written or -1.
+ */
+long bg_snapshot_dump(struct tracefs_instance *instance, struct bg_formats *f,
+		      const cpu_set_t *cpus, const char *path);
+
+#endif /* BG_SNAPSHOT_H */
@@ -0,0 +1,33 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+
+int bg_spsc_init(struct bg_spsc *q, unsigned int size)
+{
+	unsigned int n = 1;
+
+	if (!size || size > (1U << 31)) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (n < size)
+		n <<= 1;
+
+	memset(q, 0, sizeof(*q));
+	q->slots = calloc(n, sizeof(*q->slots));
+	if (!q->slots)
+		return -1;
+
+	q->mask = n - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return 0;
+}
+
+void bg_spsc_free(struct bg_spsc *q)
+{
+	free(q->slots);
+	q->slots = NULL;
+}
@@ -0,0 +1,71 @@
+#ifndef BG_SPSC_H
+#define BG_SPSC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "util.h"
+
+/*
+ * Bounded single-producer/single-consumer ring of pointers. No locks and
+ * no read-modify-write atomics: each index is written by one side only,
+ * and each side keeps a cached copy of the other's index so the shared
+ * cache line is only touched when the ring looks full (or empty).
+ */
+struct bg_spsc {
+	/* producer side */
+	atomic_uint		head __bg_aligned;
+	unsigned int		tail_cache;
+	/* consumer side */
+	atomic_uint		tail __bg_aligned;
+	unsigned int		head_cache;
+	/* read-only */
+	unsigned int		mask __bg_aligned;
+	void			**slots;
+};
+
+/* @size is rounded up to a power of two. */
+int bg_spsc_init(struct bg_spsc *q, unsigned int size);
+void bg_spsc_free(struct bg_spsc *q);
+
+static inline bool bg_spsc_push(struct bg_spsc *q, void *p)
+{
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+	if (head - q->tail_cache > q->mask) {
+		q->tail_cache = atomic_load_explicit(&q->tail,
+						     memory_order_acquire);
+		if (head - q->tail_cache > q->mask)
+			return false;
+	}
+
+	q->slots[head & q->mask] = p;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return true;
+}
+
+static inline void *bg_spsc_pop(struct bg_spsc *q)
+{
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	void *p;
+
+	if (tail == q->head_cache) {
+		q->head_cache = atomic_load_explicit(&q->head,
+						     memory_order_acquire);
+		if (tail == q->head_cache)
+			return NULL;
+	}
+
+	p = q->slots[tail & q->mask];
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return p;
+}
+
+/* Approximate when called from either side while the other runs. */
+static inline unsigned int bg_spsc_count(struct bg_spsc *q)
+{
+	return atomic_load_explicit(&q->head, memory_order_acquire) -
+	       atomic_load_explicit(&q->tail, memory_order_acquire);
+}
+
+#endif /* BG_SPSC_H */
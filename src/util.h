@@ -0,0 +1,34 @@
+#ifndef BG_UTIL_H
+#define BG_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+#define BG_CACHELINE	64
+#define __bg_aligned	__attribute__((aligned(BG_CACHELINE)))
+
+#define NSEC_PER_SEC	1000000000ULL
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_USEC	1000ULL
+
+#define bg_warn(fmt, ...)	fprintf(stderr, "bg-c-perf-tools: " fmt "\n", ##__VA_ARGS__)
+
+static inline uint64_t bg_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* write(2) that retries short writes and EINTR. Returns 0 or -1. */
+int bg_write_all(int fd, const void *buf, size_t len);
+
+#endif /* BG_UTIL_H */
@@ -0,0 +1,1356 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <event-parse.h>
+#include <kbuffer.h>
+
+#include "batch.h"
+#include "capture.h"
+#include "fixture.h"
+#include "formats.h"
+#include "merge.h"
+#include "render.h"
+#include "scan.h"
+#include "util.h"
+
+/*
+ * Replays capture files through every offline stage of the pipeline and
+ * checks that each one sees exactly the records a bare kbuffer walk of the
+ * file does: the index and its window lookups, chunks read in place and
+ * copied, batch decode, the scan on one and several threads, the k-way
+ * merge, text rendering, and the pages written back through the capture
+ * writer with every codec built in. Records are compared through an
+ * order-independent digest of their CPU, timestamp, id, pid and payload,
+ * so a single dropped record or shifted timestamp fails the check.
+ *
+ * Then decode and merge are timed on the capture's own pages, and the scan
+ * and merge replay the whole file in a child process each to measure their
+ * peak RSS. Each is held to the threads=1 line of its stage in
+ * bench_output.txt, which bench measured the same way, in a child of its
+ * own, times the slack; without a baseline the gates are
+ * skipped rather than failed. One line per check and gate goes to
+ * test_output.txt:
+ *
+ *	check=merge capture=sched.bgc records=... expected=... late=0 delayed=0 backwards=0 result=ok
+ *	gate=decode capture=sched.bgc ns_per_record=... budget=... result=ok
+ */
+
+#define TEST_SLACK		1.5	/* over the bench baselines */
+#define TEST_PERF_PAGES		4096	/* timed, from the start of a capture */
+#define TEST_PERF_REPS		8
+#define TEST_WINDOWS		4
+#define TEST_WIN_HEAD		2	/* the window that is also rendered */
+#define TEST_HEAD_SHARE		10	/* the head is 1/N of the capture */
+#define TEST_FIND_POINTS	64	/* extra starts to check lookups at */
+
+/* The capture written when none is given, laid out like bench's pages */
+#define TEST_SYNTH_CPUS		4
+#define TEST_SYNTH_PAGES	256	/* per CPU */
+#define TEST_SYNTH_PAGE_SIZE	4096
+#define TEST_SYNTH_EVENT_ID	1000
+#define TEST_SYNTH_EVENT_SIZE	32
+#define TEST_SYNTH_DELTA_NS	100
+
+enum result {
+	RES_FAIL,
+	RES_OK,
+	RES_SKIP,
+};
+
+static const char *const res_names[] = { "fail", "ok", "skipped" };
+
+enum gate {
+	GATE_DECODE,
+	GATE_MERGE,
+	NR_GATES,
+};
+
+/* The bench stage each gate takes its baseline from */
+static const char *const gate_stages[NR_GATES] = { "decode", "merge" };
+
+struct budget {
+	double		ns;		/* ns_per_record, 0: none */
+	long		rss_kb;		/* max_rss_kb, 0: none */
+};
+
+struct test {
+	FILE		*out;
+	int		jobs;
+	double		slack;
+	struct budget	budgets[NR_GATES];
+	int		checks;
+	int		failures;
+};
+
+struct digest {
+	unsigned long long	records;
+	uint64_t		sum;
+};
+
+struct window {
+	uint64_t	start;		/* inclusive, as for the scan */
+	uint64_t	end;
+	struct digest	ref;
+};
+
+/* What the bare walk of a capture found */
+struct ref {
+	struct digest		all;
+	struct window		win[TEST_WINDOWS];
+	unsigned long long	pages;
+	unsigned long long	decode_diff;	/* records batch decode got wrong */
+	unsigned long long	backwards;	/* per-CPU timestamps going back */
+	unsigned long long	bad_chunks;	/* disagreeing with header or index */
+};
+
+static void result(struct test *t, const char *kind, const char *what,
+		   const char *capture, enum result res, const char *fmt, ...)
+{
+	FILE *outs[] = { t->out, stdout };
+	va_list ap;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(outs); i++) {
+		fprintf(outs[i], "%s=%s capture=%s ", kind, what, capture);
+		va_start(ap, fmt);
+		vfprintf(outs[i], fmt, ap);
+		va_end(ap);
+		fprintf(outs[i], " result=%s\n", res_names[res]);
+	}
+	t->checks++;
+	if (res == RES_FAIL)
+		t->failures++;
+}
+
+static inline uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	return x ^ (x >> 33);
+}
+
+#define FNV_BASIS	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+static uint64_t hash_bytes(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *c = p;
+
+	while (len--)
+		h = (h ^ *c++) * FNV_PRIME;
+	return h;
+}
+
+static uint64_t rec_hash(int cpu, uint64_t ts, uint16_t id, int32_t pid,
+			 const void *data, uint32_t size)
+{
+	uint64_t h = hash_bytes(FNV_BASIS, data, size);
+
+	h = mix64(h ^ ts);
+	h = mix64(h ^ ((uint64_t)(uint32_t)cpu << 32 | id));
+	return mix64(h ^ ((uint64_t)size << 32 | (uint32_t)pid));
+}
+
+static inline void digest_add(struct digest *d, uint64_t h)
+{
+	d->records++;
+	d->sum += h;
+}
+
+static inline bool digest_eq(const struct digest *a, const struct digest *b)
+{
+	return a->records == b->records && a->sum == b->sum;
+}
+
+static void rec_common(const void *data, bool swap, uint16_t *id,
+		       int32_t *pid)
+{
+	memcpy(id, (const char *)data + BG_COMMON_TYPE_OFFSET, sizeof(*id));
+	memcpy(pid, (const char *)data + BG_COMMON_PID_OFFSET, sizeof(*pid));
+	if (swap) {
+		*id = __builtin_bswap16(*id);
+		*pid = __builtin_bswap32(*pid);
+	}
+}
+
+static bool cap_swapped(const struct bg_capture_file *cf)
+{
+	return !!(cf->hdr.flags & BG_CAP_F_BIG_ENDIAN) !=
+	       (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+}
+
+/* The merge and the capture writer read pages with host-order kbuffers */
+static bool cap_native(const struct bg_capture_file *cf)
+{
+	return !cap_swapped(cf) && cf->hdr.long_size == sizeof(long);
+}
+
+static struct kbuffer *cap_kbuffer(const struct bg_capture_file *cf)
+{
+	bool big = cf->hdr.flags & BG_CAP_F_BIG_ENDIAN;
+
+	return kbuffer_alloc(cf->hdr.long_size == 4 ? KBUFFER_LSIZE_4 :
+						      KBUFFER_LSIZE_8,
+			     big ? KBUFFER_ENDIAN_BIG : KBUFFER_ENDIAN_LITTLE);
+}
+
+static void set_windows(const struct bg_capture_file *cf, struct window *win)
+{
+	uint64_t lo = 0, hi = 0, mid = 0, span;
+
+	if (cf->nr_index) {
+		lo = cf->index[0].first_ts;
+		hi = cf->max_last_ts[cf->nr_index - 1];
+		mid = cf->index[cf->nr_index / 2].first_ts;
+	}
+	span = hi - lo;
+	memset(win, 0, TEST_WINDOWS * sizeof(*win));
+	win[0].end = UINT64_MAX;			/* everything */
+	win[1].start = lo + span / 4;			/* the middle half */
+	win[1].end = lo + span / 4 * 3;
+	win[TEST_WIN_HEAD].start = lo;
+	win[TEST_WIN_HEAD].end = lo + span / TEST_HEAD_SHARE;
+	win[3].start = win[3].end = mid;		/* one record's instant */
+}
+
+static bool chunk_matches(struct bg_capture_file *cf,
+			  const struct bg_cap_index_entry *e)
+{
+	struct bg_cap_chunk c;
+
+	if (pread(cf->fd, &c, sizeof(c), e->offset) != sizeof(c))
+		return false;
+	return c.magic == BG_CAP_CHUNK_MAGIC && c.cpu == e->cpu &&
+	       c.nr_pages == e->nr_pages && c.codec == e->codec &&
+	       c.size == e->size && c.raw_size == e->raw_size &&
+	       c.first_ts == e->first_ts && c.last_ts == e->last_ts;
+}
+
+/*
+ * The reference: every page of every chunk in index order through a bare
+ * kbuffer walk. Along the way, check each chunk against its header and
+ * index entry and its in-place pages against the copied ones, compare the
+ * batch decoder with the walk, and render the head window to @render_fd
+ * (with the formats @f) if it is not -1. ref->win must be set.
+ */
+static int walk(struct bg_capture_file *cf, struct ref *ref,
+		struct bg_formats *f, int render_fd)
+{
+	const size_t page_size = cf->hdr.page_size;
+	const struct window *head = &ref->win[TEST_WIN_HEAD];
+	const struct bg_cap_index_entry *e;
+	struct tep_record record = { 0 };
+	struct kbuffer *kbuf, *bkbuf;
+	unsigned long long ts, last;
+	struct bg_render r;
+	struct bg_batch b;
+	const void *in_place;
+	unsigned char *buf = NULL, *page, *data;
+	uint64_t *cpu_ts, h;
+	size_t i, buf_size = 0;
+	unsigned int p, k, w;
+	bool swap = cap_swapped(cf);
+	int32_t pid;
+	uint16_t id;
+	int n, ret = -1;
+
+	kbuf = cap_kbuffer(cf);
+	bkbuf = cap_kbuffer(cf);
+	cpu_ts = calloc(cf->hdr.nr_cpus + 1, sizeof(*cpu_ts));
+	if (!kbuf || !bkbuf || !cpu_ts || bg_batch_init(&b, 256) < 0)
+		goto out_kbuf;
+	b.swap = swap;
+	if (render_fd >= 0)
+		bg_render_init(&r, render_fd, NULL);
+
+	for (i = 0; i < cf->nr_index; i++) {
+		e = &cf->index[i];
+		if (e->cpu >= cf->hdr.nr_cpus ||
+		    e->raw_size != (uint64_t)e->nr_pages * page_size) {
+			ref->bad_chunks++;
+			continue;
+		}
+		if (e->raw_size > buf_size) {
+			free(buf);
+			buf_size = e->raw_size;
+			buf = malloc(buf_size);
+			if (!buf)
+				goto out;
+		}
+		if (bg_capture_read_chunk(cf, e, buf) < 0) {
+			ref->bad_chunks++;
+			continue;
+		}
+		in_place = bg_capture_chunk_pages(cf, e);
+		if ((!swap && !chunk_matches(cf, e)) ||
+		    (in_place && memcmp(in_place, buf, e->raw_size)))
+			ref->bad_chunks++;
+
+		for (p = 0; p < e->nr_pages; p++) {
+			page = buf + p * page_size;
+			ref->pages++;
+			if (kbuffer_load_subbuffer(kbuf, page) < 0 ||
+			    kbuffer_load_subbuffer(bkbuf, page) < 0) {
+				ref->bad_chunks++;
+				break;
+			}
+			if (!p && kbuffer_subbuf_timestamp(kbuf, page) != e->first_ts)
+				ref->bad_chunks++;
+			n = bg_batch_decode(&b, bkbuf, e->cpu);
+			last = e->first_ts;
+
+			for (k = 0, data = kbuffer_read_event(kbuf, &ts); data;
+			     k++, data = kbuffer_next_event(kbuf, &ts)) {
+				uint32_t size = kbuffer_event_size(kbuf);
+
+				rec_common(data, swap, &id, &pid);
+				h = rec_hash(e->cpu, ts, id, pid, data, size);
+				digest_add(&ref->all, h);
+				for (w = 0; w < TEST_WINDOWS; w++) {
+					if (ts >= ref->win[w].start &&
+					    ts <= ref->win[w].end)
+						digest_add(&ref->win[w].ref, h);
+				}
+				if (ts < cpu_ts[e->cpu])
+					ref->backwards++;
+				cpu_ts[e->cpu] = last = ts;
+
+				if (n < 0 || k >= (unsigned int)n ||
+				    b.ts[k] != ts || b.id[k] != id ||
+				    b.pid[k] != pid || b.size[k] != size ||
+				    b.off[k] != (uint32_t)(data - page))
+					ref->decode_diff++;
+
+				if (render_fd < 0 || ts < head->start ||
+				    ts > head->end)
+					continue;
+				/* Parse the format before tep_print_event() needs it */
+				bg_formats_lookup(f, id);
+				record.cpu = e->cpu;
+				record.ts = ts;
+				record.data = data;
+				record.size = size;
+				if (bg_render_record(&r, f->tep, &record) < 0)
+					goto out;
+			}
+			if (n > (int)k)
+				ref->decode_diff += n - k;
+			/* The index's last_ts is the last record of the last page */
+			if (p == e->nr_pages - 1 && last != e->last_ts)
+				ref->bad_chunks++;
+		}
+	}
+	ret = 0;
+ out:
+	if (render_fd >= 0 && bg_render_destroy(&r) < 0)
+		ret = -1;
+	free(buf);
+	bg_batch_free(&b);
+ out_kbuf:
+	free(cpu_ts);
+	if (bkbuf)
+		kbuffer_free(bkbuf);
+	if (kbuf)
+		kbuffer_free(kbuf);
+	return ret;
+}
+
+/* Chunks overlapping [@start, @end], found through the index lookup */
+static size_t count_found(struct bg_capture_file *cf, uint64_t start,
+			  uint64_t end)
+{
+	size_t i, n = 0;
+
+	for (i = bg_capture_find(cf, start); i < cf->nr_index; i++) {
+		if (cf->index[i].first_ts > end)
+			break;
+		n += bg_capture_overlaps(&cf->index[i], start, end);
+	}
+	return n;
+}
+
+/* The same by looking at every entry */
+static size_t count_overlapping(struct bg_capture_file *cf, uint64_t start,
+				uint64_t end)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < cf->nr_index; i++)
+		n += bg_capture_overlaps(&cf->index[i], start, end);
+	return n;
+}
+
+static void check_index(struct test *t, const char *name,
+			struct bg_capture_file *cf, const struct ref *ref)
+{
+	const struct bg_cap_index_entry *e;
+	uint64_t max = 0, start, end, span;
+	size_t i, bad = 0, lookups = 0;
+	int w;
+
+	for (i = 0; i < cf->nr_index; i++) {
+		e = &cf->index[i];
+		if (e->last_ts > max)
+			max = e->last_ts;
+		if ((i && e->first_ts < e[-1].first_ts) ||
+		    e->first_ts > e->last_ts || cf->max_last_ts[i] != max ||
+		    e->offset + sizeof(struct bg_cap_chunk) + e->size >
+		    cf->trailer.formats_offset)
+			bad++;
+	}
+
+	for (w = 0; w < TEST_WINDOWS; w++, lookups++) {
+		start = ref->win[w].start;
+		end = ref->win[w].end;
+		bad += count_found(cf, start, end) !=
+		       count_overlapping(cf, start, end);
+	}
+	if (cf->nr_index) {
+		span = max - cf->index[0].first_ts;
+		for (i = 0; i <= TEST_FIND_POINTS; i++, lookups++) {
+			start = cf->index[0].first_ts + span / TEST_FIND_POINTS * i;
+			end = start + span / TEST_FIND_POINTS;
+			bad += count_found(cf, start, start) !=
+			       count_overlapping(cf, start, start);
+			bad += count_found(cf, start, end) !=
+			       count_overlapping(cf, start, end);
+		}
+	}
+
+	result(t, "check", "index", name, bad ? RES_FAIL : RES_OK,
+	       "entries=%zu lookups=%zu bad=%zu", cf->nr_index, lookups, bad);
+}
+
+/* Scan ops summing a digest of the records in the window */
+static int digest_init(struct bg_scan_worker *w, void *data)
+{
+	(void)data;
+	w->priv = calloc(1, sizeof(struct digest));
+	return w->priv ? 0 : -1;
+}
+
+static int digest_batch(struct bg_scan_worker *w, const struct bg_batch *b)
+{
+	struct digest *d = w->priv;
+	unsigned int i;
+
+	for (i = 0; i < b->nr; i++) {
+		if (b->ts[i] < w->start || b->ts[i] > w->end)
+			continue;
+		digest_add(d, rec_hash(b->cpu, b->ts[i], b->id[i], b->pid[i],
+				       bg_batch_data(b, i), b->size[i]));
+	}
+	return 0;
+}
+
+static int digest_merge(struct bg_scan_worker *w, void *data)
+{
+	struct digest *part = w->priv, *d = data;
+
+	d->records += part->records;
+	d->sum += part->sum;
+	return 0;
+}
+
+static void digest_fini(struct bg_scan_worker *w)
+{
+	free(w->priv);
+}
+
+static const struct bg_scan_ops digest_ops = {
+	.init	= digest_init,
+	.batch	= digest_batch,
+	.merge	= digest_merge,
+	.fini	= digest_fini,
+};
+
+static void check_scan(struct test *t, const char *name,
+		       struct bg_capture_file *cf, const struct ref *ref)
+{
+	const int threads[] = { 1, t->jobs };
+	const struct window *win;
+	struct digest d;
+	size_t i;
+	bool ok;
+	int w;
+
+	for (w = 0; w < TEST_WINDOWS; w++) {
+		win = &ref->win[w];
+		for (i = 0; i < ARRAY_SIZE(threads); i++) {
+			if (i && threads[i] == threads[0])
+				break;
+			memset(&d, 0, sizeof(d));
+			ok = bg_capture_scan(cf, win->start, win->end, threads[i],
+					     &digest_ops, &d) == 0 &&
+			     digest_eq(&d, &win->ref);
+			result(t, "check", "scan", name, ok ? RES_OK : RES_FAIL,
+			       "window=%d threads=%d records=%llu expected=%llu",
+			       w, threads[i], d.records, win->ref.records);
+		}
+	}
+}
+
+/*
+ * Merge ops streaming each CPU's chunks out of the file, one chunk in
+ * memory per stream: bg_merge is done with a stream's pages before it
+ * asks for the next, so the buffer is reused as soon as it runs dry.
+ */
+struct stream {
+	size_t		*chunks;	/* index entries of this CPU, in order */
+	size_t		nr_chunks;
+	size_t		next_chunk;
+	unsigned char	*buf;
+	size_t		buf_size;
+	unsigned int	page;
+	unsigned int	nr_pages;
+	struct bg_page	bp;
+};
+
+struct replay {
+	struct bg_capture_file	*cf;
+	struct stream		*streams;
+	int			nr_streams;
+	bool			failed;
+};
+
+static bool replay_load(struct replay *rp, struct stream *st)
+{
+	const struct bg_cap_index_entry *e;
+
+	e = &rp->cf->index[st->chunks[st->next_chunk++]];
+	if (e->raw_size > st->buf_size) {
+		free(st->buf);
+		st->buf_size = e->raw_size;
+		st->buf = malloc(st->buf_size);
+		if (!st->buf)
+			return false;
+	}
+	if (bg_capture_read_chunk(rp->cf, e, st->buf) < 0)
+		return false;
+	st->page = 0;
+	st->nr_pages = e->nr_pages;
+	return true;
+}
+
+static struct bg_page *replay_next_page(void *src, int stream)
+{
+	struct replay *rp = src;
+	struct stream *st = &rp->streams[stream];
+
+	while (st->page == st->nr_pages) {
+		if (st->next_chunk == st->nr_chunks)
+			return NULL;
+		if (!replay_load(rp, st)) {
+			rp->failed = true;
+			st->next_chunk = st->nr_chunks;
+			st->page = st->nr_pages = 0;
+			return NULL;
+		}
+	}
+	st->bp.data = st->buf + (size_t)st->page++ * rp->cf->hdr.page_size;
+	st->bp.size = rp->cf->hdr.page_size;
+	st->bp.cpu = stream;
+	return &st->bp;
+}
+
+static bool replay_finished(void *src, int stream)
+{
+	struct replay *rp = src;
+	struct stream *st = &rp->streams[stream];
+
+	return st->next_chunk == st->nr_chunks && st->page == st->nr_pages;
+}
+
+static const struct bg_merge_ops replay_ops = {
+	.next_page	= replay_next_page,
+	.finished	= replay_finished,
+	.put_page	= bg_page_streams_put,	/* pages live in the chunk buffer */
+};
+
+/* Merge the whole capture, one stream per CPU, into a digest */
+static int replay_merge(struct bg_capture_file *cf, struct digest *d,
+			unsigned long long *backwards,
+			struct bg_merge_stats *stats)
+{
+	struct replay rp = { .cf = cf, .nr_streams = cf->hdr.nr_cpus };
+	struct bg_merge_rec rec;
+	struct bg_merge *m = NULL;
+	unsigned long long prev = 0;
+	struct stream *st;
+	size_t i;
+	int32_t pid;
+	uint16_t id;
+	int s, ret = -1;
+
+	rp.streams = calloc(rp.nr_streams, sizeof(*rp.streams));
+	if (!rp.streams)
+		return -1;
+	for (s = 0; s < rp.nr_streams; s++) {
+		rp.streams[s].chunks = malloc(cf->nr_index * sizeof(size_t) + 1);
+		if (!rp.streams[s].chunks)
+			goto out;
+	}
+	for (i = 0; i < cf->nr_index; i++) {
+		if (cf->index[i].cpu >= (uint32_t)rp.nr_streams)
+			goto out;
+		st = &rp.streams[cf->index[i].cpu];
+		st->chunks[st->nr_chunks++] = i;
+	}
+
+	m = bg_merge_alloc(rp.nr_streams, BG_MERGE_WINDOW_NS, &replay_ops, &rp);
+	if (!m)
+		goto out;
+	/* No stream ever waits for pages, so there is never a 0 */
+	while ((ret = bg_merge_next(m, &rec)) > 0) {
+		rec_common(rec.data, false, &id, &pid);
+		digest_add(d, rec_hash(rec.cpu, rec.ts, id, pid, rec.data,
+				       rec.size));
+		if (rec.ts < prev)
+			(*backwards)++;
+		prev = rec.ts;
+	}
+	bg_merge_get_stats(m, stats);
+	ret = !ret || rp.failed ? -1 : 0;
+ out:
+	bg_merge_free(m);
+	for (s = 0; s < rp.nr_streams; s++) {
+		free(rp.streams[s].chunks);
+		free(rp.streams[s].buf);
+	}
+	free(rp.streams);
+	return ret;
+}
+
+static void check_merge(struct test *t, const char *name,
+			struct bg_capture_file *cf, const struct ref *ref)
+{
+	struct bg_merge_stats stats = { 0 };
+	unsigned long long backwards = 0;
+	struct digest d = { 0 };
+	bool ok;
+
+	if (!cap_native(cf)) {
+		result(t, "check", "merge", name, RES_SKIP, "reason=foreign");
+		return;
+	}
+	ok = replay_merge(cf, &d, &backwards, &stats) == 0 &&
+	     digest_eq(&d, &ref->all) && !backwards && !stats.late &&
+	     !stats.delayed;
+	result(t, "check", "merge", name, ok ? RES_OK : RES_FAIL,
+	       "records=%llu expected=%llu late=%llu delayed=%llu backwards=%llu",
+	       d.records, ref->all.records, stats.late, stats.delayed,
+	       backwards);
+}
+
+/* Scan ops rendering the window's records to one fd */
+struct render_out {
+	int		fd;
+	pthread_mutex_t	lock;
+};
+
+static int render_init(struct bg_scan_worker *w, void *data)
+{
+	struct render_out *ro = data;
+	struct bg_render *r;
+
+	if (!w->formats)
+		return -1;
+	r = malloc(sizeof(*r));
+	if (!r)
+		return -1;
+	bg_render_init(r, ro->fd, &ro->lock);
+	w->priv = r;
+	return 0;
+}
+
+static int render_batch(struct bg_scan_worker *w, const struct bg_batch *b)
+{
+	struct tep_record record = { .cpu = b->cpu };
+	unsigned int i;
+
+	for (i = 0; i < b->nr; i++) {
+		if (b->ts[i] < w->start || b->ts[i] > w->end)
+			continue;
+		bg_formats_lookup(w->formats, b->id[i]);
+		record.ts = b->ts[i];
+		record.data = (void *)bg_batch_data(b, i);
+		record.size = b->size[i];
+		if (bg_render_record(w->priv, w->formats->tep, &record) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int render_merge(struct bg_scan_worker *w, void *data)
+{
+	(void)data;
+	return bg_render_flush(w->priv);
+}
+
+static void render_fini(struct bg_scan_worker *w)
+{
+	bg_render_destroy(w->priv);
+	free(w->priv);
+}
+
+static const struct bg_scan_ops render_ops = {
+	.init	= render_init,
+	.batch	= render_batch,
+	.merge	= render_merge,
+	.fini	= render_fini,
+};
+
+static bool fd_equal(int a, int b)
+{
+	char ba[65536], bb[sizeof(ba)];
+	struct stat sa, sb;
+	off_t off;
+	ssize_t n;
+
+	if (fstat(a, &sa) < 0 || fstat(b, &sb) < 0 || sa.st_size != sb.st_size)
+		return false;
+	for (off = 0; off < sa.st_size; off += n) {
+		n = pread(a, ba, sizeof(ba), off);
+		if (n <= 0 || pread(b, bb, n, off) != n || memcmp(ba, bb, n))
+			return false;
+	}
+	return true;
+}
+
+/* Renderers on several threads only keep whole lines together */
+static int fd_lines(int fd, struct digest *d)
+{
+	char buf[65536];
+	uint64_t h = FNV_BASIS;
+	bool partial = false;
+	off_t off = 0;
+	ssize_t n, i;
+
+	while ((n = pread(fd, buf, sizeof(buf), off)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (buf[i] != '\n') {
+				h = (h ^ (unsigned char)buf[i]) * FNV_PRIME;
+				partial = true;
+				continue;
+			}
+			digest_add(d, mix64(h));
+			h = FNV_BASIS;
+			partial = false;
+		}
+		off += n;
+	}
+	if (partial)
+		digest_add(d, mix64(h));
+	return n < 0 ? -1 : 0;
+}
+
+static void check_render(struct test *t, const char *name,
+			 struct bg_capture_file *cf, const struct ref *ref,
+			 int ref_fd)
+{
+	const struct window *head = &ref->win[TEST_WIN_HEAD];
+	const int threads[] = { 1, t->jobs };
+	struct digest want = { 0 }, got;
+	struct render_out ro;
+	struct stat st;
+	size_t i;
+	bool ok;
+
+	if (ref_fd < 0) {
+		result(t, "check", "render", name, RES_SKIP, "reason=no_formats");
+		return;
+	}
+	fd_lines(ref_fd, &want);
+
+	for (i = 0; i < ARRAY_SIZE(threads); i++) {
+		if (i && threads[i] == threads[0])
+			break;
+		ro.fd = memfd_create("bg-test-render", MFD_CLOEXEC);
+		pthread_mutex_init(&ro.lock, NULL);
+		memset(&got, 0, sizeof(got));
+		/* One thread goes through the chunks in index order, as the walk */
+		ok = ro.fd >= 0 &&
+		     bg_capture_scan(cf, head->start, head->end, threads[i],
+				     &render_ops, &ro) == 0 &&
+		     (threads[i] == 1 ? fd_equal(ref_fd, ro.fd) :
+		      (fd_lines(ro.fd, &got) == 0 && digest_eq(&got, &want)));
+		if (ro.fd < 0 || fstat(ro.fd, &st) < 0)
+			st.st_size = 0;
+		result(t, "check", "render", name, ok ? RES_OK : RES_FAIL,
+		       "threads=%d records=%llu bytes=%lld", threads[i],
+		       head->ref.records, (long long)st.st_size);
+		if (ro.fd >= 0)
+			close(ro.fd);
+		pthread_mutex_destroy(&ro.lock);
+	}
+}
+
+/* Writers the pages go back through; a depth selects io_uring */
+static const struct rewriter {
+	const char	*name;
+	const char	*codec;
+	int		uring_depth;
+} rewriters[] = {
+	{ "plain",	"none",	-1 },
+	{ "zstd",	"zstd",	-1 },
+	{ "lz4",	"lz4",	-1 },
+	{ "uring",	"none",	0 },
+};
+
+/* Write every page of @cf back through the capture writer to @fd */
+static int rewrite(struct bg_capture_file *cf, int fd,
+		   const struct rewriter *rw)
+{
+	const size_t page_size = cf->hdr.page_size;
+	const struct bg_cap_index_entry *e;
+	enum bg_cap_codec codec;
+	struct bg_capture *cap;
+	unsigned char *buf = NULL;
+	size_t i, buf_size = 0;
+	unsigned int p;
+	int level, ret = -1;
+
+	if (bg_capture_parse_codec(rw->codec, &codec, &level) < 0) {
+		close(fd);
+		return -1;
+	}
+	cap = bg_capture_create_fd(fd, cf->hdr.nr_cpus, page_size);
+	if (!cap)
+		return -1;
+	if ((codec != BG_CAP_CODEC_NONE &&
+	     bg_capture_set_codec(cap, codec, level, 2) < 0) ||
+	    (rw->uring_depth >= 0 &&
+	     bg_capture_set_uring(cap, rw->uring_depth) < 0)) {
+		level = errno;
+		bg_capture_close(cap);
+		errno = level;
+		return -1;
+	}
+
+	for (i = 0; i < cf->nr_index; i++) {
+		e = &cf->index[i];
+		if (e->raw_size > buf_size) {
+			free(buf);
+			buf_size = e->raw_size;
+			buf = malloc(buf_size);
+			if (!buf)
+				goto out;
+		}
+		if (bg_capture_read_chunk(cf, e, buf) < 0)
+			goto out;
+		for (p = 0; p < e->nr_pages; p++) {
+			if (bg_capture_add_page(cap, e->cpu, buf + p * page_size,
+						page_size) < 0)
+				goto out;
+		}
+	}
+	ret = 0;
+ out:
+	free(buf);
+	if (bg_capture_close(cap) < 0)
+		ret = -1;
+	return ret;
+}
+
+static void check_rewrite(struct test *t, const char *name,
+			  struct bg_capture_file *cf, const struct ref *ref)
+{
+	const struct rewriter *rw;
+	struct bg_capture_file *out;
+	char path[] = "/tmp/bg-test.XXXXXX";
+	struct ref got;
+	enum result res;
+	size_t i;
+	int fd;
+
+	for (i = 0; i < ARRAY_SIZE(rewriters); i++) {
+		rw = &rewriters[i];
+		memset(&got, 0, sizeof(got));
+		if (!cap_native(cf)) {
+			result(t, "check", "rewrite", name, RES_SKIP,
+			       "writer=%s reason=foreign", rw->name);
+			continue;
+		}
+
+		strcpy(path, "/tmp/bg-test.XXXXXX");
+		fd = mkstemp(path);
+		if (fd < 0 || rewrite(cf, fd, rw) < 0) {
+			res = errno == EPROTONOSUPPORT ? RES_SKIP : RES_FAIL;
+			result(t, "check", "rewrite", name, res,
+			       "writer=%s reason=%s", rw->name,
+			       res == RES_SKIP ? "not_built_in" : "write");
+			if (fd >= 0)
+				unlink(path);
+			continue;
+		}
+
+		out = bg_capture_open(path);
+		unlink(path);
+		set_windows(cf, got.win);
+		res = out && walk(out, &got, NULL, -1) == 0 &&
+		      digest_eq(&got.all, &ref->all) && got.pages == ref->pages &&
+		      !got.bad_chunks && !got.decode_diff ? RES_OK : RES_FAIL;
+		result(t, "check", "rewrite", name, res,
+		       "writer=%s records=%llu expected=%llu pages=%llu", rw->name,
+		       got.all.records, ref->all.records, got.pages);
+		bg_capture_file_close(out);
+	}
+}
+
+/* The first TEST_PERF_PAGES pages of a capture in memory, for timing */
+struct perf {
+	unsigned char		*mem;
+	struct bg_page		*pages;		/* grouped by CPU */
+	int			nr_pages;
+	int			*first;		/* per CPU, into pages */
+	int			*count;
+	int			*next;
+	int			nr_cpus;
+	struct bg_page_streams	streams;
+};
+
+static int perf_load(struct bg_capture_file *cf, struct perf *pf)
+{
+	const size_t page_size = cf->hdr.page_size;
+	const struct bg_cap_index_entry *e;
+	struct bg_page *page;
+	size_t i, total = 0;
+	int p, cpu;
+
+	memset(pf, 0, sizeof(*pf));
+	for (i = 0; i < cf->nr_index; i++) {
+		if (total && total + cf->index[i].nr_pages > TEST_PERF_PAGES)
+			break;
+		total += cf->index[i].nr_pages;
+	}
+	pf->nr_cpus = cf->hdr.nr_cpus;
+	pf->mem = malloc(total * page_size + 1);
+	pf->pages = calloc(total + 1, sizeof(*pf->pages));
+	pf->first = calloc(pf->nr_cpus, sizeof(*pf->first));
+	pf->count = calloc(pf->nr_cpus, sizeof(*pf->count));
+	pf->next = calloc(pf->nr_cpus, sizeof(*pf->next));
+	if (!pf->mem || !pf->pages || !pf->first || !pf->count || !pf->next)
+		return -1;
+	pf->streams = (struct bg_page_streams){ pf->pages, pf->first,
+						pf->count, pf->next };
+
+	/* Where each CPU's pages start, so they can be grouped as they load */
+	for (i = 0, p = 0; (size_t)p < total; p += cf->index[i++].nr_pages) {
+		if (cf->index[i].cpu >= (uint32_t)pf->nr_cpus)
+			return -1;
+		pf->count[cf->index[i].cpu] += cf->index[i].nr_pages;
+	}
+	for (cpu = 1; cpu < pf->nr_cpus; cpu++)
+		pf->first[cpu] = pf->first[cpu - 1] + pf->count[cpu - 1];
+
+	for (i = 0; (size_t)pf->nr_pages < total; i++) {
+		e = &cf->index[i];
+		if (bg_capture_read_chunk(cf, e, pf->mem +
+					  (size_t)pf->nr_pages * page_size) < 0)
+			return -1;
+		for (p = 0; p < (int)e->nr_pages; p++, pf->nr_pages++) {
+			page = &pf->pages[pf->first[e->cpu] + pf->next[e->cpu]++];
+			page->data = pf->mem + (size_t)pf->nr_pages * page_size;
+			page->size = page_size;
+			page->cpu = e->cpu;
+		}
+	}
+	return 0;
+}
+
+static void perf_free(struct perf *pf)
+{
+	free(pf->mem);
+	free(pf->pages);
+	free(pf->first);
+	free(pf->count);
+	free(pf->next);
+}
+
+static unsigned long long run_decode(struct perf *pf, struct kbuffer *kbuf,
+				     struct bg_batch *b, uint64_t *sink)
+{
+	unsigned long long n = 0;
+	int i, ret;
+
+	for (i = 0; i < pf->nr_pages; i++) {
+		kbuffer_load_subbuffer(kbuf, pf->pages[i].data);
+		ret = bg_batch_decode(b, kbuf, pf->pages[i].cpu);
+		if (ret > 0) {
+			n += ret;
+			*sink += b->ts[ret - 1];
+		}
+	}
+	return n;
+}
+
+static unsigned long long run_merge(struct perf *pf, uint64_t *sink)
+{
+	struct bg_merge_rec rec;
+	struct bg_merge *m;
+	unsigned long long n = 0;
+
+	memset(pf->next, 0, pf->nr_cpus * sizeof(*pf->next));
+	m = bg_merge_alloc(pf->nr_cpus, BG_MERGE_WINDOW_NS,
+			   &bg_page_streams_ops, &pf->streams);
+	if (!m)
+		return 0;
+	while (bg_merge_next(m, &rec) > 0) {
+		*sink += rec.ts;
+		n++;
+	}
+	bg_merge_free(m);
+	return n;
+}
+
+static void gate_ns(struct test *t, const char *name, enum gate g, double ns)
+{
+	double budget = t->budgets[g].ns * t->slack;
+
+	if (!t->budgets[g].ns) {
+		result(t, "gate", gate_stages[g], name, RES_SKIP,
+		       "ns_per_record=%.2f budget=none", ns);
+		return;
+	}
+	result(t, "gate", gate_stages[g], name, ns <= budget ? RES_OK : RES_FAIL,
+	       "ns_per_record=%.2f budget=%.2f", ns, budget);
+}
+
+/* Time decode and merge on the capture's own pages, as bench does */
+static void perf_gates(struct test *t, const char *name,
+		       struct bg_capture_file *cf)
+{
+	unsigned long long records, n;
+	struct kbuffer *kbuf;
+	struct bg_batch b;
+	struct perf pf;
+	uint64_t start, sink = 0;
+	int rep;
+
+	kbuf = cap_kbuffer(cf);
+	if (!kbuf || bg_batch_init(&b, 256) < 0) {
+		result(t, "gate", "decode", name, RES_FAIL, "reason=alloc");
+		goto out;
+	}
+	if (perf_load(cf, &pf) < 0) {
+		result(t, "gate", "decode", name, RES_FAIL, "reason=load");
+		goto out_perf;
+	}
+	b.swap = cap_swapped(cf);
+
+	/* Warm the caches and the branch predictors once */
+	records = run_decode(&pf, kbuf, &b, &sink);
+	if (!records) {
+		result(t, "gate", "decode", name, RES_SKIP, "reason=no_records");
+		goto out_perf;
+	}
+	start = bg_now_ns();
+	for (rep = 0, n = 0; rep < TEST_PERF_REPS; rep++)
+		n += run_decode(&pf, kbuf, &b, &sink);
+	gate_ns(t, name, GATE_DECODE, (double)(bg_now_ns() - start) / n);
+
+	if (!cap_native(cf)) {
+		result(t, "gate", "merge", name, RES_SKIP, "reason=foreign");
+		goto out_perf;
+	}
+	run_merge(&pf, &sink);
+	start = bg_now_ns();
+	for (rep = 0, n = 0; rep < TEST_PERF_REPS; rep++)
+		n += run_merge(&pf, &sink);
+	if (!n) {
+		result(t, "gate", "merge", name, RES_FAIL, "records=0");
+		goto out_perf;
+	}
+	gate_ns(t, name, GATE_MERGE, (double)(bg_now_ns() - start) / n);
+ out_perf:
+	perf_free(&pf);
+	bg_batch_free(&b);
+ out:
+	if (kbuf)
+		kbuffer_free(kbuf);
+	/* Keeps the decoded timestamps from being optimized away */
+	if (sink == 1)
+		fputc('\0', stderr);
+}
+
+/*
+ * Child side of the RSS gates: replay all of @path through one streaming
+ * engine. The mapping is dropped so chunks are read the way compressed
+ * ones are, and the file's page cache stays out of the RSS.
+ */
+static int child_run(const char *stage, const char *path, int jobs)
+{
+	struct bg_merge_stats stats;
+	unsigned long long backwards = 0;
+	struct bg_capture_file *cf;
+	struct digest d = { 0 };
+	int ret;
+
+	cf = bg_capture_open(path);
+	if (!cf)
+		return 1;
+	if (cf->map) {
+		munmap(cf->map, cf->size);
+		cf->map = NULL;
+	}
+	if (!strcmp(stage, gate_stages[GATE_DECODE]))
+		ret = bg_capture_scan(cf, 0, UINT64_MAX, jobs, &digest_ops, &d);
+	else
+		ret = replay_merge(cf, &d, &backwards, &stats);
+	bg_capture_file_close(cf);
+	return ret < 0;
+}
+
+static void gate_rss(struct test *t, const char *name, const char *path,
+		     enum gate g)
+{
+	long budget = t->budgets[g].rss_kb * t->slack;
+	char what[32], jobs[16];
+	struct rusage ru;
+	enum result res;
+	int status;
+	pid_t pid;
+
+	snprintf(what, sizeof(what), "%s_rss", gate_stages[g]);
+	snprintf(jobs, sizeof(jobs), "%d", t->jobs);
+	fflush(NULL);
+	pid = fork();
+	if (!pid) {
+		execl("/proc/self/exe", "bg-test", "-j", jobs, "-R",
+		      gate_stages[g], path, (char *)NULL);
+		_exit(127);
+	}
+	if (pid < 0 || wait4(pid, &status, 0, &ru) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status)) {
+		result(t, "gate", what, name, RES_FAIL, "reason=replay");
+		return;
+	}
+
+	if (!t->budgets[g].rss_kb) {
+		result(t, "gate", what, name, RES_SKIP,
+		       "max_rss_kb=%ld budget=none", ru.ru_maxrss);
+		return;
+	}
+	res = ru.ru_maxrss <= budget ? RES_OK : RES_FAIL;
+	result(t, "gate", what, name, res, "max_rss_kb=%ld budget=%ld",
+	       ru.ru_maxrss, budget);
+}
+
+static void check_capture(struct test *t, const char *path, const char *name)
+{
+	struct bg_capture_file *cf;
+	struct bg_formats *f;
+	struct ref ref = { 0 };
+	enum result res;
+	int ref_fd = -1;
+
+	cf = bg_capture_open(path);
+	if (!cf) {
+		result(t, "check", "open", name, RES_FAIL, "error=%s",
+		       strerror(errno));
+		return;
+	}
+
+	set_windows(cf, ref.win);
+	f = bg_capture_formats(cf);
+	if (f) {
+		ref_fd = memfd_create("bg-test-ref", MFD_CLOEXEC);
+		if (ref_fd < 0)
+			bg_warn("cannot render %s: %s", name, strerror(errno));
+	}
+	if (walk(cf, &ref, f, ref_fd) < 0) {
+		result(t, "check", "walk", name, RES_FAIL, "error=%s",
+		       strerror(errno));
+		goto out;
+	}
+
+	check_index(t, name, cf, &ref);
+	res = ref.bad_chunks ? RES_FAIL : RES_OK;
+	result(t, "check", "chunks", name, res, "chunks=%zu pages=%llu bad=%llu",
+	       cf->nr_index, ref.pages, ref.bad_chunks);
+	res = ref.decode_diff ? RES_FAIL : RES_OK;
+	result(t, "check", "decode", name, res, "records=%llu diff=%llu",
+	       ref.all.records, ref.decode_diff);
+	res = ref.backwards ? RES_FAIL : RES_OK;
+	result(t, "check", "timestamps", name, res, "records=%llu backwards=%llu",
+	       ref.all.records, ref.backwards);
+	check_scan(t, name, cf, &ref);
+	check_merge(t, name, cf, &ref);
+	check_render(t, name, cf, &ref, ref_fd);
+	check_rewrite(t, name, cf, &ref);
+
+	perf_gates(t, name, cf);
+	gate_rss(t, name, path, GATE_DECODE);
+	if (cap_native(cf))
+		gate_rss(t, name, path, GATE_MERGE);
+ out:
+	if (ref_fd >= 0)
+		close(ref_fd);
+	bg_formats_close(f);
+	bg_capture_file_close(cf);
+}
+
+static const struct bg_synth test_synth = {
+	.page_size	= TEST_SYNTH_PAGE_SIZE,
+	.event_size	= TEST_SYNTH_EVENT_SIZE,
+	.id		= TEST_SYNTH_EVENT_ID,
+	.delta_ns	= TEST_SYNTH_DELTA_NS,
+};
+
+/* Without formats, so rendering is skipped for it */
+static int write_synthetic(const char *path)
+{
+	const int per_page = bg_synth_per_page(&test_synth);
+	unsigned char page[TEST_SYNTH_PAGE_SIZE];
+	struct bg_capture *cap;
+	uint64_t value = 0, ts;
+	int cpu, i, ret = 0;
+
+	cap = bg_capture_create(path, TEST_SYNTH_CPUS, TEST_SYNTH_PAGE_SIZE);
+	if (!cap)
+		return -1;
+	/* CPUs overlap in time, each a little behind the one before */
+	for (i = 0; i < TEST_SYNTH_PAGES && !ret; i++) {
+		for (cpu = 0; cpu < TEST_SYNTH_CPUS && !ret; cpu++) {
+			ts = 1000000 + (uint64_t)i * per_page * TEST_SYNTH_DELTA_NS +
+			     cpu * (TEST_SYNTH_DELTA_NS / TEST_SYNTH_CPUS);
+			bg_synth_page(&test_synth, page, ts, 1000 + cpu, &value);
+			ret = bg_capture_add_page(cap, cpu, page, sizeof(page));
+		}
+	}
+	if (bg_capture_close(cap) < 0)
+		ret = -1;
+	return ret;
+}
+
+static void load_budgets(struct test *t, const char *path)
+{
+	char *line = NULL, stage[32];
+	size_t len = 0;
+	const char *p;
+	int threads;
+	FILE *f;
+	int g;
+
+	f = fopen(path, "r");
+	if (!f) {
+		bg_warn("no baselines in %s, perf gates skipped", path);
+		return;
+	}
+	while (getline(&line, &len, f) > 0) {
+		if (sscanf(line, "stage=%31s threads=%d", stage, &threads) != 2 ||
+		    threads != 1)
+			continue;
+		for (g = 0; g < NR_GATES; g++) {
+			if (strcmp(stage, gate_stages[g]))
+				continue;
+			p = strstr(line, " ns_per_record=");
+			if (p)
+				t->budgets[g].ns = strtod(p + 15, NULL);
+			p = strstr(line, " max_rss_kb=");
+			if (p)
+				t->budgets[g].rss_kb = strtol(p + 12, NULL, 10);
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bg-test [options] [capture...]\n"
+		"  -b file      baselines (default bench_output.txt)\n"
+		"  -o file      results (default test_output.txt)\n"
+		"  -j threads   scan threads to compare with one (default: online\n"
+		"               CPUs, at least 2)\n"
+		"  -x factor    slack over the baselines (default %.1f)\n"
+		"Without captures, a synthetic one is written and replayed.\n",
+		TEST_SLACK);
+}
+
+int main(int argc, char **argv)
+{
+	const char *bench = "bench_output.txt", *output = "test_output.txt";
+	const char *child = NULL, *name;
+	char synth[] = "/tmp/bg-test-synthetic.XXXXXX";
+	struct test t = { .slack = TEST_SLACK };
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int c, fd, i;
+
+	t.jobs = cpus > 2 ? cpus : 2;
+	while ((c = getopt(argc, argv, "b:o:j:x:R:h")) != -1) {
+		switch (c) {
+		case 'b':
+			bench = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'j':
+			t.jobs = atoi(optarg);
+			break;
+		case 'x':
+			t.slack = strtod(optarg, NULL);
+			break;
+		case 'R':
+			/* Internal: one RSS gate's replay, in its own process */
+			child = optarg;
+			break;
+		default:
+			usage();
+			return c != 'h';
+		}
+	}
+	if (t.jobs < 1)
+		t.jobs = 1;
+	if (child)
+		return optind == argc - 1 ? child_run(child, argv[optind], t.jobs) : 1;
+
+	load_budgets(&t, bench);
+	t.out = fopen(output, "w");
+	if (!t.out) {
+		bg_warn("cannot create %s: %s", output, strerror(errno));
+		return 1;
+	}
+
+	if (optind == argc) {
+		fd = mkstemp(synth);
+		if (fd >= 0)
+			close(fd);
+		if (fd < 0 || write_synthetic(synth) < 0) {
+			bg_warn("cannot write a synthetic capture: %s",
+				strerror(errno));
+			t.failures++;
+		} else {
+			check_capture(&t, synth, "synthetic");
+		}
+		unlink(synth);
+	}
+	for (i = optind; i < argc; i++) {
+		name = strrchr(argv[i], '/');
+		check_capture(&t, argv[i], name ? name + 1 : argv[i]);
+	}
+
+	fprintf(t.out, "checks=%d failures=%d result=%s\n", t.checks,
+		t.failures, res_names[!t.failures]);
+	printf("checks=%d failures=%d result=%s\n", t.checks, t.failures,
+	       res_names[!t.failures]);
+	fclose(t.out);
+	return !!t.failures;
+}